@@ -0,0 +1,358 @@
+/*
+
+    Provide an implementation for impair.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "tftp.h"
+#include "impair.h"
+
+typedef struct {
+    // 0 drops the packet, 2 duplicates it
+    int copies;
+    long delay_us;
+} impairment_decision;
+
+static long now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+// xorshift64*
+static uint64_t random_next(tftp_impairment *impairment) {
+    impairment->random_state ^= impairment->random_state >> 12u;
+    impairment->random_state ^= impairment->random_state << 25u;
+    impairment->random_state ^= impairment->random_state >> 27u;
+    return impairment->random_state * 2685821657736338717ull;
+}
+
+static double random_percent(tftp_impairment *impairment) {
+    return (double) (random_next(impairment) >> 11u) / (double) (1ull << 53u) * 100;
+}
+
+static impairment_decision decide(tftp_impairment *impairment, const tftp_impairment_profile *profile,
+                                  tftp_impairment_stats *stats) {
+    double loss = random_percent(impairment);
+    double duplicate = random_percent(impairment);
+    double reorder = random_percent(impairment);
+    uint64_t jitter = random_next(impairment);
+
+    impairment_decision decision = {1, profile->delay_us};
+    stats->packets++;
+    if (loss < profile->loss) {
+        stats->dropped++;
+        decision.copies = 0;
+        return decision;
+    }
+    if (duplicate < profile->duplicate) {
+        stats->duplicated++;
+        decision.copies = 2;
+    }
+    if (reorder < profile->reorder) {
+        stats->reordered++;
+        decision.delay_us += TFTP_IMPAIRMENT_REORDER_US;
+    }
+    if (profile->jitter_us > 0) {
+        decision.delay_us += (long) (jitter % (uint64_t) profile->jitter_us);
+    }
+    if (decision.delay_us > 0) {
+        stats->delayed++;
+    }
+    return decision;
+}
+
+static void hold(tftp_impairment *impairment, int socket, int received, const struct sockaddr *address,
+                 socklen_t address_size, const struct iovec *iovecs, size_t iovec_count, size_t length,
+                 long delay_us) {
+    tftp_held_packet *packet = malloc(sizeof(tftp_held_packet) + length);
+    if (packet == NULL) {
+        return;
+    }
+    packet->due_us = now_us() + delay_us;
+    packet->socket = socket;
+    packet->received = received;
+    packet->address_size = address != NULL && address_size <= sizeof(packet->address) ? address_size : 0;
+    if (packet->address_size > 0) {
+        memcpy(&packet->address, address, packet->address_size);
+    }
+    packet->length = (int) length;
+    size_t offset = 0;
+    for (size_t i = 0; i < iovec_count && offset < length; i++) {
+        size_t part = iovecs[i].iov_len < length - offset ? iovecs[i].iov_len : length - offset;
+        memcpy(packet->data + offset, iovecs[i].iov_base, part);
+        offset += part;
+    }
+
+    // Behind everything due at the same time, so packets with the same delay keep their order
+    tftp_held_packet **link = &impairment->held;
+    while (*link != NULL && (*link)->due_us <= packet->due_us) {
+        link = &(*link)->next;
+    }
+    packet->next = *link;
+    *link = packet;
+}
+
+int tftp_impairment_init(tftp_impairment *impairment, uint64_t seed) {
+    memset(impairment, 0, sizeof(tftp_impairment));
+    // xorshift never leaves a state of 0
+    impairment->random_state = seed == 0 ? 1 : seed;
+    impairment->replay_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    impairment->replay_address.sin_family = AF_INET;
+    impairment->replay_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_size = sizeof(impairment->replay_address);
+    if (impairment->replay_socket < 0 ||
+        bind(impairment->replay_socket, (struct sockaddr *) &impairment->replay_address, address_size) != 0 ||
+        getsockname(impairment->replay_socket, (struct sockaddr *) &impairment->replay_address, &address_size) != 0) {
+        tftp_impairment_destroy(impairment);
+        return TFTP_ERROR;
+    }
+    return TFTP_SUCCESS;
+}
+
+void tftp_impairment_destroy(tftp_impairment *impairment) {
+    while (impairment->held != NULL) {
+        tftp_held_packet *packet = impairment->held;
+        impairment->held = packet->next;
+        free(packet);
+    }
+    while (impairment->replayed != NULL) {
+        tftp_replayed_packet *replayed = impairment->replayed;
+        impairment->replayed = replayed->next;
+        free(replayed);
+    }
+    impairment->replayed_tail = NULL;
+    if (impairment->replay_socket >= 0) {
+        close(impairment->replay_socket);
+        impairment->replay_socket = -1;
+    }
+}
+
+ssize_t tftp_impaired_sendto(tftp_impairment *impairment, int socket, const void *data, size_t length, int flags,
+                             const struct sockaddr *address, socklen_t address_size) {
+    if (impairment == NULL) {
+        return sendto(socket, data, length, flags, address, address_size);
+    }
+    struct iovec iovec = {(void *) data, length};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = (void *) address;
+    message.msg_namelen = address_size;
+    message.msg_iov = &iovec;
+    message.msg_iovlen = 1;
+    return tftp_impaired_sendmsg(impairment, socket, &message, flags);
+}
+
+ssize_t tftp_impaired_sendmsg(tftp_impairment *impairment, int socket, const struct msghdr *message, int flags) {
+    if (impairment == NULL) {
+        return sendmsg(socket, message, flags);
+    }
+    tftp_impairment_release(impairment);
+
+    size_t length = 0;
+    for (size_t i = 0; i < message->msg_iovlen; i++) {
+        length += message->msg_iov[i].iov_len;
+    }
+    // Completions of zero copy sends would not match what really went out
+#ifdef MSG_ZEROCOPY
+    flags &= ~MSG_ZEROCOPY;
+#endif
+
+    impairment_decision decision = decide(impairment, &impairment->send, &impairment->sent);
+    ssize_t result = length;
+    for (int copy = 0; copy < decision.copies; copy++) {
+        if (decision.delay_us > 0) {
+            hold(impairment, socket, 0, message->msg_name, message->msg_namelen, message->msg_iov,
+                 message->msg_iovlen, length, decision.delay_us);
+        } else if (copy == 0) {
+            result = sendmsg(socket, message, flags);
+        } else {
+            sendmsg(socket, message, flags);
+        }
+    }
+    return result;
+}
+
+static int is_replay(const tftp_impairment *impairment, const struct msghdr *message) {
+    const struct sockaddr_in *source = message->msg_name;
+    return source != NULL && message->msg_namelen >= sizeof(struct sockaddr_in) &&
+           source->sin_port == impairment->replay_address.sin_port &&
+           source->sin_addr.s_addr == impairment->replay_address.sin_addr.s_addr;
+}
+
+// Put back the address a replayed packet was originally received from
+static int restore_source(tftp_impairment *impairment, int socket, struct msghdr *message) {
+    tftp_replayed_packet **link = &impairment->replayed;
+    tftp_replayed_packet *previous = NULL;
+    while (*link != NULL && (*link)->socket != socket) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    tftp_replayed_packet *replayed = *link;
+    if (replayed == NULL) {
+        return TFTP_ERROR;
+    }
+    *link = replayed->next;
+    if (impairment->replayed_tail == replayed) {
+        impairment->replayed_tail = previous;
+    }
+    memcpy(message->msg_name, &replayed->source, sizeof(replayed->source));
+    message->msg_namelen = sizeof(replayed->source);
+    free(replayed);
+    return TFTP_SUCCESS;
+}
+
+static void copy_message(struct mmsghdr *destination, const struct mmsghdr *source) {
+    memcpy(destination->msg_hdr.msg_iov[0].iov_base, source->msg_hdr.msg_iov[0].iov_base, source->msg_len);
+    destination->msg_len = source->msg_len;
+    if (destination->msg_hdr.msg_name != NULL && source->msg_hdr.msg_name != NULL) {
+        memcpy(destination->msg_hdr.msg_name, source->msg_hdr.msg_name, source->msg_hdr.msg_namelen);
+        destination->msg_hdr.msg_namelen = source->msg_hdr.msg_namelen;
+    }
+}
+
+int tftp_impaired_receive(tftp_impairment *impairment, int socket, struct mmsghdr *messages, int received,
+                          int capacity) {
+    if (impairment == NULL || received <= 0) {
+        return received;
+    }
+    tftp_impairment_release(impairment);
+
+    int count = received;
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        struct mmsghdr *message = &messages[i];
+        if (i < received && is_replay(impairment, &message->msg_hdr)) {
+            if (restore_source(impairment, socket, &message->msg_hdr) != TFTP_SUCCESS) {
+                continue;
+            }
+        } else if (i < received) {
+            impairment_decision decision = decide(impairment, &impairment->receive, &impairment->received);
+            if (decision.copies == 0) {
+                continue;
+            }
+            if (decision.delay_us > 0) {
+                for (int copy = 0; copy < decision.copies; copy++) {
+                    hold(impairment, socket, 1, message->msg_hdr.msg_name, message->msg_hdr.msg_namelen,
+                         message->msg_hdr.msg_iov, 1, message->msg_len, decision.delay_us);
+                }
+                continue;
+            }
+            // The duplicate arrives right after this batch, if there is room for it
+            if (decision.copies == 2 && count < capacity) {
+                copy_message(&messages[count++], message);
+            }
+        }
+        if (kept != i) {
+            copy_message(&messages[kept], message);
+        }
+        kept++;
+    }
+    return kept;
+}
+
+static void replay(tftp_impairment *impairment, const tftp_held_packet *packet) {
+    struct sockaddr_in target;
+    socklen_t target_size = sizeof(target);
+    tftp_replayed_packet *replayed = malloc(sizeof(tftp_replayed_packet));
+    if (replayed == NULL || getsockname(packet->socket, (struct sockaddr *) &target, &target_size) != 0) {
+        free(replayed);
+        return;
+    }
+    if (target.sin_addr.s_addr == htonl(INADDR_ANY)) {
+        target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    if (sendto(impairment->replay_socket, packet->data, packet->length, 0, (struct sockaddr *) &target,
+               target_size) < 0) {
+        free(replayed);
+        return;
+    }
+    replayed->next = NULL;
+    replayed->socket = packet->socket;
+    replayed->source = packet->address;
+    if (impairment->replayed_tail != NULL) {
+        impairment->replayed_tail->next = replayed;
+    } else {
+        impairment->replayed = replayed;
+    }
+    impairment->replayed_tail = replayed;
+}
+
+void tftp_impairment_release(tftp_impairment *impairment) {
+    if (impairment == NULL || impairment->held == NULL) {
+        return;
+    }
+    long now = now_us();
+    while (impairment->held != NULL && impairment->held->due_us <= now) {
+        tftp_held_packet *packet = impairment->held;
+        impairment->held = packet->next;
+        if (packet->received) {
+            replay(impairment, packet);
+        } else {
+            sendto(packet->socket, packet->data, packet->length, 0,
+                   packet->address_size > 0 ? (struct sockaddr *) &packet->address : NULL, packet->address_size);
+        }
+        free(packet);
+    }
+}
+
+long tftp_impairment_next_ms(const tftp_impairment *impairment, long max_ms) {
+    if (impairment == NULL || impairment->held == NULL) {
+        return max_ms;
+    }
+    long until = (impairment->held->due_us - now_us() + 999) / 1000;
+    if (until < 0) {
+        return 0;
+    }
+    return until < max_ms ? until : max_ms;
+}
+
+void tftp_impairment_forget(tftp_impairment *impairment, int socket) {
+    if (impairment == NULL) {
+        return;
+    }
+    tftp_held_packet **link = &impairment->held;
+    while (*link != NULL) {
+        tftp_held_packet *packet = *link;
+        if (packet->socket == socket) {
+            *link = packet->next;
+            free(packet);
+        } else {
+            link = &packet->next;
+        }
+    }
+    tftp_replayed_packet **replayed_link = &impairment->replayed;
+    impairment->replayed_tail = NULL;
+    while (*replayed_link != NULL) {
+        tftp_replayed_packet *replayed = *replayed_link;
+        if (replayed->socket == socket) {
+            *replayed_link = replayed->next;
+            free(replayed);
+        } else {
+            impairment->replayed_tail = replayed;
+            replayed_link = &replayed->next;
+        }
+    }
+}
@@ -0,0 +1,115 @@
+/*
+
+    Network impairment for tests and benchmarks: seeded loss, delay, jitter, duplication and reordering
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_IMPAIR_H
+#define TFTPSERVER_IMPAIR_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// A reordered packet is held back this much longer than its delay, so the packets sent right after it overtake it
+#define TFTP_IMPAIRMENT_REORDER_US 2000
+
+typedef struct {
+    // Percentages of the packets
+    double loss;
+    double duplicate;
+    double reorder;
+
+    long delay_us;
+    // Added to the delay, evenly spread between 0 and this
+    long jitter_us;
+} tftp_impairment_profile;
+
+typedef struct {
+    long packets;
+    long dropped;
+    long duplicated;
+    long delayed;
+    long reordered;
+} tftp_impairment_stats;
+
+typedef struct tftp_held_packet {
+    struct tftp_held_packet *next;
+    long due_us;
+    int socket;
+    // Received packets are held too, and sent back to their socket from the replay socket when they are due
+    int received;
+    // The destination of a sent packet, or the source of a received one, a size of 0 for a connected socket
+    struct sockaddr_in address;
+    socklen_t address_size;
+    int length;
+    uint8_t data[];
+} tftp_held_packet;
+
+// The source a replayed packet really came from, in the order they were sent to the socket
+typedef struct tftp_replayed_packet {
+    struct tftp_replayed_packet *next;
+    int socket;
+    struct sockaddr_in source;
+} tftp_replayed_packet;
+
+// Not thread safe, every server needs its own
+typedef struct tftp_impairment {
+    // What this process sends and what it receives
+    tftp_impairment_profile send;
+    tftp_impairment_profile receive;
+
+    // Every packet takes the same number of draws, so a seed gives the same decisions for the same packets
+    uint64_t random_state;
+
+    // Ordered by due time
+    tftp_held_packet *held;
+
+    int replay_socket;
+    struct sockaddr_in replay_address;
+    tftp_replayed_packet *replayed;
+    tftp_replayed_packet *replayed_tail;
+
+    tftp_impairment_stats sent;
+    tftp_impairment_stats received;
+} tftp_impairment;
+
+int tftp_impairment_init(tftp_impairment *impairment, uint64_t seed);
+
+void tftp_impairment_destroy(tftp_impairment *impairment);
+
+// Without an impairment these are plain sendto and sendmsg, a dropped or held packet counts as sent
+ssize_t tftp_impaired_sendto(tftp_impairment *impairment, int socket, const void *data, size_t length, int flags,
+                             const struct sockaddr *address, socklen_t address_size);
+
+ssize_t tftp_impaired_sendmsg(tftp_impairment *impairment, int socket, const struct msghdr *message, int flags);
+
+// Applied to the messages just received on the socket, returns how many are left, at most capacity
+int tftp_impaired_receive(tftp_impairment *impairment, int socket, struct mmsghdr *messages, int received,
+                          int capacity);
+
+// Send every held packet that is due
+void tftp_impairment_release(tftp_impairment *impairment);
+
+// Milliseconds until the next held packet is due, or max_ms
+long tftp_impairment_next_ms(const tftp_impairment *impairment, long max_ms);
+
+// The socket is about to be closed, whatever is held for it is lost
+void tftp_impairment_forget(tftp_impairment *impairment, int socket);
+
+#endif //TFTPSERVER_IMPAIR_H
@@ -18,6 +18,7 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  
  */
+#define _GNU_SOURCE
 #define DEBUG
 #ifdef DEBUG
 
@@ -27,16 +28,20 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include "tftp.h"
 
 const char *TFTP_BLOCKSIZE_STRING = "blksize";
 const char *TFTP_TIMEOUT_STRING = "timeout";
-// const char *TFTP_WINDOW_SIZE_STRING = "windowsize";
+const char *TFTP_WINDOW_SIZE_STRING = "windowsize";
 const char *TFTP_TSIZE_STRING = "tsize";
+const char *TFTP_MULTICAST_STRING = "multicast";
 
 const char *TFTP_ERROR_UNDEFINED_STRING = "Undefined error.";
 const char *TFTP_ERROR_ENOENT_STRING = "No such file.";
@@ -58,30 +63,63 @@ char *tftp_test_string(char *possible_string_start, int max) {
     return NULL;
 }
 
+// Where packets on the transmission socket go, nowhere in particular if the kernel already knows
+static const struct sockaddr *destination(const tftp_transmission *transmission) {
+    return transmission->connected ? NULL : transmission->client_addr;
+}
+
+static socklen_t destination_size(const tftp_transmission *transmission) {
+    return transmission->connected ? 0 : transmission->client_addr_size;
+}
+
 tftp_transmission tftp_create_transmission(uint16_t block_size) {
     tftp_transmission transmission;
-    transmission.socket = -1;
-    transmission.original_socket = -1;
-    transmission.file_descriptor = -1;
-    transmission.client_addr_size = 0;
-    transmission.client_addr = NULL;
-    transmission.rx_size = 4 + block_size;
-    transmission.rx_buffer = malloc(4 + block_size);
-    transmission.tx_size = 4 + block_size;
-    transmission.tx_buffer = malloc(4 + block_size);
+    // OACKs and errors are built in the same buffers, so never make them smaller than a default block
+    uint16_t buffer_size = block_size < 512 ? 512 : block_size;
+    tftp_init_transmission(&transmission, malloc(4 + buffer_size), 4 + buffer_size);
+    transmission.rx_size = 4 + buffer_size;
+    transmission.rx_buffer = malloc(4 + buffer_size);
+    transmission.owns_buffers = 1;
     return transmission;
 }
 
+// Set up a transmission in place, with a transmit buffer of the caller and no receive buffer
+void tftp_init_transmission(tftp_transmission *transmission, uint8_t *tx_buffer, int tx_size) {
+    transmission->socket = -1;
+    transmission->original_socket = -1;
+    transmission->file_descriptor = -1;
+    transmission->client_addr_size = 0;
+    transmission->client_addr = NULL;
+    transmission->connected = 0;
+    transmission->rx_size = 0;
+    transmission->rx_buffer = NULL;
+    transmission->tx_size = tx_size;
+    transmission->tx_buffer = tx_buffer;
+    transmission->tx_length = 0;
+    transmission->send_flags = 0;
+    transmission->fixed_socket = -1;
+    transmission->fixed_file = -1;
+    transmission->uring_pending = 0;
+    transmission->zerocopy_sent = 0;
+    transmission->zerocopy_completed = 0;
+    transmission->zerocopy_copied = 0;
+    transmission->owns_buffers = 0;
+    transmission->impairment = NULL;
+}
+
 void tftp_stop_transmission(tftp_transmission *transmission) {
     if (transmission->socket != -1) {
+        tftp_impairment_forget(transmission->impairment, transmission->socket);
         close(transmission->socket);
     }
     if (transmission->file_descriptor != -1) {
         close(transmission->file_descriptor);
     }
-    free(transmission->client_addr);
-    free(transmission->rx_buffer);
-    free(transmission->tx_buffer);
+    if (transmission->owns_buffers) {
+        free(transmission->client_addr);
+        free(transmission->rx_buffer);
+        free(transmission->tx_buffer);
+    }
 }
 
 tftp_packet_error tftp_create_packet_error() {
@@ -99,6 +137,11 @@ tftp_packet_optionack tftp_create_packet_oack() {
     oack.has_window_size = 0;
     oack.has_timeout = 0;
     oack.has_block_size = 0;
+    oack.has_transfer_size = 0;
+    oack.has_multicast = 0;
+    oack.multicast_address.s_addr = htonl(INADDR_ANY);
+    oack.multicast_port = 0;
+    oack.master_client = 0;
     return oack;
 }
 
@@ -117,151 +160,149 @@ tftp_packet_ack tftp_create_packet_ack() {
     return ack;
 }
 
+// Option names are case insensitive (RFC 2347), each known option has its own slot for its first letter and length
+#define TFTP_OPTION_SLOTS 8
+#define TFTP_OPTION_SLOT(first, length) ((((uint8_t) (first) | 0x20u) + (unsigned) (length) * 2u) & (TFTP_OPTION_SLOTS - 1))
+
+typedef struct {
+    const char *name;
+    int length;
+    int option;
+} tftp_option_name;
+
+static const tftp_option_name option_names[TFTP_OPTION_SLOTS] = {
+        [TFTP_OPTION_SLOT('b', 7)] = {"blksize", 7, TFTP_OPTION_BLOCKSIZE},
+        [TFTP_OPTION_SLOT('t', 7)] = {"timeout", 7, TFTP_OPTION_TIMEOUT},
+        [TFTP_OPTION_SLOT('w', 10)] = {"windowsize", 10, TFTP_OPTION_WINDOW_SIZE},
+        [TFTP_OPTION_SLOT('t', 5)] = {"tsize", 5, TFTP_OPTION_TSIZE},
+        [TFTP_OPTION_SLOT('m', 9)] = {"multicast", 9, TFTP_OPTION_MULTICAST},
+};
+
+// A value that is invalid or out of range still counts as the option being present, with its default value
+static long option_value(const char *value, int length, long min, long max, long default_value) {
+    long number = tftp_parse_number(value, length, max);
+    return number >= min ? number : default_value;
+}
+
 int tftp_parse_packet_request(tftp_packet_request *request, const uint8_t *data, const uint16_t data_length) {
     request->opcode = -1;
-    memset(request->filename, 0, sizeof(request->filename));
-    memset(request->mode, 0, sizeof(request->mode));
+    request->filename = NULL;
+    request->filename_length = 0;
+    request->mode = NULL;
     request->has_window_size = 0;
     request->has_timeout = 0;
     request->has_block_size = 0;
+    request->block_size = 512;
+    request->has_transfer_size = 0;
+    request->has_multicast = 0;
 
     if (data_length < 6) {
         return TFTP_TOO_LITTLE_DATA;
     }
 
-    uint16_t data_length_left = data_length;
-
     uint16_t opcode = (data[0] << 8u) + (data[1]);
-
     request->opcode = opcode;
-
-    data_length_left -= 2;
-
     if (opcode != TFTP_OPCODE_READ_REQUEST && opcode != TFTP_OPCODE_WRITE_REQUEST) {
         return TFTP_INVALID_OPCODE;
     }
 
-    uint16_t max_length_filename =
-            data_length_left <= sizeof(request->filename) ? data_length_left : sizeof(request->filename);
+    const char *cursor = (const char *) data + 2;
+    const char *end = (const char *) data + data_length;
 
-    char *file_name_start = (char *) data + 2;
-
-    char *file_name_end = tftp_test_string(file_name_start, max_length_filename);
-
-    if (file_name_end == NULL) {
+    const char *filename_end = memchr(cursor, 0, end - cursor);
+    if (filename_end == NULL || filename_end - cursor > TFTP_MAX_FILENAME_LENGTH) {
         return TFTP_INVALID_NAME;
     }
+    request->filename = cursor;
+    request->filename_length = (int) (filename_end - cursor);
+    cursor = filename_end + 1;
 
-    strcpy(request->filename, file_name_start);
-
-    data_length_left -= (file_name_end - file_name_start + 1);
-    uint16_t max_length_mode = data_length_left <= sizeof(request->mode) ? data_length_left : sizeof(request->mode);
-
-    char *mode_name_start = (char *) file_name_end + 1;
-    char *mode_name_end = tftp_test_string(mode_name_start, max_length_mode);
-
-    if (mode_name_end == NULL || strcmp(mode_name_end, "octet") == 0) {
+    const char *mode_end = memchr(cursor, 0, end - cursor);
+    if (mode_end == NULL) {
         return TFTP_INVALID_MODE;
     }
+    request->mode = cursor;
+    cursor = mode_end + 1;
 
-
-    strcpy(request->mode, mode_name_start);
-    data_length_left -= (mode_name_end - mode_name_start + 1);
-    char *start_ptr = mode_name_end + 1;
-    char *end_ptr = NULL;
-    while (data_length_left > 2) {
-        int option = tftp_parse_option(start_ptr, data_length_left, &end_ptr);
-        data_length_left -= end_ptr - start_ptr + 1;
-
-        /*
-         * Parse an option.
-         * If the value provided for this option has no valid ending, ignore it and the options following it
-         * If the value provided for this option is invalid or out of range, set it to the default value specified
-         * If the
-         * opt      The option to check for
-         * bool     The boolean field that indicates if this option is set or not in the tftp_packet_request struct
-         * val      The value field that indicates the value of this option in the tftp_packet_request struct
-         * min      The minimum allowed value for this option
-         * max      The maximum allowed value for this option
-         * defvalue The default value of this option
-         */
-#define DO_PARSE(opt, bool, val, min, max, defvalue)                                                \
-        if (option == opt) {                                                                        \
-            char *value_end_ptr;                                                                    \
-            long value = tftp_parse_ascii_number(end_ptr + 1, data_length_left, &value_end_ptr);    \
-            data_length_left -= value_end_ptr - end_ptr - 1;                                        \
-            if (value_end_ptr != NULL){                                                             \
-                start_ptr = value_end_ptr + 1;                                                      \
-            } else {                                                                                \
-                break;                                                                              \
-            }                                                                                       \
-            if (value != TFTP_INVALID_NUMBER && value >= min && (value <= max || max == -1)){       \
-              request->bool = 1;                                                                    \
-              request->val = value;                                                                 \
-            } else {                                                                                \
-                request->bool = 1;                                                                  \
-                request-> val = defvalue;                                                           \
-            }                                                                                       \
-        }
-
-        DO_PARSE(TFTP_OPTION_TIMEOUT, has_timeout, timeout, 1, 255, 5)
-        else DO_PARSE(TFTP_OPTION_BLOCKSIZE, has_block_size, block_size, 8, 65464, 512)
-        else DO_PARSE(TFTP_OPTION_WINDOW_SIZE, has_window_size, window_size, 1, 65535, 4)
-        else DO_PARSE(TFTP_OPTION_TSIZE, has_transfer_size, transfer_size, 0, 1, 0)
-        else if (option == TFTP_OPTION_INVALID) {
+    // Some clients pad their requests, a tail too short to hold an option is ignored
+    while (end - cursor > 2) {
+        const char *name_end = memchr(cursor, 0, end - cursor);
+        if (name_end == NULL) {
             return TFTP_INVALID_OPTION;
-        } else {
-            char *value_end = tftp_test_string(end_ptr + 1, data_length_left);
-            data_length_left -= value_end - end_ptr - 1;
-            if (value_end != NULL) {
-                start_ptr = value_end + 1;
-            } else {
-                break;
-            }
         }
-    }
-
-    if (!request->has_block_size) {
-        request->block_size = 512;
+        // An option whose value is cut off is ignored
+        const char *value = name_end + 1;
+        const char *value_end = value < end ? memchr(value, 0, end - value) : NULL;
+        if (value_end == NULL) {
+            break;
+        }
+        int option = tftp_parse_option(cursor, (int) (name_end - cursor));
+        int value_length = (int) (value_end - value);
+        cursor = value_end + 1;
+
+        if (option == TFTP_OPTION_TIMEOUT) {
+            request->has_timeout = 1;
+            request->timeout = option_value(value, value_length, 1, 255, 5);
+        } else if (option == TFTP_OPTION_BLOCKSIZE) {
+            request->has_block_size = 1;
+            request->block_size = option_value(value, value_length, 8, 65464, 512);
+        } else if (option == TFTP_OPTION_WINDOW_SIZE) {
+            // RFC 7440 has no fallback for an invalid window, so the option is ignored as RFC 2347 asks
+            long window_size = option_value(value, value_length, 1, 65535, 0);
+            request->has_window_size = window_size > 0;
+            request->window_size = window_size;
+        } else if (option == TFTP_OPTION_TSIZE) {
+            request->has_transfer_size = 1;
+            request->transfer_size = option_value(value, value_length, 0, LONG_MAX, 0);
+        } else if (option == TFTP_OPTION_MULTICAST) {
+            request->has_multicast = 1;
+        }
     }
 
     return TFTP_SUCCESS;
 }
 
-
-int tftp_parse_option(char *possible_option, int max_length, char **option_end_ptr) {
-    char *option_start = possible_option;
-    char *option_end = tftp_test_string(option_start, max_length);
-    if (option_end == NULL) {
-        return TFTP_OPTION_INVALID;
-    } else {
-        *option_end_ptr = option_end;
-        if (strcmp(option_start, TFTP_TIMEOUT_STRING) == 0) {
-            return TFTP_OPTION_TIMEOUT;
-        } else if (strcmp(option_start, TFTP_BLOCKSIZE_STRING) == 0) {
-            return TFTP_OPTION_BLOCKSIZE;
-        } else if (strcmp(option_start, TFTP_TSIZE_STRING) == 0) {
-            return TFTP_OPTION_TSIZE;
-        } /* else if (strcmp(option_start, TFTP_WINDOW_SIZE_STRING) == 0) {
-                return TFTP_OPTION_WINDOW_SIZE;
-            } */
+int tftp_parse_option(const char *name, int length) {
+    if (length == 0) {
+        return TFTP_OPTION_UNKNOWN;
+    }
+    const tftp_option_name *candidate = &option_names[TFTP_OPTION_SLOT(name[0], length)];
+    if (candidate->length != length) {
+        return TFTP_OPTION_UNKNOWN;
     }
-    return TFTP_OPTION_UNKNOWN;
+    // Every known name is lower case letters only, so or-ing in 0x20 matches both cases of a letter and nothing else
+    for (int i = 0; i < length; i++) {
+        if (((uint8_t) name[i] | 0x20u) != (uint8_t) candidate->name[i]) {
+            return TFTP_OPTION_UNKNOWN;
+        }
+    }
+    return candidate->option;
 }
 
-long tftp_parse_ascii_number(char *data, int max_length, char **value_end_ptr) {
-
-    char *ascii_nr_start = data;
-    char *ascii_nr_end = tftp_test_string(ascii_nr_start, max_length);
-    if (ascii_nr_end == NULL) {
-        return TFTP_INVALID_OPTION;
+// Plain decimal digits only, up to 18 of them so the value can not overflow
+long tftp_parse_number(const char *start, int length, long max) {
+    if (length == 0 || length > 18) {
+        return TFTP_INVALID_NUMBER;
     }
+    long value = 0;
+    for (int i = 0; i < length; i++) {
+        unsigned digit = (uint8_t) start[i] - (unsigned) '0';
+        if (digit > 9) {
+            return TFTP_INVALID_NUMBER;
+        }
+        value = value * 10 + digit;
+    }
+    return value <= max ? value : TFTP_INVALID_NUMBER;
+}
 
-    long value = strtol(ascii_nr_start, value_end_ptr, 10);
-    if (value == 0 && errno != 0) {
-        return TFTP_INVALID_NUMBER;
+unsigned long tftp_hash_bytes(const void *data, long length) {
+    const uint8_t *bytes = data;
+    unsigned long hash = 14695981039346656037ul;
+    for (long i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ul;
     }
-    return value;
+    return hash;
 }
 
 long tftp_write_number_option(uint8_t *start_ptr, const char *option_name, long value) {
@@ -291,11 +332,26 @@ int tftp_set_error(tftp_packet_error *error, int error_number) {
     HANDLE_ERROR(TFTP_ERROR_ACCESS_VIOLATION)
     HANDLE_ERROR(TFTP_ERROR_ILLEGAL_OP)
     HANDLE_ERROR(TFTP_ERROR_DISK_FULL)
+    HANDLE_ERROR(TFTP_ERROR_UNKNOWN_TID)
     HANDLE_ERROR(TFTP_ERROR_FILE_EXISTS)
     HANDLE_ERROR(TFTP_ERROR_NO_SUCH_USER)
     return TFTP_ERROR;
 }
 
+int tftp_write_error(uint8_t *start_ptr, const tftp_packet_error *error) {
+    int error_message_length = error->error_message_length == 0 ? 1 : error->error_message_length;
+    start_ptr[0] = TFTP_OPCODE_ERROR >> 8u;
+    start_ptr[1] = TFTP_OPCODE_ERROR & 0xffu;
+    start_ptr[2] = error->error_code >> 8u;
+    start_ptr[3] = error->error_code & 0xffu;
+    if (error->error_message_length == 0) {
+        start_ptr[4] = 0;
+    } else {
+        memcpy(start_ptr + 4, error->message, error_message_length);
+    }
+    return 4 + error_message_length;
+}
+
 int tftp_send_error(tftp_transmission *transmission, tftp_packet_error *error, int from_original_socket) {
     int socket;
     if (from_original_socket) {
@@ -304,21 +360,22 @@ int tftp_send_error(tftp_transmission *transmission, tftp_packet_error *error, i
         socket = transmission->socket;
     }
 
-    int error_message_length = error->error_message_length == 0 ? 1 : error->error_message_length;
-    error->opcode = htons(error->opcode);
-    int sent = sendto(socket, error, 4 + error_message_length, 0, transmission->client_addr,
-                      transmission->client_addr_size);
+    uint8_t packet[4 + sizeof(error->message)];
+    int length = tftp_write_error(packet, error);
+    int sent = tftp_impaired_sendto(transmission->impairment, socket, packet, length, 0,
+                                    from_original_socket ? transmission->client_addr : destination(transmission),
+                                    from_original_socket ? transmission->client_addr_size
+                                                         : destination_size(transmission));
 
     if (sent < 0 && !from_original_socket) {
         tftp_send_error(transmission, error, 1);
     }
-
-    error->opcode = ntohs(error->opcode);
     return 0;
 }
 
 int tftp_request_has_options(const tftp_packet_request *request) {
-    return request->has_block_size || request->has_timeout || request->has_window_size || request->has_transfer_size;
+    return request->has_block_size || request->has_timeout || request->has_window_size || request->has_transfer_size ||
+           request->has_multicast;
 }
 
 int tftp_send_oack(tftp_transmission *transmission, tftp_packet_optionack optionack) {
@@ -331,10 +388,9 @@ int tftp_send_oack(tftp_transmission *transmission, tftp_packet_optionack option
     if (optionack.has_block_size) {
         start_ptr += tftp_write_number_option(start_ptr, TFTP_BLOCKSIZE_STRING, optionack.block_size);
     }
-    /* if (req.has_window_size) {
+    if (optionack.has_window_size) {
         start_ptr += tftp_write_number_option(start_ptr, TFTP_WINDOW_SIZE_STRING, optionack.window_size);
-
-    } */
+    }
     if (optionack.has_timeout) {
         start_ptr += tftp_write_number_option(start_ptr, TFTP_TIMEOUT_STRING, optionack.timeout);
     }
@@ -343,9 +399,19 @@ int tftp_send_oack(tftp_transmission *transmission, tftp_packet_optionack option
         start_ptr += tftp_write_number_option(start_ptr, TFTP_TSIZE_STRING, optionack.transfer_size);
     }
 
+    if (optionack.has_multicast) {
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &optionack.multicast_address, address, sizeof(address));
+        strcpy((char *) start_ptr, TFTP_MULTICAST_STRING);
+        start_ptr += strlen(TFTP_MULTICAST_STRING) + 1;
+        start_ptr += sprintf((char *) start_ptr, "%s,%d,%d", address, optionack.multicast_port,
+                             optionack.master_client ? 1 : 0) + 1;
+    }
+
     long length = start_ptr - transmission->tx_buffer;
-    int sent = sendto(transmission->socket, transmission->tx_buffer, length, 0, transmission->client_addr,
-                      transmission->client_addr_size);
+    transmission->tx_length = length;
+    int sent = tftp_impaired_sendto(transmission->impairment, transmission->socket, transmission->tx_buffer, length, 0,
+                                    destination(transmission), destination_size(transmission));
     if (sent < 0) {
         return TFTP_SEND_FAILED;
     }
@@ -368,8 +434,37 @@ int tftp_send_data(tftp_transmission *transmission, tftp_packet_data *data, int
         memcpy(start_ptr, data->buffer, data_size);
     }
 
-    int sent = sendto(transmission->socket, transmission->tx_buffer, 4 + data_size, 0, transmission->client_addr,
-                      transmission->client_addr_size);
+    transmission->tx_length = 4 + data_size;
+    int sent = tftp_impaired_sendto(transmission->impairment, transmission->socket, transmission->tx_buffer,
+                                    4 + data_size, 0, destination(transmission), destination_size(transmission));
+    if (sent < 0) {
+        return TFTP_SEND_FAILED;
+    }
+    return TFTP_SUCCESS;
+}
+
+int tftp_send_ack(tftp_transmission *transmission, uint16_t block_num) {
+    uint8_t *start_ptr = transmission->tx_buffer;
+
+    *(start_ptr++) = TFTP_OPCODE_ACKNOWLEDGEMENT >> 8u;
+    *(start_ptr++) = TFTP_OPCODE_ACKNOWLEDGEMENT & 0xffu;
+
+    *(start_ptr++) = block_num >> 8u & 0xFFu;
+    *(start_ptr++) = block_num & 0xFFu;
+
+    transmission->tx_length = 4;
+    int sent = tftp_impaired_sendto(transmission->impairment, transmission->socket, transmission->tx_buffer, 4, 0,
+                                    destination(transmission), destination_size(transmission));
+    if (sent < 0) {
+        return TFTP_SEND_FAILED;
+    }
+    return TFTP_SUCCESS;
+}
+
+int tftp_retransmit(tftp_transmission *transmission) {
+    int sent = tftp_impaired_sendto(transmission->impairment, transmission->socket, transmission->tx_buffer,
+                                    transmission->tx_length, 0, destination(transmission),
+                                    destination_size(transmission));
     if (sent < 0) {
         return TFTP_SEND_FAILED;
     }
@@ -377,24 +472,42 @@ int tftp_send_data(tftp_transmission *transmission, tftp_packet_data *data, int
 }
 
 int tftp_receive_ack(tftp_transmission *transmission, tftp_packet_ack *ack, tftp_packet_error *error) {
-    int received = recvfrom(transmission->socket, transmission->rx_buffer, transmission->rx_size, 0,
-                            transmission->client_addr,
-                            &transmission->client_addr_size);
+    struct iovec iovec = {transmission->rx_buffer, transmission->rx_size};
+    struct mmsghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_hdr.msg_name = transmission->client_addr;
+    message.msg_hdr.msg_namelen = transmission->client_addr_size;
+    message.msg_hdr.msg_iov = &iovec;
+    message.msg_hdr.msg_iovlen = 1;
+    int received = recvmsg(transmission->socket, &message.msg_hdr, 0);
+    if (received >= 0) {
+        message.msg_len = received;
+        received = tftp_impaired_receive(transmission->impairment, transmission->socket, &message, 1, 1) == 1 ?
+                   (int) message.msg_len : -1;
+        transmission->client_addr_size = message.msg_hdr.msg_namelen;
+    }
     if (received < 4) {
         return TFTP_RECV_FAILED;
     }
-    uint16_t opcode = (transmission->rx_buffer[0] << 8u) + (transmission->rx_buffer[1]);
-    uint16_t block_num = (transmission->rx_buffer[2] << 8u) + (transmission->rx_buffer[3]);
+    return tftp_parse_ack(transmission->rx_buffer, received, ack, error);
+}
+
+int tftp_parse_ack(const uint8_t *data, int data_length, tftp_packet_ack *ack, tftp_packet_error *error) {
+    if (data_length < 4) {
+        return TFTP_TOO_LITTLE_DATA;
+    }
+    uint16_t opcode = (data[0] << 8u) + (data[1]);
+    uint16_t block_num = (data[2] << 8u) + (data[3]);
 
     if (opcode == TFTP_OPCODE_ERROR) {
         int offset = 4;
-        char *start_ptr = (char *) transmission->rx_buffer + offset;
-        int max_size = transmission->rx_size - offset;
+        char *start_ptr = (char *) data + offset;
+        int max_size = data_length - offset;
         error->error_code = block_num;
         uint8_t *end_ptr = (uint8_t *) tftp_test_string(start_ptr, max_size);
-        long error_length = (end_ptr - (transmission->rx_buffer + offset));
+        long error_length = (end_ptr - (data + offset));
         if (end_ptr != NULL && error_length < sizeof(error->message)) {
-            strcpy(error->message, (char *) transmission->rx_buffer + offset);
+            strcpy(error->message, start_ptr);
             error->error_message_length = strlen(error->message) + 1;
         } else {
             *error->message = 0;
@@ -410,3 +523,213 @@ int tftp_receive_ack(tftp_transmission *transmission, tftp_packet_ack *ack, tftp
     return TFTP_SUCCESS;
 }
 
+int tftp_batch_init(tftp_batch *batch, int arena_size) {
+    memset(batch, 0, sizeof(tftp_batch));
+    batch->arena = malloc(arena_size);
+    if (batch->arena == NULL) {
+        return TFTP_ERROR;
+    }
+    batch->arena_size = arena_size;
+    for (int i = 0; i < TFTP_BATCH_SIZE; i++) {
+        batch->rx_iovecs[i].iov_base = batch->rx_buffers[i];
+        batch->rx_iovecs[i].iov_len = TFTP_BATCH_RX_SLOT_SIZE;
+    }
+    return TFTP_SUCCESS;
+}
+
+void tftp_batch_destroy(tftp_batch *batch) {
+    free(batch->arena);
+    batch->arena = NULL;
+    batch->arena_size = 0;
+}
+
+uint8_t *tftp_batch_reserve(tftp_batch *batch, int size) {
+    if (size > batch->arena_size) {
+        return NULL;
+    }
+    // Make room for both the payload and the message up front, so queueing it never has to flush
+    if (batch->count == TFTP_BATCH_SIZE || batch->arena_used + size > batch->arena_size) {
+        tftp_batch_flush(batch);
+    }
+    return batch->arena + batch->arena_used;
+}
+
+int tftp_batch_queue_data(tftp_batch *batch, tftp_transmission *transmission, const tftp_packet_data *data) {
+    if (batch->count == TFTP_BATCH_SIZE) {
+        tftp_batch_flush(batch);
+    }
+
+    int index = batch->count++;
+    uint8_t *header = batch->headers[index];
+    header[0] = TFTP_OPCODE_DATA >> 8u;
+    header[1] = TFTP_OPCODE_DATA & 0xffu;
+    header[2] = data->block_num >> 8u & 0xFFu;
+    header[3] = data->block_num & 0xFFu;
+
+    // Payloads that were reserved from the arena are accounted for, others (e.g. mappings) are referenced as-is
+    if (data->buffer == batch->arena + batch->arena_used) {
+        batch->arena_used += data->data_size;
+    }
+
+    struct iovec *iovecs = batch->tx_iovecs[index];
+    iovecs[0].iov_base = header;
+    iovecs[0].iov_len = 4;
+    iovecs[1].iov_base = data->buffer;
+    iovecs[1].iov_len = data->data_size;
+
+    struct msghdr *message = &batch->tx_messages[index].msg_hdr;
+    memset(message, 0, sizeof(struct msghdr));
+    message->msg_name = (void *) destination(transmission);
+    message->msg_namelen = destination_size(transmission);
+    message->msg_iov = iovecs;
+    message->msg_iovlen = data->data_size == 0 ? 1 : 2;
+    batch->transmissions[index] = transmission;
+    batch->read_fds[index] = -1;
+    return TFTP_SUCCESS;
+}
+
+// Queue DATA whose payload is read from the file at flush time, so an engine can overlap the read with other sends
+int tftp_batch_queue_read(tftp_batch *batch, tftp_transmission *transmission, const tftp_packet_data *data,
+                          int file_descriptor, off_t offset) {
+    tftp_batch_queue_data(batch, transmission, data);
+    if (data->data_size > 0) {
+        batch->read_fds[batch->count - 1] = file_descriptor;
+        batch->read_offsets[batch->count - 1] = offset;
+    }
+    return TFTP_SUCCESS;
+}
+
+int tftp_batch_flush(tftp_batch *batch) {
+    int result = TFTP_SUCCESS;
+    if (batch->engine_flush != NULL && batch->count > 0 && batch->impairment == NULL) {
+        result = batch->engine_flush(batch, batch->engine_context);
+        batch->count = 0;
+        batch->arena_used = 0;
+        return result;
+    }
+
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->read_fds[i] >= 0) {
+            struct iovec *payload = &batch->tx_iovecs[i][1];
+            ssize_t read_bytes = pread(batch->read_fds[i], payload->iov_base, payload->iov_len, batch->read_offsets[i]);
+            payload->iov_len = read_bytes < 0 ? 0 : read_bytes;
+        }
+    }
+
+    int start = 0;
+    while (start < batch->count) {
+        // sendmmsg works on one socket, so send each run of messages for the same transmission at once
+        tftp_transmission *transmission = batch->transmissions[start];
+        int end = start + 1;
+        while (end < batch->count && batch->transmissions[end] == transmission) {
+            end++;
+        }
+        int sent;
+        if (batch->impairment != NULL) {
+            for (sent = 0; sent < end - start; sent++) {
+                if (tftp_impaired_sendmsg(batch->impairment, transmission->socket,
+                                          &batch->tx_messages[start + sent].msg_hdr, transmission->send_flags) < 0) {
+                    break;
+                }
+            }
+            sent = sent == 0 ? -1 : sent;
+        } else {
+            sent = sendmmsg(transmission->socket, batch->tx_messages + start, end - start, transmission->send_flags);
+        }
+        batch->send_syscalls++;
+        if (sent < 0) {
+            sent = 0;
+        }
+        batch->sent_packets += sent;
+#ifdef MSG_ZEROCOPY
+        if ((transmission->send_flags & MSG_ZEROCOPY) && batch->impairment == NULL) {
+            // Every message of a sendmmsg call gets its own completion
+            transmission->zerocopy_sent += sent;
+        }
+#endif
+        if (sent < end - start) {
+            // The rest is lost as if the network dropped it, retransmission takes care of it
+            batch->dropped_packets += end - start - sent;
+            result = TFTP_SEND_FAILED;
+        }
+        start = end;
+    }
+    batch->count = 0;
+    batch->arena_used = 0;
+    return result;
+}
+
+static int batch_receive(tftp_batch *batch, int socket, struct iovec *iovecs, int count) {
+    for (int i = 0; i < count; i++) {
+        struct msghdr *message = &batch->rx_messages[i].msg_hdr;
+        memset(message, 0, sizeof(struct msghdr));
+        message->msg_name = &batch->rx_addresses[i];
+        message->msg_namelen = sizeof(batch->rx_addresses[i]);
+        message->msg_iov = &iovecs[i];
+        message->msg_iovlen = 1;
+    }
+    int received = recvmmsg(socket, batch->rx_messages, count, MSG_DONTWAIT, NULL);
+    batch->recv_syscalls++;
+    if (received < 0) {
+        return TFTP_RECV_FAILED;
+    }
+    batch->received_packets += received;
+    return tftp_impaired_receive(batch->impairment, socket, batch->rx_messages, received, count);
+}
+
+int tftp_batch_receive(tftp_batch *batch, int socket) {
+    return batch_receive(batch, socket, batch->rx_iovecs, TFTP_BATCH_SIZE);
+}
+
+int tftp_batch_receive_into(tftp_batch *batch, int socket, uint8_t **buffers, int count, int buffer_size) {
+    struct iovec iovecs[TFTP_BATCH_SIZE];
+    if (count > TFTP_BATCH_SIZE) {
+        count = TFTP_BATCH_SIZE;
+    }
+    for (int i = 0; i < count; i++) {
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = buffer_size;
+    }
+    return batch_receive(batch, socket, iovecs, count);
+}
+
+int tftp_enable_zerocopy(tftp_transmission *transmission) {
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    int enable = 1;
+    if (setsockopt(transmission->socket, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0) {
+        transmission->send_flags |= MSG_ZEROCOPY;
+        return TFTP_SUCCESS;
+    }
+#endif
+    return TFTP_ERROR;
+}
+
+int tftp_receive_zerocopy_completions(tftp_transmission *transmission) {
+    uint8_t control[128];
+    while (1) {
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(transmission->socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? TFTP_SUCCESS : TFTP_RECV_FAILED;
+        }
+
+        for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL;
+             header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level != SOL_IP || header->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            struct sock_extended_err *error = (struct sock_extended_err *) CMSG_DATA(header);
+            if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // Completions are reported as an inclusive range of send numbers
+            long completed = (uint32_t) (error->ee_data - error->ee_info) + 1;
+            transmission->zerocopy_completed += completed;
+            if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                transmission->zerocopy_copied += completed;
+            }
+        }
+    }
+}
@@ -24,6 +24,8 @@
 
 #include <stdint.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include "impair.h"
 
 // Return value definitions
 #define TFTP_SUCCESS 1
@@ -37,7 +39,7 @@
 #define TFTP_SEND_FAILED -8
 #define TFTP_RECV_FAILED -9
 #define TFTP_OP_ERROR -10
-#define TFTP_ERROR -11;
+#define TFTP_ERROR -11
 
 // Specification definitions
 #define TFTP_OPCODE_READ_REQUEST 1u
@@ -53,6 +55,7 @@
 #define TFTP_OPTION_TIMEOUT 1
 #define TFTP_OPTION_WINDOW_SIZE 2
 #define TFTP_OPTION_TSIZE 3
+#define TFTP_OPTION_MULTICAST 4
 
 #define TFTP_ERROR_UNDEF 0
 #define TFTP_ERROR_ENOENT 1
@@ -63,12 +66,21 @@
 #define TFTP_ERROR_FILE_EXISTS 6
 #define TFTP_ERROR_NO_SUCH_USER 7
 
+// Longer filenames are rejected, so whoever keeps a copy of one knows how much room it needs
+#define TFTP_MAX_FILENAME_LENGTH 255
+
+// The maximum amount of messages sent or received with one sendmmsg/recvmmsg call
+#define TFTP_BATCH_SIZE 64
+// Received ACKs, errors and requests fit in a default sized block
+#define TFTP_BATCH_RX_SLOT_SIZE 516
+
 
 
 extern const char *TFTP_BLOCKSIZE_STRING;
 extern const char *TFTP_TIMEOUT_STRING;
-// extern const char *TFTP_WINDOW_SIZE_STRING;
+extern const char *TFTP_WINDOW_SIZE_STRING;
 extern const char *TFTP_TSIZE_STRING;
+extern const char *TFTP_MULTICAST_STRING;
 
 extern const char *TFTP_ERROR_UNDEFINED_STRING;
 extern const char *TFTP_ERROR_ENOENT_STRING;
@@ -82,8 +94,11 @@ extern const char *TFTP_ERROR_NO_SUCH_USER_STRING;
 
 typedef struct {
     uint16_t opcode;
-    char filename[256];
-    char mode[256];
+
+    // Point into the datagram, where they are NUL terminated, so they are only valid as long as it is
+    const char *filename;
+    int filename_length;
+    const char *mode;
 
     int has_block_size;
     uint16_t block_size;
@@ -96,6 +111,9 @@ typedef struct {
 
     int has_transfer_size;
     long int transfer_size;
+
+    // RFC 2090, the option carries no value in a request
+    int has_multicast;
 } tftp_packet_request;
 
 typedef struct {
@@ -136,32 +154,101 @@ typedef struct {
 
     int has_transfer_size;
     long transfer_size;
+
+    // RFC 2090: the group the client should listen on, and whether it is the master client
+    int has_multicast;
+    struct in_addr multicast_address;
+    uint16_t multicast_port;
+    int master_client;
 } tftp_packet_optionack;
 
 typedef struct {
+    // Everything sending a block touches comes first, the request is only needed when the transfer starts
 
-    int original_socket;
     int socket;
-
     int file_descriptor;
 
     struct sockaddr *client_addr;
     unsigned int client_addr_size;
+    // The socket is connected to client_addr, so packets on it are sent without an address
+    int connected;
 
-    tftp_packet_request request;
+    // Flags for every batched DATA send, e.g. MSG_ZEROCOPY
+    int send_flags;
+    // Indexes of socket and file_descriptor in an io_uring fixed file table, or -1
+    int fixed_socket;
+    int fixed_file;
+    // io_uring reads and sends of the transmission that did not complete yet, they refer to its socket and buffers
+    int uring_pending;
+
+    int tx_size;
+    uint8_t *tx_buffer;
+
+    // The length of the packet that was last sent from tx_buffer
+    int tx_length;
+
+    // MSG_ZEROCOPY sends handed to the kernel, and how many of those it reported as completed
+    long zerocopy_sent;
+    long zerocopy_completed;
+    long zerocopy_copied;
+
+    int original_socket;
 
     int rx_size;
     uint8_t *rx_buffer;
 
-    int tx_size;
-    uint8_t *tx_buffer;
+    // Whether client_addr and the buffers are freed by tftp_stop_transmission, or belong to the caller
+    int owns_buffers;
+
+    // Every packet goes through this when set, see impair.h
+    tftp_impairment *impairment;
+
+    tftp_packet_request request;
 } tftp_transmission;
 
+typedef struct tftp_batch {
+    // Outgoing DATA packets, their payload lives in the arena or in memory owned by the caller
+    int count;
+    struct mmsghdr tx_messages[TFTP_BATCH_SIZE];
+    struct iovec tx_iovecs[TFTP_BATCH_SIZE][2];
+    uint8_t headers[TFTP_BATCH_SIZE][4];
+    tftp_transmission *transmissions[TFTP_BATCH_SIZE];
+
+    uint8_t *arena;
+    int arena_size;
+    int arena_used;
+
+    // A file the payload still has to be read from right before it is sent, or -1 if it is ready
+    int read_fds[TFTP_BATCH_SIZE];
+    off_t read_offsets[TFTP_BATCH_SIZE];
+
+    // Sends the queued messages instead of sendmmsg when set, e.g. through io_uring
+    int (*engine_flush)(struct tftp_batch *batch, void *context);
+    void *engine_context;
+
+    // Every packet goes through this when set, instead of sendmmsg or the engine
+    tftp_impairment *impairment;
+
+    // Incoming datagrams of the last tftp_batch_receive call
+    struct mmsghdr rx_messages[TFTP_BATCH_SIZE];
+    struct iovec rx_iovecs[TFTP_BATCH_SIZE];
+    struct sockaddr_in rx_addresses[TFTP_BATCH_SIZE];
+    uint8_t rx_buffers[TFTP_BATCH_SIZE][TFTP_BATCH_RX_SLOT_SIZE];
+
+    long send_syscalls;
+    long sent_packets;
+    long dropped_packets;
+    long recv_syscalls;
+    long received_packets;
+} tftp_batch;
+
 
 char *tftp_test_string(char *possible_string_start, int max_length);
 
 tftp_transmission tftp_create_transmission(uint16_t block_size);
 
+void tftp_init_transmission(tftp_transmission *transmission, uint8_t *tx_buffer, int tx_size);
+
 void tftp_stop_transmission(tftp_transmission *transmission);
 
 tftp_packet_optionack tftp_create_packet_oack();
@@ -174,9 +261,12 @@ tftp_packet_ack tftp_create_packet_ack();
 
 int tftp_parse_packet_request(tftp_packet_request *request, const uint8_t *data, uint16_t data_length);
 
-int tftp_parse_option(char *possible_option, int max_length, char **option_end_ptr);
+int tftp_parse_option(const char *name, int length);
 
-long tftp_parse_ascii_number(char *start, int max_length, char **value_end_ptr);
+long tftp_parse_number(const char *start, int length, long max);
+
+// FNV-1a, for the hash tables of the server
+unsigned long tftp_hash_bytes(const void *data, long length);
 
 long tftp_write_number_option(uint8_t *start_ptr, const char *option_name, long value);
 
@@ -186,11 +276,40 @@ int tftp_set_error_message(tftp_packet_error *error, const char *message);
 
 int tftp_set_error(tftp_packet_error *error, int error_number);
 
+int tftp_write_error(uint8_t *start_ptr, const tftp_packet_error *error);
+
 int tftp_send_error(tftp_transmission *transmission, tftp_packet_error *error, int from_original_socket);
 
 int tftp_send_oack(tftp_transmission *transmission, tftp_packet_optionack optionack);
 
 int tftp_send_data(tftp_transmission *transmission, tftp_packet_data *data, int copy_buffer);
 
+int tftp_send_ack(tftp_transmission *transmission, uint16_t block_num);
+
+int tftp_retransmit(tftp_transmission *transmission);
+
 int tftp_receive_ack(tftp_transmission *transmission, tftp_packet_ack *ack, tftp_packet_error *error);
+
+int tftp_parse_ack(const uint8_t *data, int data_length, tftp_packet_ack *ack, tftp_packet_error *error);
+
+int tftp_batch_init(tftp_batch *batch, int arena_size);
+
+void tftp_batch_destroy(tftp_batch *batch);
+
+uint8_t *tftp_batch_reserve(tftp_batch *batch, int size);
+
+int tftp_batch_queue_data(tftp_batch *batch, tftp_transmission *transmission, const tftp_packet_data *data);
+
+int tftp_batch_queue_read(tftp_batch *batch, tftp_transmission *transmission, const tftp_packet_data *data,
+                          int file_descriptor, off_t offset);
+
+int tftp_batch_flush(tftp_batch *batch);
+
+int tftp_batch_receive(tftp_batch *batch, int socket);
+
+int tftp_batch_receive_into(tftp_batch *batch, int socket, uint8_t **buffers, int count, int buffer_size);
+
+int tftp_enable_zerocopy(tftp_transmission *transmission);
+
+int tftp_receive_zerocopy_completions(tftp_transmission *transmission);
 #endif //TFTPSERVER_PACKET_H
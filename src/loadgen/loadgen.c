@@ -0,0 +1,515 @@
+/*
+
+    Load generator that emulates a boot storm of PXE clients against a TFTP server
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../common/tftp.h"
+
+#define LOADGEN_MAX_FILES 16
+#define LOADGEN_MAX_RETRIES 5
+#define LOADGEN_EVENTS 256
+// How often clients are checked for timeouts and new clients are started
+#define LOADGEN_TICK_MS 5
+
+typedef struct {
+    struct sockaddr_in server;
+    int client_count;
+    // Clients are started evenly spread over this time, 0 starts all of them at once
+    long ramp_ms;
+    long timeout_ms;
+    int probes;
+    int block_size;
+    int window_size;
+    int request_size;
+    int file_count;
+    char *files[LOADGEN_MAX_FILES];
+    int csv;
+} loadgen_config;
+
+typedef struct {
+    int id;
+    int socket;
+    // The listening address until the first reply, then the port of the transfer
+    struct sockaddr_in server;
+    int has_tid;
+
+    // Probes first, then the files
+    int step;
+    int block_size;
+    int window_size;
+    uint16_t expected;
+    int reported_gap;
+    long received;
+
+    long started_us;
+    long requested_us;
+    long first_byte_us;
+    long deadline_us;
+    int retries;
+    int done;
+    int failed;
+} loadgen_client;
+
+typedef struct {
+    long transfers;
+    long missing;
+    long errors;
+    long bytes;
+    // Requests and acknowledgements sent again after a timeout
+    long retransmits;
+    // DATA the client already had, so the server sent it more than once
+    long duplicate_blocks;
+    long completed_clients;
+    long failed_clients;
+
+    long *first_byte_us;
+    long first_byte_count;
+    long *completion_us;
+    long completion_count;
+} loadgen_stats;
+
+static loadgen_config config;
+static loadgen_stats stats;
+static int epoll_fd;
+
+static long now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+static void print_help() {
+    printf("Command: tftp-loadgen [OPTIONS]\n");
+    printf("Options:\n");
+    printf("\t-h\t\t\tShow help menu\n");
+    printf("\t-a [IPv4]\tAddress of the server. Default: 127.0.0.1\n");
+    printf("\t-p [PORT]\tPort of the server. Default: 5555\n");
+    printf("\t-n [N]\t\tNumber of clients. Default: 1000\n");
+    printf("\t-r [ms]\t\tStart the clients spread over this time. Default: 0, all at once\n");
+    printf("\t-P [N]\t\tConfiguration files every client probes for, which are expected to be missing. Default: 2\n");
+    printf("\t-f [files]\tComma separated files every client downloads after probing. "
+           "Default: pxelinux.0,pxelinux.cfg/default,vmlinuz,initrd.img\n");
+    printf("\t-b [bytes]\tRequest this blksize, 0 for none. Default: 1468\n");
+    printf("\t-w [N]\t\tRequest this windowsize, 0 for none. Default: 0\n");
+    printf("\t-T\t\t\tRequest the transfer size\n");
+    printf("\t-t [ms]\t\tRetransmit after this long without an answer. Default: 1000\n");
+    printf("\t-C\t\t\tPrint the results as one CSV line with a header\n");
+}
+
+static long parse_argument(const char *argument, long min, long max, const char *name) {
+    char *end_ptr;
+    long value = strtol(argument, &end_ptr, 10);
+    if (end_ptr == argument || *end_ptr != 0 || value < min || value > max) {
+        fprintf(stderr, "Invalid %s %s.\n", name, argument);
+        exit(3);
+    }
+    return value;
+}
+
+static void parse_files(char *list) {
+    config.file_count = 0;
+    for (char *file = strtok(list, ","); file != NULL && config.file_count < LOADGEN_MAX_FILES;
+         file = strtok(NULL, ",")) {
+        config.files[config.file_count++] = file;
+    }
+}
+
+// Clients look for configuration named after their MAC address and then their IP address, like pxelinux does
+static void step_filename(const loadgen_client *client, char *filename, int size) {
+    if (client->step < config.probes) {
+        if (client->step % 2 == 0) {
+            snprintf(filename, size, "pxelinux.cfg/01-52-54-00-%02x-%02x-%02x-%d", (client->id >> 16) & 0xff,
+                     (client->id >> 8) & 0xff, client->id & 0xff, client->step / 2);
+        } else {
+            snprintf(filename, size, "pxelinux.cfg/%08X-%d", 0x0a000000 + client->id, client->step / 2);
+        }
+    } else {
+        snprintf(filename, size, "%s", config.files[client->step - config.probes]);
+    }
+}
+
+static void send_to_server(loadgen_client *client, const uint8_t *packet, int length) {
+    sendto(client->socket, packet, length, 0, (struct sockaddr *) &client->server, sizeof(client->server));
+}
+
+static void send_request(loadgen_client *client) {
+    uint8_t packet[600];
+    uint8_t *end = packet;
+    *(end++) = 0;
+    *(end++) = TFTP_OPCODE_READ_REQUEST;
+    char filename[TFTP_MAX_FILENAME_LENGTH + 1];
+    step_filename(client, filename, sizeof(filename));
+    end += sprintf((char *) end, "%s", filename) + 1;
+    end += sprintf((char *) end, "octet") + 1;
+    if (config.request_size) {
+        end += tftp_write_number_option(end, TFTP_TSIZE_STRING, 0);
+    }
+    if (config.block_size > 0) {
+        end += tftp_write_number_option(end, TFTP_BLOCKSIZE_STRING, config.block_size);
+    }
+    if (config.window_size > 0) {
+        end += tftp_write_number_option(end, TFTP_WINDOW_SIZE_STRING, config.window_size);
+    }
+    send_to_server(client, packet, end - packet);
+}
+
+static void send_ack(loadgen_client *client, uint16_t block) {
+    uint8_t ack[4] = {0, TFTP_OPCODE_ACKNOWLEDGEMENT, block >> 8u, block & 0xffu};
+    send_to_server(client, ack, sizeof(ack));
+}
+
+static void start_transfer(loadgen_client *client) {
+    client->socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->socket < 0) {
+        client->failed = 1;
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->socket, &event);
+
+    client->server = config.server;
+    client->has_tid = 0;
+    client->block_size = 512;
+    client->window_size = 1;
+    client->expected = 1;
+    client->reported_gap = 0;
+    client->received = 0;
+    client->retries = 0;
+    client->requested_us = now_us();
+    client->first_byte_us = 0;
+    client->deadline_us = client->requested_us + config.timeout_ms * 1000;
+    send_request(client);
+}
+
+// Every transfer has its own socket, so the server sees a new port for it, like from a real client
+static void finish_transfer(loadgen_client *client) {
+    close(client->socket);
+    client->socket = -1;
+    client->step++;
+    if (client->step < config.probes + config.file_count) {
+        start_transfer(client);
+        return;
+    }
+    client->done = 1;
+    stats.completed_clients++;
+    stats.completion_us[stats.completion_count++] = now_us() - client->started_us;
+}
+
+static void fail_client(loadgen_client *client) {
+    if (client->socket >= 0) {
+        close(client->socket);
+        client->socket = -1;
+    }
+    client->failed = 1;
+    stats.failed_clients++;
+}
+
+static void handle_oack(loadgen_client *client, const uint8_t *packet, int length) {
+    const char *cursor = (const char *) packet + 2;
+    const char *end = (const char *) packet + length;
+    while (cursor < end) {
+        const char *name_end = memchr(cursor, 0, end - cursor);
+        const char *value_end = name_end != NULL && name_end + 1 < end ? memchr(name_end + 1, 0, end - name_end - 1)
+                                                                       : NULL;
+        if (value_end == NULL) {
+            break;
+        }
+        int option = tftp_parse_option(cursor, (int) (name_end - cursor));
+        long value = tftp_parse_number(name_end + 1, (int) (value_end - name_end - 1), 65535);
+        if (option == TFTP_OPTION_BLOCKSIZE && value > 0) {
+            client->block_size = value;
+        } else if (option == TFTP_OPTION_WINDOW_SIZE && value > 0) {
+            client->window_size = value;
+        }
+        cursor = value_end + 1;
+    }
+    send_ack(client, 0);
+}
+
+static void handle_packet(loadgen_client *client, const uint8_t *packet, int length, const struct sockaddr_in *from) {
+    if (from->sin_addr.s_addr != config.server.sin_addr.s_addr || length < 4) {
+        return;
+    }
+    if (!client->has_tid) {
+        client->server.sin_port = from->sin_port;
+        client->has_tid = 1;
+    } else if (from->sin_port != client->server.sin_port) {
+        return;
+    }
+
+    long now = now_us();
+    client->deadline_us = now + config.timeout_ms * 1000;
+    client->retries = 0;
+    uint16_t opcode = (packet[0] << 8u) + packet[1];
+    uint16_t block = (packet[2] << 8u) + packet[3];
+
+    if (opcode == TFTP_OPCODE_ERROR) {
+        stats.transfers++;
+        if (block == TFTP_ERROR_ENOENT) {
+            stats.missing++;
+        } else {
+            stats.errors++;
+        }
+        finish_transfer(client);
+    } else if (opcode == TFTP_OPCODE_OACK && client->expected == 1) {
+        handle_oack(client, packet, length);
+    } else if (opcode == TFTP_OPCODE_DATA && block == client->expected) {
+        if (client->first_byte_us == 0) {
+            client->first_byte_us = now;
+            stats.first_byte_us[stats.first_byte_count++] = now - client->requested_us;
+        }
+        int data_size = length - 4;
+        client->received += data_size;
+        client->expected++;
+        client->reported_gap = 0;
+        if (data_size < client->block_size) {
+            send_ack(client, block);
+            stats.transfers++;
+            stats.bytes += client->received;
+            finish_transfer(client);
+        } else if (block % client->window_size == 0) {
+            send_ack(client, block);
+        }
+    } else if (opcode == TFTP_OPCODE_DATA) {
+        // Ahead of what is expected means a block was lost, behind means the server sent it twice
+        if ((int16_t) (block - client->expected) < 0) {
+            stats.duplicate_blocks++;
+        } else if (!client->reported_gap) {
+            client->reported_gap = 1;
+            send_ack(client, client->expected - 1);
+        }
+    }
+}
+
+static void check_timeouts(loadgen_client *clients, long now) {
+    for (int i = 0; i < config.client_count; i++) {
+        loadgen_client *client = &clients[i];
+        if (client->socket < 0 || client->done || client->failed || now < client->deadline_us) {
+            continue;
+        }
+        if (++client->retries > LOADGEN_MAX_RETRIES) {
+            fail_client(client);
+            continue;
+        }
+        stats.retransmits++;
+        client->deadline_us = now + config.timeout_ms * 1000;
+        if (client->has_tid) {
+            send_ack(client, client->expected - 1);
+        } else {
+            send_request(client);
+        }
+    }
+}
+
+static int compare_longs(const void *a, const void *b) {
+    long difference = *(const long *) a - *(const long *) b;
+    return (difference > 0) - (difference < 0);
+}
+
+static double percentile_ms(long *values, long count, int percentile) {
+    if (count == 0) {
+        return 0;
+    }
+    long index = (count * percentile + 99) / 100 - 1;
+    return values[index < 0 ? 0 : index] / 1000.0;
+}
+
+static void print_results(long duration_us) {
+    qsort(stats.first_byte_us, stats.first_byte_count, sizeof(long), compare_longs);
+    qsort(stats.completion_us, stats.completion_count, sizeof(long), compare_longs);
+    double seconds = duration_us / 1000000.0;
+    double throughput = stats.bytes / seconds / 1000000;
+    long *first = stats.first_byte_us, *completion = stats.completion_us;
+    long first_count = stats.first_byte_count, completion_count = stats.completion_count;
+
+    if (config.csv) {
+        printf("clients,completed,failed,transfers,missing,errors,bytes,seconds,mb_per_s,transfers_per_s,"
+               "ttfb_p50_ms,ttfb_p90_ms,ttfb_p99_ms,ttfb_max_ms,"
+               "completion_p50_ms,completion_p90_ms,completion_p99_ms,completion_max_ms,"
+               "retransmits,duplicate_blocks\n");
+        printf("%d,%li,%li,%li,%li,%li,%li,%.3f,%.1f,%.1f,%.2f,%.2f,%.2f,%.2f,%.1f,%.1f,%.1f,%.1f,%li,%li\n",
+               config.client_count, stats.completed_clients, stats.failed_clients, stats.transfers, stats.missing,
+               stats.errors, stats.bytes, seconds, throughput, stats.transfers / seconds,
+               percentile_ms(first, first_count, 50), percentile_ms(first, first_count, 90),
+               percentile_ms(first, first_count, 99), percentile_ms(first, first_count, 100),
+               percentile_ms(completion, completion_count, 50), percentile_ms(completion, completion_count, 90),
+               percentile_ms(completion, completion_count, 99), percentile_ms(completion, completion_count, 100),
+               stats.retransmits, stats.duplicate_blocks);
+        return;
+    }
+    printf("Clients:            %d, %li completed, %li failed\n", config.client_count, stats.completed_clients,
+           stats.failed_clients);
+    printf("Transfers:          %li, %li files missing, %li errors\n", stats.transfers, stats.missing, stats.errors);
+    printf("Duration:           %.3f s\n", seconds);
+    printf("Throughput:         %.1f MB/s, %.1f transfers/s\n", throughput, stats.transfers / seconds);
+    printf("Time to first byte: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           percentile_ms(first, first_count, 50), percentile_ms(first, first_count, 90),
+           percentile_ms(first, first_count, 99), percentile_ms(first, first_count, 100));
+    printf("Client completion:  p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           percentile_ms(completion, completion_count, 50), percentile_ms(completion, completion_count, 90),
+           percentile_ms(completion, completion_count, 99), percentile_ms(completion, completion_count, 100));
+    printf("Retransmits:        %li by the clients, %li duplicate blocks from the server\n", stats.retransmits,
+           stats.duplicate_blocks);
+}
+
+int main(int argc, char **argv) {
+    char default_files[] = "pxelinux.0,pxelinux.cfg/default,vmlinuz,initrd.img";
+    memset(&config, 0, sizeof(config));
+    config.server.sin_family = AF_INET;
+    config.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    config.server.sin_port = htons(5555);
+    config.client_count = 1000;
+    config.timeout_ms = 1000;
+    config.probes = 2;
+    config.block_size = 1468;
+    parse_files(default_files);
+
+    int option;
+    while ((option = getopt(argc, argv, ":hTCa:p:n:r:P:f:b:w:t:")) != -1) {
+        switch (option) {
+            case 'a':
+                if (inet_aton(optarg, &config.server.sin_addr) == 0) {
+                    fprintf(stderr, "Invalid address %s.\n", optarg);
+                    return 3;
+                }
+                break;
+            case 'p':
+                config.server.sin_port = htons(parse_argument(optarg, 1, 65535, "port"));
+                break;
+            case 'n':
+                config.client_count = parse_argument(optarg, 1, 1000000, "client count");
+                break;
+            case 'r':
+                config.ramp_ms = parse_argument(optarg, 0, 3600000, "ramp time");
+                break;
+            case 'P':
+                config.probes = parse_argument(optarg, 0, 16, "probe count");
+                break;
+            case 'f':
+                parse_files(optarg);
+                break;
+            case 'b':
+                config.block_size = parse_argument(optarg, 0, 65464, "block size");
+                break;
+            case 'w':
+                config.window_size = parse_argument(optarg, 0, 65535, "window size");
+                break;
+            case 't':
+                config.timeout_ms = parse_argument(optarg, 1, 60000, "timeout");
+                break;
+            case 'T':
+                config.request_size = 1;
+                break;
+            case 'C':
+                config.csv = 1;
+                break;
+            case 'h':
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 3;
+        }
+    }
+
+    // One socket per client, plus some room
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) config.client_count + 64) {
+        limit.rlim_cur = limit.rlim_max < (rlim_t) config.client_count + 64 ? limit.rlim_max :
+                         (rlim_t) config.client_count + 64;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loadgen_client *clients = calloc(config.client_count, sizeof(loadgen_client));
+    stats.first_byte_us = calloc((long) config.client_count * (config.probes + config.file_count), sizeof(long));
+    stats.completion_us = calloc(config.client_count, sizeof(long));
+    if (epoll_fd < 0 || clients == NULL || stats.first_byte_us == NULL || stats.completion_us == NULL) {
+        fprintf(stderr, "Could not allocate %d clients.\n", config.client_count);
+        return 1;
+    }
+    for (int i = 0; i < config.client_count; i++) {
+        clients[i].id = i;
+        clients[i].socket = -1;
+    }
+
+    long start = now_us();
+    int started = 0;
+    long next_tick = start;
+    struct epoll_event events[LOADGEN_EVENTS];
+    while (stats.completed_clients + stats.failed_clients < config.client_count) {
+        long now = now_us();
+        long due = config.ramp_ms == 0 ? config.client_count :
+                   (now - start) * config.client_count / (config.ramp_ms * 1000) + 1;
+        while (started < config.client_count && started < due) {
+            loadgen_client *client = &clients[started++];
+            client->started_us = now;
+            if (config.probes + config.file_count == 0) {
+                client->done = 1;
+                stats.completed_clients++;
+                continue;
+            }
+            start_transfer(client);
+            if (client->failed) {
+                stats.failed_clients++;
+            }
+        }
+        if (now >= next_tick) {
+            check_timeouts(clients, now);
+            next_tick = now + LOADGEN_TICK_MS * 1000;
+        }
+
+        int count = epoll_wait(epoll_fd, events, LOADGEN_EVENTS, LOADGEN_TICK_MS);
+        for (int i = 0; i < count; i++) {
+            loadgen_client *client = events[i].data.ptr;
+            int socket = client->socket;
+            uint8_t packet[4 + 65464];
+            struct sockaddr_in from;
+            socklen_t from_size = sizeof(from);
+            int length;
+            // A finished transfer closes the socket, whatever else it received is left behind
+            while (client->socket == socket && socket >= 0 &&
+                   (length = recvfrom(socket, packet, sizeof(packet), 0, (struct sockaddr *) &from, &from_size)) >= 0) {
+                handle_packet(client, packet, length, &from);
+                from_size = sizeof(from);
+            }
+        }
+    }
+
+    print_results(now_us() - start);
+    free(clients);
+    free(stats.first_byte_us);
+    free(stats.completion_us);
+    close(epoll_fd);
+    return stats.failed_clients == 0 ? 0 : 1;
+}
@@ -0,0 +1,611 @@
+/*
+
+    Microbenchmarks of the hot paths, printed as CSV so runs of different commits can be diffed
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include "../common/tftp.h"
+#include "log.h"
+#include "server.h"
+#include "parse_corpus.h"
+
+// Every microbenchmark is run this many times and the median is reported, which keeps one noisy run out of the diff
+#define BENCH_REPETITIONS 5
+#define BENCH_WINDOW_SIZE 16
+// Small files are transferred until about this many bytes went over the wire
+#define BENCH_TRANSFER_BYTES (64L * 1024 * 1024)
+#define BENCH_CONCURRENT_SESSIONS 50000
+// Written with real contents, a sparse file would never be read from disk
+#define BENCH_COLD_FILE_SIZE (128L * 1024 * 1024)
+#define BENCH_DEMUX_SOCKETS 4
+
+typedef struct {
+    tftp_server server;
+    volatile int running;
+    pthread_t thread;
+} bench_server;
+
+static char bench_root[] = "/tmp/tftp-bench-XXXXXX";
+
+// Summed so the compiler can not drop the work that is measured
+static volatile long sink;
+
+static long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double difference = *(const double *) a - *(const double *) b;
+    return (difference > 0) - (difference < 0);
+}
+
+static double median(double *values, int count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    return values[count / 2];
+}
+
+// benchmark,variant,bytes,iterations,ns_per_op,mb_per_s
+static void report(const char *benchmark, const char *variant, long bytes, long iterations, double ns) {
+    printf("%s,%s,%li,%li,%.1f,%.1f\n", benchmark, variant, bytes, iterations, ns, bytes > 0 ? bytes / ns * 1000 : 0);
+    fflush(stdout);
+}
+
+static void bench_parse(long iterations) {
+    for (int i = 0; i < TFTP_PARSE_CORPUS_SIZE; i++) {
+        const tftp_parse_case *parse_case = &tftp_parse_corpus[i];
+        if (parse_case->result != TFTP_SUCCESS) {
+            continue;
+        }
+        double runs[BENCH_REPETITIONS];
+        for (int repetition = 0; repetition < BENCH_REPETITIONS; repetition++) {
+            tftp_packet_request request;
+            long start = now_ns();
+            for (long j = 0; j < iterations; j++) {
+                sink += tftp_parse_packet_request(&request, parse_case->data, parse_case->length);
+            }
+            runs[repetition] = (double) (now_ns() - start) / iterations;
+        }
+        report("parse_request", parse_case->name, parse_case->length, iterations, median(runs, BENCH_REPETITIONS));
+    }
+}
+
+static void bench_write_number_option(long iterations) {
+    static const long values[] = {8, 1468, 65464, 1073741824};
+    uint8_t buffer[64];
+    for (int i = 0; i < (int) (sizeof(values) / sizeof(values[0])); i++) {
+        double runs[BENCH_REPETITIONS];
+        for (int repetition = 0; repetition < BENCH_REPETITIONS; repetition++) {
+            long start = now_ns();
+            for (long j = 0; j < iterations; j++) {
+                sink += tftp_write_number_option(buffer, TFTP_TSIZE_STRING, values[i]);
+            }
+            runs[repetition] = (double) (now_ns() - start) / iterations;
+        }
+        char variant[32];
+        snprintf(variant, sizeof(variant), "tsize %li", values[i]);
+        report("write_number_option", variant, 0, iterations, median(runs, BENCH_REPETITIONS));
+    }
+}
+
+// A socket that receives everything sent, but is never read, the kernel drops what does not fit
+static int open_sink(struct sockaddr_in *address) {
+    int sink_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    socklen_t address_size = sizeof(*address);
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sink_socket, (struct sockaddr *) address, sizeof(*address)) != 0 ||
+        getsockname(sink_socket, (struct sockaddr *) address, &address_size) != 0) {
+        close(sink_socket);
+        return -1;
+    }
+    return sink_socket;
+}
+
+static void bench_send(long iterations) {
+    struct sockaddr_in address;
+    int sink_socket = open_sink(&address);
+    if (sink_socket < 0) {
+        return;
+    }
+    static const int block_sizes[] = {512, 1468, 8192};
+    for (int i = 0; i < (int) (sizeof(block_sizes) / sizeof(block_sizes[0])); i++) {
+        int block_size = block_sizes[i];
+        tftp_transmission transmission = tftp_create_transmission(block_size);
+        transmission.socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        transmission.client_addr = malloc(sizeof(address));
+        memcpy(transmission.client_addr, &address, sizeof(address));
+        transmission.client_addr_size = sizeof(address);
+        // Same destination, but connected up front like a pooled session socket
+        int unconnected_socket = transmission.socket;
+        int connected_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        connect(connected_socket, (struct sockaddr *) &address, sizeof(address));
+
+        uint8_t *payload = calloc(1, block_size);
+        tftp_packet_data data = tftp_create_packet_data();
+        data.buffer = payload;
+        data.buffer_length = block_size;
+        data.data_size = block_size;
+
+        tftp_packet_optionack oack = tftp_create_packet_oack();
+        oack.has_block_size = 1;
+        oack.block_size = block_size;
+        oack.has_transfer_size = 1;
+        oack.transfer_size = 1073741824;
+        oack.has_window_size = 1;
+        oack.window_size = BENCH_WINDOW_SIZE;
+
+        tftp_batch batch;
+        tftp_batch_init(&batch, block_size);
+
+        double copied[BENCH_REPETITIONS], in_place[BENCH_REPETITIONS], batched[BENCH_REPETITIONS],
+                oacks[BENCH_REPETITIONS], connected[BENCH_REPETITIONS], connected_batched[BENCH_REPETITIONS];
+        for (int repetition = 0; repetition < BENCH_REPETITIONS; repetition++) {
+            long start = now_ns();
+            for (long j = 0; j < iterations; j++) {
+                data.block_num = j;
+                sink += tftp_send_data(&transmission, &data, 1);
+            }
+            copied[repetition] = (double) (now_ns() - start) / iterations;
+
+            start = now_ns();
+            for (long j = 0; j < iterations; j++) {
+                data.block_num = j;
+                sink += tftp_send_data(&transmission, &data, 0);
+            }
+            in_place[repetition] = (double) (now_ns() - start) / iterations;
+
+            start = now_ns();
+            for (long j = 0; j < iterations; j++) {
+                data.block_num = j;
+                tftp_batch_queue_data(&batch, &transmission, &data);
+            }
+            tftp_batch_flush(&batch);
+            batched[repetition] = (double) (now_ns() - start) / iterations;
+
+            start = now_ns();
+            for (long j = 0; j < iterations; j++) {
+                sink += tftp_send_oack(&transmission, oack);
+            }
+            oacks[repetition] = (double) (now_ns() - start) / iterations;
+
+            transmission.socket = connected_socket;
+            transmission.connected = 1;
+            start = now_ns();
+            for (long j = 0; j < iterations; j++) {
+                data.block_num = j;
+                sink += tftp_send_data(&transmission, &data, 0);
+            }
+            connected[repetition] = (double) (now_ns() - start) / iterations;
+
+            start = now_ns();
+            for (long j = 0; j < iterations; j++) {
+                data.block_num = j;
+                tftp_batch_queue_data(&batch, &transmission, &data);
+            }
+            tftp_batch_flush(&batch);
+            connected_batched[repetition] = (double) (now_ns() - start) / iterations;
+            transmission.socket = unconnected_socket;
+            transmission.connected = 0;
+        }
+        char variant[32];
+        snprintf(variant, sizeof(variant), "blksize %d", block_size);
+        report("send_data_copy", variant, block_size + 4, iterations, median(copied, BENCH_REPETITIONS));
+        report("send_data", variant, block_size + 4, iterations, median(in_place, BENCH_REPETITIONS));
+        report("batch_data", variant, block_size + 4, iterations, median(batched, BENCH_REPETITIONS));
+        report("send_oack", variant, transmission.tx_length, iterations, median(oacks, BENCH_REPETITIONS));
+        report("send_data_connected", variant, block_size + 4, iterations, median(connected, BENCH_REPETITIONS));
+        report("batch_data_connected", variant, block_size + 4, iterations,
+               median(connected_batched, BENCH_REPETITIONS));
+
+        close(connected_socket);
+        tftp_batch_destroy(&batch);
+        free(payload);
+        tftp_stop_transmission(&transmission);
+    }
+    close(sink_socket);
+}
+
+// Setting up the socket of a new session, and tearing it down again once the transfer is done
+static void bench_session_socket(long iterations) {
+    struct sockaddr_in address;
+    int sink_socket = open_sink(&address);
+    if (sink_socket < 0) {
+        return;
+    }
+    struct sockaddr_in any;
+    memset(&any, 0, sizeof(any));
+    any.sin_family = AF_INET;
+    any.sin_addr.s_addr = htonl(INADDR_ANY);
+    tftp_socket_pool pool;
+    tftp_sockets_init(&pool, TFTP_SOCKETS_DEFAULT_SIZE);
+
+    double created[BENCH_REPETITIONS], pooled[BENCH_REPETITIONS];
+    for (int repetition = 0; repetition < BENCH_REPETITIONS; repetition++) {
+        long start = now_ns();
+        for (long j = 0; j < iterations; j++) {
+            int session_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            sink += bind(session_socket, (struct sockaddr *) &any, sizeof(any));
+            close(session_socket);
+        }
+        created[repetition] = (double) (now_ns() - start) / iterations;
+
+        start = now_ns();
+        for (long j = 0; j < iterations; j++) {
+            int session_socket = tftp_sockets_get(&pool, (struct sockaddr *) &address, sizeof(address));
+            tftp_sockets_put(&pool, session_socket);
+        }
+        pooled[repetition] = (double) (now_ns() - start) / iterations;
+    }
+    report("session_socket", "socket and bind", 0, iterations, median(created, BENCH_REPETITIONS));
+    report("session_socket", "pooled and connected", 0, iterations, median(pooled, BENCH_REPETITIONS));
+
+    tftp_sockets_destroy(&pool);
+    close(sink_socket);
+}
+
+static void *run_server(void *argument) {
+    bench_server *server = argument;
+    tftp_server_run(&server->server, &server->running);
+    return NULL;
+}
+
+// Download the file with a window of BENCH_WINDOW_SIZE blocks, return the number of bytes received or -1
+static long transfer(uint16_t port, const char *filename, int block_size) {
+    int client_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(port);
+
+    // Room for whole windows of the largest blocks, drops here would measure the client instead of the server
+    int buffer_size = 4 * 1024 * 1024;
+    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size, sizeof(buffer_size)) != 0) {
+        setsockopt(client_socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    }
+
+    uint8_t *packet = malloc(4 + block_size);
+    uint8_t *end = packet;
+    *(end++) = 0;
+    *(end++) = TFTP_OPCODE_READ_REQUEST;
+    end += sprintf((char *) end, "%s", filename) + 1;
+    end += sprintf((char *) end, "octet") + 1;
+    end += tftp_write_number_option(end, TFTP_BLOCKSIZE_STRING, block_size);
+    end += tftp_write_number_option(end, TFTP_WINDOW_SIZE_STRING, BENCH_WINDOW_SIZE);
+    sendto(client_socket, packet, end - packet, 0, (struct sockaddr *) &server, sizeof(server));
+
+    long received = 0;
+    uint16_t expected = 1;
+    // A gap is reported once, the server restarts its window from there anyway
+    int reported_gap = 0;
+    int done = 0;
+    int timeouts = 0;
+    struct pollfd fd = {client_socket, POLLIN, 0};
+    while (!done && timeouts < 5) {
+        uint16_t acknowledged = expected - 1;
+        int acknowledge = 0;
+        if (poll(&fd, 1, 1000) != 1) {
+            acknowledge = 1;
+            timeouts++;
+        } else {
+            socklen_t server_size = sizeof(server);
+            int length = recvfrom(client_socket, packet, 4 + block_size, 0, (struct sockaddr *) &server,
+                                  &server_size);
+            if (length < 4) {
+                continue;
+            }
+            uint16_t opcode = (packet[0] << 8u) + packet[1];
+            uint16_t block = (packet[2] << 8u) + packet[3];
+            if (opcode == TFTP_OPCODE_OACK) {
+                acknowledge = 1;
+            } else if (opcode == TFTP_OPCODE_DATA && block == expected) {
+                received += length - 4;
+                expected++;
+                acknowledged = block;
+                reported_gap = 0;
+                done = length - 4 < block_size;
+                acknowledge = done || block % BENCH_WINDOW_SIZE == 0;
+            } else if (opcode == TFTP_OPCODE_DATA) {
+                acknowledge = !reported_gap;
+                reported_gap = 1;
+            } else {
+                break;
+            }
+        }
+        if (acknowledge) {
+            uint8_t ack[4] = {0, TFTP_OPCODE_ACKNOWLEDGEMENT, acknowledged >> 8u, acknowledged & 0xffu};
+            sendto(client_socket, ack, sizeof(ack), 0, (struct sockaddr *) &server, sizeof(server));
+        }
+    }
+    free(packet);
+    close(client_socket);
+    return done ? received : -1;
+}
+
+static void bench_transfers(long max_file_size) {
+    bench_server server;
+    tftp_server_config config = tftp_create_server_config();
+    config.root_path = bench_root;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (tftp_server_init(&server.server, &address, &config) != TFTP_SUCCESS) {
+        fprintf(stderr, "Could not start the server.\n");
+        return;
+    }
+    server.running = 1;
+    pthread_create(&server.thread, NULL, run_server, &server);
+    uint16_t port = ntohs(server.server.address.sin_port);
+
+    static const int block_sizes[] = {512, 1468, 8192, 65464};
+    for (long file_size = 1024; file_size <= max_file_size; file_size *= 1024) {
+        // Sparse, so even the largest file costs no disk space
+        char filename[32], path[64];
+        snprintf(filename, sizeof(filename), "bench-%li.img", file_size);
+        snprintf(path, sizeof(path), "%s/%s", bench_root, filename);
+        int file_descriptor = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (file_descriptor < 0 || ftruncate(file_descriptor, file_size) != 0) {
+            fprintf(stderr, "Could not create %s.\n", path);
+            break;
+        }
+        close(file_descriptor);
+
+        long transfers = BENCH_TRANSFER_BYTES / file_size > 0 ? BENCH_TRANSFER_BYTES / file_size : 1;
+        if (transfers > 1000) {
+            transfers = 1000;
+        }
+        for (int i = 0; i < (int) (sizeof(block_sizes) / sizeof(block_sizes[0])); i++) {
+            long start = now_ns();
+            long completed = 0;
+            for (long j = 0; j < transfers; j++) {
+                completed += transfer(port, filename, block_sizes[i]) == file_size;
+            }
+            char variant[32];
+            snprintf(variant, sizeof(variant), "blksize %d", block_sizes[i]);
+            if (completed == transfers) {
+                report("transfer", variant, file_size, transfers, (double) (now_ns() - start) / transfers);
+            } else {
+                fprintf(stderr, "%li of %li transfers of %li bytes failed.\n", transfers - completed, transfers,
+                        file_size);
+            }
+        }
+        unlink(path);
+    }
+
+    server.running = 0;
+    pthread_join(server.thread, NULL);
+    tftp_server_destroy(&server.server);
+}
+
+// Transfers of a file that is not in the page cache, read through a mapping and with pread, with and without reading
+// ahead of the client
+static void bench_cold_transfers() {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/cold.img", bench_root);
+    int file_descriptor = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    uint8_t *chunk = malloc(1024 * 1024);
+    for (int i = 0; i < 1024 * 1024; i++) {
+        chunk[i] = (uint8_t) (i * 31 + 7);
+    }
+    long written = 0;
+    while (file_descriptor >= 0 && written < BENCH_COLD_FILE_SIZE && write(file_descriptor, chunk, 1024 * 1024) > 0) {
+        written += 1024 * 1024;
+    }
+    free(chunk);
+    if (written < BENCH_COLD_FILE_SIZE || fsync(file_descriptor) != 0) {
+        fprintf(stderr, "Could not create %s.\n", path);
+        if (file_descriptor >= 0) {
+            close(file_descriptor);
+        }
+        unlink(path);
+        return;
+    }
+
+    for (int variant_index = 0; variant_index < 4; variant_index++) {
+        int mapped = variant_index < 2;
+        int prefetched = variant_index % 2;
+        bench_server server;
+        tftp_server_config config = tftp_create_server_config();
+        config.root_path = bench_root;
+        config.mmap_threshold = mapped ? TFTP_SESSION_DEFAULT_MMAP_THRESHOLD : 0;
+        config.max_prefetch = prefetched ? TFTP_SESSION_DEFAULT_MAX_PREFETCH : 0;
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (tftp_server_init(&server.server, &address, &config) != TFTP_SUCCESS) {
+            fprintf(stderr, "Could not start the server.\n");
+            break;
+        }
+        server.running = 1;
+        pthread_create(&server.thread, NULL, run_server, &server);
+        uint16_t port = ntohs(server.server.address.sin_port);
+
+        double runs[BENCH_REPETITIONS];
+        int completed = 0;
+        for (int repetition = 0; repetition < BENCH_REPETITIONS; repetition++) {
+            // Clean pages that are not mapped anywhere are dropped, so every run reads the file from disk
+            while (server.server.session_count > 0) {
+                usleep(1000);
+            }
+            posix_fadvise(file_descriptor, 0, 0, POSIX_FADV_DONTNEED);
+            long start = now_ns();
+            completed += transfer(port, "cold.img", 1468) == BENCH_COLD_FILE_SIZE;
+            runs[repetition] = (double) (now_ns() - start);
+        }
+        char variant[48];
+        snprintf(variant, sizeof(variant), "%s, %s", mapped ? "mmap" : "pread",
+                 prefetched ? "read ahead" : "kernel read-ahead only");
+        if (completed == BENCH_REPETITIONS) {
+            report("cold_transfer", variant, BENCH_COLD_FILE_SIZE, 1, median(runs, BENCH_REPETITIONS));
+        } else {
+            fprintf(stderr, "%d of %d cold transfers failed.\n", BENCH_REPETITIONS - completed, BENCH_REPETITIONS);
+        }
+
+        server.running = 0;
+        pthread_join(server.thread, NULL);
+        tftp_server_destroy(&server.server);
+    }
+    close(file_descriptor);
+    unlink(path);
+}
+
+static long open_file_descriptors() {
+    DIR *directory = opendir("/proc/self/fd");
+    long count = 0;
+    while (directory != NULL && readdir(directory) != NULL) {
+        count++;
+    }
+    if (directory != NULL) {
+        closedir(directory);
+    }
+    return count;
+}
+
+// Kernel memory in slab caches, which is where sockets, their files and inodes live
+static long slab_kb() {
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    char line[128];
+    long kb = 0;
+    while (meminfo != NULL && fgets(line, sizeof(line), meminfo) != NULL) {
+        if (sscanf(line, "Slab: %li kB", &kb) == 1) {
+            break;
+        }
+    }
+    if (meminfo != NULL) {
+        fclose(meminfo);
+    }
+    return kb;
+}
+
+// Starts sessions until sessions are running at once, or the server can not take more. Every request comes from a
+// client address of its own, whose socket is closed right away, and asks for the longest timeout so nothing is
+// retransmitted in the meantime. Memory and descriptors go to stderr, to keep the CSV as it is.
+static void bench_concurrency(long sessions) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/concurrency.img", bench_root);
+    int file_descriptor = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file_descriptor < 0 || ftruncate(file_descriptor, 1024 * 1024) != 0) {
+        fprintf(stderr, "Could not create %s.\n", path);
+        return;
+    }
+    close(file_descriptor);
+
+    uint8_t request[128];
+    uint8_t *end = request;
+    *(end++) = 0;
+    *(end++) = TFTP_OPCODE_READ_REQUEST;
+    end += sprintf((char *) end, "concurrency.img") + 1;
+    end += sprintf((char *) end, "octet") + 1;
+    end += tftp_write_number_option(end, TFTP_TIMEOUT_STRING, 255);
+
+    // Shared sockets first, kernel memory freed by the other run would otherwise be reused without showing up
+    static const int demux_sockets[] = {BENCH_DEMUX_SOCKETS, 0};
+    for (int i = 0; i < (int) (sizeof(demux_sockets) / sizeof(demux_sockets[0])); i++) {
+        tftp_server server;
+        tftp_server_config config = tftp_create_server_config();
+        config.root_path = bench_root;
+        config.demux_sockets = demux_sockets[i];
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (tftp_server_init(&server, &address, &config) != TFTP_SUCCESS) {
+            fprintf(stderr, "Could not start the server.\n");
+            break;
+        }
+        long descriptors = open_file_descriptors();
+        long kernel_kb = slab_kb();
+        long pool_slabs = server.pool.slab_count;
+
+        long start = now_ns();
+        for (long j = 0; j < sessions && server.session_count >= j - TFTP_BATCH_SIZE; j++) {
+            struct sockaddr_in client;
+            memset(&client, 0, sizeof(client));
+            client.sin_family = AF_INET;
+            client.sin_addr.s_addr = htonl(0x7f010000 + j);
+            int client_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            if (bind(client_socket, (struct sockaddr *) &client, sizeof(client)) == 0) {
+                sendto(client_socket, request, end - request, 0, (struct sockaddr *) &server.address,
+                       sizeof(server.address));
+            }
+            close(client_socket);
+            if (j % (TFTP_BATCH_SIZE / 2) == 0) {
+                tftp_server_poll(&server, 0);
+            }
+        }
+        tftp_server_poll(&server, 0);
+        long elapsed = now_ns() - start;
+        long established = server.session_count;
+
+        descriptors = open_file_descriptors() - descriptors;
+        kernel_kb = slab_kb() - kernel_kb;
+        long pool_kb = (server.pool.slab_count - pool_slabs) * TFTP_POOL_SLAB_SIZE / 1024;
+        char variant[32];
+        if (demux_sockets[i] == 0) {
+            snprintf(variant, sizeof(variant), "socket per session");
+        } else {
+            snprintf(variant, sizeof(variant), "%d shared sockets", demux_sockets[i]);
+        }
+        report("session_setup", variant, 0, established, established > 0 ? (double) elapsed / established : 0);
+        fprintf(stderr, "%s: %li of %li sessions at once, %li more file descriptors, %li kB more kernel slab, "
+                        "%li kB more pool (%li bytes per session)\n", variant, established, sessions, descriptors,
+                kernel_kb, pool_kb, established > 0 ? (kernel_kb + pool_kb) * 1024 / established : 0);
+        tftp_server_destroy(&server);
+    }
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    LOG_LEVEL = LOG_NONE;
+    long iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 100000;
+    long max_file_size = argc > 2 ? strtol(argv[2], NULL, 10) : 1024L * 1024 * 1024;
+    long sessions = argc > 3 ? strtol(argv[3], NULL, 10) : BENCH_CONCURRENT_SESSIONS;
+    if (mkdtemp(bench_root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    printf("benchmark,variant,bytes,iterations,ns_per_op,mb_per_s\n");
+    bench_parse(iterations * 10);
+    bench_write_number_option(iterations * 10);
+    bench_send(iterations);
+    bench_session_socket(iterations / 10);
+    bench_transfers(max_file_size);
+    bench_cold_transfers();
+    bench_concurrency(sessions);
+
+    rmdir(bench_root);
+    return 0;
+}
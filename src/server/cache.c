@@ -0,0 +1,395 @@
+/*
+
+    Provide an implementation for cache.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "../common/tftp.h"
+#include "cache.h"
+
+static unsigned long hash_path(const char *path) {
+    return tftp_hash_bytes(path, (long) strlen(path));
+}
+
+static int same_file(const tftp_cache_entry *entry, const struct stat *stats) {
+    return entry->device == stats->st_dev && entry->inode == stats->st_ino && entry->size == stats->st_size &&
+           entry->modified.tv_sec == stats->st_mtim.tv_sec && entry->modified.tv_nsec == stats->st_mtim.tv_nsec;
+}
+
+static tftp_cache_entry *find_entry(tftp_cache *cache, const char *path) {
+    tftp_cache_entry *entry = cache->buckets[hash_path(path) % TFTP_CACHE_BUCKETS];
+    while (entry != NULL && strcmp(entry->path, path) != 0) {
+        entry = entry->bucket_next;
+    }
+    return entry;
+}
+
+static void free_entry(tftp_cache_entry *entry) {
+    if (entry->locked) {
+        munlock(entry->data, entry->size);
+    }
+    free(entry->data);
+    free(entry->path);
+    free(entry);
+}
+
+// Take an entry out of the table and the clock, it stays alive until the last transfer releases it
+static void remove_entry(tftp_cache *cache, tftp_cache_entry *entry) {
+    tftp_cache_entry **link = &cache->buckets[hash_path(entry->path) % TFTP_CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+
+    if (entry->pinned) {
+        cache->pinned -= entry->size;
+    } else {
+        if (entry->clock_next == entry) {
+            cache->clock_hand = NULL;
+        } else {
+            entry->clock_prev->clock_next = entry->clock_next;
+            entry->clock_next->clock_prev = entry->clock_prev;
+            if (cache->clock_hand == entry) {
+                cache->clock_hand = entry->clock_next;
+            }
+        }
+        cache->used -= entry->size;
+    }
+    cache->entries--;
+    entry->stale = 1;
+    if (entry->references == 0) {
+        free_entry(entry);
+    }
+}
+
+static void insert_entry(tftp_cache *cache, tftp_cache_entry *entry) {
+    unsigned long bucket = hash_path(entry->path) % TFTP_CACHE_BUCKETS;
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    cache->entries++;
+    if (entry->pinned) {
+        cache->pinned += entry->size;
+        return;
+    }
+
+    // New entries go right behind the hand, so they get a full revolution before they are considered
+    if (cache->clock_hand == NULL) {
+        entry->clock_prev = entry;
+        entry->clock_next = entry;
+        cache->clock_hand = entry;
+    } else {
+        entry->clock_next = cache->clock_hand;
+        entry->clock_prev = cache->clock_hand->clock_prev;
+        entry->clock_prev->clock_next = entry;
+        cache->clock_hand->clock_prev = entry;
+    }
+    cache->used += entry->size;
+}
+
+// Evict unreferenced entries with the CLOCK algorithm until size bytes fit in the budget
+static int make_room(tftp_cache *cache, long size) {
+    long unproductive_steps = 0;
+    while (cache->used + size > cache->budget) {
+        tftp_cache_entry *entry = cache->clock_hand;
+        if (entry == NULL) {
+            return 0;
+        }
+        cache->clock_hand = entry->clock_next;
+        if (entry->references == 0 && !entry->referenced) {
+            remove_entry(cache, entry);
+            cache->evictions++;
+            unproductive_steps = 0;
+        } else {
+            entry->referenced = 0;
+            // Two full revolutions without an eviction means everything left is in use
+            if (++unproductive_steps > 2 * cache->entries) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static uint8_t *load_file(int file_descriptor, long size) {
+    uint8_t *data = malloc(size == 0 ? 1 : size);
+    if (data == NULL) {
+        return NULL;
+    }
+    long offset = 0;
+    while (offset < size) {
+        ssize_t read_bytes = pread(file_descriptor, data + offset, size - offset, offset);
+        if (read_bytes <= 0) {
+            // Read error, or the file shrunk while reading it
+            free(data);
+            return NULL;
+        }
+        offset += read_bytes;
+    }
+    return data;
+}
+
+static int fill_queued(const tftp_cache *cache, const char *path) {
+    for (const tftp_cache_fill *fill = cache->fills; fill != NULL; fill = fill->next) {
+        if (strcmp(fill->path, path) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void free_fill(tftp_cache_fill *fill) {
+    if (fill->file_descriptor >= 0) {
+        close(fill->file_descriptor);
+    }
+    free(fill->path);
+    free(fill);
+}
+
+// Called with the lock held, takes data over
+static void insert_loaded(tftp_cache *cache, const tftp_cache_fill *fill, uint8_t *data) {
+    tftp_cache_entry *entry = find_entry(cache, fill->path);
+    if (entry != NULL && (entry->pinned || same_file(entry, &fill->stats))) {
+        // Pinned or loaded again in the meantime, pinned entries are only replaced by the warm set
+        free(data);
+        return;
+    }
+    if (entry != NULL) {
+        remove_entry(cache, entry);
+        cache->invalidations++;
+    }
+    if (!make_room(cache, fill->stats.st_size)) {
+        cache->bypasses++;
+        free(data);
+        return;
+    }
+
+    entry = calloc(1, sizeof(tftp_cache_entry));
+    char *entry_path = strdup(fill->path);
+    if (entry == NULL || entry_path == NULL) {
+        free(entry_path);
+        free(entry);
+        free(data);
+        return;
+    }
+    entry->path = entry_path;
+    entry->device = fill->stats.st_dev;
+    entry->inode = fill->stats.st_ino;
+    entry->modified = fill->stats.st_mtim;
+    entry->data = data;
+    entry->size = fill->stats.st_size;
+    insert_entry(cache, entry);
+    cache->loads++;
+}
+
+static void *run_filler(void *argument) {
+    tftp_cache *cache = argument;
+    pthread_mutex_lock(&cache->lock);
+    while (1) {
+        while (cache->fills == NULL && !cache->stopping) {
+            pthread_cond_wait(&cache->wake, &cache->lock);
+        }
+        if (cache->stopping) {
+            break;
+        }
+        tftp_cache_fill *fill = cache->fills;
+        pthread_mutex_unlock(&cache->lock);
+
+        // Read without holding the lock, so the workers are not stalled by the disk
+        uint8_t *data = load_file(fill->file_descriptor, fill->stats.st_size);
+        close(fill->file_descriptor);
+        fill->file_descriptor = -1;
+
+        pthread_mutex_lock(&cache->lock);
+        if (data != NULL) {
+            insert_loaded(cache, fill, data);
+        }
+        cache->fills = fill->next;
+        if (cache->fills == NULL) {
+            cache->fills_tail = NULL;
+        }
+        free_fill(fill);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+int tftp_cache_init(tftp_cache *cache, long budget) {
+    memset(cache, 0, sizeof(tftp_cache));
+    cache->budget = budget;
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        return TFTP_ERROR;
+    }
+    pthread_cond_init(&cache->wake, NULL);
+    if (pthread_create(&cache->filler, NULL, run_filler, cache) != 0) {
+        pthread_cond_destroy(&cache->wake);
+        pthread_mutex_destroy(&cache->lock);
+        return TFTP_ERROR;
+    }
+    cache->started = 1;
+    return TFTP_SUCCESS;
+}
+
+// Files still queued are not loaded anymore
+void tftp_cache_destroy(tftp_cache *cache) {
+    if (cache->started) {
+        pthread_mutex_lock(&cache->lock);
+        cache->stopping = 1;
+        pthread_cond_signal(&cache->wake);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_join(cache->filler, NULL);
+        cache->started = 0;
+    }
+    while (cache->fills != NULL) {
+        tftp_cache_fill *next = cache->fills->next;
+        free_fill(cache->fills);
+        cache->fills = next;
+    }
+    cache->fills_tail = NULL;
+
+    for (int i = 0; i < TFTP_CACHE_BUCKETS; i++) {
+        tftp_cache_entry *entry = cache->buckets[i];
+        while (entry != NULL) {
+            tftp_cache_entry *next = entry->bucket_next;
+            free_entry(entry);
+            entry = next;
+        }
+        cache->buckets[i] = NULL;
+    }
+    cache->clock_hand = NULL;
+    cache->used = 0;
+    cache->pinned = 0;
+    cache->entries = 0;
+    pthread_cond_destroy(&cache->wake);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+tftp_cache_entry *tftp_cache_acquire(tftp_cache *cache, const char *path, int file_descriptor,
+                                     const struct stat *stats) {
+    pthread_mutex_lock(&cache->lock);
+    // Pinned entries are looked up first, they are served even when the budget is 0
+    tftp_cache_entry *entry = find_entry(cache, path);
+    if (entry != NULL && same_file(entry, stats)) {
+        entry->references++;
+        entry->referenced = 1;
+        cache->hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return entry;
+    }
+    if (entry != NULL && entry->pinned) {
+        // Changed on disk, but the new version is not swapped in yet. The transfer reads it from the file instead.
+        cache->bypasses++;
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    if (stats->st_size > cache->budget) {
+        cache->bypasses++;
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    if (entry != NULL) {
+        // The file changed on disk, transfers still using the old contents keep them until they finish
+        remove_entry(cache, entry);
+        cache->invalidations++;
+    }
+    cache->misses++;
+    if (fill_queued(cache, path)) {
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+
+    tftp_cache_fill *fill = malloc(sizeof(tftp_cache_fill));
+    if (fill != NULL) {
+        fill->next = NULL;
+        fill->path = strdup(path);
+        fill->file_descriptor = fcntl(file_descriptor, F_DUPFD_CLOEXEC, 0);
+        fill->stats = *stats;
+        if (fill->path == NULL || fill->file_descriptor < 0) {
+            free_fill(fill);
+            fill = NULL;
+        }
+    }
+    if (fill != NULL) {
+        if (cache->fills_tail != NULL) {
+            cache->fills_tail->next = fill;
+        } else {
+            cache->fills = fill;
+        }
+        cache->fills_tail = fill;
+        pthread_cond_signal(&cache->wake);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+void tftp_cache_release(tftp_cache *cache, tftp_cache_entry *entry) {
+    pthread_mutex_lock(&cache->lock);
+    entry->references--;
+    if (entry->stale && entry->references == 0) {
+        free_entry(entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int tftp_cache_pin(tftp_cache *cache, const char *path, int file_descriptor, const struct stat *stats,
+                   int lock_memory) {
+    tftp_cache_entry *entry = calloc(1, sizeof(tftp_cache_entry));
+    if (entry == NULL) {
+        return TFTP_ERROR;
+    }
+    entry->path = strdup(path);
+    entry->data = load_file(file_descriptor, stats->st_size);
+    if (entry->path == NULL || entry->data == NULL) {
+        free_entry(entry);
+        return TFTP_ERROR;
+    }
+    entry->device = stats->st_dev;
+    entry->inode = stats->st_ino;
+    entry->modified = stats->st_mtim;
+    entry->size = stats->st_size;
+    entry->pinned = 1;
+    // Without the privilege or a large enough RLIMIT_MEMLOCK the contents are still pinned, but may be swapped out
+    entry->locked = lock_memory && entry->size > 0 && mlock(entry->data, entry->size) == 0;
+
+    // Everything is prepared outside the lock, so a transfer either gets the old version or the new one
+    pthread_mutex_lock(&cache->lock);
+    tftp_cache_entry *old_entry = find_entry(cache, path);
+    if (old_entry != NULL) {
+        remove_entry(cache, old_entry);
+        cache->invalidations++;
+    }
+    insert_entry(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+    return TFTP_SUCCESS;
+}
+
+void tftp_cache_unpin(tftp_cache *cache, const char *path) {
+    pthread_mutex_lock(&cache->lock);
+    tftp_cache_entry *entry = find_entry(cache, path);
+    if (entry != NULL && entry->pinned) {
+        remove_entry(cache, entry);
+        cache->invalidations++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
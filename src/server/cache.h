@@ -0,0 +1,118 @@
+/*
+
+    Shared, reference counted cache of file contents
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_CACHE_H
+#define TFTPSERVER_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define TFTP_CACHE_BUCKETS 4096
+
+typedef struct tftp_cache_entry {
+    char *path;
+
+    // The identity of the file the contents were read from, a mismatch means the file changed on disk
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+
+    uint8_t *data;
+    long size;
+
+    // Transfers using this entry, it is never freed or evicted while this is non-zero
+    int references;
+    // Replaced by a newer version of the file, freed as soon as the last transfer releases it
+    int stale;
+    // Set on every hit and cleared by the clock hand, entries are only evicted when it is clear
+    int referenced;
+    // Loaded at startup and kept outside the budget and the clock until it is replaced or unpinned
+    int pinned;
+    // The data is locked in memory with mlock
+    int locked;
+
+    struct tftp_cache_entry *bucket_next;
+    struct tftp_cache_entry *clock_prev;
+    struct tftp_cache_entry *clock_next;
+} tftp_cache_entry;
+
+// A file that missed, read into the cache by the filler thread while the transfer that missed is sent from the file
+typedef struct tftp_cache_fill {
+    struct tftp_cache_fill *next;
+    char *path;
+    // A duplicate, the transfer closes its own descriptor whenever it is done
+    int file_descriptor;
+    struct stat stats;
+} tftp_cache_fill;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    long budget;
+    long used;
+    long entries;
+    // Bytes held by pinned entries, these do not count towards used
+    long pinned;
+
+    tftp_cache_entry *buckets[TFTP_CACHE_BUCKETS];
+    tftp_cache_entry *clock_hand;
+
+    // Misses are loaded one at a time, the first fill stays queued until it is in the cache
+    tftp_cache_fill *fills;
+    tftp_cache_fill *fills_tail;
+    pthread_t filler;
+    pthread_cond_t wake;
+    int started;
+    int stopping;
+
+    long hits;
+    // Transfers that were not sent from the cache, the file was queued to be loaded or already is
+    long misses;
+    // Files the filler read into the cache
+    long loads;
+    long evictions;
+    long invalidations;
+    // Files that could not be cached because they did not fit in the budget
+    long bypasses;
+} tftp_cache;
+
+// Starts the thread that loads missed files
+int tftp_cache_init(tftp_cache *cache, long budget);
+
+void tftp_cache_destroy(tftp_cache *cache);
+
+// Returns the cached contents of the file, or NULL after queueing it to be loaded, so only later transfers get it.
+// The caller reads the file itself until then, a miss never waits for the disk.
+tftp_cache_entry *tftp_cache_acquire(tftp_cache *cache, const char *path, int file_descriptor,
+                                     const struct stat *stats);
+
+void tftp_cache_release(tftp_cache *cache, tftp_cache_entry *entry);
+
+// Loads the file as a pinned entry, replacing any older version of it. Transfers of the old version keep it until
+// they finish. If lock_memory is set the contents are locked with mlock, when the limit allows it.
+int tftp_cache_pin(tftp_cache *cache, const char *path, int file_descriptor, const struct stat *stats,
+                   int lock_memory);
+
+// Takes the pinned entry for path out of the cache, if there is one
+void tftp_cache_unpin(tftp_cache *cache, const char *path);
+
+#endif //TFTPSERVER_CACHE_H
@@ -0,0 +1,196 @@
+/*
+
+    Provide an implementation for demux.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../common/tftp.h"
+#include "demux.h"
+
+static unsigned long hash_client(int socket_index, uint32_t address, uint16_t port) {
+    uint8_t key[8];
+    memcpy(key, &address, 4);
+    memcpy(key + 4, &port, 2);
+    key[6] = (uint8_t) socket_index;
+    key[7] = (uint8_t) (socket_index >> 8);
+    return tftp_hash_bytes(key, sizeof(key));
+}
+
+static tftp_demux_entry **bucket_of(const tftp_demux_table *table, int socket_index, uint32_t address,
+                                    uint16_t port) {
+    return &table->buckets[hash_client(socket_index, address, port) & (table->bucket_count - 1)];
+}
+
+static int create_socket() {
+    int new_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (new_socket < 0) {
+        return -1;
+    }
+    // Root may go past net.core.rmem_max, anyone else gets what the limit allows
+    int buffer_size = TFTP_DEMUX_BUFFER_SIZE;
+    if (setsockopt(new_socket, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size, sizeof(buffer_size)) != 0) {
+        setsockopt(new_socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    }
+    if (setsockopt(new_socket, SOL_SOCKET, SO_SNDBUFFORCE, &buffer_size, sizeof(buffer_size)) != 0) {
+        setsockopt(new_socket, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(0);
+    if (bind(new_socket, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(new_socket);
+        return -1;
+    }
+    return new_socket;
+}
+
+int tftp_demux_init(tftp_demux *demux, int socket_count) {
+    memset(demux, 0, sizeof(tftp_demux));
+    if (socket_count <= 0) {
+        return TFTP_SUCCESS;
+    }
+    if (socket_count > TFTP_DEMUX_MAX_SOCKETS) {
+        socket_count = TFTP_DEMUX_MAX_SOCKETS;
+    }
+    if (tftp_demux_table_init(&demux->table) != TFTP_SUCCESS) {
+        return TFTP_ERROR;
+    }
+    while (demux->socket_count < socket_count) {
+        int new_socket = create_socket();
+        if (new_socket < 0) {
+            tftp_demux_destroy(demux);
+            return TFTP_ERROR;
+        }
+        demux->sockets[demux->socket_count++] = new_socket;
+    }
+    return TFTP_SUCCESS;
+}
+
+void tftp_demux_destroy(tftp_demux *demux) {
+    for (int i = 0; i < demux->socket_count; i++) {
+        close(demux->sockets[i]);
+    }
+    demux->socket_count = 0;
+    tftp_demux_table_destroy(&demux->table);
+}
+
+int tftp_demux_table_init(tftp_demux_table *table) {
+    table->buckets = calloc(TFTP_DEMUX_MIN_BUCKETS, sizeof(tftp_demux_entry *));
+    table->bucket_count = table->buckets != NULL ? TFTP_DEMUX_MIN_BUCKETS : 0;
+    table->count = 0;
+    return table->buckets != NULL ? TFTP_SUCCESS : TFTP_ERROR;
+}
+
+void tftp_demux_table_destroy(tftp_demux_table *table) {
+    free(table->buckets);
+    table->buckets = NULL;
+    table->bucket_count = 0;
+    table->count = 0;
+}
+
+void tftp_demux_init_entry(tftp_demux_entry *entry, void *context) {
+    memset(entry, 0, sizeof(tftp_demux_entry));
+    entry->socket_index = -1;
+    entry->context = context;
+}
+
+int tftp_demux_next_socket(tftp_demux *demux) {
+    int socket_index = demux->next_socket;
+    demux->next_socket = (demux->next_socket + 1) % demux->socket_count;
+    return socket_index;
+}
+
+// Doubles the table, or leaves it as it is if there is no memory for a larger one
+static void grow(tftp_demux_table *table) {
+    long bucket_count = table->bucket_count * 2;
+    tftp_demux_entry **buckets = calloc(bucket_count, sizeof(tftp_demux_entry *));
+    if (buckets == NULL) {
+        return;
+    }
+    tftp_demux_entry **old_buckets = table->buckets;
+    long old_count = table->bucket_count;
+    table->buckets = buckets;
+    table->bucket_count = bucket_count;
+    // Walked from the back, so entries for the same client stay newest first
+    for (long i = 0; i < old_count; i++) {
+        tftp_demux_entry *reversed = NULL;
+        while (old_buckets[i] != NULL) {
+            tftp_demux_entry *entry = old_buckets[i];
+            old_buckets[i] = entry->next;
+            entry->next = reversed;
+            reversed = entry;
+        }
+        while (reversed != NULL) {
+            tftp_demux_entry *entry = reversed;
+            reversed = entry->next;
+            tftp_demux_entry **bucket = bucket_of(table, entry->socket_index, entry->address, entry->port);
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+    free(old_buckets);
+}
+
+void tftp_demux_insert(tftp_demux_table *table, tftp_demux_entry *entry, int socket_index,
+                       const struct sockaddr_in *client) {
+    if (table->count >= table->bucket_count) {
+        grow(table);
+    }
+    entry->address = client->sin_addr.s_addr;
+    entry->port = client->sin_port;
+    entry->socket_index = socket_index;
+    tftp_demux_entry **bucket = bucket_of(table, socket_index, entry->address, entry->port);
+    entry->next = *bucket;
+    *bucket = entry;
+    table->count++;
+}
+
+void tftp_demux_remove(tftp_demux_table *table, tftp_demux_entry *entry) {
+    if (entry->socket_index < 0) {
+        return;
+    }
+    tftp_demux_entry **link = bucket_of(table, entry->socket_index, entry->address, entry->port);
+    while (*link != NULL && *link != entry) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = entry->next;
+        table->count--;
+    }
+    entry->next = NULL;
+    entry->socket_index = -1;
+}
+
+void *tftp_demux_find(const tftp_demux_table *table, int socket_index, const struct sockaddr_in *client) {
+    uint32_t address = client->sin_addr.s_addr;
+    uint16_t port = client->sin_port;
+    tftp_demux_entry *entry = *bucket_of(table, socket_index, address, port);
+    while (entry != NULL &&
+           (entry->address != address || entry->port != port || entry->socket_index != socket_index)) {
+        entry = entry->next;
+    }
+    return entry != NULL ? entry->context : NULL;
+}
@@ -0,0 +1,85 @@
+/*
+
+    Shared session sockets, with transfers told apart by the address and port of their client
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_DEMUX_H
+#define TFTPSERVER_DEMUX_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define TFTP_DEMUX_MAX_SOCKETS 64
+#define TFTP_DEMUX_MIN_BUCKETS 1024
+// Every transfer of a worker queues its ACKs on the same few sockets, so they get larger buffers than the default
+#define TFTP_DEMUX_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Embedded in whatever it finds, like a timer
+typedef struct tftp_demux_entry {
+    struct tftp_demux_entry *next;
+    // The TID of the client, in network byte order, and the shared socket it talks to
+    uint32_t address;
+    uint16_t port;
+    // -1 while the entry is not in the table
+    int socket_index;
+    void *context;
+} tftp_demux_entry;
+
+// Entries by client TID and socket
+typedef struct {
+    // Grown to keep chains short, a power of two
+    tftp_demux_entry **buckets;
+    long bucket_count;
+    long count;
+} tftp_demux_table;
+
+// Sessions that share a few sockets, instead of owning one each
+typedef struct {
+    int sockets[TFTP_DEMUX_MAX_SOCKETS];
+    int socket_count;
+    // New transfers are spread over the sockets in turn
+    int next_socket;
+
+    tftp_demux_table table;
+} tftp_demux;
+
+// Binds socket_count non-blocking sockets on ephemeral ports, 0 leaves demultiplexing off
+int tftp_demux_init(tftp_demux *demux, int socket_count);
+
+void tftp_demux_destroy(tftp_demux *demux);
+
+// Picks the shared socket of a new transfer, returns its index
+int tftp_demux_next_socket(tftp_demux *demux);
+
+int tftp_demux_table_init(tftp_demux_table *table);
+
+void tftp_demux_table_destroy(tftp_demux_table *table);
+
+void tftp_demux_init_entry(tftp_demux_entry *entry, void *context);
+
+// A newer entry for the same client and socket hides the older one until it is removed
+void tftp_demux_insert(tftp_demux_table *table, tftp_demux_entry *entry, int socket_index,
+                       const struct sockaddr_in *client);
+
+void tftp_demux_remove(tftp_demux_table *table, tftp_demux_entry *entry);
+
+// The context of the newest entry for client on the socket, or NULL for an unknown TID
+void *tftp_demux_find(const tftp_demux_table *table, int socket_index, const struct sockaddr_in *client);
+
+#endif //TFTPSERVER_DEMUX_H
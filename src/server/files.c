@@ -0,0 +1,280 @@
+/*
+
+    Provide an implementation for files.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include "../common/tftp.h"
+#include "files.h"
+
+#ifdef TFTP_HAVE_OPENAT2
+#include <linux/openat2.h>
+#endif
+
+// Anything that can point the name at another file, or make it unreadable
+#define TFTP_FILES_WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB | IN_DELETE_SELF | \
+                               IN_MOVE_SELF | IN_ONLYDIR)
+
+static unsigned long hash_filename(const char *filename) {
+    return tftp_hash_bytes(filename, (long) strlen(filename));
+}
+
+const char *tftp_files_relative_name(const char *filename) {
+    while (*filename == '/') {
+        filename++;
+    }
+    return filename;
+}
+
+// Resolve the name without ever leaving the root, through .. or symlinks, and without /proc magic links
+static int open_beneath(tftp_files *files, const char *filename, int flags, mode_t mode) {
+#ifdef TFTP_HAVE_OPENAT2
+    if (files->beneath) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags;
+        how.mode = (flags & O_CREAT) ? mode : 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int file_descriptor = syscall(SYS_openat2, files->root_fd, filename, &how, sizeof(how));
+        if (file_descriptor >= 0 || errno != ENOSYS) {
+            return file_descriptor;
+        }
+        files->beneath = 0;
+    }
+#endif
+    return openat(files->root_fd, filename, flags, mode);
+}
+
+static void unlink_entry(tftp_files *files, tftp_file_entry *entry) {
+    tftp_file_entry **link = &files->buckets[hash_filename(entry->filename) % TFTP_FILES_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        files->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        files->lru_tail = entry->lru_prev;
+    }
+    files->count--;
+    close(entry->file_descriptor);
+    free(entry);
+}
+
+static void move_to_front(tftp_files *files, tftp_file_entry *entry) {
+    if (files->lru_head == entry) {
+        return;
+    }
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        files->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = files->lru_head;
+    files->lru_head->lru_prev = entry;
+    files->lru_head = entry;
+}
+
+static tftp_file_entry *find_entry(tftp_files *files, const char *filename) {
+    tftp_file_entry *entry = files->buckets[hash_filename(filename) % TFTP_FILES_BUCKETS];
+    while (entry != NULL && strcmp(entry->filename, filename) != 0) {
+        entry = entry->bucket_next;
+    }
+    return entry;
+}
+
+// Entries without a watch are checked against what the name points at now
+static int entry_is_current(tftp_files *files, const tftp_file_entry *entry) {
+    if (entry->watch >= 0) {
+        return 1;
+    }
+    struct stat stats;
+    return fstatat(files->root_fd, entry->filename, &stats, 0) == 0 && stats.st_dev == entry->device &&
+           stats.st_ino == entry->inode && stats.st_mtim.tv_sec == entry->modified.tv_sec &&
+           stats.st_mtim.tv_nsec == entry->modified.tv_nsec;
+}
+
+static int watch_directory(tftp_files *files, const char *filename) {
+    if (files->inotify_fd < 0) {
+        return -1;
+    }
+    const char *last_slash = strrchr(filename, '/');
+    int directory_length = last_slash == NULL ? 0 : (int) (last_slash - filename);
+    char *directory = NULL;
+    if (asprintf(&directory, "%s/%.*s", files->root_path, directory_length, filename) < 0) {
+        return -1;
+    }
+    int watch = inotify_add_watch(files->inotify_fd, directory, TFTP_FILES_WATCH_MASK);
+    free(directory);
+    return watch;
+}
+
+static void insert_entry(tftp_files *files, const char *filename, int file_descriptor) {
+    struct stat stats;
+    if (files->max_entries <= 0 || fstat(file_descriptor, &stats) != 0 || !S_ISREG(stats.st_mode)) {
+        return;
+    }
+    unsigned long length = strlen(filename);
+    tftp_file_entry *entry = malloc(sizeof(tftp_file_entry) + length + 1);
+    if (entry == NULL) {
+        return;
+    }
+    entry->file_descriptor = fcntl(file_descriptor, F_DUPFD_CLOEXEC, 0);
+    if (entry->file_descriptor < 0) {
+        free(entry);
+        return;
+    }
+    if (files->count >= files->max_entries) {
+        unlink_entry(files, files->lru_tail);
+    }
+    memcpy(entry->filename, filename, length + 1);
+    entry->watch = watch_directory(files, filename);
+    entry->device = stats.st_dev;
+    entry->inode = stats.st_ino;
+    entry->modified = stats.st_mtim;
+
+    unsigned long bucket = hash_filename(filename) % TFTP_FILES_BUCKETS;
+    entry->bucket_next = files->buckets[bucket];
+    files->buckets[bucket] = entry;
+    entry->lru_prev = NULL;
+    entry->lru_next = files->lru_head;
+    if (files->lru_head != NULL) {
+        files->lru_head->lru_prev = entry;
+    } else {
+        files->lru_tail = entry;
+    }
+    files->lru_head = entry;
+    files->count++;
+}
+
+int tftp_files_init(tftp_files *files, const char *root_path, long max_entries) {
+    memset(files, 0, sizeof(tftp_files));
+    files->inotify_fd = -1;
+    files->max_entries = max_entries;
+    files->root_fd = open(root_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (files->root_fd < 0) {
+        return TFTP_ERROR;
+    }
+    files->root_path = strdup(root_path);
+#ifdef TFTP_HAVE_OPENAT2
+    files->beneath = 1;
+#endif
+    if (max_entries > 0) {
+        files->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    return TFTP_SUCCESS;
+}
+
+void tftp_files_destroy(tftp_files *files) {
+    tftp_files_flush(files);
+    if (files->inotify_fd >= 0) {
+        close(files->inotify_fd);
+        files->inotify_fd = -1;
+    }
+    if (files->root_fd >= 0) {
+        close(files->root_fd);
+        files->root_fd = -1;
+    }
+    free(files->root_path);
+    files->root_path = NULL;
+}
+
+int tftp_files_open_read(tftp_files *files, const char *filename) {
+    filename = tftp_files_relative_name(filename);
+    tftp_file_entry *entry = find_entry(files, filename);
+    if (entry != NULL && entry_is_current(files, entry)) {
+        files->hits++;
+        move_to_front(files, entry);
+        return fcntl(entry->file_descriptor, F_DUPFD_CLOEXEC, 0);
+    }
+    if (entry != NULL) {
+        files->invalidations++;
+        unlink_entry(files, entry);
+    }
+
+    files->misses++;
+    int file_descriptor = open_beneath(files, filename, O_RDONLY | O_CLOEXEC, 0);
+    if (file_descriptor >= 0) {
+        insert_entry(files, filename, file_descriptor);
+    }
+    return file_descriptor;
+}
+
+int tftp_files_create(tftp_files *files, const char *filename, mode_t mode) {
+    return open_beneath(files, tftp_files_relative_name(filename), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+}
+
+int tftp_files_unlink(tftp_files *files, const char *filename) {
+    return unlinkat(files->root_fd, tftp_files_relative_name(filename), 0);
+}
+
+void tftp_files_flush(tftp_files *files) {
+    while (files->lru_head != NULL) {
+        unlink_entry(files, files->lru_head);
+    }
+}
+
+void tftp_files_handle_events(tftp_files *files) {
+    uint8_t events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int length;
+    while ((length = read(files->inotify_fd, events, sizeof(events))) > 0) {
+        for (int offset = 0; offset < length;) {
+            struct inotify_event *event = (struct inotify_event *) (events + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+
+            if ((event->mask & (IN_ISDIR | IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) ||
+                event->len == 0) {
+                // A directory changed, which may affect any name below it
+                files->invalidations += files->count;
+                tftp_files_flush(files);
+                continue;
+            }
+            tftp_file_entry *entry = files->lru_head;
+            while (entry != NULL) {
+                tftp_file_entry *next = entry->lru_next;
+                const char *base_name = strrchr(entry->filename, '/');
+                base_name = base_name == NULL ? entry->filename : base_name + 1;
+                if (entry->watch == event->wd && strcmp(base_name, event->name) == 0) {
+                    files->invalidations++;
+                    unlink_entry(files, entry);
+                }
+                entry = next;
+            }
+        }
+    }
+}
@@ -0,0 +1,87 @@
+/*
+
+    Opening files below the root directory, with a cache of open descriptors for files that are asked for often
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_FILES_H
+#define TFTPSERVER_FILES_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#define TFTP_FILES_BUCKETS 256
+#define TFTP_FILES_DEFAULT_MAX_ENTRIES 128
+
+typedef struct tftp_file_entry {
+    struct tftp_file_entry *bucket_next;
+    struct tftp_file_entry *lru_prev;
+    struct tftp_file_entry *lru_next;
+
+    int file_descriptor;
+    // The inotify watch of the directory the file is in, or -1 if the entry is checked with fstatat on every hit
+    int watch;
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+
+    // Relative to the root, without leading slashes
+    char filename[];
+} tftp_file_entry;
+
+// Open files by name, the least recently used one is closed when there are too many
+typedef struct {
+    char *root_path;
+    int root_fd;
+    // Whether the kernel has openat2, otherwise files are opened with openat and only the name checks apply
+    int beneath;
+
+    // Watches the directories of cached files, a name that is created, moved, deleted or changes permissions is dropped
+    int inotify_fd;
+
+    tftp_file_entry *buckets[TFTP_FILES_BUCKETS];
+    // Most recently used first
+    tftp_file_entry *lru_head;
+    tftp_file_entry *lru_tail;
+    long count;
+    long max_entries;
+
+    long hits;
+    long misses;
+    long invalidations;
+} tftp_files;
+
+int tftp_files_init(tftp_files *files, const char *root_path, long max_entries);
+
+void tftp_files_destroy(tftp_files *files);
+
+// Names are relative to the root, a client asking for /boot.img means the same file as boot.img
+const char *tftp_files_relative_name(const char *filename);
+
+// These return a new descriptor owned by the caller, or -1 with errno set like open does
+int tftp_files_open_read(tftp_files *files, const char *filename);
+
+int tftp_files_create(tftp_files *files, const char *filename, mode_t mode);
+
+int tftp_files_unlink(tftp_files *files, const char *filename);
+
+void tftp_files_flush(tftp_files *files);
+
+void tftp_files_handle_events(tftp_files *files);
+
+#endif //TFTPSERVER_FILES_H
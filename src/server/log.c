@@ -0,0 +1,403 @@
+/*
+
+    Provide an implementation for log.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../common/tftp.h"
+#include "log.h"
+
+int LOG_LEVEL = LOG_INFO;
+int TRACE = 0;
+
+// A record is this header, then every argument in the order of the format: numbers in 8 bytes, strings as their
+// length and bytes padded to 8. The format itself is a string literal and only referred to.
+typedef struct {
+    uint32_t size;
+    uint32_t reserved;
+    // NULL for the filler that skips the rest of the ring before a record that did not fit at its end
+    const char *format;
+} tftp_log_header;
+
+typedef union {
+    long long integer;
+    double real;
+    const void *pointer;
+} tftp_log_slot;
+
+// Single producer, single consumer
+typedef struct tftp_log_ring {
+    uint8_t buffer[TFTP_LOG_RING_SIZE];
+    // Bytes ever written and read, only the logging thread moves head and only the log thread moves tail
+    long head;
+    long tail;
+    long dropped;
+    long reported_dropped;
+    struct tftp_log_ring *next;
+} tftp_log_ring;
+
+static __thread tftp_log_ring *thread_ring = NULL;
+
+// Only taken when a thread logs for the first time, and by the log thread to walk the list
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static tftp_log_ring *rings = NULL;
+
+static pthread_t log_thread;
+static int log_running = 0;
+
+#define ALIGN_RECORD(size) (((size) + 7u) & ~7u)
+
+// Finds the next conversion of a format, and whether it takes its width or precision from an argument.
+// Returns a pointer to its conversion character, or NULL if there are no more.
+static const char *next_conversion(const char *format, const char **start, int *width_star, int *precision_star,
+                                   int *longs) {
+    format = strchr(format, '%');
+    while (format != NULL && format[1] == '%') {
+        format = strchr(format + 2, '%');
+    }
+    if (format == NULL) {
+        return NULL;
+    }
+    *start = format++;
+    while (*format != 0 && strchr("-+ #0", *format) != NULL) {
+        format++;
+    }
+    *width_star = *format == '*';
+    while (*format == '*' || (*format >= '0' && *format <= '9')) {
+        format++;
+    }
+    *precision_star = 0;
+    if (*format == '.') {
+        format++;
+        *precision_star = *format == '*';
+        while (*format == '*' || (*format >= '0' && *format <= '9')) {
+            format++;
+        }
+    }
+    *longs = 0;
+    while (*format == 'l' || *format == 'z' || *format == 'h') {
+        *longs += *format == 'h' ? 0 : 1;
+        format++;
+    }
+    return format;
+}
+
+static int put_slot(uint8_t *record, int capacity, int *length, tftp_log_slot slot) {
+    if (*length + (int) sizeof(slot) > capacity) {
+        return TFTP_ERROR;
+    }
+    memcpy(record + *length, &slot, sizeof(slot));
+    *length += sizeof(slot);
+    return TFTP_SUCCESS;
+}
+
+static int put_string(uint8_t *record, int capacity, int *length, const char *string, int precision) {
+    uint32_t string_length = 0;
+    int room = capacity - *length - (int) sizeof(uint32_t) - 1;
+    if (room < 0) {
+        return TFTP_ERROR;
+    }
+    if (string == NULL) {
+        string = "(null)";
+    }
+    while (string[string_length] != 0 && (precision < 0 || (int) string_length < precision) &&
+           (int) string_length < room) {
+        string_length++;
+    }
+    memcpy(record + *length, &string_length, sizeof(uint32_t));
+    memcpy(record + *length + sizeof(uint32_t), string, string_length);
+    record[*length + sizeof(uint32_t) + string_length] = 0;
+    *length = ALIGN_RECORD(*length + sizeof(uint32_t) + string_length + 1);
+    return *length <= capacity ? TFTP_SUCCESS : TFTP_ERROR;
+}
+
+// Copies the arguments the format refers to, fails on anything it does not know how to copy
+static int encode(uint8_t *record, int capacity, const char *format, va_list arguments) {
+    int length = sizeof(tftp_log_header);
+    const char *start;
+    int width_star, precision_star, longs;
+    while ((format = next_conversion(format, &start, &width_star, &precision_star, &longs)) != NULL) {
+        tftp_log_slot slot;
+        int precision = -1;
+        if (width_star) {
+            slot.integer = va_arg(arguments, int);
+            if (put_slot(record, capacity, &length, slot) != TFTP_SUCCESS) {
+                return TFTP_ERROR;
+            }
+        }
+        if (precision_star) {
+            slot.integer = precision = va_arg(arguments, int);
+            if (put_slot(record, capacity, &length, slot) != TFTP_SUCCESS) {
+                return TFTP_ERROR;
+            }
+        }
+        int result;
+        switch (*format) {
+            case 'd':
+            case 'i':
+            case 'c':
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                slot.integer = longs == 0 ? va_arg(arguments, int) : longs == 1 ? va_arg(arguments, long)
+                                                                               : va_arg(arguments, long long);
+                result = put_slot(record, capacity, &length, slot);
+                break;
+            case 'f':
+            case 'e':
+            case 'g':
+                slot.real = va_arg(arguments, double);
+                result = put_slot(record, capacity, &length, slot);
+                break;
+            case 'p':
+                slot.pointer = va_arg(arguments, void *);
+                result = put_slot(record, capacity, &length, slot);
+                break;
+            case 's':
+                result = put_string(record, capacity, &length, va_arg(arguments, const char *), precision);
+                break;
+            default:
+                return TFTP_ERROR;
+        }
+        if (result != TFTP_SUCCESS) {
+            return TFTP_ERROR;
+        }
+        format++;
+    }
+    return length;
+}
+
+static tftp_log_slot take_slot(const uint8_t *record, int *offset) {
+    tftp_log_slot slot;
+    memcpy(&slot, record + *offset, sizeof(slot));
+    *offset += sizeof(slot);
+    return slot;
+}
+
+// Text between conversions, with %% written as %
+static int append_literal(char *line, int size, int length, const char *text, const char *end) {
+    while (text < end && *text != 0 && length < size - 1) {
+        line[length++] = *text;
+        text += text[0] == '%' && text[1] == '%' ? 2 : 1;
+    }
+    line[length] = 0;
+    return length;
+}
+
+// Formats one record into line, the inverse of encode
+static int decode(const uint8_t *record, char *line, int size) {
+    tftp_log_header header;
+    memcpy(&header, record, sizeof(header));
+    int offset = sizeof(header);
+    int length = 0;
+    const char *format = header.format;
+    const char *start;
+    int width_star, precision_star, longs;
+    const char *end;
+    while ((end = next_conversion(format, &start, &width_star, &precision_star, &longs)) != NULL && length < size - 1) {
+        length = append_literal(line, size, length, format, start);
+
+        // The conversion, with the width and precision arguments written into it
+        char spec[64];
+        int spec_length = 0;
+        for (const char *character = start; character <= end && spec_length < (int) sizeof(spec) - 24; character++) {
+            if (*character == '*') {
+                spec_length += snprintf(spec + spec_length, sizeof(spec) - spec_length, "%lli",
+                                        take_slot(record, &offset).integer);
+            } else {
+                spec[spec_length++] = *character;
+            }
+        }
+        spec[spec_length] = 0;
+
+        if (*end == 's') {
+            length += snprintf(line + length, size - length, spec, (const char *) record + offset + sizeof(uint32_t));
+            uint32_t string_length;
+            memcpy(&string_length, record + offset, sizeof(uint32_t));
+            offset = ALIGN_RECORD(offset + sizeof(uint32_t) + string_length + 1);
+        } else {
+            tftp_log_slot slot = take_slot(record, &offset);
+            if (*end == 'f' || *end == 'e' || *end == 'g') {
+                length += snprintf(line + length, size - length, spec, slot.real);
+            } else if (*end == 'p') {
+                length += snprintf(line + length, size - length, spec, slot.pointer);
+            } else if (longs == 0) {
+                length += snprintf(line + length, size - length, spec, (int) slot.integer);
+            } else if (longs == 1) {
+                length += snprintf(line + length, size - length, spec, (long) slot.integer);
+            } else {
+                length += snprintf(line + length, size - length, spec, slot.integer);
+            }
+        }
+        // snprintf returns what it would have written
+        if (length > size - 1) {
+            length = size - 1;
+        }
+        format = end + 1;
+    }
+    if (end == NULL) {
+        length = append_literal(line, size, length, format, format + strlen(format));
+    }
+    return length;
+}
+
+static tftp_log_ring *get_ring() {
+    if (thread_ring == NULL) {
+        thread_ring = calloc(1, sizeof(tftp_log_ring));
+        if (thread_ring != NULL) {
+            pthread_mutex_lock(&rings_lock);
+            thread_ring->next = rings;
+            rings = thread_ring;
+            pthread_mutex_unlock(&rings_lock);
+        }
+    }
+    return thread_ring;
+}
+
+static void push(tftp_log_ring *ring, const uint8_t *record, uint32_t size) {
+    long head = ring->head;
+    long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    long offset = head & (TFTP_LOG_RING_SIZE - 1);
+    long until_end = TFTP_LOG_RING_SIZE - offset;
+    long filler = until_end < size ? until_end : 0;
+    if (head + filler + size - tail > TFTP_LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (filler >= (long) sizeof(tftp_log_header)) {
+        tftp_log_header header = {(uint32_t) filler, 0, NULL};
+        memcpy(ring->buffer + offset, &header, sizeof(header));
+    }
+    memcpy(ring->buffer + ((head + filler) & (TFTP_LOG_RING_SIZE - 1)), record, size);
+    __atomic_store_n(&ring->head, head + filler + size, __ATOMIC_RELEASE);
+}
+
+void log_record(const char *format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    tftp_log_ring *ring = __atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ? get_ring() : NULL;
+    if (ring == NULL) {
+        vprintf(format, arguments);
+        va_end(arguments);
+        return;
+    }
+
+    uint8_t record[TFTP_LOG_MAX_RECORD] __attribute__ ((aligned(8)));
+    va_list copy;
+    va_copy(copy, arguments);
+    int size = encode(record, sizeof(record), format, copy);
+    va_end(copy);
+    tftp_log_header header = {0, 0, format};
+    if (size < 0) {
+        // Formatted right here instead, and passed on as a single string
+        char text[TFTP_LOG_MAX_RECORD / 2];
+        vsnprintf(text, sizeof(text), format, arguments);
+        header.format = "%s";
+        size = sizeof(header);
+        put_string(record, sizeof(record), &size, text, -1);
+    }
+    va_end(arguments);
+    header.size = ALIGN_RECORD(size);
+    memcpy(record, &header, sizeof(header));
+    push(ring, record, header.size);
+}
+
+// Writes every record waiting in the ring, returns how many there were
+static int drain(tftp_log_ring *ring) {
+    char line[TFTP_LOG_MAX_RECORD * 2];
+    long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    long tail = ring->tail;
+    int records = 0;
+    while (tail < head) {
+        long offset = tail & (TFTP_LOG_RING_SIZE - 1);
+        long until_end = TFTP_LOG_RING_SIZE - offset;
+        if (until_end < (long) sizeof(tftp_log_header)) {
+            tail += until_end;
+            continue;
+        }
+        tftp_log_header header;
+        memcpy(&header, ring->buffer + offset, sizeof(header));
+        if (header.format != NULL) {
+            int length = decode(ring->buffer + offset, line, sizeof(line));
+            fwrite(line, 1, length, stdout);
+            records++;
+        }
+        tail += header.size;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported_dropped) {
+        printf("Dropped %li log messages, the log could not keep up.\n", dropped - ring->reported_dropped);
+        ring->reported_dropped = dropped;
+    }
+    return records;
+}
+
+static int drain_all() {
+    int records = 0;
+    pthread_mutex_lock(&rings_lock);
+    for (tftp_log_ring *ring = rings; ring != NULL; ring = ring->next) {
+        records += drain(ring);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    return records;
+}
+
+static void *run_log(__attribute__ ((unused)) void *argument) {
+    while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        if (drain_all() == 0) {
+            fflush(stdout);
+            usleep(TFTP_LOG_IDLE_US);
+        }
+    }
+    return NULL;
+}
+
+int log_start() {
+    if (log_running) {
+        return TFTP_SUCCESS;
+    }
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&log_thread, NULL, run_log, NULL) != 0) {
+        __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+        return TFTP_ERROR;
+    }
+    return TFTP_SUCCESS;
+}
+
+void log_stop() {
+    if (!log_running) {
+        return;
+    }
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+    // Rings stay registered, every thread keeps its ring in case the log thread is started again
+    drain_all();
+    fflush(stdout);
+}
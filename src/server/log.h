@@ -0,0 +1,66 @@
+/*
+
+    Logging facilities shared by the server and its tests
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_LOG_H
+#define TFTPSERVER_LOG_H
+
+#define LOG_NONE 0
+#define LOG_INFO 1
+#define LOG_VERBOSE 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 50
+
+// Messages above this level are compiled out, e.g. -DTFTP_LOG_MAX_LEVEL=LOG_VERBOSE drops debug and trace messages
+#ifndef TFTP_LOG_MAX_LEVEL
+#define TFTP_LOG_MAX_LEVEL LOG_TRACE
+#endif
+
+// Bytes of records every logging thread can have waiting for the log thread, a power of two
+#define TFTP_LOG_RING_SIZE (64 * 1024)
+// Longer messages are cut short, each string argument is cut to fit as well
+#define TFTP_LOG_MAX_RECORD 1024
+// How long the log thread sleeps when every ring is empty
+#define TFTP_LOG_IDLE_US 1000
+
+extern int LOG_LEVEL;
+extern int TRACE;
+
+#define log_enabled(level) ((level) <= TFTP_LOG_MAX_LEVEL && (LOG_LEVEL >= (level) || ((level) == LOG_TRACE && TRACE)))
+
+// The arguments are only evaluated if the level is enabled
+#define log_message(level, ...) \
+    do { \
+        if (log_enabled(level)) { \
+            log_record(__VA_ARGS__); \
+        } \
+    } while (0)
+
+// Copies the format and its arguments into the ring of the calling thread, or prints them right away when the log
+// thread is not running. A full ring drops the message instead of waiting.
+void log_record(const char *format, ...) __attribute__ ((format(printf, 1, 2)));
+
+// Format and write messages on a thread of its own from now on
+int log_start();
+
+// Write whatever is still waiting and print synchronously again
+void log_stop();
+
+#endif //TFTPSERVER_LOG_H
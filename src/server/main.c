@@ -19,29 +19,21 @@
 
  */
 
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <fcntl.h>
 #include <unistd.h>
-#include <errno.h>
-#include <stdarg.h>
-#include <sys/stat.h>
 #include "../common/tftp.h"
-
-#define INITIAL_BUFSIZE 516
-
-#define LOG_NONE 0
-#define LOG_INFO 1
-#define LOG_VERBOSE 2
-#define LOG_DEBUG 3
-#define LOG_TRACE 50
-
-int LOG_LEVEL = LOG_INFO;
-int TRACE = 0;
+#include "log.h"
+#include "server.h"
+#include "worker.h"
+#include "metrics.h"
+#include "warm.h"
 
 const char *version = "1.0.0";
 char *defaultaddress = "0.0.0.0";
@@ -50,11 +42,9 @@ char defaultpath[] = ".";
 
 void sighandler(int);
 
-void handle_read_request(tftp_transmission);
-
-void log_message(int level, const char *format, ...);
+void stop_cache(tftp_cache *cache, tftp_warm_set *warm);
 
-void run_test();
+int start_exporter(tftp_metrics_exporter *exporter, const char *endpoint);
 
 void print_help() {
     printf("cTFTP version %s help:\n", version);
@@ -67,25 +57,53 @@ void print_help() {
     printf("\t-p [PORT]\tSet the port the server will listen on. Default: %d\n", defaultport);
     printf("\t-a [IPv4]\tSet the IP address the server will listen on. Default: %s\n", defaultaddress);
     printf("\t-r [path]\tSet the root path for files this server will serve. Default: %s\n", defaultpath);
+    printf("\t-w [N]\t\tRun N worker threads, each with its own SO_REUSEPORT socket. Default: 1\n");
+    printf("\t-c\t\t\tPin each worker thread to its own CPU\n");
+    printf("\t-m [bytes]\tMemory-map files of at least this size. 0 disables. Default: %d\n",
+           TFTP_SESSION_DEFAULT_MMAP_THRESHOLD);
+    printf("\t-R [KiB]\tRead files up to this far ahead of the client. 0 leaves it to the kernel. Default: %d\n",
+           TFTP_SESSION_DEFAULT_MAX_PREFETCH / 1024);
+    printf("\t-z\t\t\tSend memory-mapped files with MSG_ZEROCOPY\n");
+    printf("\t-C [MiB]\tKeep up to this much file contents in a cache shared by all workers. Default: off\n");
+    printf("\t-W [globs]\tLoad files matching these comma separated globs under the root path into memory at "
+           "startup, and reload them when they change. Default: off\n");
+    printf("\t-L\t\t\tLock the files loaded with -W in memory\n");
+    printf("\t-n [N]\t\tRemember up to N missing filenames per worker. 0 disables. Default: %d\n",
+           TFTP_NEGATIVE_DEFAULT_MAX_ENTRIES);
+    printf("\t-F [N]\t\tKeep up to N files open per worker for repeated requests. 0 disables. Default: %d\n",
+           TFTP_FILES_DEFAULT_MAX_ENTRIES);
+    printf("\t-P [N]\t\tKeep up to N bound session sockets per worker for reuse. 0 disables. Default: %d\n",
+           TFTP_SOCKETS_DEFAULT_SIZE);
+    printf("\t-D [N]\t\tSend downloads from N shared sockets per worker instead of a socket each. Default: 0, off\n");
+    printf("\t-H\t\t\tBack sessions and packet buffers with huge pages, if any are reserved\n");
+    printf("\t-U\t\t\tRead files and send through io_uring, if the kernel supports it\n");
+    printf("\t-u\t\t\tAccept uploads, which create new files in the root path\n");
+    printf("\t-S [file|none]\tfsync every uploaded file before acknowledging it, or never. Default: file\n");
+    printf("\t-M [IPv4:port]\tOffer RFC 2090 multicast on this group, using ports from the given one up. Default: off\n");
+    printf("\t-e [endpoint]\tExport Prometheus metrics over HTTP on [IPv4:]port (loopback by default) or a Unix "
+           "socket path. Default: off\n");
 }
 
-uint8_t recv_buffer[INITIAL_BUFSIZE];
-
-int running = 1;
+volatile int running = 1;
 char *root_path = defaultpath;
 
 int main(int argc, char **argv) {
     char *address = defaultaddress;
     int port = defaultport;
-
-    int sock_fd;
-    socklen_t sock_addr_size = sizeof(struct sockaddr_in);
-    struct sockaddr_in server, client;
-    memset(&server, 0, sizeof(server));
-    server.sin_family = AF_INET;
+    int worker_count = 1;
+    int pin_cpus = 0;
+    tftp_server_config config = tftp_create_server_config();
+    long cache_budget = 0;
+    const char *warm_patterns = NULL;
+    int lock_warm_set = 0;
+    const char *metrics_endpoint = NULL;
+
+    struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
 
     int option;
-    while ((option = getopt(argc, argv, ":hvstp:r:a:")) != -1) {
+    while ((option = getopt(argc, argv, ":hvstczuUHLp:r:a:w:m:R:C:W:n:F:P:D:M:S:e:")) != -1) {
         switch (option) {
             case 'v':
                 if (LOG_LEVEL < LOG_DEBUG) {
@@ -113,12 +131,150 @@ int main(int argc, char **argv) {
             case 't':
                 TRACE = 1;
                 break;
+            case 'w': {
+                char *end_ptr;
+                long picked_workers = strtol(optarg, &end_ptr, 10);
+                if (picked_workers < 1 || picked_workers > TFTP_MAX_WORKERS || end_ptr != optarg + strlen(optarg)) {
+                    log_message(LOG_INFO, "Invalid worker count %s.\n", optarg);
+                    return 3;
+                } else {
+                    worker_count = picked_workers;
+                }
+                break;
+            }
+            case 'c':
+                pin_cpus = 1;
+                break;
+            case 'm': {
+                char *end_ptr;
+                long picked_threshold = strtol(optarg, &end_ptr, 10);
+                if (picked_threshold < 0 || end_ptr != optarg + strlen(optarg)) {
+                    log_message(LOG_INFO, "Invalid mmap threshold %s.\n", optarg);
+                    return 3;
+                } else {
+                    config.mmap_threshold = picked_threshold;
+                }
+                break;
+            }
+            case 'R': {
+                char *end_ptr;
+                long picked_prefetch = strtol(optarg, &end_ptr, 10);
+                if (picked_prefetch < 0 || end_ptr != optarg + strlen(optarg)) {
+                    log_message(LOG_INFO, "Invalid read-ahead %s.\n", optarg);
+                    return 3;
+                } else {
+                    config.max_prefetch = picked_prefetch * 1024;
+                }
+                break;
+            }
+            case 'z':
+                config.zero_copy = 1;
+                break;
+            case 'C': {
+                char *end_ptr;
+                long picked_budget = strtol(optarg, &end_ptr, 10);
+                if (picked_budget < 0 || end_ptr != optarg + strlen(optarg)) {
+                    log_message(LOG_INFO, "Invalid cache size %s.\n", optarg);
+                    return 3;
+                } else {
+                    cache_budget = picked_budget * 1024 * 1024;
+                }
+                break;
+            }
+            case 'W':
+                warm_patterns = optarg;
+                break;
+            case 'L':
+                lock_warm_set = 1;
+                break;
+            case 'n': {
+                char *end_ptr;
+                long picked_entries = strtol(optarg, &end_ptr, 10);
+                if (picked_entries < 0 || end_ptr != optarg + strlen(optarg)) {
+                    log_message(LOG_INFO, "Invalid negative cache size %s.\n", optarg);
+                    return 3;
+                } else {
+                    config.negative_cache_size = picked_entries;
+                }
+                break;
+            }
+            case 'F': {
+                char *end_ptr;
+                long picked_entries = strtol(optarg, &end_ptr, 10);
+                if (picked_entries < 0 || end_ptr != optarg + strlen(optarg)) {
+                    log_message(LOG_INFO, "Invalid open file cache size %s.\n", optarg);
+                    return 3;
+                } else {
+                    config.open_file_cache_size = picked_entries;
+                }
+                break;
+            }
+            case 'P': {
+                char *end_ptr;
+                long picked_sockets = strtol(optarg, &end_ptr, 10);
+                if (picked_sockets < 0 || picked_sockets > 65535 || end_ptr != optarg + strlen(optarg)) {
+                    log_message(LOG_INFO, "Invalid socket pool size %s.\n", optarg);
+                    return 3;
+                } else {
+                    config.socket_pool_size = picked_sockets;
+                }
+                break;
+            }
+            case 'D': {
+                char *end_ptr;
+                long picked_demux = strtol(optarg, &end_ptr, 10);
+                if (picked_demux < 0 || picked_demux > TFTP_DEMUX_MAX_SOCKETS || end_ptr != optarg + strlen(optarg)) {
+                    log_message(LOG_INFO, "Invalid shared socket count %s.\n", optarg);
+                    return 3;
+                } else {
+                    config.demux_sockets = picked_demux;
+                }
+                break;
+            }
+            case 'u':
+                config.allow_uploads = 1;
+                break;
+            case 'U':
+                config.io_uring = 1;
+                break;
+            case 'H':
+                config.huge_pages = 1;
+                break;
+            case 'S':
+                if (strcmp(optarg, "file") == 0) {
+                    config.upload_sync = TFTP_UPLOAD_SYNC_FILE;
+                } else if (strcmp(optarg, "none") == 0) {
+                    config.upload_sync = TFTP_UPLOAD_SYNC_NONE;
+                } else {
+                    log_message(LOG_INFO, "Invalid upload durability %s.\n", optarg);
+                    return 3;
+                }
+                break;
+            case 'M': {
+                char *separator = strchr(optarg, ':');
+                char *end_ptr = NULL;
+                long picked_port = separator == NULL ? 0 : strtol(separator + 1, &end_ptr, 10);
+                if (separator != NULL) {
+                    *separator = 0;
+                }
+                if (separator == NULL || inet_aton(optarg, &config.multicast_address) == 0 ||
+                    !IN_MULTICAST(ntohl(config.multicast_address.s_addr)) || picked_port <= 0 || picked_port > 65535 ||
+                    *end_ptr != 0) {
+                    log_message(LOG_INFO, "Invalid multicast group %s.\n", optarg);
+                    return 3;
+                }
+                config.multicast_port = picked_port;
+                break;
+            }
+            case 'e':
+                metrics_endpoint = optarg;
+                break;
             case 'h':
                 print_help();
                 return 0;
             case 'a': {
                 address = optarg;
-                int convert_address = inet_aton(address, &server.sin_addr);
+                int convert_address = inet_aton(address, &server_address.sin_addr);
                 if (convert_address == 0) {
                     log_message(LOG_INFO, "Invalid address %s\n", address);
                     return 3;
@@ -131,309 +287,130 @@ int main(int argc, char **argv) {
                 return 2;
         }
     }
+    if (config.multicast_port != 0 && config.multicast_port + (long) TFTP_MULTICAST_PORTS * worker_count > 65536) {
+        log_message(LOG_INFO, "Not enough multicast ports above %d for %d workers.\n", config.multicast_port,
+                    worker_count);
+        return 3;
+    }
     log_message(LOG_VERBOSE, "Using address %s, port %d, verbosity level %d, and root directory %s\n", address, port,
                 LOG_LEVEL, root_path);
     signal(SIGINT, sighandler);
     signal(SIGTERM, sighandler);
-
-    struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 500000;
-
-
-    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(struct timeval));
-
-    server.sin_port = htons(port);
-    int could_bind = bind(sock_fd, (struct sockaddr *) &server, sock_addr_size);
-
-    if (could_bind != 0) {
-        log_message(LOG_INFO, "Could not bind to port %d. Terminating\n", port);
-        return 1;
+    // Writing to stdout must not hold up transfers, from here on messages are written by a thread of their own
+    if ((LOG_LEVEL > LOG_NONE || TRACE) && log_start() != TFTP_SUCCESS) {
+        log_message(LOG_INFO, "Could not start the log thread, logging synchronously.\n");
     }
 
-    log_message(LOG_INFO, "Started server on %s:%d.\n", inet_ntoa(server.sin_addr),
-                ntohs(server.sin_port));
+    server_address.sin_port = htons(port);
 
-    tftp_transmission host_transmission = tftp_create_transmission(0);
-    host_transmission.original_socket = sock_fd;
-    while (running) {
-        int rec = recvfrom(sock_fd, recv_buffer, 514, 0, (struct sockaddr *) &client, &sock_addr_size);
-        if (rec > 0) {
-            tftp_packet_request request_packet = {};
-            int result = tftp_parse_packet_request(&request_packet, recv_buffer, rec);
-            if (result) {
-                log_message(LOG_INFO, "Received request from %s:%d, opcode: %d, filename: %s, mode: %s\n",
-                            inet_ntoa(client.sin_addr),
-                            ntohs(client.sin_port), request_packet.opcode, request_packet.filename,
-                            request_packet.mode);
-                if (tftp_request_has_options(&request_packet)) {
-                    log_message(LOG_DEBUG, "Options:\n");
-                    if (request_packet.has_block_size) {
-                        log_message(LOG_DEBUG, "\tBlock size: %d\n", request_packet.block_size);
-                    }
-                    if (request_packet.has_window_size) {
-                        log_message(LOG_DEBUG, "\tWindow size: %d\n", request_packet.window_size);
-                    }
-                    if (request_packet.has_timeout) {
-                        log_message(LOG_DEBUG, "\tTimeout: %d\n", request_packet.timeout);
-                    }
-                    if (request_packet.has_transfer_size) {
-                        log_message(LOG_DEBUG, "\tTransfer size: %li\n", request_packet.transfer_size);
-                    }
-                }
-                tftp_transmission transmission = tftp_create_transmission(request_packet.block_size);
+    config.root_path = root_path;
 
-                transmission.request = request_packet;
-                transmission.client_addr_size = sizeof(client);
-                transmission.client_addr = malloc(transmission.client_addr_size);
-                transmission.original_socket = sock_fd;
-                memcpy(transmission.client_addr, &client, transmission.client_addr_size);
-                if (strstr(request_packet.filename, "../") != NULL || strstr(request_packet.filename, "/../") != NULL ||
-                    strstr(request_packet.filename, "/..") != NULL || strstr(request_packet.filename, "~/") != NULL) {
-                    tftp_packet_error error = tftp_create_packet_error();
-                    tftp_set_error(&error, TFTP_ERROR_UNDEF);
-                    tftp_set_error_message(&error, "Filename must not contain relative operators.");
-                    tftp_send_error(&host_transmission, &error, 1);
-                    log_message(LOG_TRACE, "Sent error code %d, \"%.*s\"\n", error.error_code,
-                                error.error_message_length,
-                                error.message);
-                } else if (request_packet.opcode == TFTP_OPCODE_READ_REQUEST) {
-                    handle_read_request(transmission);
-                } else if (request_packet.opcode == TFTP_OPCODE_WRITE_REQUEST) {
-                    // handle_write_request(transmission);
-                } else {
-                    tftp_packet_error error = tftp_create_packet_error();
-                    tftp_set_error(&error, TFTP_ERROR_ILLEGAL_OP);
-                    tftp_send_error(&host_transmission, &error, 1);
-                    log_message(LOG_TRACE, "Sent error code %d, \"%.*s\"\n", error.error_code,
-                                error.error_message_length,
-                                error.message);
-                }
-            }
+    tftp_cache cache;
+    // Pinned files live in the contents cache, which then only holds those if it has no budget of its own
+    if (cache_budget > 0 || warm_patterns != NULL) {
+        if (tftp_cache_init(&cache, cache_budget) != TFTP_SUCCESS) {
+            log_message(LOG_INFO, "Could not create the file cache. Terminating\n");
+            log_stop();
+            return 1;
         }
+        config.cache = &cache;
     }
-    tftp_stop_transmission(&host_transmission);
-    return 0;
-}
-
-
-void sighandler(int signum) {
-    log_message(LOG_INFO, "Stopping server...\n");
-    running = 0;
-}
-
-void handle_read_request(tftp_transmission transmission) {
-
-    int sockfd;
-    struct sockaddr_in server;
-
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    struct timeval timeout;
-    timeout.tv_usec = 0;
-    if (transmission.request.has_timeout) {
-        timeout.tv_sec = transmission.request.timeout;
-    } else {
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 500000;
-    }
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(struct timeval));
-
-    memset(&server, 0, sizeof(server));
-    server.sin_family = AF_INET;
-
-    // Converting arguments from host byte order to network byte order
-    // Then binding address to socket using arguments
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(INADDR_ANY);
-
-    int bound = bind(sockfd, (struct sockaddr *) &server, sizeof(struct sockaddr_in));
-    if (bound != 0) {
-        log_message(LOG_VERBOSE, "Could not create return socket. Terminating transmission.\n");
-        tftp_packet_error error = tftp_create_packet_error();
-        tftp_set_error_message(&error, "Could not create new socket.");
-        tftp_send_error(&transmission, &error, 1);
-        log_message(LOG_TRACE, "Sent error code %d, \"%.*s\"\n", error.error_code, error.error_message_length,
-                    error.message);
-        tftp_stop_transmission(&transmission);
-        return;
-    }
-    log_message(LOG_DEBUG, "Created new socket for transmission.\n");
-    transmission.socket = sockfd;
-
-    char actualPath[512];
-    strcpy(actualPath, root_path);
-    if (actualPath[strlen(actualPath) - 1] != '/') {
-        strcat(actualPath, "/");
-    }
-
-    strcat(actualPath, transmission.request.filename);
-    log_message(LOG_DEBUG, "Actual path of requested file: %s\n", actualPath);
-
-    int file_descriptor = open(actualPath, O_RDONLY);
-    if (file_descriptor < 0) {
-        tftp_packet_error error = tftp_create_packet_error();
-        if (errno == ENOENT) {
-            log_message(LOG_VERBOSE, "Could not find file %s\n", actualPath);
-            error.error_code = TFTP_ERROR_ENOENT;
-            tftp_set_error_message(&error, TFTP_ERROR_ENOENT_STRING);
-        } else if (errno == EACCES) {
-            log_message(LOG_VERBOSE, "Permission denied for file %s\n", actualPath);
-            error.error_code = TFTP_ERROR_ACCESS_VIOLATION;
-            tftp_set_error_message(&error, TFTP_ERROR_ACCESS_VIOLATION_STRING);
+    tftp_warm_set warm;
+    tftp_warm_set *warm_set = NULL;
+    if (warm_patterns != NULL) {
+        if (tftp_warm_start(&warm, &cache, root_path, warm_patterns, lock_warm_set) != TFTP_SUCCESS) {
+            log_message(LOG_INFO, "Could not load %s. Terminating\n", warm_patterns);
+            stop_cache(config.cache, NULL);
+            log_stop();
+            return 1;
         }
-        tftp_send_error(&transmission, &error, 0);
-        log_message(LOG_TRACE, "Sent error code %d, \"%.*s\"\n", error.error_code, error.error_message_length,
-                    error.message);
-        return;
+        warm_set = &warm;
+        log_message(LOG_INFO, "Pinned %li files, %li bytes, in memory.\n", warm.files, warm.bytes);
     }
-
-    transmission.file_descriptor = file_descriptor;
-    tftp_packet_ack ack = tftp_create_packet_ack();
-    tftp_packet_error recv_error = tftp_create_packet_error();
-
-    if (tftp_request_has_options(&transmission.request)) {
-        struct stat stats;
-        fstat(file_descriptor, &stats);
-
-        tftp_packet_optionack optionack = tftp_create_packet_oack();
-        optionack.has_block_size = transmission.request.has_block_size;
-        optionack.block_size = transmission.request.block_size;
-        optionack.has_timeout = transmission.request.has_timeout;
-        optionack.timeout = transmission.request.timeout;
-        optionack.has_window_size = transmission.request.has_window_size;
-        optionack.window_size = transmission.request.window_size;
-        optionack.has_transfer_size = transmission.request.has_transfer_size;
-        optionack.transfer_size = stats.st_size;
-        tftp_send_oack(&transmission, optionack);
-        log_message(LOG_TRACE, "Sent oack:\n");
-        if (optionack.has_block_size) {
-            log_message(LOG_TRACE, "\tBlock size: %d\n", optionack.block_size);
+    tftp_metrics_exporter exporter;
+    tftp_metrics_exporter_init(&exporter, config.cache);
+
+    if (worker_count > 1 || pin_cpus) {
+        // Every worker carries its own buffers, which is too much for the stack
+        tftp_worker *workers = calloc(worker_count, sizeof(tftp_worker));
+        if (workers == NULL ||
+            tftp_workers_start(workers, worker_count, &server_address, &config, pin_cpus, &running) != TFTP_SUCCESS) {
+            log_message(LOG_INFO, "Could not start %d workers on port %d. Terminating\n", worker_count, port);
+            free(workers);
+            stop_cache(config.cache, warm_set);
+            log_stop();
+            return 1;
         }
-        if (optionack.has_window_size) {
-            log_message(LOG_TRACE, "\tWindow size: %d\n", optionack.window_size);
+        log_message(LOG_INFO, "Started server on %s:%d with %d workers.\n", inet_ntoa(server_address.sin_addr),
+                    ntohs(workers[0].server.address.sin_port), worker_count);
+        for (int i = 0; i < worker_count; i++) {
+            tftp_metrics_exporter_add(&exporter, &workers[i].server.metrics);
         }
-        if (optionack.has_timeout) {
-            log_message(LOG_TRACE, "\tTimeout: %d\n", optionack.timeout);
-        }
-        if (optionack.has_transfer_size) {
-            log_message(LOG_TRACE, "\tTransfer size: %li\n", optionack.transfer_size);
-
-        }
-        int receive = tftp_receive_ack(&transmission, &ack, &recv_error);
-        if (receive == TFTP_OP_ERROR) {
-            log_message(LOG_VERBOSE, "Received TFTP error. Error code %d, message \"%.*s\".\n", recv_error.error_code,
-                        recv_error.error_message_length, recv_error.message);
-            tftp_stop_transmission(&transmission);
-            return;
-        } else if (receive != TFTP_SUCCESS) {
-            tftp_packet_error error = tftp_create_packet_error();
-            tftp_set_error(&error, TFTP_ERROR_ILLEGAL_OP);
-            tftp_stop_transmission(&transmission);
-            return;
+        int exported = metrics_endpoint == NULL || start_exporter(&exporter, metrics_endpoint) == TFTP_SUCCESS;
+        if (!exported) {
+            running = 0;
         }
+        tftp_workers_join(workers, worker_count);
+        log_message(LOG_INFO, "Stopping server...\n");
+        tftp_metrics_exporter_stop(&exporter);
+        free(workers);
+        stop_cache(config.cache, warm_set);
+        log_stop();
+        return exported ? 0 : 1;
     }
 
-    tftp_packet_data data = tftp_create_packet_data();
-
-    data.buffer = transmission.tx_buffer + 4;
-    data.buffer_length = transmission.request.block_size;
+    tftp_server server;
+    if (tftp_server_init(&server, &server_address, &config) != TFTP_SUCCESS) {
+        log_message(LOG_INFO, "Could not bind to port %d. Terminating\n", port);
+        stop_cache(config.cache, warm_set);
+        log_stop();
+        return 1;
+    }
 
-    int retransmissions = 0;
-    int is_retransmission = 0;
-    int do_transmission = 1;
-    int read_bytes = -1;
-    uint16_t block_num = 1;
-    long block_counter = 0;
-    do {
-        if (!is_retransmission && do_transmission) {
-            read_bytes = read(file_descriptor, data.buffer, data.buffer_length);
-        }
-        data.block_num = block_num;
-        data.data_size = read_bytes;
-        if (do_transmission) {
-            tftp_send_data(&transmission, &data, 0);
-        }
-        log_message(LOG_TRACE, "Sent data block %d, size %d\n", block_num, read_bytes);
+    log_message(LOG_INFO, "Started server on %s:%d.\n", inet_ntoa(server.address.sin_addr),
+                ntohs(server.address.sin_port));
 
-        int receive = tftp_receive_ack(&transmission, &ack, &recv_error);
+    tftp_metrics_exporter_add(&exporter, &server.metrics);
+    if (metrics_endpoint != NULL && start_exporter(&exporter, metrics_endpoint) != TFTP_SUCCESS) {
+        tftp_server_destroy(&server);
+        stop_cache(config.cache, warm_set);
+        log_stop();
+        return 1;
+    }
 
-        if (receive == TFTP_OP_ERROR) {
-            log_message(LOG_VERBOSE, "Received TFTP error. Error code %d, message \"%.*s\".\n", recv_error.error_code,
-                        recv_error.error_message_length, recv_error.message);
-            tftp_stop_transmission(&transmission);
-            return;
-        }
+    int result = tftp_server_run(&server, &running);
+    log_message(LOG_INFO, "Stopping server...\n");
+    tftp_metrics_exporter_stop(&exporter);
+    tftp_server_destroy(&server);
+    stop_cache(config.cache, warm_set);
+    log_stop();
+    return result == TFTP_SUCCESS ? 0 : 1;
+}
 
-        if (receive == TFTP_INVALID_OPCODE) {
-            log_message(LOG_VERBOSE, "Received invalid opcode.\n");
-            tftp_packet_error error = tftp_create_packet_error();
-            tftp_set_error(&error, TFTP_ERROR_ILLEGAL_OP);
-            tftp_send_error(&transmission, &error, 0);
-            log_message(LOG_TRACE, "Sent error code %d, \"%.*s\"\n", error.error_code, error.error_message_length,
-                        error.message);
-            break;
-        }
 
-        if (receive == TFTP_RECV_FAILED) {
-            if (retransmissions == 5) {
-                log_message(LOG_VERBOSE, "Transmission timed out.\n");
-                tftp_packet_error error = tftp_create_packet_error();
-                tftp_set_error_message(&error, "Receive timed out.");
-                tftp_send_error(&transmission, &error, 0);
-                log_message(LOG_TRACE, "Sent error code %d, \"%.*s\"\n", error.error_code, error.error_message_length,
-                            error.message);
-                break;
-            }
-            retransmissions++;
-            is_retransmission = 1;
-            log_message(LOG_VERBOSE, "Transmission timed out %d out of 5 times.\n", retransmissions);
-            continue;
-        }
-        if (receive == TFTP_SUCCESS) {
-            if (ack.block_num == block_num) {
-                log_message(LOG_TRACE, "Received ack %d.\n", block_num);
-                block_num = ack.block_num + 1;
-                block_counter += 1;
-                is_retransmission = 0;
-                retransmissions = 0;
-                do_transmission = 1;
-            } else if (ack.block_num < block_num) {
-                do_transmission = 0;
-                continue;
-            } else {
-                retransmissions++;
-                is_retransmission = 1;
-                log_message(LOG_TRACE, "Received incorrect ACK.\n", retransmissions);
-            }
-        }
-    } while (read_bytes == transmission.request.block_size || is_retransmission);
-    log_message(LOG_VERBOSE, "Successfully transferred file %s in %li blocks.\n", transmission.request.filename,
-                block_counter);
-    tftp_stop_transmission(&transmission);
+// Only sets the flag, a message logged here could interrupt the same thread halfway through writing another one
+void sighandler(int signum) {
+    running = 0;
 }
 
-void log_message(int level, const char *format, ...) {
-    va_list argp;
-    va_start(argp, format);
-    int is_trace = (level == LOG_TRACE && TRACE);
-    if (is_trace || LOG_LEVEL >= level) {
-        vprintf(format, argp);
+void stop_cache(tftp_cache *cache, tftp_warm_set *warm) {
+    if (warm != NULL) {
+        tftp_warm_stop(warm);
+        log_message(LOG_VERBOSE, "Pinned files: %li swapped for a new version, %li removed, %li failed to load.\n",
+                    warm->swaps, warm->removals, warm->failures);
+    }
+    if (cache == NULL) {
+        return;
     }
-    va_end(argp);
+    log_message(LOG_VERBOSE, "File cache: %li hits, %li misses, %li evictions, %li invalidations, %li bypasses.\n",
+                cache->hits, cache->misses, cache->evictions, cache->invalidations, cache->bypasses);
+    tftp_cache_destroy(cache);
 }
 
-void run_test(){
-    uint8_t packet_output[] = {
-            0x00, 0x01, 0x73, 0x79, 0x73, 0x6c, 0x69, 0x6e, 0x75, 0x78, 0x2e, 0x65,
-            0x66, 0x69, 0x36, 0x34, 0x00, 0x6f, 0x63, 0x74, 0x65, 0x74, 0x00, 0x74,
-            0x73, 0x69, 0x7a, 0x65, 0x00, 0x30, 0x00, 0x62, 0x6c, 0x6b, 0x73, 0x69,
-            0x7a, 0x65, 0x00, 0x31, 0x34, 0x36, 0x38, 0x00, 0x77, 0x69, 0x6e, 0x64,
-            0x6f, 0x77, 0x73, 0x69, 0x7a, 0x65, 0x00, 0x34, 0x00, 0x00, 0x31, 0x34,
-            0x30, 0x38, 0x00, 0x00, 0x30, 0x00, 0x62, 0x6c, 0x6b, 0x73, 0x69, 0x7a,
-            0x65, 0x00, 0x31, 0x34, 0x30, 0x38, 0x00
-    };
-    const int packet_length = 79;
-    tftp_packet_request request = {};
-    tftp_parse_packet_request(&request, packet_output, packet_length);
+int start_exporter(tftp_metrics_exporter *exporter, const char *endpoint) {
+    if (tftp_metrics_exporter_start(exporter, endpoint) != TFTP_SUCCESS) {
+        log_message(LOG_INFO, "Could not export metrics on %s. Terminating\n", endpoint);
+        return TFTP_ERROR;
+    }
+    return TFTP_SUCCESS;
 }
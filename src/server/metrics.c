@@ -0,0 +1,309 @@
+/*
+
+    Provide an implementation for metrics.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../common/tftp.h"
+#include "metrics.h"
+#include "log.h"
+
+// How often the exporter thread checks whether it should stop
+#define TFTP_METRICS_POLL_MS 100
+
+static const long bucket_bounds_us[TFTP_METRICS_BUCKETS] = TFTP_METRICS_BUCKET_BOUNDS_US;
+
+void tftp_metrics_count_error(tftp_metrics *metrics, int error_code) {
+    if (error_code < 0 || error_code >= TFTP_METRICS_ERROR_CODES) {
+        error_code = TFTP_ERROR_UNDEF;
+    }
+    tftp_metrics_add(&metrics->errors[error_code], 1);
+}
+
+void tftp_metrics_observe(tftp_histogram *histogram, long microseconds) {
+    int bucket = 0;
+    while (bucket < TFTP_METRICS_BUCKETS && microseconds > bucket_bounds_us[bucket]) {
+        bucket++;
+    }
+    tftp_metrics_add(&histogram->buckets[bucket], 1);
+    tftp_metrics_add(&histogram->sum_us, microseconds);
+    tftp_metrics_add(&histogram->count, 1);
+}
+
+void tftp_metrics_exporter_init(tftp_metrics_exporter *exporter, tftp_cache *cache) {
+    memset(exporter, 0, sizeof(tftp_metrics_exporter));
+    exporter->socket = -1;
+    exporter->cache = cache;
+}
+
+int tftp_metrics_exporter_add(tftp_metrics_exporter *exporter, tftp_metrics *metrics) {
+    if (exporter->started || exporter->source_count >= TFTP_METRICS_MAX_SOURCES) {
+        return TFTP_ERROR;
+    }
+    exporter->sources[exporter->source_count++] = metrics;
+    return TFTP_SUCCESS;
+}
+
+static void append(char *buffer, int size, int *length, const char *format, ...) {
+    if (*length >= size) {
+        return;
+    }
+    va_list arguments;
+    va_start(arguments, format);
+    int written = vsnprintf(buffer + *length, size - *length, format, arguments);
+    va_end(arguments);
+    *length = written < 0 || *length + written >= size ? size : *length + written;
+}
+
+// The sum of one field over every source
+static long total(tftp_metrics_exporter *exporter, size_t offset) {
+    long sum = 0;
+    for (int i = 0; i < exporter->source_count; i++) {
+        sum += __atomic_load_n((long *) ((char *) exporter->sources[i] + offset), __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+static void append_metric(char *buffer, int size, int *length, const char *name, const char *type, const char *help,
+                          long value) {
+    append(buffer, size, length, "# HELP %s %s\n# TYPE %s %s\n%s %li\n", name, help, name, type, name, value);
+}
+
+static void append_histogram(tftp_metrics_exporter *exporter, char *buffer, int size, int *length, const char *name,
+                             const char *help, size_t offset) {
+    append(buffer, size, length, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    long cumulative = 0;
+    for (int i = 0; i <= TFTP_METRICS_BUCKETS; i++) {
+        cumulative += total(exporter, offset + offsetof(tftp_histogram, buckets) + i * sizeof(long));
+        if (i < TFTP_METRICS_BUCKETS) {
+            append(buffer, size, length, "%s_bucket{le=\"%g\"} %li\n", name, bucket_bounds_us[i] / 1e6, cumulative);
+        } else {
+            append(buffer, size, length, "%s_bucket{le=\"+Inf\"} %li\n", name, cumulative);
+        }
+    }
+    append(buffer, size, length, "%s_sum %.6f\n%s_count %li\n", name,
+           total(exporter, offset + offsetof(tftp_histogram, sum_us)) / 1e6, name,
+           total(exporter, offset + offsetof(tftp_histogram, count)));
+}
+
+int tftp_metrics_render(tftp_metrics_exporter *exporter, char *buffer, int size) {
+    int length = 0;
+    append_metric(buffer, size, &length, "tftp_read_requests_total", "counter", "Read requests received.",
+                  total(exporter, offsetof(tftp_metrics, read_requests)));
+    append_metric(buffer, size, &length, "tftp_write_requests_total", "counter", "Write requests received.",
+                  total(exporter, offsetof(tftp_metrics, write_requests)));
+    append_metric(buffer, size, &length, "tftp_duplicate_requests_total", "counter",
+                  "Retransmitted requests answered by the transfer they had started.",
+                  total(exporter, offsetof(tftp_metrics, duplicate_requests)));
+    append_metric(buffer, size, &length, "tftp_sessions_active", "gauge", "Transfers in progress.",
+                  total(exporter, offsetof(tftp_metrics, active_sessions)));
+    append_metric(buffer, size, &length, "tftp_transfers_completed_total", "counter",
+                  "Transfers that were completed.", total(exporter, offsetof(tftp_metrics, completed_transfers)));
+    append_metric(buffer, size, &length, "tftp_blocks_sent_total", "counter", "DATA blocks sent, with retransmissions.",
+                  total(exporter, offsetof(tftp_metrics, blocks_sent)));
+    append_metric(buffer, size, &length, "tftp_bytes_sent_total", "counter", "DATA payload bytes sent.",
+                  total(exporter, offsetof(tftp_metrics, bytes_sent)));
+    append_metric(buffer, size, &length, "tftp_retransmitted_blocks_total", "counter", "DATA blocks sent again.",
+                  total(exporter, offsetof(tftp_metrics, retransmitted_blocks)));
+    append_metric(buffer, size, &length, "tftp_timeouts_total", "counter", "Retransmission timeouts.",
+                  total(exporter, offsetof(tftp_metrics, timeouts)));
+
+    append(buffer, size, &length, "# HELP tftp_errors_total ERROR packets sent, by error code.\n"
+                                  "# TYPE tftp_errors_total counter\n");
+    for (int code = 0; code < TFTP_METRICS_ERROR_CODES; code++) {
+        append(buffer, size, &length, "tftp_errors_total{code=\"%d\"} %li\n", code,
+               total(exporter, offsetof(tftp_metrics, errors) + code * sizeof(long)));
+    }
+
+    append_metric(buffer, size, &length, "tftp_open_file_cache_hits_total", "counter",
+                  "Files opened from the open file cache.", total(exporter, offsetof(tftp_metrics, open_file_hits)));
+    append_metric(buffer, size, &length, "tftp_open_file_cache_misses_total", "counter", "Files opened by name.",
+                  total(exporter, offsetof(tftp_metrics, open_file_misses)));
+    append_metric(buffer, size, &length, "tftp_negative_cache_hits_total", "counter",
+                  "Requests for files known to be missing.", total(exporter, offsetof(tftp_metrics, negative_hits)));
+    if (exporter->cache != NULL) {
+        pthread_mutex_lock(&exporter->cache->lock);
+        long hits = exporter->cache->hits;
+        long misses = exporter->cache->misses;
+        long used = exporter->cache->used;
+        long pinned = exporter->cache->pinned;
+        pthread_mutex_unlock(&exporter->cache->lock);
+        append_metric(buffer, size, &length, "tftp_contents_cache_hits_total", "counter",
+                      "Transfers sent from the contents cache.", hits);
+        append_metric(buffer, size, &length, "tftp_contents_cache_misses_total", "counter",
+                      "Transfers of files that were not in the contents cache yet.", misses);
+        append_metric(buffer, size, &length, "tftp_contents_cache_bytes", "gauge",
+                      "File contents held by the contents cache.", used);
+        append_metric(buffer, size, &length, "tftp_contents_cache_pinned_bytes", "gauge",
+                      "File contents pinned in memory at startup.", pinned);
+    }
+
+    append_histogram(exporter, buffer, size, &length, "tftp_open_seconds", "Time to open a requested file.",
+                     offsetof(tftp_metrics, open_time));
+    append_histogram(exporter, buffer, size, &length, "tftp_first_block_seconds",
+                     "Time from a read request to its first DATA block.", offsetof(tftp_metrics, first_block_time));
+    append_histogram(exporter, buffer, size, &length, "tftp_transfer_seconds",
+                     "Time from a request to the end of its transfer.", offsetof(tftp_metrics, transfer_time));
+    return length < size ? length : size - 1;
+}
+
+static void serve(tftp_metrics_exporter *exporter, int connection, char *body) {
+    // Whatever was asked for, only the request has to be read before answering
+    struct timeval timeout = {1, 0};
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[2048];
+    if (recv(connection, request, sizeof(request), 0) <= 0) {
+        return;
+    }
+
+    int length = tftp_metrics_render(exporter, body, TFTP_METRICS_RESPONSE_SIZE);
+    char header[128];
+    int header_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                                         "Content-Type: text/plain; version=0.0.4\r\n"
+                                                         "Content-Length: %d\r\n\r\n", length);
+    if (send(connection, header, header_length, MSG_NOSIGNAL | MSG_MORE) == header_length) {
+        send(connection, body, length, MSG_NOSIGNAL);
+    }
+}
+
+static void *run_exporter(void *argument) {
+    tftp_metrics_exporter *exporter = argument;
+    char *body = malloc(TFTP_METRICS_RESPONSE_SIZE);
+    if (body == NULL) {
+        return NULL;
+    }
+    struct pollfd listener = {exporter->socket, POLLIN, 0};
+    while (exporter->running) {
+        if (poll(&listener, 1, TFTP_METRICS_POLL_MS) != 1) {
+            continue;
+        }
+        int connection = accept4(exporter->socket, NULL, NULL, SOCK_CLOEXEC);
+        if (connection >= 0) {
+            serve(exporter, connection, body);
+            close(connection);
+        }
+    }
+    free(body);
+    return NULL;
+}
+
+static int open_listener(tftp_metrics_exporter *exporter, const char *endpoint) {
+    if (endpoint[0] == '/') {
+        if (strlen(endpoint) >= sizeof(exporter->unix_address.sun_path)) {
+            return -1;
+        }
+        // Left behind by an earlier run that did not stop cleanly. Anything else at that path is not ours to remove.
+        struct stat stats;
+        if (lstat(endpoint, &stats) == 0) {
+            if (!S_ISSOCK(stats.st_mode)) {
+                return -1;
+            }
+            unlink(endpoint);
+        }
+        exporter->unix_address.sun_family = AF_UNIX;
+        strcpy(exporter->unix_address.sun_path, endpoint);
+        int unix_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (unix_socket >= 0 &&
+            bind(unix_socket, (struct sockaddr *) &exporter->unix_address, sizeof(exporter->unix_address)) != 0) {
+            close(unix_socket);
+            exporter->unix_address.sun_path[0] = 0;
+            return -1;
+        }
+        return unix_socket;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char *port = endpoint;
+    const char *separator = strchr(endpoint, ':');
+    if (separator != NULL) {
+        char host[INET_ADDRSTRLEN];
+        if (separator - endpoint >= (long) sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, endpoint, separator - endpoint);
+        host[separator - endpoint] = 0;
+        if (inet_aton(host, &address.sin_addr) == 0) {
+            return -1;
+        }
+        port = separator + 1;
+    }
+    char *end_ptr;
+    long picked_port = strtol(port, &end_ptr, 10);
+    if (*port == 0 || *end_ptr != 0 || picked_port < 0 || picked_port > 65535) {
+        return -1;
+    }
+    address.sin_port = htons(picked_port);
+
+    int tcp_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if (tcp_socket >= 0 && (setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+                            bind(tcp_socket, (struct sockaddr *) &address, sizeof(address)) != 0)) {
+        close(tcp_socket);
+        return -1;
+    }
+    return tcp_socket;
+}
+
+int tftp_metrics_exporter_start(tftp_metrics_exporter *exporter, const char *endpoint) {
+    exporter->socket = open_listener(exporter, endpoint);
+    if (exporter->socket < 0 || listen(exporter->socket, 16) != 0) {
+        tftp_metrics_exporter_stop(exporter);
+        return TFTP_ERROR;
+    }
+    exporter->running = 1;
+    if (pthread_create(&exporter->thread, NULL, run_exporter, exporter) != 0) {
+        tftp_metrics_exporter_stop(exporter);
+        return TFTP_ERROR;
+    }
+    exporter->started = 1;
+    log_message(LOG_VERBOSE, "Exporting metrics on %s.\n", endpoint);
+    return TFTP_SUCCESS;
+}
+
+void tftp_metrics_exporter_stop(tftp_metrics_exporter *exporter) {
+    exporter->running = 0;
+    if (exporter->started) {
+        pthread_join(exporter->thread, NULL);
+        exporter->started = 0;
+    }
+    if (exporter->socket >= 0) {
+        close(exporter->socket);
+        exporter->socket = -1;
+    }
+    if (exporter->unix_address.sun_path[0] != 0) {
+        unlink(exporter->unix_address.sun_path);
+        exporter->unix_address.sun_path[0] = 0;
+    }
+}
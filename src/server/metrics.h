@@ -0,0 +1,111 @@
+/*
+
+    Counters, gauges and latency histograms, exported in the Prometheus text format
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_METRICS_H
+#define TFTPSERVER_METRICS_H
+
+#include <pthread.h>
+#include <sys/un.h>
+#include "cache.h"
+
+// Error codes 0 to 8, RFC 1350 and the RFC 2347 option negotiation error
+#define TFTP_METRICS_ERROR_CODES 9
+// Upper bounds in microseconds, every histogram has one more bucket for anything slower
+#define TFTP_METRICS_BUCKETS 14
+#define TFTP_METRICS_BUCKET_BOUNDS_US {10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, \
+                                       5000000, 10000000, 60000000}
+// Servers one exporter reports on, one per worker
+#define TFTP_METRICS_MAX_SOURCES 256
+#define TFTP_METRICS_RESPONSE_SIZE (64 * 1024)
+
+typedef struct {
+    // Not cumulative, the exporter adds them up
+    long buckets[TFTP_METRICS_BUCKETS + 1];
+    long count;
+    long sum_us;
+} tftp_histogram;
+
+// Written by the thread running the server only, and read by the exporter without locking
+typedef struct {
+    long read_requests;
+    long write_requests;
+    long blocks_sent;
+    long bytes_sent;
+    long errors[TFTP_METRICS_ERROR_CODES];
+
+    // Kept elsewhere in the server, copied here once every event loop iteration
+    long active_sessions;
+    long completed_transfers;
+    long timeouts;
+    long retransmitted_blocks;
+    long duplicate_requests;
+    long open_file_hits;
+    long open_file_misses;
+    long negative_hits;
+
+    // Opening the file, from the request to its first DATA block, and from the request to the last ACK
+    tftp_histogram open_time;
+    tftp_histogram first_block_time;
+    tftp_histogram transfer_time;
+} tftp_metrics;
+
+typedef struct {
+    tftp_metrics *sources[TFTP_METRICS_MAX_SOURCES];
+    int source_count;
+    // The contents cache is shared and has its own lock, NULL if there is none
+    tftp_cache *cache;
+
+    int socket;
+    // Set for a Unix socket, which is removed again when the exporter stops
+    struct sockaddr_un unix_address;
+    pthread_t thread;
+    volatile int running;
+    int started;
+} tftp_metrics_exporter;
+
+// Only the owning thread writes, so a relaxed load and store is enough and never takes a lock or a locked instruction
+static inline void tftp_metrics_add(long *counter, long value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline void tftp_metrics_set(long *gauge, long value) {
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+void tftp_metrics_count_error(tftp_metrics *metrics, int error_code);
+
+void tftp_metrics_observe(tftp_histogram *histogram, long microseconds);
+
+void tftp_metrics_exporter_init(tftp_metrics_exporter *exporter, tftp_cache *cache);
+
+// Only before the exporter is started
+int tftp_metrics_exporter_add(tftp_metrics_exporter *exporter, tftp_metrics *metrics);
+
+// Renders every source into buffer, returns the length
+int tftp_metrics_render(tftp_metrics_exporter *exporter, char *buffer, int size);
+
+// Serves the metrics over HTTP on a Unix socket if endpoint starts with a /, otherwise on [IPv4:]port, which defaults
+// to the loopback address
+int tftp_metrics_exporter_start(tftp_metrics_exporter *exporter, const char *endpoint);
+
+void tftp_metrics_exporter_stop(tftp_metrics_exporter *exporter);
+
+#endif //TFTPSERVER_METRICS_H
@@ -0,0 +1,146 @@
+/*
+
+    Provide an implementation for negative.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include "../common/tftp.h"
+#include "negative.h"
+
+// Anything that can make a missing file appear: creation, a rename into the directory, or the directory moving
+#define TFTP_NEGATIVE_WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static unsigned long hash_filename(const char *filename) {
+    return tftp_hash_bytes(filename, (long) strlen(filename));
+}
+
+int tftp_negative_init(tftp_negative_cache *cache, long max_entries) {
+    memset(cache, 0, sizeof(tftp_negative_cache));
+    cache->max_entries = max_entries;
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify_fd < 0) {
+        return TFTP_ERROR;
+    }
+    return TFTP_SUCCESS;
+}
+
+void tftp_negative_destroy(tftp_negative_cache *cache) {
+    tftp_negative_flush(cache);
+    if (cache->inotify_fd >= 0) {
+        close(cache->inotify_fd);
+        cache->inotify_fd = -1;
+    }
+}
+
+int tftp_negative_contains(tftp_negative_cache *cache, const char *filename) {
+    tftp_negative_entry *entry = cache->buckets[hash_filename(filename) % TFTP_NEGATIVE_BUCKETS];
+    while (entry != NULL) {
+        if (strcmp(entry->filename, filename) == 0) {
+            cache->hits++;
+            return 1;
+        }
+        entry = entry->next;
+    }
+    return 0;
+}
+
+// Watch the deepest directory of the path that exists, as that is where the next missing component would appear
+static int watch_parent(tftp_negative_cache *cache, const char *root_path, const char *filename) {
+    char directory[768];
+    int length = snprintf(directory, sizeof(directory), "%s/%s", root_path, filename);
+    if (length < 0 || length >= (int) sizeof(directory)) {
+        return TFTP_ERROR;
+    }
+    int root_length = strlen(root_path);
+    while (length > root_length) {
+        while (length > root_length && directory[length - 1] != '/') {
+            length--;
+        }
+        // Strip the slash, unless it belongs to the root itself
+        directory[length > root_length ? --length : length] = 0;
+        if (inotify_add_watch(cache->inotify_fd, directory, TFTP_NEGATIVE_WATCH_MASK) >= 0) {
+            return TFTP_SUCCESS;
+        }
+        if (errno != ENOENT && errno != ENOTDIR) {
+            return TFTP_ERROR;
+        }
+    }
+    return TFTP_ERROR;
+}
+
+void tftp_negative_insert(tftp_negative_cache *cache, const char *root_path, const char *filename) {
+    if (cache->inotify_fd < 0 || tftp_negative_contains(cache, filename)) {
+        return;
+    }
+    // Without a watch nothing would ever tell us the file appeared, so such names are not cached
+    if (watch_parent(cache, root_path, filename) != TFTP_SUCCESS) {
+        return;
+    }
+    if (cache->count >= cache->max_entries) {
+        tftp_negative_flush(cache);
+    }
+
+    unsigned long length = strlen(filename);
+    tftp_negative_entry *entry = malloc(sizeof(tftp_negative_entry) + length + 1);
+    if (entry == NULL) {
+        return;
+    }
+    memcpy(entry->filename, filename, length + 1);
+    unsigned long bucket = hash_filename(filename) % TFTP_NEGATIVE_BUCKETS;
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    cache->count++;
+    cache->inserts++;
+}
+
+void tftp_negative_flush(tftp_negative_cache *cache) {
+    if (cache->count == 0) {
+        return;
+    }
+    for (int i = 0; i < TFTP_NEGATIVE_BUCKETS; i++) {
+        tftp_negative_entry *entry = cache->buckets[i];
+        while (entry != NULL) {
+            tftp_negative_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        cache->buckets[i] = NULL;
+    }
+    cache->count = 0;
+    cache->flushes++;
+}
+
+void tftp_negative_handle_events(tftp_negative_cache *cache) {
+    // The events themselves do not matter, any of them may have created a cached name
+    uint8_t events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    while (read(cache->inotify_fd, events, sizeof(events)) > 0) {
+        changed = 1;
+    }
+    if (changed) {
+        tftp_negative_flush(cache);
+    }
+}
@@ -0,0 +1,58 @@
+/*
+
+    Cache of file names that are known not to exist, invalidated with inotify
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_NEGATIVE_H
+#define TFTPSERVER_NEGATIVE_H
+
+#define TFTP_NEGATIVE_BUCKETS 1024
+#define TFTP_NEGATIVE_DEFAULT_MAX_ENTRIES 4096
+
+typedef struct tftp_negative_entry {
+    struct tftp_negative_entry *next;
+    char filename[];
+} tftp_negative_entry;
+
+typedef struct {
+    // Watches every directory a missing file was looked up in, any change there empties the cache
+    int inotify_fd;
+
+    tftp_negative_entry *buckets[TFTP_NEGATIVE_BUCKETS];
+    long count;
+    long max_entries;
+
+    long hits;
+    long inserts;
+    long flushes;
+} tftp_negative_cache;
+
+int tftp_negative_init(tftp_negative_cache *cache, long max_entries);
+
+void tftp_negative_destroy(tftp_negative_cache *cache);
+
+int tftp_negative_contains(tftp_negative_cache *cache, const char *filename);
+
+void tftp_negative_insert(tftp_negative_cache *cache, const char *root_path, const char *filename);
+
+void tftp_negative_flush(tftp_negative_cache *cache);
+
+void tftp_negative_handle_events(tftp_negative_cache *cache);
+
+#endif //TFTPSERVER_NEGATIVE_H
@@ -0,0 +1,74 @@
+/*
+
+    Requests the parser is tested, benchmarked and fuzzed with
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_PARSE_CORPUS_H
+#define TFTPSERVER_PARSE_CORPUS_H
+
+#include <stdint.h>
+#include "../common/tftp.h"
+
+typedef struct {
+    const char *name;
+    const uint8_t *data;
+    int length;
+    int result;
+} tftp_parse_case;
+
+// Every field is its own literal, so a NUL is never read as the start of an octal escape with the digits after it
+#define TFTP_PARSE_PACKET(literal) (const uint8_t *) (literal), sizeof(literal) - 1
+
+static const uint8_t tftp_weird_packet[] = {
+        0x00, 0x01, 0x73, 0x79, 0x73, 0x6c, 0x69, 0x6e, 0x75, 0x78, 0x2e, 0x65,
+        0x66, 0x69, 0x36, 0x34, 0x00, 0x6f, 0x63, 0x74, 0x65, 0x74, 0x00, 0x74,
+        0x73, 0x69, 0x7a, 0x65, 0x00, 0x30, 0x00, 0x62, 0x6c, 0x6b, 0x73, 0x69,
+        0x7a, 0x65, 0x00, 0x31, 0x34, 0x36, 0x38, 0x00, 0x77, 0x69, 0x6e, 0x64,
+        0x6f, 0x77, 0x73, 0x69, 0x7a, 0x65, 0x00, 0x34, 0x00, 0x00, 0x31, 0x34,
+        0x30, 0x38, 0x00, 0x00, 0x30, 0x00, 0x62, 0x6c, 0x6b, 0x73, 0x69, 0x7a,
+        0x65, 0x00, 0x31, 0x34, 0x30, 0x38, 0x00
+};
+
+static const uint8_t tftp_illegal_opcode[] = {0x00, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+static const uint8_t tftp_invalid_data[] = {0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01};
+
+static const tftp_parse_case tftp_parse_corpus[] = {
+        {"Weird packet", tftp_weird_packet, sizeof(tftp_weird_packet), TFTP_SUCCESS},
+        {"Illegal request", tftp_illegal_opcode, sizeof(tftp_illegal_opcode), TFTP_INVALID_OPCODE},
+        {"Invalid data", tftp_invalid_data, sizeof(tftp_invalid_data), TFTP_INVALID_NAME},
+        {"Plain request", TFTP_PARSE_PACKET("\0\1" "boot.img\0" "octet\0"), TFTP_SUCCESS},
+        {"PXE request", TFTP_PARSE_PACKET("\0\1" "pxelinux.0\0" "octet\0" "tsize\0" "0\0" "blksize\0" "1456\0"),
+         TFTP_SUCCESS},
+        {"Upper case options", TFTP_PARSE_PACKET("\0\2" "upload.bin\0" "OCTET\0" "BlkSize\0" "8192\0" "WINDOWSIZE\0"
+                                                 "16\0" "Timeout\0" "2\0"), TFTP_SUCCESS},
+        {"Out of range values", TFTP_PARSE_PACKET("\0\1" "boot.img\0" "octet\0" "blksize\0" "4\0" "timeout\0" "300\0"
+                                                  "windowsize\0" "0\0" "tsize\0" "-1\0"), TFTP_SUCCESS},
+        {"Overlong number", TFTP_PARSE_PACKET("\0\1" "boot.img\0" "octet\0" "tsize\0" "99999999999999999999\0"),
+         TFTP_SUCCESS},
+        {"Multicast request", TFTP_PARSE_PACKET("\0\1" "boot.img\0" "octet\0" "multicast\0" "\0"), TFTP_SUCCESS},
+        {"Value cut off", TFTP_PARSE_PACKET("\0\1" "boot.img\0" "octet\0" "blksize\0" "14"), TFTP_SUCCESS},
+        {"Option cut off", TFTP_PARSE_PACKET("\0\1" "boot.img\0" "octet\0" "blksize"), TFTP_INVALID_OPTION},
+        {"Mode cut off", TFTP_PARSE_PACKET("\0\1" "boot.img\0" "oct"), TFTP_INVALID_MODE},
+        {"Too little data", TFTP_PARSE_PACKET("\0\1" "a\0"), TFTP_TOO_LITTLE_DATA},
+};
+
+#define TFTP_PARSE_CORPUS_SIZE ((int) (sizeof(tftp_parse_corpus) / sizeof(tftp_parse_corpus[0])))
+
+#endif //TFTPSERVER_PARSE_CORPUS_H
@@ -0,0 +1,106 @@
+/*
+
+    Fuzz target for the request parser, for libFuzzer or as a standalone random mutator of the parser tests
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../common/tftp.h"
+#include "parse_corpus.h"
+
+static int within(const uint8_t *data, size_t size, const char *pointer) {
+    return pointer >= (const char *) data && pointer < (const char *) data + size;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size > UINT16_MAX) {
+        return 0;
+    }
+    // An exact copy, so reading past the end is caught by the address sanitizer
+    uint8_t *copy = malloc(size == 0 ? 1 : size);
+    memcpy(copy, data, size);
+
+    tftp_packet_request request;
+    if (tftp_parse_packet_request(&request, copy, size) == TFTP_SUCCESS) {
+        if (!within(copy, size, request.filename) || !within(copy, size, request.filename + request.filename_length) ||
+            request.filename[request.filename_length] != 0 || (int) strlen(request.filename) != request.filename_length ||
+            request.filename_length > TFTP_MAX_FILENAME_LENGTH || !within(copy, size, request.mode) ||
+            request.block_size < 8 || request.block_size > 65464 ||
+            (request.has_timeout && request.timeout < 1) ||
+            (request.has_window_size && request.window_size < 1) ||
+            (request.has_transfer_size && request.transfer_size < 0)) {
+            abort();
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+#ifndef TFTP_LIBFUZZER
+
+static uint32_t random_state = 1;
+
+static uint32_t random_next() {
+    random_state ^= random_state << 13u;
+    random_state ^= random_state >> 17u;
+    random_state ^= random_state << 5u;
+    return random_state;
+}
+
+// Flip, insert or remove a few bytes, or cut the request short
+static size_t mutate(uint8_t *data, size_t size, size_t max_size) {
+    int mutations = 1 + random_next() % 4;
+    for (int i = 0; i < mutations; i++) {
+        size_t position = size == 0 ? 0 : random_next() % size;
+        uint32_t kind = random_next() % 4;
+        if (kind == 0 && size > 0) {
+            data[position] = random_next() % 4 == 0 ? 0 : random_next();
+        } else if (kind == 1 && size < max_size) {
+            memmove(data + position + 1, data + position, size - position);
+            data[position] = random_next() % 2 == 0 ? 0 : random_next();
+            size++;
+        } else if (kind == 2 && size > 0) {
+            memmove(data + position, data + position + 1, size - position - 1);
+            size--;
+        } else {
+            size = position;
+        }
+    }
+    return size;
+}
+
+int main(int argc, char **argv) {
+    long runs = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+    uint8_t buffer[1024];
+    for (long run = 0; run < runs; run++) {
+        const tftp_parse_case *parse_case = &tftp_parse_corpus[run % TFTP_PARSE_CORPUS_SIZE];
+        memcpy(buffer, parse_case->data, parse_case->length);
+        size_t size = run < TFTP_PARSE_CORPUS_SIZE ? (size_t) parse_case->length
+                                                   : mutate(buffer, parse_case->length, sizeof(buffer));
+        LLVMFuzzerTestOneInput(buffer, size);
+    }
+    printf("Parsed %li requests\n", runs);
+    return 0;
+}
+
+#endif
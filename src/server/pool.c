@@ -0,0 +1,114 @@
+/*
+
+    Provide an implementation for pool.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+static int size_class(int size) {
+    int size_class = 0;
+    while (size_class < TFTP_POOL_CLASSES && (1 << (size_class + TFTP_POOL_MIN_SHIFT)) < size) {
+        size_class++;
+    }
+    return size_class;
+}
+
+static int map_slab(tftp_pool *pool, int index) {
+    size_t size = pool->huge_pages ? TFTP_POOL_HUGE_SLAB_SIZE : TFTP_POOL_SLAB_SIZE;
+    void *memory = MAP_FAILED;
+    if (pool->huge_pages) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            pool->huge_slab_count++;
+        }
+    }
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return 0;
+        }
+        if (pool->huge_pages) {
+            // Transparent huge pages, if the system has them enabled for madvise
+            madvise(memory, size, MADV_HUGEPAGE);
+        }
+    }
+
+    tftp_pool_slab *slab = memory;
+    slab->size = size;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_count++;
+    pool->carve_next[index] = (uint8_t *) memory + TFTP_POOL_SLAB_HEADER;
+    pool->carve_end[index] = (uint8_t *) memory + size;
+    return 1;
+}
+
+void tftp_pool_init(tftp_pool *pool, int huge_pages) {
+    memset(pool, 0, sizeof(tftp_pool));
+    pool->huge_pages = huge_pages;
+}
+
+void tftp_pool_destroy(tftp_pool *pool) {
+    while (pool->slabs != NULL) {
+        tftp_pool_slab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        munmap(slab, slab->size);
+    }
+    for (int i = 0; i < TFTP_POOL_CLASSES; i++) {
+        pool->free_lists[i] = NULL;
+        pool->free_counts[i] = 0;
+        pool->carve_next[i] = NULL;
+        pool->carve_end[i] = NULL;
+    }
+}
+
+void *tftp_pool_get(tftp_pool *pool, int size) {
+    int index = size_class(size);
+    if (index == TFTP_POOL_CLASSES) {
+        return NULL;
+    }
+    tftp_pool_buffer *buffer = pool->free_lists[index];
+    if (buffer != NULL) {
+        pool->free_lists[index] = buffer->next;
+        pool->free_counts[index]--;
+        pool->reuses++;
+        return buffer;
+    }
+
+    long buffer_size = 1L << (index + TFTP_POOL_MIN_SHIFT);
+    if (pool->carve_end[index] - pool->carve_next[index] < buffer_size && !map_slab(pool, index)) {
+        return NULL;
+    }
+    void *carved = pool->carve_next[index];
+    pool->carve_next[index] += buffer_size;
+    pool->allocations++;
+    return carved;
+}
+
+void tftp_pool_put(tftp_pool *pool, void *buffer, int size) {
+    int index = size_class(size);
+    tftp_pool_buffer *entry = buffer;
+    entry->next = pool->free_lists[index];
+    pool->free_lists[index] = entry;
+    pool->free_counts[index]++;
+}
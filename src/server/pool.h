@@ -0,0 +1,71 @@
+/*
+
+    Free lists of packet sized buffers, so the hot path does not hit malloc
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_POOL_H
+#define TFTPSERVER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Buffers are handed out in power of two size classes, from 512 bytes up to 64 KiB
+#define TFTP_POOL_MIN_SHIFT 9
+#define TFTP_POOL_CLASSES 8
+// Buffers are carved from slabs, which go back to the system only when the pool is destroyed
+#define TFTP_POOL_SLAB_SIZE (256 * 1024)
+#define TFTP_POOL_HUGE_SLAB_SIZE (2 * 1024 * 1024)
+// The slab header takes this much room in front of the first buffer, so buffers stay cache line aligned
+#define TFTP_POOL_SLAB_HEADER 64
+
+typedef struct tftp_pool_buffer {
+    struct tftp_pool_buffer *next;
+} tftp_pool_buffer;
+
+typedef struct tftp_pool_slab {
+    struct tftp_pool_slab *next;
+    size_t size;
+} tftp_pool_slab;
+
+typedef struct {
+    tftp_pool_buffer *free_lists[TFTP_POOL_CLASSES];
+    int free_counts[TFTP_POOL_CLASSES];
+    // The part of the newest slab of every class that was never handed out
+    uint8_t *carve_next[TFTP_POOL_CLASSES];
+    uint8_t *carve_end[TFTP_POOL_CLASSES];
+    tftp_pool_slab *slabs;
+
+    // Back slabs with huge pages, falling back to normal pages when none are reserved
+    int huge_pages;
+
+    long slab_count;
+    long huge_slab_count;
+    long allocations;
+    long reuses;
+} tftp_pool;
+
+void tftp_pool_init(tftp_pool *pool, int huge_pages);
+
+void tftp_pool_destroy(tftp_pool *pool);
+
+void *tftp_pool_get(tftp_pool *pool, int size);
+
+void tftp_pool_put(tftp_pool *pool, void *buffer, int size);
+
+#endif //TFTPSERVER_POOL_H
@@ -0,0 +1,1783 @@
+/*
+
+    Provide an implementation for server.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "server.h"
+#include "log.h"
+
+static void handle_listener(tftp_server *server);
+
+static void handle_request(tftp_server *server, const uint8_t *packet, int length, struct sockaddr_in *client_address,
+                           socklen_t client_size);
+
+static void handle_read_request(tftp_server *server, tftp_session *session);
+
+static void handle_write_request(tftp_server *server, tftp_session *session);
+
+static void handle_writer(tftp_server *server);
+
+static void handle_session(tftp_server *server, tftp_session *session, uint32_t events);
+
+static void handle_demux(tftp_server *server, int socket_index);
+
+static void handle_uring(tftp_server *server);
+
+static int session_is_active(const tftp_session *session);
+
+static void send_member_oack(tftp_session *session, tftp_multicast_member *member, int master_client);
+
+static void expire_sessions(tftp_server *server, long now);
+
+static void end_session(tftp_server *server, tftp_session *session);
+
+static int retransmit(tftp_server *server, tftp_session *session);
+
+static void release_session(tftp_server *server, tftp_session *session);
+
+long tftp_server_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static long now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+tftp_server_config tftp_create_server_config() {
+    tftp_server_config config;
+    config.root_path = ".";
+    config.max_window_size = TFTP_SESSION_DEFAULT_MAX_WINDOW_SIZE;
+    config.mmap_threshold = TFTP_SESSION_DEFAULT_MMAP_THRESHOLD;
+    config.max_prefetch = TFTP_SESSION_DEFAULT_MAX_PREFETCH;
+    config.zero_copy = 0;
+    config.cache = NULL;
+    config.reuse_port = 0;
+    config.negative_cache_size = TFTP_NEGATIVE_DEFAULT_MAX_ENTRIES;
+    config.open_file_cache_size = TFTP_FILES_DEFAULT_MAX_ENTRIES;
+    config.socket_pool_size = TFTP_SOCKETS_DEFAULT_SIZE;
+    config.demux_sockets = 0;
+    config.multicast_address.s_addr = htonl(INADDR_ANY);
+    config.multicast_port = 0;
+    config.allow_uploads = 0;
+    config.upload_sync = TFTP_UPLOAD_SYNC_FILE;
+    config.io_uring = 0;
+    config.huge_pages = 0;
+    config.impairment = NULL;
+    return config;
+}
+
+int tftp_server_init(tftp_server *server, const struct sockaddr_in *address, const tftp_server_config *config) {
+    memset(server, 0, sizeof(*server));
+    server->source.kind = TFTP_SOURCE_LISTENER;
+    server->config = *config;
+    server->epoll_fd = -1;
+    server->listen_socket = -1;
+    server->address = *address;
+    server->sessions = NULL;
+    server->negative_cache.inotify_fd = -1;
+    server->files.root_fd = -1;
+    server->files.inotify_fd = -1;
+    server->uring.ring_fd = -1;
+    server->host_transmission = tftp_create_transmission(0);
+    tftp_pool_init(&server->pool, config->huge_pages);
+    if (tftp_demux_table_init(&server->requests) != TFTP_SUCCESS) {
+        tftp_server_destroy(server);
+        return TFTP_ERROR;
+    }
+    tftp_timer_wheel_init(&server->timers, tftp_server_now_ms());
+    if (tftp_batch_init(&server->batch, TFTP_SERVER_BATCH_ARENA_SIZE) != TFTP_SUCCESS) {
+        tftp_server_destroy(server);
+        return TFTP_ERROR;
+    }
+
+    if (tftp_files_init(&server->files, config->root_path, config->open_file_cache_size) != TFTP_SUCCESS) {
+        log_message(LOG_INFO, "Could not open root directory %s.\n", config->root_path);
+        tftp_server_destroy(server);
+        return TFTP_ERROR;
+    }
+
+    if (tftp_sockets_init(&server->sockets, config->socket_pool_size) != TFTP_SUCCESS) {
+        log_message(LOG_INFO, "Could not create %d session sockets.\n", config->socket_pool_size);
+        tftp_server_destroy(server);
+        return TFTP_ERROR;
+    }
+
+    if (tftp_demux_init(&server->demux, config->demux_sockets) != TFTP_SUCCESS) {
+        log_message(LOG_INFO, "Could not create %d shared session sockets.\n", config->demux_sockets);
+        tftp_server_destroy(server);
+        return TFTP_ERROR;
+    }
+
+
+    server->listen_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_socket < 0) {
+        tftp_server_destroy(server);
+        return TFTP_ERROR;
+    }
+
+    if (config->reuse_port) {
+        int enable = 1;
+        if (setsockopt(server->listen_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) {
+            tftp_server_destroy(server);
+            return TFTP_ERROR;
+        }
+    }
+
+    socklen_t address_size = sizeof(server->address);
+    if (bind(server->listen_socket, (struct sockaddr *) &server->address, address_size) != 0) {
+        tftp_server_destroy(server);
+        return TFTP_ERROR;
+    }
+    // Pick up the port actually assigned, in case port 0 was requested
+    getsockname(server->listen_socket, (struct sockaddr *) &server->address, &address_size);
+    server->host_transmission.original_socket = server->listen_socket;
+    server->host_transmission.impairment = config->impairment;
+    server->batch.impairment = config->impairment;
+
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd < 0) {
+        tftp_server_destroy(server);
+        return TFTP_ERROR;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &server->source;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_socket, &event) != 0) {
+        tftp_server_destroy(server);
+        return TFTP_ERROR;
+    }
+
+    for (int i = 0; i < server->demux.socket_count; i++) {
+        server->demux_sources[i].source.kind = TFTP_SOURCE_DEMUX;
+        server->demux_sources[i].index = i;
+        event.events = EPOLLIN;
+        event.data.ptr = &server->demux_sources[i].source;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->demux.sockets[i], &event) != 0) {
+            tftp_server_destroy(server);
+            return TFTP_ERROR;
+        }
+    }
+
+    // Without inotify, open files are checked with fstatat on every hit instead
+    if (server->files.inotify_fd >= 0) {
+        server->files_source.kind = TFTP_SOURCE_FILES;
+        event.events = EPOLLIN;
+        event.data.ptr = &server->files_source;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->files.inotify_fd, &event) != 0) {
+            tftp_server_destroy(server);
+            return TFTP_ERROR;
+        }
+    }
+
+    // Without inotify nothing would invalidate the cache, so the server just runs without one
+    if (config->negative_cache_size > 0 &&
+        tftp_negative_init(&server->negative_cache, config->negative_cache_size) == TFTP_SUCCESS) {
+        server->negative_source.kind = TFTP_SOURCE_NEGATIVE_CACHE;
+        event.events = EPOLLIN;
+        event.data.ptr = &server->negative_source;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->negative_cache.inotify_fd, &event) != 0) {
+            tftp_negative_destroy(&server->negative_cache);
+        }
+    }
+    if (config->io_uring && tftp_uring_init(&server->uring, &server->batch) != TFTP_SUCCESS) {
+        log_message(LOG_INFO, "io_uring is not available, using pread and sendmmsg.\n");
+    } else if (config->io_uring) {
+        server->uring_source.kind = TFTP_SOURCE_URING;
+        event.events = EPOLLIN;
+        event.data.ptr = &server->uring_source;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->uring.event_fd, &event) != 0) {
+            tftp_server_destroy(server);
+            return TFTP_ERROR;
+        }
+    }
+    if (config->allow_uploads) {
+        if (tftp_writer_start(&server->writer) != TFTP_SUCCESS) {
+            tftp_server_destroy(server);
+            return TFTP_ERROR;
+        }
+        server->writer_source.kind = TFTP_SOURCE_WRITER;
+        event.events = EPOLLIN;
+        event.data.ptr = &server->writer_source;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->writer.event_fd, &event) != 0) {
+            tftp_server_destroy(server);
+            return TFTP_ERROR;
+        }
+    }
+
+    tftp_packet_error enoent = tftp_create_packet_error();
+    enoent.error_code = TFTP_ERROR_ENOENT;
+    tftp_set_error_message(&enoent, TFTP_ERROR_ENOENT_STRING);
+    server->enoent_length = tftp_write_error(server->enoent_packet, &enoent);
+    tftp_packet_error unknown_tid = tftp_create_packet_error();
+    tftp_set_error(&unknown_tid, TFTP_ERROR_UNKNOWN_TID);
+    server->unknown_tid_length = tftp_write_error(server->unknown_tid_packet, &unknown_tid);
+
+    return TFTP_SUCCESS;
+}
+
+// Counters the rest of the server keeps as plain fields are copied once per iteration, not on every change
+static void publish_metrics(tftp_server *server) {
+    tftp_metrics *metrics = &server->metrics;
+    tftp_metrics_set(&metrics->active_sessions, server->session_count);
+    tftp_metrics_set(&metrics->completed_transfers, server->completed_count);
+    tftp_metrics_set(&metrics->timeouts, server->timeouts);
+    tftp_metrics_set(&metrics->retransmitted_blocks, server->retransmitted_blocks);
+    tftp_metrics_set(&metrics->duplicate_requests, server->duplicate_requests);
+    tftp_metrics_set(&metrics->open_file_hits, server->files.hits);
+    tftp_metrics_set(&metrics->open_file_misses, server->files.misses);
+    tftp_metrics_set(&metrics->negative_hits, server->negative_cache.hits);
+}
+
+int tftp_server_poll(tftp_server *server, int timeout_ms) {
+    struct epoll_event events[TFTP_SERVER_MAX_EVENTS];
+
+    if (timeout_ms < 0 || timeout_ms > TFTP_SERVER_TICK_MS) {
+        timeout_ms = TFTP_SERVER_TICK_MS;
+    }
+    // Wake up for the earliest timer, which can be sooner than a tick
+    long until_timer = tftp_timer_next_ms(&server->timers, timeout_ms) -
+                       (tftp_server_now_ms() - server->timers.now_ms);
+    if (until_timer < timeout_ms) {
+        timeout_ms = until_timer < 0 ? 0 : (int) until_timer;
+    }
+    timeout_ms = (int) tftp_impairment_next_ms(server->config.impairment, timeout_ms);
+
+    int ready = epoll_wait(server->epoll_fd, events, TFTP_SERVER_MAX_EVENTS, timeout_ms);
+    if (ready < 0 && errno != EINTR) {
+        return TFTP_ERROR;
+    }
+
+    for (int i = 0; i < ready; i++) {
+        tftp_event_source *source = events[i].data.ptr;
+        if (source->kind == TFTP_SOURCE_LISTENER) {
+            handle_listener(server);
+        } else if (source->kind == TFTP_SOURCE_SESSION) {
+            handle_session(server, (tftp_session *) source, events[i].events);
+        } else if (source->kind == TFTP_SOURCE_NEGATIVE_CACHE) {
+            tftp_negative_handle_events(&server->negative_cache);
+        } else if (source->kind == TFTP_SOURCE_WRITER) {
+            handle_writer(server);
+        } else if (source->kind == TFTP_SOURCE_FILES) {
+            tftp_files_handle_events(&server->files);
+        } else if (source->kind == TFTP_SOURCE_DEMUX) {
+            handle_demux(server, ((tftp_demux_source *) source)->index);
+        } else if (source->kind == TFTP_SOURCE_URING) {
+            handle_uring(server);
+        }
+    }
+
+    expire_sessions(server, tftp_server_now_ms());
+
+    tftp_batch_flush(&server->batch);
+    tftp_impairment_release(server->config.impairment);
+    tftp_writer_submit(&server->writer);
+    publish_metrics(server);
+    return TFTP_SUCCESS;
+}
+
+int tftp_server_run(tftp_server *server, volatile int *running) {
+    while (*running) {
+        if (tftp_server_poll(server, TFTP_SERVER_TICK_MS) != TFTP_SUCCESS) {
+            return TFTP_ERROR;
+        }
+    }
+    return TFTP_SUCCESS;
+}
+
+void tftp_server_destroy(tftp_server *server) {
+    // Let the writer finish every queued job first, sessions can only be freed once nothing refers to them
+    if (server->writer.started) {
+        tftp_writer_stop(&server->writer);
+        handle_writer(server);
+        log_message(LOG_VERBOSE, "Wrote %li uploaded blocks in %li calls, synced %li files.\n", server->writer.writes,
+                    server->writer.write_calls, server->writer.syncs);
+    }
+    // Likewise for reads and sends that io_uring still has in flight
+    tftp_uring_wait(&server->uring);
+    while (server->sessions != NULL) {
+        release_session(server, server->sessions);
+    }
+    if (server->prefetches > 0) {
+        log_message(LOG_VERBOSE, "Asked the kernel to read ahead %li times.\n", server->prefetches);
+    }
+    if (server->timeouts > 0) {
+        log_message(LOG_VERBOSE, "Retransmitted %li blocks after %li timeouts.\n", server->retransmitted_blocks,
+                    server->timeouts);
+    }
+    if (server->sockets.reused > 0) {
+        log_message(LOG_VERBOSE, "Reused pooled session sockets %li times, created %li more.\n", server->sockets.reused,
+                    server->sockets.created);
+    }
+    tftp_sockets_destroy(&server->sockets);
+    if (server->unknown_tids > 0) {
+        log_message(LOG_VERBOSE, "Answered %li packets from unknown TIDs.\n", server->unknown_tids);
+    }
+    tftp_demux_destroy(&server->demux);
+    if (server->duplicate_requests > 0) {
+        log_message(LOG_VERBOSE, "Suppressed %li retransmitted requests.\n", server->duplicate_requests);
+    }
+    tftp_demux_table_destroy(&server->requests);
+    if (server->epoll_fd >= 0) {
+        close(server->epoll_fd);
+        server->epoll_fd = -1;
+    }
+    if (server->listen_socket >= 0) {
+        close(server->listen_socket);
+        server->listen_socket = -1;
+    }
+    tftp_stop_transmission(&server->host_transmission);
+    // Without buffers, so destroying the server again frees nothing twice
+    tftp_init_transmission(&server->host_transmission, NULL, 0);
+
+    tftp_batch *batch = &server->batch;
+    if (server->uring.ring_fd >= 0) {
+        log_message(LOG_VERBOSE, "io_uring: %li reads (%li failed) and %li sends in %li submissions.\n",
+                    server->uring.reads, server->uring.failed_reads, server->uring.sends, server->uring.submit_calls);
+    }
+    tftp_uring_destroy(&server->uring, batch);
+    if (batch->send_syscalls > 0) {
+        log_message(LOG_VERBOSE, "Sent %li packets in %li sendmmsg calls, received %li packets in %li recvmmsg calls.\n",
+                    batch->sent_packets, batch->send_syscalls, batch->received_packets, batch->recv_syscalls);
+    }
+    tftp_batch_destroy(batch);
+
+    tftp_negative_cache *negative_cache = &server->negative_cache;
+    if (negative_cache->inserts > 0) {
+        log_message(LOG_VERBOSE, "Answered %li requests for %li missing files from the negative cache, flushed %li times.\n",
+                    negative_cache->hits, negative_cache->inserts, negative_cache->flushes);
+    }
+    tftp_negative_destroy(negative_cache);
+
+    if (server->files.hits > 0) {
+        log_message(LOG_VERBOSE, "Opened %li files from the open file cache, %li by name, invalidated %li.\n",
+                    server->files.hits, server->files.misses, server->files.invalidations);
+    }
+    tftp_files_destroy(&server->files);
+    tftp_pool_destroy(&server->pool);
+}
+
+static void send_error(tftp_server *server, tftp_transmission *transmission, tftp_packet_error *error,
+                       int from_original_socket) {
+    tftp_send_error(transmission, error, from_original_socket);
+    tftp_metrics_count_error(&server->metrics, error->error_code);
+    log_message(LOG_TRACE, "Sent error code %d, \"%.*s\"\n", error->error_code, error->error_message_length,
+                error->message);
+}
+
+static void handle_listener(tftp_server *server) {
+    tftp_batch *batch = &server->batch;
+
+    // Drain every pending request, a full batch means more may be waiting
+    int received = TFTP_BATCH_SIZE;
+    while (received == TFTP_BATCH_SIZE) {
+        received = tftp_batch_receive(batch, server->listen_socket);
+        for (int i = 0; i < received; i++) {
+            handle_request(server, batch->rx_buffers[i], batch->rx_messages[i].msg_len, &batch->rx_addresses[i],
+                           batch->rx_messages[i].msg_hdr.msg_namelen);
+        }
+    }
+}
+
+// Sessions, their transmit buffer and the client address come from the pool, so steady traffic does not allocate
+static tftp_session *create_session(tftp_server *server, const tftp_packet_request *request,
+                                    const struct sockaddr_in *client, socklen_t client_size) {
+    // OACKs and errors are built in the transmit buffer, so never make it smaller than a default block
+    int tx_size = 4 + (request->block_size < 512 ? 512 : request->block_size);
+    tftp_session *session = tftp_pool_get(&server->pool, sizeof(tftp_session));
+    uint8_t *tx_buffer = session != NULL ? tftp_pool_get(&server->pool, tx_size) : NULL;
+    if (tx_buffer == NULL) {
+        if (session != NULL) {
+            tftp_pool_put(&server->pool, session, sizeof(tftp_session));
+        }
+        return NULL;
+    }
+
+    memset(session, 0, sizeof(tftp_session));
+    session->source.kind = TFTP_SOURCE_SESSION;
+    session->started_us = now_us();
+    session->block_size = request->block_size;
+    tftp_timer_init(&session->timer, session);
+    tftp_demux_init_entry(&session->demux_entry, session);
+    tftp_demux_init_entry(&session->request_entry, session);
+
+    tftp_transmission *transmission = &session->transmission;
+    tftp_init_transmission(transmission, tx_buffer, tx_size);
+    transmission->request = *request;
+    memcpy(session->filename, request->filename, request->filename_length + 1);
+    transmission->request.filename = session->filename;
+    transmission->request.mode = NULL;
+    transmission->original_socket = server->listen_socket;
+    transmission->impairment = server->config.impairment;
+    session->client_address = *client;
+    transmission->client_addr = (struct sockaddr *) &session->client_address;
+    transmission->client_addr_size = client_size;
+    return session;
+}
+
+// Gives everything back to the pool, for sessions that never made it into the session list or were released
+static void free_session(tftp_server *server, tftp_session *session) {
+    tftp_transmission *transmission = &session->transmission;
+    // A shared socket stays open for the other sessions, and so does whatever an impairment holds for it
+    if (session->demux_entry.socket_index >= 0) {
+        tftp_demux_remove(&server->demux.table, &session->demux_entry);
+        transmission->socket = -1;
+    }
+    tftp_demux_remove(&server->requests, &session->request_entry);
+    // A socket set up for MSG_ZEROCOPY would carry its completion counter into the next transfer
+    if (transmission->socket >= 0 && session->pooled_socket && transmission->send_flags == 0) {
+        // Unlike closing it, putting it back does not take the socket out of the epoll set
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, transmission->socket, NULL);
+        tftp_impairment_forget(transmission->impairment, transmission->socket);
+        tftp_sockets_put(&server->sockets, transmission->socket);
+        transmission->socket = -1;
+    }
+    tftp_stop_transmission(transmission);
+    tftp_pool_put(&server->pool, transmission->tx_buffer, transmission->tx_size);
+    if (session->multicast != NULL) {
+        while (session->multicast->members != NULL) {
+            tftp_multicast_member *member = session->multicast->members;
+            session->multicast->members = member->next;
+            tftp_pool_put(&server->pool, member, sizeof(tftp_multicast_member));
+        }
+        tftp_pool_put(&server->pool, session->multicast, sizeof(tftp_multicast));
+    }
+    tftp_pool_put(&server->pool, session, sizeof(tftp_session));
+}
+
+// One line per transfer once it ended, like an HTTP access log
+static void log_transfer(const tftp_session *session, const char *outcome) {
+    if (!log_enabled(LOG_INFO)) {
+        return;
+    }
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &session->client_address.sin_addr, address, sizeof(address));
+    long bytes = session->acked_block * session->block_size;
+    if (session->completed || bytes > session->file_size) {
+        bytes = session->file_size;
+    }
+    log_message(LOG_INFO, "%s:%d %s %s %s, %li bytes in %li ms, %li blocks retransmitted\n", address,
+                ntohs(session->client_address.sin_port), session->upload ? "WRQ" : "RRQ",
+                session->transmission.request.filename, outcome, bytes, (now_us() - session->started_us) / 1000,
+                session->retransmitted_blocks);
+}
+
+// A client that heard nothing back sends its request again, from the same TID. Answering it with a second transfer
+// would double the load just when the server is slow, so the transfer that is already running answers it instead.
+// Returns whether the request was such a retransmission.
+static int handle_duplicate_request(tftp_server *server, const tftp_packet_request *request,
+                                    const struct sockaddr_in *client) {
+    tftp_session *session = tftp_demux_find(&server->requests, 0, client);
+    if (session == NULL || session->transmission.request.opcode != request->opcode ||
+        strcmp(session->filename, request->filename) != 0) {
+        return 0;
+    }
+    server->duplicate_requests++;
+    log_message(LOG_VERBOSE, "Request for %s from %s:%d is a retransmission.\n", request->filename,
+                inet_ntoa(client->sin_addr), ntohs(client->sin_port));
+    // Once the client acknowledged anything it did get an answer, and the request was just late
+    int waiting = session->acked_block == 0 &&
+                  (session->state == TFTP_SESSION_OACK_SENT || session->state == TFTP_SESSION_RECEIVING ||
+                   (session->state == TFTP_SESSION_DATA_SENT &&
+                    !tftp_request_has_options(&session->transmission.request)));
+    if (waiting) {
+        // Whatever was being timed may now be acknowledged twice
+        session->timed_block = -1;
+        if (retransmit(server, session) != TFTP_SUCCESS) {
+            end_session(server, session);
+        }
+    }
+    return 1;
+}
+
+static void handle_request(tftp_server *server, const uint8_t *packet, int length, struct sockaddr_in *client_address,
+                           socklen_t client_size) {
+    struct sockaddr_in client = *client_address;
+
+    tftp_packet_request request_packet = {};
+    int result = tftp_parse_packet_request(&request_packet, packet, length);
+    if (result != TFTP_SUCCESS) {
+        return;
+    }
+
+    log_message(LOG_VERBOSE, "Received request from %s:%d, opcode: %d, filename: %s, mode: %s\n",
+                inet_ntoa(client.sin_addr),
+                ntohs(client.sin_port), request_packet.opcode, request_packet.filename,
+                request_packet.mode);
+    if (tftp_request_has_options(&request_packet)) {
+        log_message(LOG_DEBUG, "Options:\n");
+        if (request_packet.has_block_size) {
+            log_message(LOG_DEBUG, "\tBlock size: %d\n", request_packet.block_size);
+        }
+        if (request_packet.has_window_size) {
+            log_message(LOG_DEBUG, "\tWindow size: %d\n", request_packet.window_size);
+        }
+        if (request_packet.has_timeout) {
+            log_message(LOG_DEBUG, "\tTimeout: %d\n", request_packet.timeout);
+        }
+        if (request_packet.has_transfer_size) {
+            log_message(LOG_DEBUG, "\tTransfer size: %li\n", request_packet.transfer_size);
+        }
+    }
+
+    if (request_packet.opcode == TFTP_OPCODE_READ_REQUEST) {
+        tftp_metrics_add(&server->metrics.read_requests, 1);
+    } else if (request_packet.opcode == TFTP_OPCODE_WRITE_REQUEST) {
+        tftp_metrics_add(&server->metrics.write_requests, 1);
+    }
+
+    if (handle_duplicate_request(server, &request_packet, &client)) {
+        return;
+    }
+
+    tftp_transmission *host_transmission = &server->host_transmission;
+    host_transmission->client_addr = (struct sockaddr *) &client;
+    host_transmission->client_addr_size = client_size;
+
+    if (strstr(request_packet.filename, "../") != NULL || strstr(request_packet.filename, "/../") != NULL ||
+        strstr(request_packet.filename, "/..") != NULL || strstr(request_packet.filename, "~/") != NULL) {
+        tftp_packet_error error = tftp_create_packet_error();
+        tftp_set_error(&error, TFTP_ERROR_UNDEF);
+        tftp_set_error_message(&error, "Filename must not contain relative operators.");
+        send_error(server, host_transmission, &error, 1);
+    } else if (request_packet.opcode == TFTP_OPCODE_READ_REQUEST &&
+               tftp_negative_contains(&server->negative_cache, request_packet.filename)) {
+        log_message(LOG_VERBOSE, "File %s is known to be missing.\n", request_packet.filename);
+        tftp_impaired_sendto(server->config.impairment, server->listen_socket, server->enoent_packet,
+                             server->enoent_length, 0, (struct sockaddr *) &client, client_size);
+        tftp_metrics_count_error(&server->metrics, TFTP_ERROR_ENOENT);
+    } else if (request_packet.opcode == TFTP_OPCODE_READ_REQUEST ||
+               (request_packet.opcode == TFTP_OPCODE_WRITE_REQUEST && server->config.allow_uploads)) {
+        tftp_session *session = create_session(server, &request_packet, &client, client_size);
+        if (session == NULL) {
+            tftp_packet_error error = tftp_create_packet_error();
+            tftp_set_error_message(&error, "Out of memory.");
+            send_error(server, host_transmission, &error, 1);
+        } else if (request_packet.opcode == TFTP_OPCODE_READ_REQUEST) {
+            handle_read_request(server, session);
+        } else {
+            handle_write_request(server, session);
+        }
+    } else if (request_packet.opcode == TFTP_OPCODE_WRITE_REQUEST) {
+        tftp_packet_error error = tftp_create_packet_error();
+        tftp_set_error(&error, TFTP_ERROR_ACCESS_VIOLATION);
+        tftp_set_error_message(&error, "Uploads are not allowed.");
+        send_error(server, host_transmission, &error, 1);
+    } else {
+        tftp_packet_error error = tftp_create_packet_error();
+        tftp_set_error(&error, TFTP_ERROR_ILLEGAL_OP);
+        send_error(server, host_transmission, &error, 1);
+    }
+
+    host_transmission->client_addr = NULL;
+    host_transmission->client_addr_size = 0;
+}
+
+static void init_timeouts(tftp_session *session, const tftp_packet_request *request) {
+    if (request->has_timeout) {
+        session->timeout_ms = request->timeout * 1000L;
+        session->max_rto_ms = session->timeout_ms;
+    } else {
+        session->timeout_ms = TFTP_SESSION_DEFAULT_TIMEOUT_MS;
+        session->max_rto_ms = TFTP_SESSION_DEFAULT_MAX_RTO_MS;
+    }
+    // Until the first round trip was measured
+    session->rto_ms = session->timeout_ms < session->max_rto_ms ? session->timeout_ms : session->max_rto_ms;
+    session->timed_block = -1;
+}
+
+static void set_timer(tftp_server *server, tftp_session *session, long delay_ms) {
+    tftp_timer_arm(&server->timers, &session->timer, tftp_server_now_ms() + delay_ms);
+}
+
+static void arm_timer(tftp_server *server, tftp_session *session) {
+    set_timer(server, session, session->rto_ms);
+}
+
+static void start_rtt_sample(tftp_session *session, long block) {
+    if (session->timed_block < 0) {
+        session->timed_block = block;
+        session->timed_since_us = now_us();
+    }
+}
+
+// RFC 6298 section 2, with a clock granularity of one millisecond
+static void take_rtt_sample(tftp_session *session) {
+    long rtt = now_us() - session->timed_since_us;
+    session->timed_block = -1;
+    if (session->rtt_samples == 0) {
+        session->srtt_us = rtt;
+        session->rttvar_us = rtt / 2;
+    } else {
+        long error = session->srtt_us > rtt ? session->srtt_us - rtt : rtt - session->srtt_us;
+        session->rttvar_us += (error - session->rttvar_us) / 4;
+        session->srtt_us += (rtt - session->srtt_us) / 8;
+    }
+    session->rtt_samples++;
+
+    long variation = 4 * session->rttvar_us < 1000 ? 1000 : 4 * session->rttvar_us;
+    long rto_ms = (session->srtt_us + variation + 999) / 1000;
+    if (rto_ms < TFTP_SESSION_MIN_RTO_MS) {
+        rto_ms = TFTP_SESSION_MIN_RTO_MS;
+    }
+    session->rto_ms = rto_ms < session->max_rto_ms ? rto_ms : session->max_rto_ms;
+}
+
+// Queue a block for sending, either straight from the mapping or read from the file into the batch
+static int send_block(tftp_server *server, tftp_session *session, long block) {
+    tftp_transmission *transmission = &session->transmission;
+    tftp_packet_data data = tftp_create_packet_data();
+    data.buffer_length = session->block_size;
+
+    off_t offset = (off_t) (block - 1) * data.buffer_length;
+    int read_bytes;
+    if (session->mapping != NULL) {
+        long left = session->file_size - offset;
+        read_bytes = left < 0 ? 0 : left < data.buffer_length ? (int) left : data.buffer_length;
+        data.buffer = session->mapping + offset;
+    } else if (server->batch.engine_flush != NULL) {
+        // The engine reads the block when the batch is flushed, the size is what the file had when the transfer started
+        data.buffer = tftp_batch_reserve(&server->batch, data.buffer_length);
+        if (data.buffer == NULL) {
+            return TFTP_ERROR;
+        }
+        long left = session->file_size - offset;
+        data.block_num = (uint16_t) block;
+        data.data_size = left < 0 ? 0 : left < data.buffer_length ? (int) left : data.buffer_length;
+        tftp_batch_queue_read(&server->batch, transmission, &data, transmission->file_descriptor, offset);
+        tftp_metrics_add(&server->metrics.blocks_sent, 1);
+        tftp_metrics_add(&server->metrics.bytes_sent, data.data_size);
+        log_message(LOG_TRACE, "Queued data block %d, size %d\n", data.block_num, data.data_size);
+        return TFTP_SUCCESS;
+    } else {
+        data.buffer = tftp_batch_reserve(&server->batch, data.buffer_length);
+        if (data.buffer == NULL) {
+            return TFTP_ERROR;
+        }
+        read_bytes = pread(transmission->file_descriptor, data.buffer, data.buffer_length, offset);
+        if (read_bytes < 0) {
+            return TFTP_ERROR;
+        }
+    }
+    if (read_bytes < data.buffer_length && block < session->block_count) {
+        // The file shrunk since the transfer started, this short block ends it
+        session->block_count = block;
+    }
+
+    data.block_num = (uint16_t) block;
+    data.data_size = read_bytes;
+    tftp_batch_queue_data(&server->batch, transmission, &data);
+    tftp_metrics_add(&server->metrics.blocks_sent, 1);
+    tftp_metrics_add(&server->metrics.bytes_sent, read_bytes);
+    log_message(LOG_TRACE, "Sent data block %d, size %d\n", data.block_num, read_bytes);
+    return TFTP_SUCCESS;
+}
+
+// Has the kernel read the part of the file the client asks for next in the background, so a block of a cold file is
+// not read from disk only when it is due. How far ahead follows the rate the client acknowledges at, a window every
+// round trip: a slow client only needs the next few windows, a fast one gets up to max_prefetch.
+static void prefetch(tftp_server *server, tftp_session *session) {
+    if (server->config.max_prefetch <= 0 || session->prefetched_until >= session->file_size) {
+        return;
+    }
+    long window_bytes = (long) session->window_size * session->block_size;
+    long depth = 2 * window_bytes;
+    if (session->srtt_us > 0 && window_bytes * TFTP_SESSION_PREFETCH_HORIZON_US / session->srtt_us > depth) {
+        depth = window_bytes * TFTP_SESSION_PREFETCH_HORIZON_US / session->srtt_us;
+    }
+    if (depth < TFTP_SESSION_MIN_PREFETCH) {
+        depth = TFTP_SESSION_MIN_PREFETCH;
+    }
+    if (depth > server->config.max_prefetch) {
+        depth = server->config.max_prefetch;
+    }
+
+    // Hinted again once half of what was read ahead got sent, not for every window
+    long sent_until = session->sent_block * session->block_size;
+    if (session->prefetched_until - sent_until >= depth / 2) {
+        return;
+    }
+    long start = session->prefetched_until > sent_until ? session->prefetched_until : sent_until;
+    long end = sent_until + depth < session->file_size ? sent_until + depth : session->file_size;
+    if (session->mapping != NULL) {
+        long page_start = start & ~(sysconf(_SC_PAGESIZE) - 1);
+        madvise(session->mapping + page_start, end - page_start, MADV_WILLNEED);
+    } else {
+        posix_fadvise(session->transmission.file_descriptor, start, end - start, POSIX_FADV_WILLNEED);
+    }
+    session->prefetched_until = end;
+    server->prefetches++;
+}
+
+// A file that is mapped can be truncated while it is served. Sends from the part that is gone fail with EFAULT and
+// would only time out, so the size is checked before every window, and the transfer ends at the new end of the file.
+static void notice_shrink(tftp_session *session) {
+    struct stat stats;
+    if (session->mapping == NULL || session->cache_entry != NULL ||
+        fstat(session->transmission.file_descriptor, &stats) != 0 || stats.st_size >= session->file_size) {
+        return;
+    }
+    log_message(LOG_VERBOSE, "%s shrunk from %ld to %ld bytes while it was sent.\n",
+                session->transmission.request.filename, session->file_size, (long) stats.st_size);
+    session->file_size = stats.st_size;
+    // The block after the new end is short and ends the transfer. Blocks are never taken back from the client, if it
+    // already has everything up to there, the next one it gets is empty.
+    long block_count = session->file_size / session->block_size + 1;
+    session->block_count = block_count > session->acked_block ? block_count : session->acked_block + 1;
+    // The last block may have gone out full before the file shrunk, it is sent again
+    if (session->sent_block >= session->block_count) {
+        session->sent_block = session->block_count - 1;
+    }
+}
+
+// Send blocks until window_size blocks are in flight or the last block was sent
+static int fill_window(tftp_server *server, tftp_session *session) {
+    long window_end = session->acked_block + session->window_size;
+    if (session->sent_block >= window_end || session->sent_block >= session->block_count) {
+        return TFTP_SUCCESS;
+    }
+    notice_shrink(session);
+    prefetch(server, session);
+    while (session->sent_block < window_end && session->sent_block < session->block_count) {
+        long block = session->sent_block + 1;
+        if (block <= session->highest_sent_block) {
+            // An acknowledgement of a block that is sent again can't be told apart from the first one
+            session->retransmitted_blocks++;
+            server->retransmitted_blocks++;
+            if (block == session->timed_block) {
+                session->timed_block = -1;
+            }
+        } else {
+            if (block == 1) {
+                tftp_metrics_observe(&server->metrics.first_block_time, now_us() - session->started_us);
+            }
+            session->highest_sent_block = block;
+            start_rtt_sample(session, block);
+        }
+        if (send_block(server, session, block) != TFTP_SUCCESS) {
+            return TFTP_ERROR;
+        }
+        session->sent_block++;
+    }
+    session->state = TFTP_SESSION_DATA_SENT;
+    arm_timer(server, session);
+    return TFTP_SUCCESS;
+}
+
+static int retransmit(tftp_server *server, tftp_session *session) {
+    if (session->upload) {
+        // The last ACK or OACK is still in the transmit buffer
+        tftp_retransmit(&session->transmission);
+        arm_timer(server, session);
+        return TFTP_SUCCESS;
+    }
+    if (session->state == TFTP_SESSION_OACK_SENT) {
+        if (session->multicast != NULL) {
+            send_member_oack(session, session->multicast->members, 1);
+        } else {
+            tftp_retransmit(&session->transmission);
+        }
+        arm_timer(server, session);
+        return TFTP_SUCCESS;
+    }
+    // Go back N: everything after the last acknowledged block is sent again
+    session->sent_block = session->acked_block;
+    return fill_window(server, session);
+}
+
+static void release_contents(tftp_server *server, tftp_session *session) {
+    if (session->cache_entry != NULL) {
+        tftp_cache_release(server->config.cache, session->cache_entry);
+    } else if (session->mapping != NULL) {
+        munmap(session->mapping, session->mapping_size);
+    }
+    session->cache_entry = NULL;
+    session->mapping = NULL;
+}
+
+static tftp_packet_optionack create_optionack(const tftp_session *session, const tftp_packet_request *request,
+                                              long file_size) {
+    tftp_packet_optionack optionack = tftp_create_packet_oack();
+    optionack.has_block_size = request->has_block_size;
+    optionack.block_size = request->block_size;
+    optionack.has_timeout = request->has_timeout;
+    optionack.timeout = request->timeout;
+    optionack.has_window_size = request->has_window_size;
+    optionack.window_size = session->window_size;
+    optionack.has_transfer_size = request->has_transfer_size;
+    optionack.transfer_size = file_size;
+    if (session->multicast != NULL) {
+        const struct sockaddr_in *group = (const struct sockaddr_in *) session->transmission.client_addr;
+        optionack.has_multicast = 1;
+        optionack.multicast_address = group->sin_addr;
+        optionack.multicast_port = session->multicast->port;
+    }
+    return optionack;
+}
+
+static void send_oack(tftp_transmission *transmission, const tftp_packet_optionack *optionack) {
+    tftp_send_oack(transmission, *optionack);
+    log_message(LOG_TRACE, "Sent oack:\n");
+    if (optionack->has_block_size) {
+        log_message(LOG_TRACE, "\tBlock size: %d\n", optionack->block_size);
+    }
+    if (optionack->has_window_size) {
+        log_message(LOG_TRACE, "\tWindow size: %d\n", optionack->window_size);
+    }
+    if (optionack->has_timeout) {
+        log_message(LOG_TRACE, "\tTimeout: %d\n", optionack->timeout);
+    }
+    if (optionack->has_transfer_size) {
+        log_message(LOG_TRACE, "\tTransfer size: %li\n", optionack->transfer_size);
+    }
+    if (optionack->has_multicast) {
+        log_message(LOG_TRACE, "\tMulticast: %s:%d, master client: %d\n", inet_ntoa(optionack->multicast_address),
+                    optionack->multicast_port, optionack->master_client);
+    }
+}
+
+// The OACK goes to the member itself, DATA for the whole group goes to the group address
+static void send_member_oack(tftp_session *session, tftp_multicast_member *member, int master_client) {
+    tftp_transmission *transmission = &session->transmission;
+    struct sockaddr *group_address = transmission->client_addr;
+    member->optionack.master_client = master_client;
+    transmission->client_addr = (struct sockaddr *) &member->address;
+    send_oack(transmission, &member->optionack);
+    transmission->client_addr = group_address;
+}
+
+static tftp_multicast_member *find_member(tftp_multicast *multicast, const struct sockaddr_in *address) {
+    tftp_multicast_member *member = multicast->members;
+    while (member != NULL && (member->address.sin_addr.s_addr != address->sin_addr.s_addr ||
+                              member->address.sin_port != address->sin_port)) {
+        member = member->next;
+    }
+    return member;
+}
+
+static tftp_session *find_multicast_group(tftp_server *server, const tftp_packet_request *request,
+                                          uint16_t window_size, const struct stat *stats) {
+    for (tftp_session *session = server->sessions; session != NULL; session = session->next) {
+        tftp_multicast *multicast = session->multicast;
+        if (multicast != NULL && session_is_active(session) && multicast->device == stats->st_dev &&
+            multicast->inode == stats->st_ino && multicast->modified.tv_sec == stats->st_mtim.tv_sec &&
+            multicast->modified.tv_nsec == stats->st_mtim.tv_nsec &&
+            session->transmission.request.block_size == request->block_size && session->window_size == window_size) {
+            return session;
+        }
+    }
+    return NULL;
+}
+
+static void join_multicast_group(tftp_server *server, tftp_session *session, const struct sockaddr_in *address,
+                                 const tftp_packet_optionack *optionack) {
+    tftp_multicast *multicast = session->multicast;
+    // A repeated request only means our OACK got lost
+    tftp_multicast_member *member = find_member(multicast, address);
+    if (member == NULL) {
+        member = tftp_pool_get(&server->pool, sizeof(tftp_multicast_member));
+        if (member == NULL) {
+            return;
+        }
+        memset(member, 0, sizeof(tftp_multicast_member));
+        member->address = *address;
+        member->optionack = *optionack;
+        if (multicast->last_member != NULL) {
+            multicast->last_member->next = member;
+        } else {
+            multicast->members = member;
+        }
+        multicast->last_member = member;
+        log_message(LOG_VERBOSE, "%s:%d joined the multicast group on port %d.\n", inet_ntoa(address->sin_addr),
+                    ntohs(address->sin_port), multicast->port);
+    }
+    send_member_oack(session, member, member == multicast->members);
+}
+
+// The master client finished or went away, the next client in line takes over and reports which blocks it misses
+static void replace_master(tftp_server *server, tftp_session *session) {
+    tftp_multicast *multicast = session->multicast;
+    tftp_multicast_member *master = multicast->members;
+    multicast->members = master->next;
+    if (multicast->members == NULL) {
+        multicast->last_member = NULL;
+    }
+    tftp_pool_put(&server->pool, master, sizeof(tftp_multicast_member));
+
+    if (multicast->members == NULL) {
+        session->state = TFTP_SESSION_DONE;
+        return;
+    }
+    session->state = TFTP_SESSION_OACK_SENT;
+    session->retransmissions = 0;
+    session->timed_block = -1;
+    send_member_oack(session, multicast->members, 1);
+    arm_timer(server, session);
+}
+
+static void leave_multicast_group(tftp_server *server, tftp_session *session, const struct sockaddr_in *address) {
+    tftp_multicast *multicast = session->multicast;
+    tftp_multicast_member *member = find_member(multicast, address);
+    if (member == NULL) {
+        return;
+    }
+    if (member == multicast->members) {
+        replace_master(server, session);
+        return;
+    }
+    tftp_multicast_member *previous = multicast->members;
+    while (previous->next != member) {
+        previous = previous->next;
+    }
+    previous->next = member->next;
+    if (multicast->last_member == member) {
+        multicast->last_member = previous;
+    }
+    tftp_pool_put(&server->pool, member, sizeof(tftp_multicast_member));
+}
+
+// Turn a fresh session into an RFC 2090 group, its DATA is sent to the group address instead of the client
+static int create_multicast_group(tftp_server *server, tftp_session *session, const struct stat *stats) {
+    tftp_transmission *transmission = &session->transmission;
+
+    uint16_t port = 0;
+    for (int i = 0; i < TFTP_MULTICAST_PORTS && port == 0; i++) {
+        uint16_t candidate = server->config.multicast_port + server->next_multicast_port;
+        server->next_multicast_port = (server->next_multicast_port + 1) % TFTP_MULTICAST_PORTS;
+        port = candidate;
+        for (tftp_session *other = server->sessions; other != NULL; other = other->next) {
+            if (other->multicast != NULL && other->multicast->port == candidate) {
+                port = 0;
+                break;
+            }
+        }
+    }
+    if (port == 0) {
+        return TFTP_ERROR;
+    }
+
+    if (server->address.sin_addr.s_addr != htonl(INADDR_ANY) &&
+        setsockopt(transmission->socket, IPPROTO_IP, IP_MULTICAST_IF, &server->address.sin_addr,
+                   sizeof(struct in_addr)) != 0) {
+        return TFTP_ERROR;
+    }
+    int ttl = TFTP_MULTICAST_TTL;
+    if (setsockopt(transmission->socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0) {
+        return TFTP_ERROR;
+    }
+
+    tftp_multicast *multicast = tftp_pool_get(&server->pool, sizeof(tftp_multicast));
+    if (multicast == NULL) {
+        return TFTP_ERROR;
+    }
+    memset(multicast, 0, sizeof(tftp_multicast));
+    multicast->device = stats->st_dev;
+    multicast->inode = stats->st_ino;
+    multicast->modified = stats->st_mtim;
+    multicast->port = port;
+    session->multicast = multicast;
+
+    struct sockaddr_in *group = (struct sockaddr_in *) transmission->client_addr;
+    group->sin_family = AF_INET;
+    group->sin_addr = server->config.multicast_address;
+    group->sin_port = htons(port);
+    return TFTP_SUCCESS;
+}
+
+// Give the transmission a socket of its own, the client talks to it for the rest of the transfer
+// Connected to the client, the kernel then drops packets from any other TID and sends skip the address.
+// Multicast groups hear from every member, and replayed packets of an impairment come from elsewhere as well.
+// In demultiplexed mode, downloads share a socket instead. Uploads are received straight into write jobs of their
+// block size, which only works on a socket of their own.
+static int open_session_socket(tftp_server *server, tftp_session *session) {
+    tftp_transmission *transmission = &session->transmission;
+    if (server->demux.socket_count > 0 && !transmission->request.has_multicast &&
+        transmission->request.opcode == TFTP_OPCODE_READ_REQUEST) {
+        int socket_index = tftp_demux_next_socket(&server->demux);
+        transmission->socket = server->demux.sockets[socket_index];
+        transmission->connected = 0;
+        tftp_demux_insert(&server->demux.table, &session->demux_entry, socket_index, &session->client_address);
+        return TFTP_SUCCESS;
+    }
+    int connected = !transmission->request.has_multicast && server->config.impairment == NULL;
+    int session_socket = tftp_sockets_get(&server->sockets, connected ? transmission->client_addr : NULL,
+                                          connected ? transmission->client_addr_size : 0);
+    if (session_socket < 0) {
+        log_message(LOG_VERBOSE, "Could not create return socket. Terminating transmission.\n");
+        tftp_packet_error error = tftp_create_packet_error();
+        tftp_set_error_message(&error, "Could not create new socket.");
+        send_error(server, transmission, &error, 1);
+        return TFTP_ERROR;
+    }
+    log_message(LOG_DEBUG, "Opened %s socket for transmission.\n", connected ? "connected" : "unconnected");
+    transmission->socket = session_socket;
+    transmission->connected = connected;
+    // Multicast options stay with the socket, so it is closed instead of reused
+    session->pooled_socket = !transmission->request.has_multicast;
+    return TFTP_SUCCESS;
+}
+
+static int add_session(tftp_server *server, tftp_session *session) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &session->source;
+    // Packets on a shared socket are handed to the session by the demultiplexer
+    if (session->demux_entry.socket_index < 0 &&
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, session->transmission.socket, &event) != 0) {
+        log_message(LOG_VERBOSE, "Could not register transmission socket. Terminating transmission.\n");
+        return TFTP_ERROR;
+    }
+
+    tftp_demux_insert(&server->requests, &session->request_entry, 0, &session->client_address);
+    session->next = server->sessions;
+    if (server->sessions != NULL) {
+        server->sessions->prev = session;
+    }
+    server->sessions = session;
+    server->session_count++;
+    return TFTP_SUCCESS;
+}
+
+static void handle_read_request(tftp_server *server, tftp_session *session) {
+    tftp_transmission *transmission = &session->transmission;
+    tftp_packet_request *request = &transmission->request;
+    long open_started_us = now_us();
+    int file_descriptor = tftp_files_open_read(&server->files, request->filename);
+    tftp_metrics_observe(&server->metrics.open_time, now_us() - open_started_us);
+    if (file_descriptor < 0) {
+        tftp_packet_error error = tftp_create_packet_error();
+        if (errno == ENOENT) {
+            log_message(LOG_VERBOSE, "Could not find file %s\n", request->filename);
+            tftp_negative_insert(&server->negative_cache, server->config.root_path, request->filename);
+            error.error_code = TFTP_ERROR_ENOENT;
+            tftp_set_error_message(&error, TFTP_ERROR_ENOENT_STRING);
+        } else if (errno == EACCES || errno == EXDEV || errno == ELOOP) {
+            // EXDEV and ELOOP: the name led outside the root directory
+            log_message(LOG_VERBOSE, "Permission denied for file %s\n", request->filename);
+            error.error_code = TFTP_ERROR_ACCESS_VIOLATION;
+            tftp_set_error_message(&error, TFTP_ERROR_ACCESS_VIOLATION_STRING);
+        }
+        send_error(server, transmission, &error, 1);
+        log_transfer(session, "refused");
+        free_session(server, session);
+        return;
+    }
+    transmission->file_descriptor = file_descriptor;
+
+    struct stat stats;
+    fstat(file_descriptor, &stats);
+
+    long block_count = stats.st_size / request->block_size + 1;
+    if (request->has_window_size && request->window_size > server->config.max_window_size) {
+        request->window_size = server->config.max_window_size;
+    }
+    uint16_t window_size = request->has_window_size ? request->window_size : 1;
+
+    // Leaving the option out of the OACK makes the client fall back to a unicast transfer
+    if (request->has_multicast && (server->config.multicast_port == 0 || block_count > TFTP_MULTICAST_MAX_BLOCKS)) {
+        request->has_multicast = 0;
+    }
+    struct sockaddr_in client = session->client_address;
+    if (request->has_multicast) {
+        tftp_session *group = find_multicast_group(server, request, window_size, &stats);
+        if (group != NULL) {
+            tftp_packet_optionack optionack = create_optionack(group, request, stats.st_size);
+            join_multicast_group(server, group, &client, &optionack);
+            free_session(server, session);
+            return;
+        }
+    }
+
+    if (open_session_socket(server, session) != TFTP_SUCCESS) {
+        free_session(server, session);
+        return;
+    }
+
+    session->block_count = block_count;
+    session->file_size = stats.st_size;
+    session->window_size = window_size;
+    init_timeouts(session, request);
+    if (request->has_multicast && create_multicast_group(server, session, &stats) != TFTP_SUCCESS) {
+        log_message(LOG_VERBOSE, "Could not create a multicast group, sending %s by unicast.\n", request->filename);
+        request->has_multicast = 0;
+    }
+
+    // Concurrent transfers of the same file share one copy of its contents, under the name it was opened by
+    if (server->config.cache != NULL) {
+        session->cache_entry = tftp_cache_acquire(server->config.cache, tftp_files_relative_name(request->filename),
+                                                  file_descriptor, &stats);
+        if (session->cache_entry != NULL) {
+            session->mapping = session->cache_entry->data;
+            session->mapping_size = session->cache_entry->size;
+            // Already in memory, there is nothing to read ahead
+            session->prefetched_until = session->file_size;
+        }
+    }
+
+    // Large files are mapped once, so DATA is sent from the page cache without copying it into a buffer first.
+    // Sending from a part of the mapping the file was truncated away from fails with EFAULT, see notice_shrink.
+    if (session->mapping == NULL && server->config.mmap_threshold > 0 &&
+        stats.st_size >= server->config.mmap_threshold) {
+        void *mapping = mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, stats.st_size, MADV_SEQUENTIAL);
+            session->mapping = mapping;
+            session->mapping_size = stats.st_size;
+        }
+    }
+    // Cached contents are a copy that can't shrink, the descriptor would only count against RLIMIT_NOFILE
+    if (session->cache_entry != NULL) {
+        close(file_descriptor);
+        transmission->file_descriptor = -1;
+    }
+    // Completions on the error queue of a shared socket could not be told apart
+    if (session->mapping != NULL && server->config.zero_copy && session->demux_entry.socket_index < 0 &&
+        tftp_enable_zerocopy(transmission) != TFTP_SUCCESS) {
+        log_message(LOG_DEBUG, "MSG_ZEROCOPY is not supported, sending with copies.\n");
+    }
+
+    if (session->mapping == NULL) {
+        // Doubles the kernel's own read-ahead, on top of what prefetch asks for
+        posix_fadvise(file_descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+        tftp_uring_register(&server->uring, transmission);
+    }
+
+    if (add_session(server, session) != TFTP_SUCCESS) {
+        tftp_uring_unregister(&server->uring, transmission);
+        release_contents(server, session);
+        free_session(server, session);
+        return;
+    }
+
+    tftp_packet_optionack optionack = create_optionack(session, request, stats.st_size);
+    if (session->multicast != NULL) {
+        // The first client becomes the master client
+        join_multicast_group(server, session, &client, &optionack);
+        session->state = TFTP_SESSION_OACK_SENT;
+        arm_timer(server, session);
+    } else if (tftp_request_has_options(request)) {
+        send_oack(transmission, &optionack);
+        session->state = TFTP_SESSION_OACK_SENT;
+        start_rtt_sample(session, 0);
+        arm_timer(server, session);
+    } else if (fill_window(server, session) != TFTP_SUCCESS) {
+        end_session(server, session);
+    }
+}
+
+static void handle_write_request(tftp_server *server, tftp_session *session) {
+    tftp_transmission *transmission = &session->transmission;
+    tftp_packet_request *request = &transmission->request;
+    // Existing files are never overwritten
+    long open_started_us = now_us();
+    int file_descriptor = tftp_files_create(&server->files, request->filename, 0644);
+    tftp_metrics_observe(&server->metrics.open_time, now_us() - open_started_us);
+    if (file_descriptor < 0) {
+        log_message(LOG_VERBOSE, "Could not create file %s: %s\n", request->filename, strerror(errno));
+        tftp_packet_error error = tftp_create_packet_error();
+        if (errno == EEXIST) {
+            tftp_set_error(&error, TFTP_ERROR_FILE_EXISTS);
+        } else if (errno == ENOENT) {
+            tftp_set_error(&error, TFTP_ERROR_ENOENT);
+        } else if (errno == EACCES || errno == EXDEV || errno == ELOOP) {
+            tftp_set_error(&error, TFTP_ERROR_ACCESS_VIOLATION);
+        } else if (errno == ENOSPC || errno == EDQUOT) {
+            tftp_set_error(&error, TFTP_ERROR_DISK_FULL);
+        }
+        send_error(server, transmission, &error, 1);
+        log_transfer(session, "refused");
+        free_session(server, session);
+        return;
+    }
+    transmission->file_descriptor = file_descriptor;
+
+    // Reserve the announced size up front, a full disk is then reported before any data is sent
+    if (request->has_transfer_size && request->transfer_size > 0 &&
+        fallocate(file_descriptor, 0, 0, request->transfer_size) != 0 &&
+        (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)) {
+        log_message(LOG_VERBOSE, "Could not reserve %li bytes for %s.\n", request->transfer_size, request->filename);
+        tftp_packet_error error = tftp_create_packet_error();
+        tftp_set_error(&error, TFTP_ERROR_DISK_FULL);
+        send_error(server, transmission, &error, 1);
+        tftp_files_unlink(&server->files, request->filename);
+        log_transfer(session, "refused");
+        free_session(server, session);
+        return;
+    }
+
+    request->has_multicast = 0;
+    if (request->has_window_size && request->window_size > server->config.max_window_size) {
+        request->window_size = server->config.max_window_size;
+    }
+    if (open_session_socket(server, session) != TFTP_SUCCESS) {
+        tftp_files_unlink(&server->files, request->filename);
+        free_session(server, session);
+        return;
+    }
+
+    session->upload = 1;
+    session->window_size = request->has_window_size ? request->window_size : 1;
+    init_timeouts(session, request);
+
+    if (add_session(server, session) != TFTP_SUCCESS) {
+        tftp_files_unlink(&server->files, request->filename);
+        free_session(server, session);
+        return;
+    }
+
+    session->state = TFTP_SESSION_RECEIVING;
+    if (tftp_request_has_options(request)) {
+        tftp_packet_optionack optionack = create_optionack(session, request, request->transfer_size);
+        send_oack(transmission, &optionack);
+    } else {
+        tftp_send_ack(transmission, 0);
+    }
+    start_rtt_sample(session, 1);
+    arm_timer(server, session);
+}
+
+static void abort_upload(tftp_server *server, tftp_session *session) {
+    log_message(LOG_VERBOSE, "Upload of %s failed, removing it.\n", session->transmission.request.filename);
+    tftp_files_unlink(&server->files, session->transmission.request.filename);
+    session->state = TFTP_SESSION_DONE;
+}
+
+static void send_upload_ack(tftp_session *session) {
+    session->unacked_blocks = 0;
+    // The client answers an ACK with the next block, unless this ACK was sent before
+    if (session->timed_block >= 0) {
+        session->timed_block = -1;
+    } else {
+        start_rtt_sample(session, session->acked_block + 1);
+    }
+    tftp_send_ack(&session->transmission, (uint16_t) session->acked_block);
+    log_message(LOG_TRACE, "Sent ack %d.\n", (uint16_t) session->acked_block);
+}
+
+static void complete_upload(tftp_server *server, tftp_session *session) {
+    send_upload_ack(session);
+    log_message(LOG_VERBOSE, "Successfully received file %s in %li blocks.\n",
+                session->transmission.request.filename, session->block_count);
+    server->completed_count++;
+    session->completed = 1;
+    tftp_metrics_observe(&server->metrics.transfer_time, now_us() - session->started_us);
+    session->state = TFTP_SESSION_DALLYING;
+    set_timer(server, session, TFTP_SESSION_DALLY_TIMEOUTS * session->timeout_ms);
+}
+
+// The last block arrived, the writer truncates and closes the file once everything before it is on disk
+static void finish_upload(tftp_server *server, tftp_session *session, long file_size) {
+    tftp_transmission *transmission = &session->transmission;
+    session->block_count = session->acked_block;
+    session->file_size = file_size;
+
+    tftp_write_job *job = tftp_pool_get(&server->pool, sizeof(tftp_write_job));
+    if (job == NULL) {
+        abort_upload(server, session);
+        return;
+    }
+    job->size = sizeof(tftp_write_job);
+    job->kind = TFTP_WRITE_FINISH;
+    job->file_descriptor = transmission->file_descriptor;
+    job->offset = file_size;
+    job->sync = server->config.upload_sync == TFTP_UPLOAD_SYNC_FILE;
+    job->context = session;
+    transmission->file_descriptor = -1;
+    session->pending_writes++;
+    tftp_writer_queue(&server->writer, job);
+
+    if (job->sync) {
+        // The final ACK promises the file is stored, so it waits for the fsync
+        session->state = TFTP_SESSION_SYNCING;
+    } else {
+        complete_upload(server, session);
+    }
+}
+
+// RFC 1350: answer the source without disturbing any transfer, but never answer an error
+static void answer_unknown_tid(tftp_server *server, int socket, const uint8_t *packet, int length,
+                               const struct sockaddr_in *from) {
+    server->unknown_tids++;
+    if (length >= 2 && ((packet[0] << 8u) + packet[1]) != TFTP_OPCODE_ERROR) {
+        log_message(LOG_TRACE, "Packet from unknown TID %s:%d.\n", inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+        tftp_impaired_sendto(server->config.impairment, socket, server->unknown_tid_packet, server->unknown_tid_length,
+                             0, (struct sockaddr *) from, sizeof(*from));
+        tftp_metrics_count_error(&server->metrics, TFTP_ERROR_UNKNOWN_TID);
+    }
+}
+
+static int from_client(const tftp_session *session, const struct sockaddr_in *from) {
+    return from->sin_addr.s_addr == session->client_address.sin_addr.s_addr &&
+           from->sin_port == session->client_address.sin_port;
+}
+
+// Returns whether the job was handed to the writer, otherwise it goes back to the pool
+static int handle_upload_packet(tftp_server *server, tftp_session *session, tftp_write_job *job, int length,
+                                int *answered) {
+    tftp_transmission *transmission = &session->transmission;
+    const uint8_t *packet = job->packet;
+    if (length < 4) {
+        return 0;
+    }
+
+    uint16_t opcode = (packet[0] << 8u) + packet[1];
+    int receiving = session->state == TFTP_SESSION_RECEIVING || session->state == TFTP_SESSION_SYNCING;
+    if (opcode == TFTP_OPCODE_ERROR) {
+        log_message(LOG_VERBOSE, "Received TFTP error during upload.\n");
+        if (receiving) {
+            abort_upload(server, session);
+        }
+        return 0;
+    } else if (opcode != TFTP_OPCODE_DATA) {
+        log_message(LOG_VERBOSE, "Received invalid opcode.\n");
+        if (receiving) {
+            tftp_packet_error error = tftp_create_packet_error();
+            tftp_set_error(&error, TFTP_ERROR_ILLEGAL_OP);
+            send_error(server, transmission, &error, 0);
+            abort_upload(server, session);
+        }
+        return 0;
+    } else if (session->state == TFTP_SESSION_DALLYING) {
+        // Our final ACK got lost, the transmit buffer still holds it
+        tftp_retransmit(transmission);
+        return 0;
+    } else if (session->state != TFTP_SESSION_RECEIVING) {
+        return 0;
+    }
+
+    uint16_t block_num = (packet[2] << 8u) + packet[3];
+    if (block_num != (uint16_t) (session->acked_block + 1)) {
+        // A duplicate, or a block after a gap: the client continues after the last block we have (RFC 7440)
+        log_message(LOG_TRACE, "Received unexpected data block %d.\n", block_num);
+        if (!*answered) {
+            send_upload_ack(session);
+            *answered = 1;
+        }
+        return 0;
+    }
+
+    int data_size = length - 4;
+    long offset = session->acked_block * (long) session->block_size;
+    session->acked_block++;
+    if (session->timed_block == session->acked_block) {
+        take_rtt_sample(session);
+    }
+    session->unacked_blocks++;
+    session->retransmissions = 0;
+    log_message(LOG_TRACE, "Received data block %d, size %d\n", block_num, data_size);
+
+    int queued = 0;
+    if (data_size > 0) {
+        job->kind = TFTP_WRITE_DATA;
+        job->file_descriptor = transmission->file_descriptor;
+        job->offset = offset;
+        job->data = job->packet + 4;
+        job->length = data_size;
+        job->context = session;
+        session->pending_writes++;
+        tftp_writer_queue(&server->writer, job);
+        queued = 1;
+    }
+
+    if (data_size < session->block_size) {
+        finish_upload(server, session, offset + data_size);
+    } else {
+        // As in RFC 7440, only the last block of every window is acknowledged
+        if (session->unacked_blocks >= session->window_size) {
+            send_upload_ack(session);
+        }
+        arm_timer(server, session);
+    }
+    return queued;
+}
+
+// DATA is received straight into pooled write jobs, which are handed to the writer as they are
+static void receive_upload(tftp_server *server, tftp_session *session) {
+    tftp_transmission *transmission = &session->transmission;
+    int packet_size = 4 + session->block_size;
+    int job_size = sizeof(tftp_write_job) + packet_size;
+    // A whole window, plus one to notice that more is waiting
+    int count = session->window_size < TFTP_BATCH_SIZE ? session->window_size + 1 : TFTP_BATCH_SIZE;
+    tftp_write_job *jobs[TFTP_BATCH_SIZE];
+    uint8_t *buffers[TFTP_BATCH_SIZE];
+
+    int received = count;
+    while (received == count && session->state != TFTP_SESSION_DONE) {
+        int available = 0;
+        while (available < count && (jobs[available] = tftp_pool_get(&server->pool, job_size)) != NULL) {
+            jobs[available]->size = job_size;
+            buffers[available] = jobs[available]->packet;
+            available++;
+        }
+        if (available == 0) {
+            return;
+        }
+        received = tftp_batch_receive_into(&server->batch, transmission->socket, buffers, available, packet_size);
+
+        int answered = 0;
+        for (int i = 0; i < available; i++) {
+            if (i < received && !from_client(session, &server->batch.rx_addresses[i])) {
+                answer_unknown_tid(server, transmission->socket, jobs[i]->packet,
+                                   server->batch.rx_messages[i].msg_len, &server->batch.rx_addresses[i]);
+                tftp_pool_put(&server->pool, jobs[i], jobs[i]->size);
+                continue;
+            }
+            if (i >= received || session->state == TFTP_SESSION_DONE ||
+                !handle_upload_packet(server, session, jobs[i], server->batch.rx_messages[i].msg_len, &answered)) {
+                tftp_pool_put(&server->pool, jobs[i], jobs[i]->size);
+            }
+        }
+    }
+}
+
+static int session_is_drained(const tftp_session *session) {
+    return session->transmission.zerocopy_completed >= session->transmission.zerocopy_sent &&
+           session->pending_writes == 0 && session->transmission.uring_pending == 0;
+}
+
+static void handle_uring(tftp_server *server) {
+    tftp_uring_reap(&server->uring);
+    for (int i = 0; i < server->uring.idle_count; i++) {
+        // Only sessions queue DATA, so every transmission in the batch is the one of a session
+        tftp_session *session = (tftp_session *) ((uint8_t *) server->uring.idle[i] -
+                                                  offsetof(tftp_session, transmission));
+        if (session->state == TFTP_SESSION_DRAINING && session_is_drained(session)) {
+            end_session(server, session);
+        }
+    }
+}
+
+static void handle_writer(tftp_server *server) {
+    tftp_write_job *job = tftp_writer_take_completed(&server->writer);
+    while (job != NULL) {
+        tftp_write_job *next = job->next;
+        tftp_session *session = job->context;
+        session->pending_writes--;
+
+        if (job->result != TFTP_SUCCESS &&
+            (session->state == TFTP_SESSION_RECEIVING || session->state == TFTP_SESSION_SYNCING)) {
+            log_message(LOG_VERBOSE, "Could not write %s: %s\n", session->transmission.request.filename, strerror(job->error));
+            tftp_packet_error error = tftp_create_packet_error();
+            if (job->error == ENOSPC || job->error == EDQUOT) {
+                tftp_set_error(&error, TFTP_ERROR_DISK_FULL);
+            }
+            send_error(server, &session->transmission, &error, 0);
+            abort_upload(server, session);
+        } else if (job->kind == TFTP_WRITE_FINISH && session->state == TFTP_SESSION_SYNCING) {
+            complete_upload(server, session);
+        }
+        tftp_pool_put(&server->pool, job, job->size);
+
+        // Once its last job completed, nothing else in the list refers to the session
+        if (session->state == TFTP_SESSION_DONE ||
+            (session->state == TFTP_SESSION_DRAINING && session_is_drained(session))) {
+            end_session(server, session);
+        }
+        job = next;
+    }
+}
+
+static void complete_transfer(tftp_server *server, tftp_session *session) {
+    log_message(LOG_VERBOSE, "Successfully transferred file %s in %li blocks.\n",
+                session->transmission.request.filename, session->block_count);
+    server->completed_count++;
+    session->completed = 1;
+    tftp_metrics_observe(&server->metrics.transfer_time, now_us() - session->started_us);
+    if (session->multicast != NULL) {
+        replace_master(server, session);
+    } else {
+        session->state = TFTP_SESSION_DONE;
+    }
+}
+
+static void handle_ack(tftp_server *server, tftp_session *session, const tftp_packet_ack *ack) {
+    tftp_transmission *transmission = &session->transmission;
+
+    if (session->state == TFTP_SESSION_OACK_SENT && session->multicast != NULL) {
+        // A new master client acknowledges the last block it has, which can be anywhere in the file
+        if (ack->block_num > session->block_count) {
+            return;
+        }
+        session->acked_block = ack->block_num;
+        session->sent_block = ack->block_num;
+        session->retransmissions = 0;
+        if (session->acked_block == session->block_count) {
+            complete_transfer(server, session);
+            return;
+        }
+    } else if (session->state == TFTP_SESSION_OACK_SENT) {
+        if (ack->block_num != 0) {
+            return;
+        }
+        if (session->timed_block == 0) {
+            take_rtt_sample(session);
+        }
+    } else {
+        // Map the 16 bit block number onto the blocks that are in flight
+        long in_flight = session->sent_block - session->acked_block;
+        // A multicast master client may already have later blocks, from before it became master
+        long limit = session->multicast != NULL ? session->block_count - session->acked_block : in_flight;
+        uint16_t distance = ack->block_num - (uint16_t) session->acked_block;
+        if (distance == 0 || distance > limit) {
+            // Duplicate or stale acknowledgement, answering it would start the Sorcerer's Apprentice syndrome
+            log_message(LOG_TRACE, "Received incorrect ACK %d.\n", ack->block_num);
+            return;
+        }
+
+        log_message(LOG_TRACE, "Received ack %d.\n", ack->block_num);
+        session->acked_block += distance;
+        session->retransmissions = 0;
+        if (session->timed_block >= 0 && session->acked_block >= session->timed_block) {
+            take_rtt_sample(session);
+        }
+        if (session->acked_block == session->block_count) {
+            complete_transfer(server, session);
+            return;
+        }
+        if (distance < in_flight || session->sent_block < session->acked_block) {
+            // The client saw a gap in the window, continue right after the last block it has
+            session->sent_block = session->acked_block;
+        }
+    }
+
+    if (fill_window(server, session) != TFTP_SUCCESS) {
+        log_message(LOG_VERBOSE, "Could not read file %s.\n", transmission->request.filename);
+        tftp_packet_error error = tftp_create_packet_error();
+        send_error(server, transmission, &error, 0);
+        session->state = TFTP_SESSION_DONE;
+    }
+}
+
+static void handle_packet(tftp_server *server, tftp_session *session, const uint8_t *packet, int length,
+                          const struct sockaddr_in *from) {
+    tftp_transmission *transmission = &session->transmission;
+    tftp_packet_ack ack = tftp_create_packet_ack();
+    tftp_packet_error recv_error = tftp_create_packet_error();
+
+    // A connected socket only hears from its client, an unconnected one from anyone. Multicast members are checked
+    // against the group instead.
+    if (session->multicast == NULL && !from_client(session, from)) {
+        answer_unknown_tid(server, transmission->socket, packet, length, from);
+        return;
+    }
+
+    int receive = tftp_parse_ack(packet, length, &ack, &recv_error);
+    if (receive == TFTP_OP_ERROR) {
+        log_message(LOG_VERBOSE, "Received TFTP error. Error code %d, message \"%.*s\".\n",
+                    recv_error.error_code, recv_error.error_message_length, recv_error.message);
+        if (session->multicast != NULL) {
+            leave_multicast_group(server, session, from);
+        } else {
+            session->state = TFTP_SESSION_DONE;
+        }
+    } else if (receive == TFTP_INVALID_OPCODE && session->multicast != NULL) {
+        log_message(LOG_VERBOSE, "Received invalid opcode from a multicast client.\n");
+    } else if (receive == TFTP_INVALID_OPCODE) {
+        log_message(LOG_VERBOSE, "Received invalid opcode.\n");
+        tftp_packet_error error = tftp_create_packet_error();
+        tftp_set_error(&error, TFTP_ERROR_ILLEGAL_OP);
+        send_error(server, transmission, &error, 0);
+        session->state = TFTP_SESSION_DONE;
+    } else if (receive == TFTP_SUCCESS) {
+        // Only the master client drives a multicast transfer, everyone else just listens
+        if (session->multicast == NULL || find_member(session->multicast, from) == session->multicast->members) {
+            handle_ack(server, session, &ack);
+        }
+    }
+}
+
+static int session_is_active(const tftp_session *session) {
+    return session->state == TFTP_SESSION_OACK_SENT || session->state == TFTP_SESSION_DATA_SENT;
+}
+
+static void handle_session(tftp_server *server, tftp_session *session, uint32_t events) {
+    tftp_batch *batch = &server->batch;
+    tftp_transmission *transmission = &session->transmission;
+
+    if (events & EPOLLERR) {
+        tftp_receive_zerocopy_completions(transmission);
+    }
+
+    int received = TFTP_BATCH_SIZE;
+    if (session->upload) {
+        receive_upload(server, session);
+        received = 0;
+    }
+    while (received == TFTP_BATCH_SIZE && session->state != TFTP_SESSION_DONE) {
+        received = tftp_batch_receive(batch, transmission->socket);
+        // Anything arriving while draining is read only to keep the socket from staying readable
+        for (int i = 0; i < received && session_is_active(session); i++) {
+            handle_packet(server, session, batch->rx_buffers[i], batch->rx_messages[i].msg_len,
+                          &batch->rx_addresses[i]);
+        }
+    }
+
+    if (session->state == TFTP_SESSION_DONE ||
+        (session->state == TFTP_SESSION_DRAINING && session_is_drained(session))) {
+        end_session(server, session);
+    }
+}
+
+// The session is looked up for every packet, as handling one can end a session the next packet would have belonged to
+static void handle_demux(tftp_server *server, int socket_index) {
+    tftp_batch *batch = &server->batch;
+    int demux_socket = server->demux.sockets[socket_index];
+
+    int received = TFTP_BATCH_SIZE;
+    while (received == TFTP_BATCH_SIZE) {
+        received = tftp_batch_receive(batch, demux_socket);
+        for (int i = 0; i < received; i++) {
+            const uint8_t *packet = batch->rx_buffers[i];
+            int length = batch->rx_messages[i].msg_len;
+            struct sockaddr_in *from = &batch->rx_addresses[i];
+            tftp_session *session = tftp_demux_find(&server->demux.table, socket_index, from);
+            if (session == NULL) {
+                answer_unknown_tid(server, demux_socket, packet, length, from);
+                continue;
+            }
+            // Anything arriving while draining is dropped, like on a socket of its own
+            if (session_is_active(session)) {
+                handle_packet(server, session, packet, length, from);
+            }
+            if (session->state == TFTP_SESSION_DONE) {
+                end_session(server, session);
+            }
+        }
+    }
+}
+
+// Expired timers are collected first and handled in one pass, handling one may re-arm or cancel others
+static void expire_sessions(tftp_server *server, long now) {
+    tftp_timer_advance(&server->timers, now);
+    tftp_timer *timer;
+    while ((timer = tftp_timer_take_expired(&server->timers)) != NULL) {
+        tftp_session *session = timer->context;
+        if (session->state == TFTP_SESSION_SYNCING || (session->state == TFTP_SESSION_DRAINING &&
+                                                       (session->pending_writes > 0 ||
+                                                        session->transmission.uring_pending > 0))) {
+            // The writer or io_uring still refers to the session, however long the disk takes
+            set_timer(server, session, session->timeout_ms);
+        } else if (session->state == TFTP_SESSION_DALLYING ||
+                   (session->state == TFTP_SESSION_DRAINING && session_is_drained(session))) {
+            // Also a session whose last io_uring completion was taken by a flush, which does not end sessions
+            end_session(server, session);
+        } else if (session->state == TFTP_SESSION_DRAINING) {
+            log_message(LOG_VERBOSE, "Gave up waiting for %li zero-copy completions.\n",
+                        session->transmission.zerocopy_sent - session->transmission.zerocopy_completed);
+            release_session(server, session);
+        } else if (session->retransmissions == TFTP_SESSION_MAX_RETRANSMISSIONS && session->multicast != NULL) {
+            log_message(LOG_VERBOSE, "Master client timed out, handing the group to the next client.\n");
+            replace_master(server, session);
+            if (session->state == TFTP_SESSION_DONE) {
+                end_session(server, session);
+            }
+        } else if (session->retransmissions == TFTP_SESSION_MAX_RETRANSMISSIONS) {
+            log_message(LOG_VERBOSE, "Transmission timed out.\n");
+            tftp_packet_error error = tftp_create_packet_error();
+            tftp_set_error_message(&error, "Receive timed out.");
+            send_error(server, &session->transmission, &error, 0);
+            if (session->upload) {
+                abort_upload(server, session);
+            }
+            end_session(server, session);
+        } else {
+            session->retransmissions++;
+            session->timeouts++;
+            server->timeouts++;
+            // RFC 6298 section 5.5, and whatever was being timed is going to be sent again
+            session->rto_ms = 2 * session->rto_ms < session->max_rto_ms ? 2 * session->rto_ms : session->max_rto_ms;
+            session->timed_block = -1;
+            log_message(LOG_VERBOSE, "Transmission timed out %d out of %d times, next timeout %d ms.\n",
+                        session->retransmissions, TFTP_SESSION_MAX_RETRANSMISSIONS, session->rto_ms);
+            if (retransmit(server, session) != TFTP_SUCCESS) {
+                end_session(server, session);
+            }
+        }
+    }
+}
+
+static void end_session(tftp_server *server, tftp_session *session) {
+    tftp_transmission *transmission = &session->transmission;
+
+    // Queued packets refer to the socket by number, so they have to go out before it is closed
+    if (server->batch.count > 0) {
+        tftp_batch_flush(&server->batch);
+    }
+
+    if (!session_is_drained(session)) {
+        // The kernel may still read from the mapping, keep it until every MSG_ZEROCOPY send completed.
+        // Likewise, the writer may still be writing received blocks of an upload, and io_uring sending DATA.
+        session->state = TFTP_SESSION_DRAINING;
+        set_timer(server, session, TFTP_SESSION_DRAIN_TIMEOUT_MS);
+        return;
+    }
+    if (transmission->zerocopy_sent > 0) {
+        log_message(LOG_DEBUG, "%li of %li zero-copy sends were copied by the kernel.\n",
+                    transmission->zerocopy_copied, transmission->zerocopy_sent);
+    }
+    release_session(server, session);
+}
+
+static void release_session(tftp_server *server, tftp_session *session) {
+    if (session->prev != NULL) {
+        session->prev->next = session->next;
+    } else {
+        server->sessions = session->next;
+    }
+    if (session->next != NULL) {
+        session->next->prev = session->prev;
+    }
+    server->session_count--;
+    tftp_timer_cancel(&server->timers, &session->timer);
+    log_transfer(session, session->completed ? "completed" : "failed");
+    log_message(LOG_DEBUG, "Round trip %.2f ms (deviation %.2f ms) from %li samples, timeout %d ms, "
+                           "%li blocks retransmitted after %li timeouts.\n", session->srtt_us / 1000.0,
+                session->rttvar_us / 1000.0, session->rtt_samples, session->rto_ms, session->retransmitted_blocks,
+                session->timeouts);
+
+    if (server->batch.count > 0) {
+        tftp_batch_flush(&server->batch);
+    }
+    release_contents(server, session);
+    tftp_uring_unregister(&server->uring, &session->transmission);
+    if (session->upload && session->state == TFTP_SESSION_RECEIVING) {
+        // The server is shutting down halfway through the upload
+        tftp_files_unlink(&server->files, session->transmission.request.filename);
+    }
+
+    // Closing the socket also removes it from the epoll set
+    free_session(server, session);
+}
@@ -0,0 +1,354 @@
+/*
+
+    Event-driven TFTP server that multiplexes transmissions on one thread
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_SERVER_H
+#define TFTPSERVER_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "../common/tftp.h"
+#include "cache.h"
+#include "negative.h"
+#include "pool.h"
+#include "writer.h"
+#include "uring.h"
+#include "timer.h"
+#include "files.h"
+#include "metrics.h"
+#include "sockets.h"
+#include "demux.h"
+
+#define TFTP_SERVER_MAX_EVENTS 256
+// Room for outgoing DATA payloads that are queued up until the end of a loop iteration
+#define TFTP_SERVER_BATCH_ARENA_SIZE (256 * 1024)
+
+// The longest the event loop sleeps (in milliseconds) when no timer expires sooner
+#define TFTP_SERVER_TICK_MS 50
+
+#define TFTP_SESSION_MAX_RETRANSMISSIONS 5
+#define TFTP_SESSION_DEFAULT_TIMEOUT_MS 500
+// Bounds of the adaptive retransmission timeout, a negotiated timeout replaces the upper bound
+#define TFTP_SESSION_MIN_RTO_MS 20
+#define TFTP_SESSION_DEFAULT_MAX_RTO_MS 3000
+#define TFTP_SESSION_DEFAULT_MAX_WINDOW_SIZE 64
+// Files at least this large are memory-mapped and sent straight from the mapping
+#define TFTP_SESSION_DEFAULT_MMAP_THRESHOLD (64 * 1024)
+// Files are read ahead of the client by what it acknowledges in this long, within these bounds
+#define TFTP_SESSION_PREFETCH_HORIZON_US 200000
+#define TFTP_SESSION_MIN_PREFETCH (128 * 1024)
+#define TFTP_SESSION_DEFAULT_MAX_PREFETCH (8 * 1024 * 1024)
+// How long a finished session waits for outstanding MSG_ZEROCOPY completions
+#define TFTP_SESSION_DRAIN_TIMEOUT_MS 1000
+// An upload lingers this many timeouts after the final ACK, to answer a retransmitted last block
+#define TFTP_SESSION_DALLY_TIMEOUTS 2
+
+// Durability of uploaded files
+#define TFTP_UPLOAD_SYNC_NONE 0
+// fsync every file before its final ACK, so an acknowledged upload survives a crash
+#define TFTP_UPLOAD_SYNC_FILE 1
+
+// RFC 2090 groups send each block once, so they are limited to what a 16 bit block number can address
+#define TFTP_MULTICAST_MAX_BLOCKS 65535
+// Every server hands out group ports from its own range of this many ports
+#define TFTP_MULTICAST_PORTS 64
+#define TFTP_MULTICAST_TTL 1
+
+// Kinds of file descriptors registered with the epoll instance
+#define TFTP_SOURCE_LISTENER 0
+#define TFTP_SOURCE_SESSION 1
+#define TFTP_SOURCE_NEGATIVE_CACHE 2
+#define TFTP_SOURCE_WRITER 3
+#define TFTP_SOURCE_FILES 4
+#define TFTP_SOURCE_DEMUX 5
+#define TFTP_SOURCE_URING 6
+
+// States of the read request state machine
+#define TFTP_SESSION_OACK_SENT 0
+#define TFTP_SESSION_DATA_SENT 1
+#define TFTP_SESSION_DONE 2
+// Finished, but the kernel may still be reading from the mapping, or the writer from received blocks
+#define TFTP_SESSION_DRAINING 3
+
+// States of the write request state machine
+#define TFTP_SESSION_RECEIVING 4
+// The last block arrived, its ACK waits until the writer synced the file
+#define TFTP_SESSION_SYNCING 5
+// The final ACK was sent, a retransmitted last block is answered with it again
+#define TFTP_SESSION_DALLYING 6
+
+typedef struct {
+    int kind;
+} tftp_event_source;
+
+// One of the shared sockets in demultiplexed mode
+typedef struct {
+    tftp_event_source source;
+    int index;
+} tftp_demux_source;
+
+typedef struct tftp_multicast_member {
+    struct sockaddr_in address;
+    // Answered to this client whenever it joins or is made master client
+    tftp_packet_optionack optionack;
+    struct tftp_multicast_member *next;
+} tftp_multicast_member;
+
+typedef struct {
+    // The file the group is sending, later requests only join if they would get the same contents
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+
+    uint16_t port;
+
+    // Clients in the order they joined, the first one is the master client whose ACKs drive the transfer
+    tftp_multicast_member *members;
+    tftp_multicast_member *last_member;
+} tftp_multicast;
+
+typedef struct tftp_session {
+    // Must be the first member, so the epoll data pointer can be cast back to the session
+    tftp_event_source source;
+
+    // Everything sending or acknowledging a block touches is packed into the first two cache lines, the timer and the
+    // front of the transmission fill the next two. Sessions come from the pool, so they start on a cache line.
+
+    int state;
+
+    // Blocks are counted from 1 without wrapping, only the low 16 bits are put on the wire
+    // The number of blocks in the file, including the final short (possibly empty) block
+    long block_count;
+    // The highest block that was acknowledged by the client
+    long acked_block;
+    // The highest block that was sent, at most window_size ahead of acked_block
+    long sent_block;
+    long highest_sent_block;
+
+    // The file contents in memory, either from the shared cache or memory-mapped for this session. Blocks are sent
+    // from it up to file_size, mapping_size is only needed to unmap it.
+    uint8_t *mapping;
+    long file_size;
+    uint16_t window_size;
+    uint16_t block_size;
+
+    // Timeouts in a row without progress
+    int retransmissions;
+
+    // Set for RFC 2090 sessions, DATA then goes to the group address in transmission.client_addr
+    tftp_multicast *multicast;
+
+    // The block whose acknowledgement (or for uploads, arrival) is being timed, or -1
+    long timed_block;
+    long timed_since_us;
+
+    // The retransmission timeout, doubled on every timeout up to max_rto_ms
+    int rto_ms;
+    int max_rto_ms;
+
+    // RFC 6298 round trip estimation in microseconds. Only packets that were sent once are timed (Karn's rule).
+    long srtt_us;
+    long rttvar_us;
+    long rtt_samples;
+
+    // The file up to this offset was handed to the kernel to read ahead, or is in the contents cache already
+    long prefetched_until;
+
+    // Retransmission, dallying, draining or giving up on the session, whichever is next
+    tftp_timer timer;
+
+    // Its socket, address and transmit buffer come first, the request at its end is only read at the start
+    tftp_transmission transmission;
+
+    // Set for uploads, which count blocks received in acked_block and are written behind by the writer
+    int upload;
+    // Blocks received since the last ACK, one is sent for every window_size blocks
+    int unacked_blocks;
+    // Write jobs handed to the writer, the session is not freed while any of them refer to it
+    int pending_writes;
+
+    long mapping_size;
+
+    tftp_cache_entry *cache_entry;
+
+    long timeouts;
+    long retransmitted_blocks;
+    // When the request arrived, for the first block and transfer time histograms and the access log
+    long started_us;
+    int completed;
+    // The socket came from the socket pool and has no options set that the next transfer must not inherit
+    int pooled_socket;
+    // In the demultiplexer's table while the session sends from one of its shared sockets
+    tftp_demux_entry demux_entry;
+    // In the request table for as long as the session exists, so a retransmitted request finds it
+    tftp_demux_entry request_entry;
+
+    // The negotiated or default timeout, which paces dallying and waiting for the writer
+    long timeout_ms;
+
+    // Where transmission.client_addr points, unless it was replaced by a multicast group
+    struct sockaddr_in client_address;
+
+    // The request only points into the receive buffer, transmission.request.filename points here instead
+    char filename[TFTP_MAX_FILENAME_LENGTH + 1];
+
+    struct tftp_session *prev;
+    struct tftp_session *next;
+} tftp_session;
+
+_Static_assert(offsetof(tftp_session, mapping) + sizeof(uint8_t *) <= 128 &&
+               offsetof(tftp_session, file_size) + sizeof(long) <= 128 &&
+               offsetof(tftp_session, rtt_samples) + sizeof(long) <= 128 &&
+               offsetof(tftp_session, prefetched_until) + sizeof(long) <= 128,
+               "the per-block session state no longer fits in two cache lines");
+_Static_assert(offsetof(tftp_session, transmission) + offsetof(tftp_transmission, zerocopy_completed) <= 256,
+               "the timer and the front of the transmission no longer fit in the third and fourth cache line");
+
+typedef struct {
+    const char *root_path;
+
+    // The largest RFC 7440 window this server agrees to, larger requests are negotiated down
+    uint16_t max_window_size;
+
+    // Memory-map files of at least this size instead of reading them block by block, 0 to disable
+    long mmap_threshold;
+
+    // Read at most this many bytes ahead of what was sent, 0 to leave read-ahead to the kernel
+    long max_prefetch;
+
+    // Send DATA from mapped files with MSG_ZEROCOPY, if the kernel supports it
+    int zero_copy;
+
+    // Contents cache shared by all workers, or NULL to read every transfer from disk
+    tftp_cache *cache;
+
+    // Bind the listening socket with SO_REUSEPORT, so several servers can share one port
+    int reuse_port;
+
+    // How many open files are kept for repeated requests, 0 to open every file by name
+    long open_file_cache_size;
+
+    // How many bound session sockets are kept for reuse, 0 to create a socket for every transfer
+    int socket_pool_size;
+
+    // Carry every unicast download over this many shared sockets, told apart by the client's address and port,
+    // instead of a socket per transfer. 0 to disable.
+    int demux_sockets;
+
+    // How many missing filenames are remembered and answered without touching the file system, 0 to disable
+    long negative_cache_size;
+
+    // Group address and first port for RFC 2090 multicast transfers, a port of 0 disables multicast
+    struct in_addr multicast_address;
+    uint16_t multicast_port;
+
+    // Back pooled sessions and buffers with huge pages, if the system has them
+    int huge_pages;
+
+    // Accept write requests, creating new files under root_path
+    int allow_uploads;
+    int upload_sync;
+
+    // Read files and send DATA through io_uring, falls back to pread and sendmmsg where that is not available
+    int io_uring;
+
+    // Every packet the server sends or receives goes through this, for tests and benchmarks, NULL for none
+    tftp_impairment *impairment;
+} tftp_server_config;
+
+// Every worker thread runs a server of its own. Nothing a server owns is locked, its pool, timers, sockets, tables
+// and file caches are only touched by its own thread. The contents cache and the metrics are the ones shared.
+typedef struct {
+    tftp_event_source source;
+
+    int epoll_fd;
+    int listen_socket;
+    struct sockaddr_in address;
+
+    tftp_server_config config;
+
+    // Used to send errors from the listening socket, before a session exists
+    tftp_transmission host_transmission;
+
+    tftp_session *sessions;
+    long session_count;
+    long completed_count;
+    long timeouts;
+    long retransmitted_blocks;
+    long duplicate_requests;
+    long unknown_tids;
+    long prefetches;
+    tftp_timer_wheel timers;
+    int next_multicast_port;
+
+    // Outgoing DATA is queued here and flushed with sendmmsg once per loop iteration
+    tftp_batch batch;
+    // Or submitted through io_uring, whose completions are reaped when its event fd is readable
+    tftp_uring uring;
+    tftp_event_source uring_source;
+
+    // Session sockets are bound up front and reused, and connected to the client of their transfer
+    tftp_socket_pool sockets;
+
+    // Sessions by client TID, a request from the TID of a session asking for the same file is a retransmission
+    tftp_demux_table requests;
+
+    // Shared session sockets, and the table that finds the session an incoming packet belongs to
+    tftp_demux demux;
+    tftp_demux_source demux_sources[TFTP_DEMUX_MAX_SOCKETS];
+    // RFC 1350 unknown transfer ID error, sent to anyone whose packet does not belong to a session
+    uint8_t unknown_tid_packet[32];
+    int unknown_tid_length;
+
+    // Files are opened relative to the root directory, and kept open for a while
+    tftp_files files;
+    tftp_event_source files_source;
+
+    // Filenames known not to exist, invalidated through inotify when anything appears in the root
+    tftp_negative_cache negative_cache;
+    tftp_event_source negative_source;
+    // The file not found error, built once and sent as-is for every negative cache hit
+    uint8_t enoent_packet[64];
+    int enoent_length;
+
+    // Sessions and their buffers come from here, uploads are received into it as well
+    tftp_pool pool;
+    // Uploads are written by a thread of their own, only started if allowed
+    tftp_writer writer;
+    tftp_event_source writer_source;
+
+    // Read by a metrics exporter on another thread
+    tftp_metrics metrics;
+} tftp_server;
+
+long tftp_server_now_ms();
+
+tftp_server_config tftp_create_server_config();
+
+int tftp_server_init(tftp_server *server, const struct sockaddr_in *address, const tftp_server_config *config);
+
+int tftp_server_poll(tftp_server *server, int timeout_ms);
+
+int tftp_server_run(tftp_server *server, volatile int *running);
+
+void tftp_server_destroy(tftp_server *server);
+
+#endif //TFTPSERVER_SERVER_H
@@ -0,0 +1,128 @@
+/*
+
+    Provide an implementation for sockets.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include "../common/tftp.h"
+#include "sockets.h"
+
+static int create_socket() {
+    int new_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (new_socket < 0) {
+        return -1;
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(0);
+    if (bind(new_socket, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(new_socket);
+        return -1;
+    }
+    return new_socket;
+}
+
+// Throws away whatever is queued, and a pending error such as an ICMP port unreachable of the last client
+static void drain(int pooled_socket) {
+    uint8_t discard[4];
+    while (recv(pooled_socket, discard, sizeof(discard), MSG_DONTWAIT | MSG_TRUNC) >= 0 || errno == ECONNREFUSED) {
+    }
+}
+
+int tftp_sockets_init(tftp_socket_pool *pool, int capacity) {
+    memset(pool, 0, sizeof(tftp_socket_pool));
+    if (capacity <= 0) {
+        return TFTP_SUCCESS;
+    }
+    pool->sockets = malloc(capacity * sizeof(int));
+    if (pool->sockets == NULL) {
+        return TFTP_ERROR;
+    }
+    pool->capacity = capacity;
+    while (pool->count < capacity) {
+        int new_socket = create_socket();
+        if (new_socket < 0) {
+            tftp_sockets_destroy(pool);
+            return TFTP_ERROR;
+        }
+        pool->sockets[pool->count++] = new_socket;
+    }
+    return TFTP_SUCCESS;
+}
+
+void tftp_sockets_destroy(tftp_socket_pool *pool) {
+    for (int i = 0; i < pool->count; i++) {
+        close(pool->sockets[(pool->first + i) % pool->capacity]);
+    }
+    free(pool->sockets);
+    pool->sockets = NULL;
+    pool->count = 0;
+    pool->capacity = 0;
+}
+
+int tftp_sockets_get(tftp_socket_pool *pool, const struct sockaddr *address, socklen_t address_size) {
+    // A pooled socket may still be connected to its last client, an unconnected socket has to be a new one
+    if (address == NULL) {
+        int new_socket = create_socket();
+        if (new_socket >= 0) {
+            pool->created++;
+        }
+        return new_socket;
+    }
+    int pooled_socket;
+    if (pool->count > 0) {
+        pooled_socket = pool->sockets[pool->first];
+        pool->first = (pool->first + 1) % pool->capacity;
+        pool->count--;
+        pool->reused++;
+    } else {
+        pooled_socket = create_socket();
+        if (pooled_socket < 0) {
+            return -1;
+        }
+        pool->created++;
+    }
+    // Connecting again moves the socket to the new client, and keeps its port
+    if (connect(pooled_socket, address, address_size) != 0) {
+        close(pooled_socket);
+        return -1;
+    }
+    // Anything that arrived while the socket was in the pool came from somewhere else
+    drain(pooled_socket);
+    return pooled_socket;
+}
+
+// Not disconnected: for a socket bound to port 0, connect with AF_UNSPEC releases the port it was given as well
+void tftp_sockets_put(tftp_socket_pool *pool, int socket) {
+    if (pool->count >= pool->capacity) {
+        close(socket);
+        return;
+    }
+    drain(socket);
+    pool->sockets[(pool->first + pool->count) % pool->capacity] = socket;
+    pool->count++;
+}
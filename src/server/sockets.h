@@ -0,0 +1,55 @@
+/*
+
+    Pool of bound session sockets, connected to a client for the length of a transfer
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_SOCKETS_H
+#define TFTPSERVER_SOCKETS_H
+
+#include <sys/socket.h>
+
+#define TFTP_SOCKETS_DEFAULT_SIZE 64
+
+// Bound session sockets that are not in use, in a ring
+typedef struct {
+    // Handed out oldest first, so a port is reused as late as possible and stray packets of its last transfer
+    // had the longest time to arrive and be drained
+    int *sockets;
+    int capacity;
+    int first;
+    int count;
+
+    long created;
+    long reused;
+} tftp_socket_pool;
+
+// Binds capacity sockets up front, a capacity of 0 creates every socket when it is needed
+int tftp_sockets_init(tftp_socket_pool *pool, int capacity);
+
+void tftp_sockets_destroy(tftp_socket_pool *pool);
+
+// A non-blocking socket on an ephemeral port with nothing queued, connected to address. Only connected sockets come
+// from the pool, for a NULL address a new unconnected one is created.
+int tftp_sockets_get(tftp_socket_pool *pool, const struct sockaddr *address, socklen_t address_size);
+
+// Keeps the socket, and its port, for the next transfer, or closes it if the pool is full. It stays connected to its
+// last client until it is handed out again.
+void tftp_sockets_put(tftp_socket_pool *pool, int socket);
+
+#endif //TFTPSERVER_SOCKETS_H
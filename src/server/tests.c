@@ -19,40 +19,1758 @@
  
  */
 
+#define _GNU_SOURCE
+
 #include "../common/tftp.h"
+#include "log.h"
+#include "server.h"
+#include "worker.h"
+#include "warm.h"
+#include "parse_corpus.h"
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#define TEST_FILE_SIZE (200 * 1024 + 77)
+#define TEST_CONCURRENT_CLIENTS 256
+#define TEST_MULTICAST_BLOCK_SIZE 1024
+#define TEST_MULTICAST_BLOCKS (TEST_FILE_SIZE / TEST_MULTICAST_BLOCK_SIZE + 1)
+#define TEST_MULTICAST_CLIENTS 6
+
+typedef struct {
+    int block_size;
+    int window_size;
+
+    // Hold back every acknowledgement this long, to emulate the round trip time of a real link
+    int ack_delay_ms;
+} test_options;
+
+typedef struct {
+    int socket;
+    struct sockaddr_in server;
+    int has_tid;
+    uint16_t expected_block;
+    int window_size;
+    int unacked_blocks;
+    long received;
+    long last_activity_ms;
+
+    int has_pending_ack;
+    uint16_t pending_ack;
+    long pending_ack_ms;
+
+    int done;
+    int failed;
+} test_client;
+
+typedef struct {
+    // Talks to the server's transfer port, the group socket only receives DATA
+    int socket;
+    int group_socket;
+    struct sockaddr_in server;
+    int has_tid;
+    int master;
+
+    uint8_t received_blocks[TEST_MULTICAST_BLOCKS + 1];
+    // Every block up to this one was received
+    long contiguous;
+    int failed;
+} multicast_client;
+
+typedef struct {
+    tftp_server server;
+    volatile int running;
+    pthread_t thread;
+} test_server;
+
+int failures = 0;
+
+char test_root[] = "/tmp/tftp-tests-XXXXXX";
+uint8_t *test_file_content;
 
 void run_test();
 
-void test_request(const char *test_name, const uint8_t *data, int data_length);
+void test_request(const char *test_name, const uint8_t *data, int data_length, int expected);
+
+void check(const char *test_name, int passed);
+
+int setup_test_root();
+
+void cleanup_test_root();
+
+void test_concurrent_transfers();
+
+void test_window_size();
+
+void test_adaptive_timeout();
+
+void test_impaired_transfers();
+
+void test_timer_wheel();
+
+void test_log();
+
+void test_zero_copy();
+
+void test_io_uring();
+
+void test_pooled_sessions();
+
+void test_cache();
+
+void test_workers();
+
+void test_negative_cache();
+
+void test_open_files();
+
+void test_metrics();
+
+void test_socket_pool();
+
+void test_demux();
+
+void test_duplicate_requests();
+
+void test_read_ahead();
+
+void test_warm_set();
+
+void test_multicast();
+
+void test_upload();
 
 int main(){
+    LOG_LEVEL = LOG_NONE;
     run_test();
+    test_timer_wheel();
+    test_log();
+    if (setup_test_root() != TFTP_SUCCESS) {
+        check("Create test root", 0);
+        return 1;
+    }
+    test_concurrent_transfers();
+    test_window_size();
+    test_adaptive_timeout();
+    test_impaired_transfers();
+    test_zero_copy();
+    test_io_uring();
+    test_pooled_sessions();
+    test_cache();
+    test_workers();
+    test_negative_cache();
+    test_open_files();
+    test_metrics();
+    test_socket_pool();
+    test_demux();
+    test_duplicate_requests();
+    test_read_ahead();
+    test_warm_set();
+    test_multicast();
+    test_upload();
+    cleanup_test_root();
+    return failures == 0 ? 0 : 1;
+}
+
+void check(const char *test_name, int passed) {
+    printf("Test \"%s\" %s\n", test_name, passed ? "passed" : "FAILED");
+    if (!passed) {
+        failures++;
+    }
+}
+
+void create_test_file(const char *name, uint8_t *content, long size) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", test_root, name);
+    FILE *file = fopen(path, "wb");
+    fwrite(content, 1, size, file);
+    fclose(file);
+}
+
+void remove_test_file(const char *name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", test_root, name);
+    unlink(path);
+}
+
+int setup_test_root() {
+    if (mkdtemp(test_root) == NULL) {
+        return TFTP_ERROR;
+    }
+    test_file_content = malloc(TEST_FILE_SIZE);
+    srand(1);
+    for (long i = 0; i < TEST_FILE_SIZE; i++) {
+        test_file_content[i] = rand();
+    }
+    create_test_file("boot.img", test_file_content, TEST_FILE_SIZE);
+    return TFTP_SUCCESS;
+}
+
+void cleanup_test_root() {
+    remove_test_file("boot.img");
+    rmdir(test_root);
+}
+
+void *run_server(void *argument) {
+    test_server *server = argument;
+    tftp_server_run(&server->server, &server->running);
+    return NULL;
+}
+
+tftp_server_config create_test_config() {
+    tftp_server_config config = tftp_create_server_config();
+    config.root_path = test_root;
+    return config;
+}
+
+int start_server(test_server *server, const tftp_server_config *config) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (tftp_server_init(&server->server, &address, config) != TFTP_SUCCESS) {
+        return TFTP_ERROR;
+    }
+    server->running = 1;
+    pthread_create(&server->thread, NULL, run_server, server);
+    return TFTP_SUCCESS;
+}
+
+// The server thread may still be processing the final acknowledgements when the clients are done
+int wait_for_idle(test_server *server) {
+    long deadline = tftp_server_now_ms() + 2000;
+    while (server->server.session_count != 0 && tftp_server_now_ms() < deadline) {
+        usleep(1000);
+    }
+    return server->server.session_count == 0;
+}
+
+static int wait_for_count(long *counter, long expected) {
+    long deadline = tftp_server_now_ms() + 2000;
+    while (__atomic_load_n(counter, __ATOMIC_RELAXED) < expected && tftp_server_now_ms() < deadline) {
+        usleep(1000);
+    }
+    return __atomic_load_n(counter, __ATOMIC_RELAXED) == expected;
+}
+
+void stop_server(test_server *server) {
+    server->running = 0;
+    pthread_join(server->thread, NULL);
+    tftp_server_destroy(&server->server);
+}
+
+int client_send(test_client *client, const uint8_t *packet, int length) {
+    return sendto(client->socket, packet, length, 0, (struct sockaddr *) &client->server, sizeof(client->server));
+}
+
+void client_send_ack(test_client *client, uint16_t block_num) {
+    uint8_t ack[4] = {0, TFTP_OPCODE_ACKNOWLEDGEMENT, block_num >> 8u, block_num & 0xffu};
+    client_send(client, ack, sizeof(ack));
+}
+
+void client_queue_ack(test_client *client, uint16_t block_num, const test_options *options) {
+    if (options->ack_delay_ms == 0) {
+        client_send_ack(client, block_num);
+        return;
+    }
+    client->has_pending_ack = 1;
+    client->pending_ack = block_num;
+    client->pending_ack_ms = tftp_server_now_ms() + options->ack_delay_ms;
+}
+
+int build_request(uint8_t *packet, const char *filename, const test_options *options) {
+    uint8_t *end_ptr = packet;
+    *(end_ptr++) = 0;
+    *(end_ptr++) = TFTP_OPCODE_READ_REQUEST;
+    strcpy((char *) end_ptr, filename);
+    end_ptr += strlen(filename) + 1;
+    strcpy((char *) end_ptr, "octet");
+    end_ptr += 6;
+    if (options->block_size != 0) {
+        end_ptr += tftp_write_number_option(end_ptr, TFTP_BLOCKSIZE_STRING, options->block_size);
+    }
+    if (options->window_size != 0) {
+        end_ptr += tftp_write_number_option(end_ptr, TFTP_WINDOW_SIZE_STRING, options->window_size);
+    }
+    return end_ptr - packet;
+}
+
+void client_receive(test_client *client, uint8_t *buffer, int buffer_size, const test_options *options) {
+    int block_size = options->block_size == 0 ? 512 : options->block_size;
+
+    struct sockaddr_in from;
+    socklen_t from_size = sizeof(from);
+    int received = recvfrom(client->socket, buffer, buffer_size, MSG_DONTWAIT, (struct sockaddr *) &from,
+                            &from_size);
+    if (received < 4) {
+        return;
+    }
+    if (!client->has_tid) {
+        client->server = from;
+        client->has_tid = 1;
+    }
+    client->last_activity_ms = tftp_server_now_ms();
+
+    uint16_t opcode = (buffer[0] << 8u) + buffer[1];
+    uint16_t block_num = (buffer[2] << 8u) + buffer[3];
+    if (opcode == TFTP_OPCODE_OACK) {
+        // The server may negotiate the window down
+        char *option = (char *) buffer + 2;
+        char *end = (char *) buffer + received;
+        while (option < end) {
+            char *value = option + strlen(option) + 1;
+            if (value < end && strcmp(option, TFTP_WINDOW_SIZE_STRING) == 0) {
+                client->window_size = atoi(value);
+            }
+            option = value + strlen(value) + 1;
+        }
+        client_queue_ack(client, 0, options);
+    } else if (opcode == TFTP_OPCODE_DATA) {
+        int data_size = received - 4;
+        if (block_num == client->expected_block) {
+            long offset = (long) (block_num - 1) * block_size;
+            if (offset + data_size > TEST_FILE_SIZE ||
+                memcmp(buffer + 4, test_file_content + offset, data_size) != 0) {
+                client->failed = 1;
+                client->done = 1;
+                return;
+            }
+            client->received += data_size;
+            client->expected_block++;
+            client->unacked_blocks++;
+            // As in RFC 7440, only the last block of every window is acknowledged
+            if (client->unacked_blocks == client->window_size || data_size < block_size) {
+                client->unacked_blocks = 0;
+                client_queue_ack(client, block_num, options);
+            }
+            if (data_size < block_size) {
+                client->done = 1;
+            }
+        } else {
+            // A block was lost or repeated, ask for everything after the last block we have
+            client->unacked_blocks = 0;
+            client_queue_ack(client, client->expected_block - 1, options);
+        }
+    } else {
+        client->failed = 1;
+        client->done = 1;
+    }
+}
+
+// Run count clients against the server at the same time and return how many of them received the whole file
+int run_clients(uint16_t port, int count, const char *filename, const test_options *options) {
+    test_client *clients = calloc(count, sizeof(test_client));
+    struct pollfd *fds = calloc(count, sizeof(struct pollfd));
+    int buffer_size = 4 + (options->block_size == 0 ? 512 : options->block_size);
+    uint8_t *buffer = malloc(buffer_size);
+    uint8_t request[600];
+    int request_length = build_request(request, filename, options);
+
+    for (int i = 0; i < count; i++) {
+        clients[i].socket = socket(AF_INET, SOCK_DGRAM, 0);
+        clients[i].server.sin_family = AF_INET;
+        clients[i].server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        clients[i].server.sin_port = htons(port);
+        clients[i].expected_block = 1;
+        clients[i].window_size = 1;
+        clients[i].last_activity_ms = tftp_server_now_ms();
+        fds[i].fd = clients[i].socket;
+        fds[i].events = POLLIN;
+        client_send(&clients[i], request, request_length);
+    }
+
+    long deadline = tftp_server_now_ms() + 20000;
+    int remaining = count;
+    while (remaining > 0 && tftp_server_now_ms() < deadline) {
+        poll(fds, count, options->ack_delay_ms == 0 ? 100 : 1);
+        remaining = 0;
+        long now = tftp_server_now_ms();
+        for (int i = 0; i < count; i++) {
+            test_client *client = &clients[i];
+            if (client->has_pending_ack && now >= client->pending_ack_ms) {
+                client->has_pending_ack = 0;
+                client_send_ack(client, client->pending_ack);
+            }
+            if (client->done) {
+                continue;
+            }
+            if (fds[i].revents & POLLIN) {
+                client_receive(client, buffer, buffer_size, options);
+            } else if (now - client->last_activity_ms > 1000) {
+                // Our acknowledgement or the request got lost, the server will retransmit on its own
+                client->last_activity_ms = now;
+                if (!client->has_tid) {
+                    client_send(client, request, request_length);
+                }
+            }
+            remaining += !client->done || client->has_pending_ack;
+        }
+    }
+
+    int completed = 0;
+    for (int i = 0; i < count; i++) {
+        if (clients[i].done && !clients[i].failed && clients[i].received == TEST_FILE_SIZE) {
+            completed++;
+        }
+        close(clients[i].socket);
+    }
+    free(buffer);
+    free(fds);
+    free(clients);
+    return completed;
+}
+
+void test_concurrent_transfers() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+
+    test_options options = {0, 0, 0};
+    check("Single transfer", run_clients(port, 1, "boot.img", &options) == 1);
+    options.block_size = 1428;
+    check("Single transfer with block size", run_clients(port, 1, "boot.img", &options) == 1);
+    options.window_size = 8;
+    check("Single transfer with window size", run_clients(port, 1, "boot.img", &options) == 1);
+    options.block_size = 1024;
+    options.window_size = 0;
+
+    long start = tftp_server_now_ms();
+    int completed = run_clients(port, TEST_CONCURRENT_CLIENTS, "boot.img", &options);
+    printf("%d of %d concurrent transfers completed in %li ms\n", completed, TEST_CONCURRENT_CLIENTS,
+           tftp_server_now_ms() - start);
+    check("Concurrent transfers", completed == TEST_CONCURRENT_CLIENTS);
+    check("No sessions left", wait_for_idle(&server));
+
+    stop_server(&server);
+}
+
+void test_window_size() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+
+    // Every acknowledgement takes 2 ms, so a lock-step transfer pays that once per block
+    test_options options = {1024, 0, 2};
+    long start = tftp_server_now_ms();
+    int lock_step_completed = run_clients(port, 1, "boot.img", &options);
+    long lock_step_ms = tftp_server_now_ms() - start;
+
+    options.window_size = 16;
+    start = tftp_server_now_ms();
+    int windowed_completed = run_clients(port, 1, "boot.img", &options);
+    long windowed_ms = tftp_server_now_ms() - start;
+
+    printf("Transfer with 2 ms acknowledgement delay took %li ms lock-step and %li ms with window size %d\n",
+           lock_step_ms, windowed_ms, options.window_size);
+    check("Window size transfers", lock_step_completed == 1 && windowed_completed == 1);
+    check("Window size speedup", windowed_ms * 2 < lock_step_ms);
+
+    options.window_size = 100;
+    start = tftp_server_now_ms();
+    int negotiated_completed = run_clients(port, 1, "boot.img", &options);
+    check("Window size above maximum", negotiated_completed == 1 && tftp_server_now_ms() - start < lock_step_ms);
+
+    server.running = 0;
+    pthread_join(server.thread, NULL);
+    tftp_batch *batch = &server.server.batch;
+    printf("Sent %li packets in %li sendmmsg calls, received %li packets in %li recvmmsg calls\n",
+           batch->sent_packets, batch->send_syscalls, batch->received_packets, batch->recv_syscalls);
+    check("Batched sends", batch->sent_packets > 2 * batch->send_syscalls);
+    tftp_server_destroy(&server.server);
+}
+
+void *log_from_thread(void *argument) {
+    log_message(LOG_INFO, "From another thread %d\n", *(int *) argument);
+    return NULL;
+}
+
+void test_log() {
+    char path[] = "/tmp/tftpserver-log-XXXXXX";
+    int file = mkstemp(path);
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(file, STDOUT_FILENO);
+
+    LOG_LEVEL = LOG_VERBOSE;
+    int started = log_start() == TFTP_SUCCESS;
+    char address[32];
+    snprintf(address, sizeof(address), "10.0.0.1");
+    log_message(LOG_INFO, "%s:%d RRQ %s, %li bytes in %.2f ms, 100%% done\n", address, 69, "boot.img", 123456789012L,
+                1.5);
+    // The string is copied into the record, changing it afterwards must not change the message
+    snprintf(address, sizeof(address), "changed");
+    log_message(LOG_VERBOSE, "Sent error code %d, \"%.*s\"\n", 1, 5, "File not found.");
+    log_message(LOG_DEBUG, "Not enabled %d\n", 1);
+    int argument = 7;
+    pthread_t thread;
+    pthread_create(&thread, NULL, log_from_thread, &argument);
+    pthread_join(thread, NULL);
+    log_stop();
+    LOG_LEVEL = LOG_NONE;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    char written[512] = {0};
+    // Records of one thread stay in order, but the other thread may be written in between
+    pread(file, written, sizeof(written) - 1, 0);
+    close(file);
+    unlink(path);
+    const char *request_line = strstr(written, "10.0.0.1:69 RRQ boot.img, 123456789012 bytes in 1.50 ms, 100% done\n");
+    const char *error_line = strstr(written, "Sent error code 1, \"File \"\n");
+    check("Log thread started", started);
+    check("Log records formatted by the log thread",
+          request_line != NULL && error_line != NULL && request_line < error_line &&
+          strstr(written, "From another thread 7\n") != NULL && strstr(written, "Not enabled") == NULL);
+}
+
+void test_timer_wheel() {
+    long delays[] = {1, 2, 63, 64, 65, 100, 4095, 4096, 4097, 70000, 300000};
+    int count = sizeof(delays) / sizeof(delays[0]);
+    tftp_timer_wheel *wheel = malloc(sizeof(tftp_timer_wheel));
+    tftp_timer timers[sizeof(delays) / sizeof(delays[0]) + 2];
+    long fired_at[sizeof(delays) / sizeof(delays[0]) + 2];
+
+    // Start just before a level boundary, so arming and cascading cross it
+    tftp_timer_wheel_init(wheel, 4090);
+    for (int i = 0; i < count + 2; i++) {
+        tftp_timer_init(&timers[i], &fired_at[i]);
+        fired_at[i] = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        tftp_timer_arm(wheel, &timers[i], 4090 + delays[i]);
+    }
+    tftp_timer_arm(wheel, &timers[count], 4090 + 10);
+    tftp_timer_cancel(wheel, &timers[count]);
+    tftp_timer_arm(wheel, &timers[count + 1], 4090 + 5000);
+    tftp_timer_arm(wheel, &timers[count + 1], 4090 + 20);
+
+    int next_checked = 1;
+    for (long now = 4091; now <= 4090 + 300000; now++) {
+        tftp_timer_advance(wheel, now);
+        tftp_timer *timer;
+        while ((timer = tftp_timer_take_expired(wheel)) != NULL) {
+            *(long *) timer->context = now;
+        }
+        if (next_checked && tftp_timer_next_ms(wheel, 50) > 64) {
+            next_checked = 0;
+        }
+    }
+
+    int exact = 1;
+    for (int i = 0; i < count; i++) {
+        exact = exact && fired_at[i] == 4090 + delays[i];
+    }
+    check("Timers expire at their exact millisecond", exact);
+    check("Cancelled timer does not expire", fired_at[count] == -1);
+    check("Re-armed timer expires once, at its new time", fired_at[count + 1] == 4090 + 20);
+    check("Timer wheel is empty afterwards", wheel->count == 0 && tftp_timer_next_ms(wheel, 50) == 50);
+    check("Next expiry stays within one level 0 round", next_checked);
+    free(wheel);
+}
+
+// Returns the number of the DATA block that arrived, or -1
+int receive_data_block(test_client *client, uint8_t *buffer, int buffer_size) {
+    struct pollfd fd = {client->socket, POLLIN, 0};
+    if (poll(&fd, 1, 2000) != 1) {
+        return -1;
+    }
+    socklen_t from_size = sizeof(client->server);
+    int received = recvfrom(client->socket, buffer, buffer_size, 0, (struct sockaddr *) &client->server, &from_size);
+    if (received < 4 || buffer[1] != TFTP_OPCODE_DATA) {
+        return -1;
+    }
+    return (buffer[2] << 8u) + buffer[3];
+}
+
+void test_adaptive_timeout() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+
+    // Acknowledge some blocks right away, then let one go unacknowledged
+    test_options options = {1428, 0, 0};
+    test_client client;
+    memset(&client, 0, sizeof(client));
+    client.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client.server.sin_family = AF_INET;
+    client.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client.server.sin_port = server.server.address.sin_port;
+    uint8_t packet[1500];
+    client_send(&client, packet, build_request(packet, "boot.img", &options));
+    struct pollfd fd = {client.socket, POLLIN, 0};
+    socklen_t from_size = sizeof(client.server);
+    int oack = poll(&fd, 1, 2000) == 1 &&
+               recvfrom(client.socket, packet, sizeof(packet), 0, (struct sockaddr *) &client.server, &from_size) > 0 &&
+               packet[1] == TFTP_OPCODE_OACK;
+    client_send_ack(&client, 0);
+
+    int block = oack ? receive_data_block(&client, packet, sizeof(packet)) : -1;
+    while (block > 0 && block < 20) {
+        client_send_ack(&client, block);
+        block = receive_data_block(&client, packet, sizeof(packet));
+    }
+    long lost_ms = tftp_server_now_ms();
+    int repeated = receive_data_block(&client, packet, sizeof(packet));
+    long retransmit_ms = tftp_server_now_ms() - lost_ms;
+    close(client.socket);
+
+    printf("Block retransmitted after %li ms on loopback, the initial timeout is %d ms\n", retransmit_ms,
+           TFTP_SESSION_DEFAULT_TIMEOUT_MS);
+    check("Retransmission timeout adapts to the round trip time",
+          block == 20 && repeated == 20 && retransmit_ms < TFTP_SESSION_DEFAULT_TIMEOUT_MS / 2);
+    check("Timeout counted", server.server.timeouts >= 1 && server.server.retransmitted_blocks >= 1);
+
+    // A slower link must not make the transfer fail
+    options.window_size = 16;
+    options.ack_delay_ms = 30;
+    check("Transfer with 30 ms acknowledgement delay",
+          run_clients(ntohs(server.server.address.sin_port), 1, "boot.img", &options) == 1);
+    stop_server(&server);
+}
+
+typedef struct {
+    long milliseconds;
+    long retransmitted_blocks;
+    long timeouts;
+    tftp_impairment_stats sent;
+    tftp_impairment_stats received;
+} impaired_result;
+
+// One lock-step download through the impairment, the same seed must give the same result
+int run_impaired(const char *name, const tftp_impairment_profile *profile, uint64_t seed, impaired_result *result) {
+    tftp_impairment impairment;
+    if (tftp_impairment_init(&impairment, seed) != TFTP_SUCCESS) {
+        return 0;
+    }
+    impairment.send = *profile;
+    impairment.receive = *profile;
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.impairment = &impairment;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        tftp_impairment_destroy(&impairment);
+        return 0;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+
+    test_options options = {1024, 0, 0};
+    long start = tftp_server_now_ms();
+    int completed = run_clients(port, 1, "boot.img", &options);
+    result->milliseconds = tftp_server_now_ms() - start;
+    wait_for_idle(&server);
+    stop_server(&server);
+
+    result->retransmitted_blocks = server.server.retransmitted_blocks;
+    result->timeouts = server.server.timeouts;
+    result->sent = impairment.sent;
+    result->received = impairment.received;
+    printf("%-28s %6li KB/s, %3li blocks retransmitted after %3li timeouts, dropped %li of %li sent and %li of %li "
+           "received\n", name, TEST_FILE_SIZE / (result->milliseconds > 0 ? result->milliseconds : 1),
+           result->retransmitted_blocks, result->timeouts, result->sent.dropped, result->sent.packets,
+           result->received.dropped, result->received.packets);
+    tftp_impairment_destroy(&impairment);
+    return completed == 1;
+}
+
+void test_impaired_transfers() {
+    tftp_impairment_profile clean = {0, 0, 0, 0, 0};
+    tftp_impairment_profile lossy = {5, 0, 0, 0, 0};
+    tftp_impairment_profile slow = {0, 0, 0, 2000, 0};
+    tftp_impairment_profile messy = {1, 5, 5, 500, 500};
+    impaired_result clean_result, lossy_result, repeated_result, slow_result, messy_result;
+
+    check("Transfer through clean impairment", run_impaired("No impairment", &clean, 1, &clean_result) &&
+                                               clean_result.retransmitted_blocks == 0);
+    check("Transfer with 5% loss", run_impaired("5% loss both ways", &lossy, 7, &lossy_result) &&
+                                   lossy_result.sent.dropped + lossy_result.received.dropped > 0 &&
+                                   lossy_result.retransmitted_blocks > 0);
+    check("Transfer with 5% loss again", run_impaired("5% loss both ways, again", &lossy, 7, &repeated_result));
+    check("Same seed, same losses and retransmissions",
+          repeated_result.sent.dropped == lossy_result.sent.dropped &&
+          repeated_result.received.dropped == lossy_result.received.dropped &&
+          repeated_result.retransmitted_blocks == lossy_result.retransmitted_blocks &&
+          repeated_result.timeouts == lossy_result.timeouts);
+    // Every block waits a full round trip in lock-step
+    check("Transfer with 4 ms round trip", run_impaired("2 ms delay both ways", &slow, 1, &slow_result) &&
+                                          slow_result.milliseconds >= 201 * 4);
+    check("Transfer with loss, duplicates and reordering",
+          run_impaired("Loss, duplicates, reordering", &messy, 3, &messy_result));
+
+    // Behind the shim the session socket is not connected, so the server itself has to tell TIDs apart
+    tftp_impairment impairment;
+    tftp_impairment_init(&impairment, 1);
+    impairment.send = clean;
+    impairment.receive = clean;
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.impairment = &impairment;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        tftp_impairment_destroy(&impairment);
+        return;
+    }
+    test_options options = {0, 0, 0};
+    test_client client;
+    memset(&client, 0, sizeof(client));
+    client.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client.server.sin_family = AF_INET;
+    client.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client.server.sin_port = server.server.address.sin_port;
+    uint8_t packet[600];
+    client_send(&client, packet, build_request(packet, "boot.img", &options));
+    int first = receive_data_block(&client, packet, sizeof(packet));
+
+    test_client stranger = client;
+    stranger.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client_send_ack(&stranger, 1);
+    struct pollfd stranger_fd = {stranger.socket, POLLIN, 0};
+    int answered = poll(&stranger_fd, 1, 2000) == 1 && recv(stranger.socket, packet, sizeof(packet), 0) >= 4 &&
+                   packet[1] == TFTP_OPCODE_ERROR && packet[3] == TFTP_ERROR_UNKNOWN_TID;
+    uint8_t stray_error[5] = {0, TFTP_OPCODE_ERROR, 0, 0, 0};
+    client_send(&stranger, stray_error, sizeof(stray_error));
+    usleep(50000);
+
+    int block = first;
+    int last_block = block;
+    while (block > 0) {
+        client_send_ack(&client, block);
+        last_block = block;
+        do {
+            block = receive_data_block(&client, packet, sizeof(packet));
+        } while (block > 0 && block <= last_block);
+    }
+    close(stranger.socket);
+    close(client.socket);
+    int idle = wait_for_idle(&server);
+    check("Stray TID answered by an unconnected session", first == 1 && answered);
+    check("Transfer not disturbed by a stray TID",
+          idle && last_block == TEST_FILE_SIZE / 512 + 1 && server.server.completed_count == 1 &&
+          server.server.unknown_tids == 2);
+    stop_server(&server);
+    tftp_impairment_destroy(&impairment);
+}
+
+void test_zero_copy() {
+    test_options options = {1428, 16, 0};
+
+    // Without a mapping every block is read into the batch
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.mmap_threshold = 0;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    check("Transfer with read path", run_clients(ntohs(server.server.address.sin_port), 8, "boot.img", &options) == 8);
+    stop_server(&server);
+
+    config = create_test_config();
+    config.zero_copy = 1;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    check("Transfer with MSG_ZEROCOPY", run_clients(ntohs(server.server.address.sin_port), 8, "boot.img", &options) == 8);
+    check("Zero-copy sessions drained", wait_for_idle(&server));
+    stop_server(&server);
+}
+
+void test_io_uring() {
+    test_options options = {1428, 8, 0};
+
+    // Falls back to pread and sendmmsg when the kernel has no io_uring, the transfers must succeed either way
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.mmap_threshold = 0;
+    config.io_uring = 1;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+    check("Transfer with io_uring", run_clients(port, 16, "boot.img", &options) == 16);
+    options.window_size = 0;
+    check("Lock-step transfer with io_uring", run_clients(port, 1, "boot.img", &options) == 1);
+    if (server.server.uring.ring_fd >= 0) {
+        tftp_uring *ring = &server.server.uring;
+        check("Blocks read through io_uring", ring->reads > 0 && ring->failed_reads == 0 && ring->sends > 0);
+        // Completions are reaped by the event loop, the sessions only end once nothing of theirs is in flight
+        check("Nothing left in flight with io_uring", wait_for_idle(&server) &&
+              ring->first_message == ring->next_message && ring->arena_head == ring->arena_tail);
+    }
+    stop_server(&server);
+}
+
+void test_pooled_sessions() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.huge_pages = 1;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+    test_options options = {1428, 8, 0};
+    int warm = run_clients(port, 32, "boot.img", &options) == 32 && wait_for_idle(&server);
+    long allocations = server.server.pool.allocations;
+    long slabs = server.server.pool.slab_count;
+    options.block_size = 1024;
+    int steady = run_clients(port, 32, "boot.img", &options) == 32 && wait_for_idle(&server);
+    printf("Pool: %li buffers carved from %li slabs (%li huge), %li reuses\n", server.server.pool.allocations,
+           server.server.pool.slab_count, server.server.pool.huge_slab_count, server.server.pool.reuses);
+    check("Pooled transfers", warm && steady);
+    check("No allocations in steady state",
+          server.server.pool.allocations == allocations && server.server.pool.slab_count == slabs);
+    stop_server(&server);
+}
+
+void test_cache() {
+    test_options options = {1428, 16, 0};
+    tftp_cache cache;
+    tftp_cache_init(&cache, TEST_FILE_SIZE + TEST_FILE_SIZE / 2);
+
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.cache = &cache;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+
+    // Transfers that start before the file is loaded are sent from it, like the first one
+    check("Cached transfers", run_clients(port, 16, "boot.img", &options) == 16);
+    check("Cache loaded the file once",
+          wait_for_count(&cache.loads, 1) && cache.misses >= 1 && cache.hits + cache.misses == 16);
+    check("Transfer after the load sent from the cache",
+          run_clients(port, 1, "boot.img", &options) == 1 && cache.hits + cache.misses == 17 &&
+          cache.hits >= 1 && cache.loads == 1);
+
+    // Change the file on disk, new transfers must see the new contents
+    for (long i = 0; i < TEST_FILE_SIZE; i += 4096) {
+        test_file_content[i]++;
+    }
+    create_test_file("boot.img", test_file_content, TEST_FILE_SIZE);
+    check("Transfer of changed file", run_clients(port, 2, "boot.img", &options) == 2);
+    check("Cache noticed the change", cache.invalidations == 1 && wait_for_count(&cache.loads, 2));
+
+    // Only one of the two files fits in the budget
+    create_test_file("copy.img", test_file_content, TEST_FILE_SIZE);
+    check("Transfer of second file",
+          run_clients(port, 1, "copy.img", &options) == 1 && wait_for_count(&cache.loads, 3));
+    wait_for_idle(&server);
+    check("Transfer of first file",
+          run_clients(port, 1, "boot.img", &options) == 1 && wait_for_count(&cache.loads, 4));
+    printf("Cache: %li hits, %li misses, %li evictions, %li invalidations, %li bypasses\n", cache.hits,
+           cache.misses, cache.evictions, cache.invalidations, cache.bypasses);
+    check("Cache evicted to stay in budget", cache.evictions >= 1 && cache.used <= cache.budget);
+
+    stop_server(&server);
+    remove_test_file("copy.img");
+    tftp_cache_destroy(&cache);
+}
+
+void test_workers() {
+    const int worker_count = 4;
+    tftp_worker workers[worker_count];
+    volatile int running = 1;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    tftp_server_config config = create_test_config();
+
+    if (tftp_workers_start(workers, worker_count, &address, &config, 1, &running) != TFTP_SUCCESS) {
+        check("Start workers", 0);
+        return;
+    }
+    uint16_t port = ntohs(workers[0].server.address.sin_port);
+
+    test_options options = {1024, 0, 0};
+    long start = tftp_server_now_ms();
+    int completed = run_clients(port, TEST_CONCURRENT_CLIENTS, "boot.img", &options);
+    printf("%d of %d concurrent transfers completed on %d workers in %li ms\n", completed, TEST_CONCURRENT_CLIENTS,
+           worker_count, tftp_server_now_ms() - start);
+    check("Concurrent transfers on workers", completed == TEST_CONCURRENT_CLIENTS);
+
+    running = 0;
+    tftp_workers_join(workers, worker_count);
+
+    int idle_workers = 0;
+    for (int i = 0; i < worker_count; i++) {
+        idle_workers += workers[i].server.completed_count == 0;
+    }
+    check("Requests spread over workers", idle_workers == 0);
 }
 
 
 void run_test(){
-    uint8_t weird_packet[] = {
-            0x00, 0x01, 0x73, 0x79, 0x73, 0x6c, 0x69, 0x6e, 0x75, 0x78, 0x2e, 0x65,
-            0x66, 0x69, 0x36, 0x34, 0x00, 0x6f, 0x63, 0x74, 0x65, 0x74, 0x00, 0x74,
-            0x73, 0x69, 0x7a, 0x65, 0x00, 0x30, 0x00, 0x62, 0x6c, 0x6b, 0x73, 0x69,
-            0x7a, 0x65, 0x00, 0x31, 0x34, 0x36, 0x38, 0x00, 0x77, 0x69, 0x6e, 0x64,
-            0x6f, 0x77, 0x73, 0x69, 0x7a, 0x65, 0x00, 0x34, 0x00, 0x00, 0x31, 0x34,
-            0x30, 0x38, 0x00, 0x00, 0x30, 0x00, 0x62, 0x6c, 0x6b, 0x73, 0x69, 0x7a,
-            0x65, 0x00, 0x31, 0x34, 0x30, 0x38, 0x00
-    };
-    test_request("Weird packet", weird_packet, sizeof(weird_packet));
-
-    uint8_t illegal_opcode[] = {0x00, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00};
-    test_request("Illegal request", illegal_opcode, sizeof(illegal_opcode));
-
-    uint8_t invalid_data[] = {0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01};
-    test_request("Invalid data", invalid_data, sizeof(invalid_data));
-}
-
-void test_request(const char *test_name, const uint8_t *data, const int data_length){
-    tftp_packet_request request = {};
+    for (int i = 0; i < TFTP_PARSE_CORPUS_SIZE; i++) {
+        const tftp_parse_case *parse_case = &tftp_parse_corpus[i];
+        test_request(parse_case->name, parse_case->data, parse_case->length, parse_case->result);
+    }
+
+    tftp_packet_request request;
+    const tftp_parse_case *pxe = &tftp_parse_corpus[4];
+    tftp_parse_packet_request(&request, pxe->data, pxe->length);
+    check("Filename points into the datagram", request.filename == (const char *) pxe->data + 2 &&
+                                               request.filename_length == 10 && strcmp(request.mode, "octet") == 0);
+    check("PXE options", request.has_transfer_size && request.transfer_size == 0 && request.block_size == 1456);
+
+    tftp_parse_packet_request(&request, tftp_parse_corpus[5].data, tftp_parse_corpus[5].length);
+    check("Option names ignore case", request.block_size == 8192 && request.window_size == 16 && request.timeout == 2);
+
+    tftp_parse_packet_request(&request, tftp_parse_corpus[6].data, tftp_parse_corpus[6].length);
+    check("Out of range values get defaults", request.has_block_size && request.block_size == 512 &&
+                                              request.timeout == 5 && !request.has_window_size &&
+                                              request.has_transfer_size && request.transfer_size == 0);
+
+    tftp_parse_packet_request(&request, tftp_parse_corpus[9].data, tftp_parse_corpus[9].length);
+    check("Option with cut off value ignored", !request.has_block_size && request.block_size == 512);
+
+    uint8_t long_name[4 + TFTP_MAX_FILENAME_LENGTH + 7];
+    memset(long_name, 'a', sizeof(long_name));
+    long_name[0] = 0;
+    long_name[1] = TFTP_OPCODE_READ_REQUEST;
+    memcpy(long_name + 3 + TFTP_MAX_FILENAME_LENGTH, "\0octet", 7);
+    test_request("Filename too long", long_name, sizeof(long_name), TFTP_INVALID_NAME);
+}
+
+void test_request(const char *test_name, const uint8_t *data, const int data_length, int expected){
+    tftp_packet_request request;
     int result = tftp_parse_packet_request(&request, data, data_length);
-    printf("Test \"%s\" result: %d\n", test_name, result);
+    check(test_name, result == expected);
+}
+
+
+// Request a file and return the error code the server answered with, or -1 if it did not send an error
+int request_error(uint16_t port, const char *filename, uint16_t *from_port) {
+    test_options options = {0, 0, 0};
+    test_client client;
+    memset(&client, 0, sizeof(client));
+    client.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client.server.sin_family = AF_INET;
+    client.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client.server.sin_port = htons(port);
+    uint8_t packet[600];
+    client_send(&client, packet, build_request(packet, filename, &options));
+
+    struct pollfd fd = {client.socket, POLLIN, 0};
+    int error_code = -1;
+    if (poll(&fd, 1, 1000) == 1) {
+        struct sockaddr_in from;
+        socklen_t from_size = sizeof(from);
+        int received = recvfrom(client.socket, packet, sizeof(packet), 0, (struct sockaddr *) &from, &from_size);
+        if (received >= 4 && packet[1] == TFTP_OPCODE_ERROR) {
+            error_code = (packet[2] << 8u) + packet[3];
+            *from_port = ntohs(from.sin_port);
+        }
+    }
+    close(client.socket);
+    return error_code;
+}
+
+void test_negative_cache() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+    uint16_t from_port = 0;
+
+    check("Missing file", request_error(port, "pxelinux.img", &from_port) == TFTP_ERROR_ENOENT);
+    check("Missing file again", request_error(port, "pxelinux.img", &from_port) == TFTP_ERROR_ENOENT);
+    check("Negative hit answered from the listening socket",
+          server.server.negative_cache.hits == 1 && from_port == port);
+
+    // The file appearing must invalidate the cache
+    create_test_file("pxelinux.img", test_file_content, TEST_FILE_SIZE);
+    usleep(100 * 1000);
+    test_options options = {0, 0, 0};
+    check("Transfer of created file", run_clients(port, 1, "pxelinux.img", &options) == 1);
+    check("Negative cache flushed", server.server.negative_cache.flushes == 1);
+
+    stop_server(&server);
+    remove_test_file("pxelinux.img");
+}
+
+void test_open_files() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    create_test_file("kernel.img", test_file_content, TEST_FILE_SIZE);
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+    test_options options = {0, 0, 0};
+
+    check("Transfer of file", run_clients(port, 1, "kernel.img", &options) == 1);
+    check("Transfer of open file", run_clients(port, 1, "/kernel.img", &options) == 1);
+    check("Second request opened from the cache", server.server.files.hits == 1);
+
+    // Replacing the file must not serve the old one
+    create_test_file("kernel.img.new", test_file_content, TEST_FILE_SIZE);
+    char from[512], to[512];
+    snprintf(from, sizeof(from), "%s/kernel.img.new", test_root);
+    snprintf(to, sizeof(to), "%s/kernel.img", test_root);
+    rename(from, to);
+    usleep(100 * 1000);
+    check("Transfer of replaced file", run_clients(port, 1, "kernel.img", &options) == 1);
+    check("Replaced file invalidated", server.server.files.invalidations == 1 && server.server.files.hits == 1);
+
+    // A symlink out of the root must not be followed
+    char escape[512];
+    snprintf(escape, sizeof(escape), "%s/escape.img", test_root);
+    symlink("/etc/hostname", escape);
+    uint16_t from_port = 0;
+    int error_code = request_error(port, "escape.img", &from_port);
+    check("Symlink out of the root refused", !server.server.files.beneath ||
+                                             error_code == TFTP_ERROR_ACCESS_VIOLATION);
+
+    stop_server(&server);
+    unlink(escape);
+    remove_test_file("kernel.img");
+}
+
+void multicast_send_ack(multicast_client *client) {
+    uint8_t ack[4] = {0, TFTP_OPCODE_ACKNOWLEDGEMENT, client->contiguous >> 8u, client->contiguous & 0xffu};
+    sendto(client->socket, ack, sizeof(ack), 0, (struct sockaddr *) &client->server, sizeof(client->server));
 }
 
+void multicast_send_request(multicast_client *client) {
+    uint8_t request[600];
+    test_options options = {TEST_MULTICAST_BLOCK_SIZE, 0, 0};
+    int length = build_request(request, "boot.img", &options);
+    strcpy((char *) request + length, TFTP_MULTICAST_STRING);
+    length += strlen(TFTP_MULTICAST_STRING) + 2;
+    request[length - 1] = 0;
+    sendto(client->socket, request, length, 0, (struct sockaddr *) &client->server, sizeof(client->server));
+}
+
+int multicast_join(multicast_client *client, const char *value) {
+    char address[64];
+    int port;
+    if (sscanf(value, "%63[^,],%d,%d", address, &port, &client->master) != 3) {
+        return TFTP_ERROR;
+    }
+    if (client->group_socket >= 0) {
+        return TFTP_SUCCESS;
+    }
+    struct sockaddr_in group;
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(port);
+    inet_aton(address, &group.sin_addr);
+    struct ip_mreq membership;
+    membership.imr_multiaddr = group.sin_addr;
+    membership.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+
+    int enable = 1;
+    client->group_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (setsockopt(client->group_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+        bind(client->group_socket, (struct sockaddr *) &group, sizeof(group)) != 0 ||
+        setsockopt(client->group_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0) {
+        return TFTP_ERROR;
+    }
+    return TFTP_SUCCESS;
+}
+
+void multicast_receive(multicast_client *client, int from_group) {
+    uint8_t buffer[4 + TEST_MULTICAST_BLOCK_SIZE];
+    struct sockaddr_in from;
+    socklen_t from_size = sizeof(from);
+    int received = recvfrom(from_group ? client->group_socket : client->socket, buffer, sizeof(buffer) - 1,
+                            MSG_DONTWAIT, (struct sockaddr *) &from, &from_size);
+    if (received < 4) {
+        return;
+    }
+    uint16_t opcode = (buffer[0] << 8u) + buffer[1];
+    if (!from_group && opcode == TFTP_OPCODE_OACK) {
+        client->server = from;
+        client->has_tid = 1;
+        buffer[received] = 0;
+        char *option = (char *) buffer + 2;
+        char *end = (char *) buffer + received;
+        int joined = 0;
+        while (option < end) {
+            char *value = option + strlen(option) + 1;
+            if (value < end && strcmp(option, TFTP_MULTICAST_STRING) == 0) {
+                joined = multicast_join(client, value) == TFTP_SUCCESS;
+            }
+            option = value + strlen(value) + 1;
+        }
+        client->failed |= !joined;
+        if (client->master) {
+            multicast_send_ack(client);
+        }
+    } else if (from_group && opcode == TFTP_OPCODE_DATA) {
+        uint16_t block_num = (buffer[2] << 8u) + buffer[3];
+        long offset = (long) (block_num - 1) * TEST_MULTICAST_BLOCK_SIZE;
+        int data_size = received - 4;
+        if (block_num < 1 || block_num > TEST_MULTICAST_BLOCKS || offset + data_size > TEST_FILE_SIZE ||
+            memcmp(buffer + 4, test_file_content + offset, data_size) != 0) {
+            client->failed = 1;
+            return;
+        }
+        client->received_blocks[block_num] = 1;
+        long previous = client->contiguous;
+        while (client->contiguous < TEST_MULTICAST_BLOCKS && client->received_blocks[client->contiguous + 1]) {
+            client->contiguous++;
+        }
+        if (client->master && (client->contiguous != previous || block_num > client->contiguous + 1)) {
+            multicast_send_ack(client);
+        }
+    } else if (!from_group) {
+        client->failed = 1;
+    }
+}
+
+// Fetch the metrics page from the exporter's Unix socket, returns its length including the HTTP header
+int fetch_metrics(const char *path, char *response, int size) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(client, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(client);
+        return -1;
+    }
+    const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    send(client, request, strlen(request), 0);
+    int length = 0;
+    int received;
+    while (length < size - 1 && (received = recv(client, response + length, size - 1 - length, 0)) > 0) {
+        length += received;
+    }
+    response[length] = 0;
+    close(client);
+    return length;
+}
+
+long metric_value(const char *page, const char *name) {
+    char line[128];
+    snprintf(line, sizeof(line), "\n%s ", name);
+    const char *found = strstr(page, line);
+    return found == NULL ? -1 : strtol(found + strlen(line), NULL, 10);
+}
+
+void test_metrics() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+    tftp_metrics_exporter exporter;
+    tftp_metrics_exporter_init(&exporter, NULL);
+    tftp_metrics_exporter_add(&exporter, &server.server.metrics);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/metrics.sock", test_root);
+    // A regular file in the way is left alone
+    create_test_file("metrics.sock", test_file_content, 16);
+    tftp_metrics_exporter blocked;
+    tftp_metrics_exporter_init(&blocked, NULL);
+    struct stat stats;
+    check("Metrics exporter leaves other files alone",
+          tftp_metrics_exporter_start(&blocked, path) != TFTP_SUCCESS && stat(path, &stats) == 0 &&
+          S_ISREG(stats.st_mode));
+    remove_test_file("metrics.sock");
+    check("Start metrics exporter", tftp_metrics_exporter_start(&exporter, path) == TFTP_SUCCESS);
+
+    test_options options = {1024, 0, 0};
+    uint16_t from_port = 0;
+    check("Transfers with metrics", run_clients(port, 2, "boot.img", &options) == 2);
+    check("Missing file with metrics", request_error(port, "missing.img", &from_port) == TFTP_ERROR_ENOENT);
+    wait_for_idle(&server);
+    // Counters kept elsewhere are published at the end of an event loop iteration
+    usleep(2 * TFTP_SERVER_TICK_MS * 1000);
+
+    int size = TFTP_METRICS_RESPONSE_SIZE + 1024;
+    char *page = malloc(size);
+    int length = fetch_metrics(path, page, size);
+    check("Metrics served over HTTP", length > 0 && strncmp(page, "HTTP/1.0 200 OK", 15) == 0);
+    check("Requests, transfers and errors counted", metric_value(page, "tftp_read_requests_total") == 3 &&
+                                                    metric_value(page, "tftp_transfers_completed_total") == 2 &&
+                                                    metric_value(page, "tftp_errors_total{code=\"1\"}") == 1 &&
+                                                    metric_value(page, "tftp_sessions_active") == 0);
+    check("Blocks and bytes counted", metric_value(page, "tftp_blocks_sent_total") >= 2 * 201 &&
+                                      metric_value(page, "tftp_bytes_sent_total") >= 2 * TEST_FILE_SIZE);
+    check("Latency histograms", metric_value(page, "tftp_open_seconds_count") == 3 &&
+                                metric_value(page, "tftp_first_block_seconds_count") == 2 &&
+                                metric_value(page, "tftp_transfer_seconds_bucket{le=\"+Inf\"}") == 2);
+    free(page);
+
+    tftp_metrics_exporter_stop(&exporter);
+    stop_server(&server);
+}
+
+void test_multicast() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    inet_aton("239.255.69.69", &config.multicast_address);
+    config.multicast_port = 20000 + getpid() % 20000;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+
+    // The last client only joins once the transfer is well underway, and has to catch up on the blocks it missed
+    const int count = TEST_MULTICAST_CLIENTS + 1;
+    multicast_client *clients = calloc(count, sizeof(multicast_client));
+    struct pollfd fds[2 * count];
+    for (int i = 0; i < count; i++) {
+        clients[i].socket = socket(AF_INET, SOCK_DGRAM, 0);
+        clients[i].group_socket = -1;
+        clients[i].server.sin_family = AF_INET;
+        clients[i].server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        clients[i].server.sin_port = htons(port);
+        if (i < TEST_MULTICAST_CLIENTS) {
+            multicast_send_request(&clients[i]);
+        }
+    }
+
+    int late_joined = 0;
+    int remaining = count;
+    long deadline = tftp_server_now_ms() + 10000;
+    while ((remaining > 0 || server.server.session_count > 0) && tftp_server_now_ms() < deadline) {
+        if (!late_joined && clients[0].contiguous >= TEST_MULTICAST_BLOCKS / 4) {
+            multicast_send_request(&clients[count - 1]);
+            late_joined = 1;
+        }
+        for (int i = 0; i < count; i++) {
+            fds[2 * i].fd = clients[i].socket;
+            fds[2 * i].events = POLLIN;
+            fds[2 * i + 1].fd = clients[i].group_socket;
+            fds[2 * i + 1].events = POLLIN;
+        }
+        poll(fds, 2 * count, 10);
+        remaining = 0;
+        for (int i = 0; i < count; i++) {
+            if (fds[2 * i].revents & POLLIN) {
+                multicast_receive(&clients[i], 0);
+            }
+            if (fds[2 * i + 1].revents & POLLIN) {
+                multicast_receive(&clients[i], 1);
+            }
+            remaining += clients[i].contiguous != TEST_MULTICAST_BLOCKS && !clients[i].failed;
+        }
+    }
+
+    int completed = 0;
+    for (int i = 0; i < count; i++) {
+        completed += clients[i].contiguous == TEST_MULTICAST_BLOCKS && !clients[i].failed;
+        close(clients[i].socket);
+        if (clients[i].group_socket >= 0) {
+            close(clients[i].group_socket);
+        }
+    }
+    printf("%d of %d multicast clients completed, %li DATA packets sent for %d blocks\n", completed, count,
+           server.server.batch.sent_packets, TEST_MULTICAST_BLOCKS);
+    check("Multicast transfers", completed == count && late_joined);
+    check("Every client was master once", server.server.completed_count == count);
+    check("Multicast sent blocks to the group", server.server.batch.sent_packets < 2 * TEST_MULTICAST_BLOCKS);
+
+    free(clients);
+    stop_server(&server);
+}
+
+// Upload the test file with RFC 7440 windows, returns the error code the server answered with or -1 on success
+int upload_file(uint16_t port, const char *filename, const test_options *options) {
+    int block_size = options->block_size == 0 ? 512 : options->block_size;
+    int window_size = options->window_size == 0 ? 1 : options->window_size;
+    long block_count = TEST_FILE_SIZE / block_size + 1;
+
+    test_client client;
+    memset(&client, 0, sizeof(client));
+    client.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client.server.sin_family = AF_INET;
+    client.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client.server.sin_port = htons(port);
+
+    uint8_t *packet = malloc(4 + block_size);
+    int length = build_request(packet, filename, options);
+    packet[1] = TFTP_OPCODE_WRITE_REQUEST;
+    length += tftp_write_number_option(packet + length, TFTP_TSIZE_STRING, TEST_FILE_SIZE);
+    client_send(&client, packet, length);
+
+    struct pollfd fd = {client.socket, POLLIN, 0};
+    long acked = -1;
+    int error_code = -2;
+    int timeouts = 0;
+    while (error_code == -2 && timeouts < 5) {
+        if (poll(&fd, 1, 1000) != 1) {
+            // Go back to the block after the last acknowledged one
+            timeouts++;
+            if (acked < 0) {
+                continue;
+            }
+        } else {
+            struct sockaddr_in from;
+            socklen_t from_size = sizeof(from);
+            int received = recvfrom(client.socket, packet, 4 + block_size, 0, (struct sockaddr *) &from, &from_size);
+            uint16_t opcode = (packet[0] << 8u) + packet[1];
+            uint16_t block_num = (packet[2] << 8u) + packet[3];
+            client.server = from;
+            if (received < 4 || opcode == TFTP_OPCODE_ERROR) {
+                error_code = received < 4 ? 0 : block_num;
+                break;
+            } else if (opcode == TFTP_OPCODE_OACK) {
+                acked = 0;
+            } else if (opcode == TFTP_OPCODE_ACKNOWLEDGEMENT) {
+                // Block numbers do not wrap for a file this small
+                if (block_num <= acked) {
+                    continue;
+                }
+                acked = block_num;
+            }
+            if (acked == block_count) {
+                error_code = -1;
+                break;
+            }
+        }
+        for (long block = acked + 1; block <= acked + window_size && block <= block_count; block++) {
+            long offset = (block - 1) * block_size;
+            int data_size = TEST_FILE_SIZE - offset < block_size ? (int) (TEST_FILE_SIZE - offset) : block_size;
+            packet[0] = 0;
+            packet[1] = TFTP_OPCODE_DATA;
+            packet[2] = block >> 8u;
+            packet[3] = block & 0xffu;
+            memcpy(packet + 4, test_file_content + offset, data_size);
+            client_send(&client, packet, 4 + data_size);
+        }
+    }
+    free(packet);
+    close(client.socket);
+    return error_code;
+}
+
+int test_file_matches(const char *name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", test_root, name);
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    uint8_t *content = malloc(TEST_FILE_SIZE + 1);
+    long size = fread(content, 1, TEST_FILE_SIZE + 1, file);
+    fclose(file);
+    int matches = size == TEST_FILE_SIZE && memcmp(content, test_file_content, TEST_FILE_SIZE) == 0;
+    free(content);
+    return matches;
+}
+
+void test_upload() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    test_options options = {1428, 8, 0};
+    uint16_t port = ntohs(server.server.address.sin_port);
+    check("Uploads refused unless allowed", upload_file(port, "upload.img", &options) == TFTP_ERROR_ACCESS_VIOLATION);
+    stop_server(&server);
+
+    config.allow_uploads = 1;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    port = ntohs(server.server.address.sin_port);
+    check("Windowed upload", upload_file(port, "upload.img", &options) == -1);
+    check("Existing file is not overwritten",
+          upload_file(port, "upload.img", &options) == TFTP_ERROR_FILE_EXISTS);
+    options.window_size = 0;
+    options.block_size = 512;
+    check("Lock-step upload", upload_file(port, "upload-512.img", &options) == -1);
+    check("Upload sessions ended", wait_for_idle(&server));
+    stop_server(&server);
+
+    check("Uploaded file is complete", test_file_matches("upload.img") && test_file_matches("upload-512.img"));
+    check("Uploaded blocks written behind", server.server.writer.writes > 0 && server.server.writer.syncs == 2);
+    remove_test_file("upload.img");
+    remove_test_file("upload-512.img");
+}
+
+void test_socket_pool() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.socket_pool_size = 4;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+    test_options options = {1024, 4, 0};
+    int transferred = 1;
+    for (int i = 0; i < 8; i++) {
+        transferred = transferred && run_clients(port, 1, "boot.img", &options) == 1 && wait_for_idle(&server);
+    }
+    check("Transfers on pooled sockets", transferred);
+    check("Session sockets reused", server.server.sockets.reused == 8 && server.server.sockets.created == 0);
+
+    // An ACK from another port must not move the transfer along
+    options.window_size = 0;
+    test_client client;
+    memset(&client, 0, sizeof(client));
+    client.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client.server.sin_family = AF_INET;
+    client.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client.server.sin_port = server.server.address.sin_port;
+    uint8_t packet[1500];
+    client_send(&client, packet, build_request(packet, "boot.img", &options));
+    struct pollfd fd = {client.socket, POLLIN, 0};
+    socklen_t from_size = sizeof(client.server);
+    int oack = poll(&fd, 1, 2000) == 1 &&
+               recvfrom(client.socket, packet, sizeof(packet), 0, (struct sockaddr *) &client.server, &from_size) > 0 &&
+               packet[1] == TFTP_OPCODE_OACK;
+    client_send_ack(&client, 0);
+    int first = oack ? receive_data_block(&client, packet, sizeof(packet)) : -1;
+
+    test_client stranger = client;
+    stranger.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client_send_ack(&stranger, 1);
+    // Only a retransmission of the first block may show up in the meantime
+    int ignored = poll(&fd, 1, 100) == 0 || receive_data_block(&client, packet, sizeof(packet)) == 1;
+    client_send_ack(&client, 1);
+    int second;
+    do {
+        second = receive_data_block(&client, packet, sizeof(packet));
+    } while (second == 1);
+    close(stranger.socket);
+    close(client.socket);
+    check("Stray TID ignored by a connected session socket", first == 1 && ignored && second == 2);
+    stop_server(&server);
+
+    // A pooled socket keeps its port from one client to the next
+    tftp_socket_pool pool;
+    tftp_sockets_init(&pool, 1);
+    struct sockaddr_in peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+    peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    peer.sin_port = htons(9);
+    struct sockaddr_in bound[2];
+    for (int i = 0; i < 2; i++) {
+        int pooled_socket = tftp_sockets_get(&pool, (struct sockaddr *) &peer, sizeof(peer));
+        socklen_t bound_size = sizeof(bound[i]);
+        getsockname(pooled_socket, (struct sockaddr *) &bound[i], &bound_size);
+        tftp_sockets_put(&pool, pooled_socket);
+        peer.sin_port = htons(10);
+    }
+    check("Pooled socket keeps its port", pool.reused == 2 && bound[0].sin_port != 0 &&
+                                          bound[0].sin_port == bound[1].sin_port);
+    tftp_sockets_destroy(&pool);
+}
+
+void test_demux() {
+    // The table on its own, grown well past its initial size
+    tftp_demux demux;
+    int entry_count = 4 * TFTP_DEMUX_MIN_BUCKETS;
+    tftp_demux_entry *entries = calloc(entry_count, sizeof(tftp_demux_entry));
+    int found = tftp_demux_init(&demux, 2) == TFTP_SUCCESS;
+    struct sockaddr_in client;
+    memset(&client, 0, sizeof(client));
+    client.sin_family = AF_INET;
+    for (int i = 0; i < entry_count; i++) {
+        client.sin_addr.s_addr = htonl(0x0a000000 + i / 2);
+        client.sin_port = htons(1024 + i % 2);
+        tftp_demux_init_entry(&entries[i], &entries[i]);
+        tftp_demux_insert(&demux.table, &entries[i], tftp_demux_next_socket(&demux), &client);
+    }
+    for (int i = 0; i < entry_count; i += 2) {
+        tftp_demux_remove(&demux.table, &entries[i]);
+    }
+    for (int i = 0; i < entry_count; i++) {
+        client.sin_addr.s_addr = htonl(0x0a000000 + i / 2);
+        client.sin_port = htons(1024 + i % 2);
+        found = found && tftp_demux_find(&demux.table, entries[i].socket_index < 0 ? 0 : entries[i].socket_index,
+                                         &client) == (i % 2 == 0 ? NULL : &entries[i]);
+    }
+    check("Transfers found by client address and port",
+          found && demux.table.count == entry_count / 2 && demux.table.bucket_count >= entry_count / 2);
+    tftp_demux_destroy(&demux);
+    free(entries);
+
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.demux_sockets = 2;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+    uint16_t port = ntohs(server.server.address.sin_port);
+    test_options options = {1024, 4, 0};
+    check("Concurrent transfers over shared sockets",
+          run_clients(port, 16, "boot.img", &options) == 16 && wait_for_idle(&server));
+    check("Shared sockets only", server.server.sockets.reused == 0 && server.server.demux.table.count == 0);
+
+    // A packet from another port gets an unknown TID error, and the transfer carries on
+    options.window_size = 0;
+    test_client client_one;
+    memset(&client_one, 0, sizeof(client_one));
+    client_one.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client_one.server.sin_family = AF_INET;
+    client_one.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client_one.server.sin_port = server.server.address.sin_port;
+    uint8_t packet[1500];
+    client_send(&client_one, packet, build_request(packet, "boot.img", &options));
+    struct pollfd fd = {client_one.socket, POLLIN, 0};
+    socklen_t from_size = sizeof(client_one.server);
+    int oack = poll(&fd, 1, 2000) == 1 &&
+               recvfrom(client_one.socket, packet, sizeof(packet), 0, (struct sockaddr *) &client_one.server,
+                        &from_size) > 0 && packet[1] == TFTP_OPCODE_OACK;
+    client_send_ack(&client_one, 0);
+    int first = oack ? receive_data_block(&client_one, packet, sizeof(packet)) : -1;
+
+    test_client stranger = client_one;
+    stranger.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client_send_ack(&stranger, 1);
+    struct pollfd stranger_fd = {stranger.socket, POLLIN, 0};
+    int error = poll(&stranger_fd, 1, 2000) == 1 && recv(stranger.socket, packet, sizeof(packet), 0) >= 4 &&
+                packet[1] == TFTP_OPCODE_ERROR && packet[3] == TFTP_ERROR_UNKNOWN_TID;
+    client_send_ack(&client_one, 1);
+    int second;
+    do {
+        second = receive_data_block(&client_one, packet, sizeof(packet));
+    } while (second == 1);
+    close(stranger.socket);
+    close(client_one.socket);
+    check("Unknown TID answered with an error", error && server.server.unknown_tids == 1);
+    check("Transfer not disturbed by an unknown TID", first == 1 && second == 2);
+    stop_server(&server);
+}
+
+void test_duplicate_requests() {
+    test_server server;
+    tftp_server_config config = create_test_config();
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        return;
+    }
+
+    test_options options = {1024, 0, 0};
+    test_client client;
+    memset(&client, 0, sizeof(client));
+    client.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client.server.sin_family = AF_INET;
+    client.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client.server.sin_port = server.server.address.sin_port;
+    struct sockaddr_in listener = client.server;
+    uint8_t request[256];
+    int request_length = build_request(request, "boot.img", &options);
+    uint8_t packet[1500];
+    struct pollfd fd = {client.socket, POLLIN, 0};
+    socklen_t from_size = sizeof(client.server);
+
+    // Sent again before the OACK was acknowledged, the same transfer sends it again
+    int oacks = 0;
+    uint16_t session_ports[2] = {0, 0};
+    for (int i = 0; i < 2; i++) {
+        sendto(client.socket, request, request_length, 0, (struct sockaddr *) &listener, sizeof(listener));
+        oacks += poll(&fd, 1, 2000) == 1 &&
+                 recvfrom(client.socket, packet, sizeof(packet), 0, (struct sockaddr *) &client.server,
+                          &from_size) > 0 && packet[1] == TFTP_OPCODE_OACK;
+        session_ports[i] = client.server.sin_port;
+    }
+    int one_session = server.server.session_count == 1;
+
+    // Late once the transfer is underway, it is ignored
+    client_send_ack(&client, 0);
+    int block = receive_data_block(&client, packet, sizeof(packet));
+    sendto(client.socket, request, request_length, 0, (struct sockaddr *) &listener, sizeof(listener));
+    int last_block = block;
+    while (block > 0) {
+        client_send_ack(&client, block);
+        last_block = block;
+        block = receive_data_block(&client, packet, sizeof(packet));
+    }
+    close(client.socket);
+    int idle = wait_for_idle(&server);
+
+    check("Retransmitted request answered by its transfer",
+          oacks == 2 && session_ports[0] == session_ports[1] && one_session);
+    check("Transfer completed after retransmitted requests",
+          idle && last_block > 1 && server.server.completed_count == 1);
+    check("Retransmitted requests counted",
+          server.server.duplicate_requests == 2 && server.server.metrics.duplicate_requests == 2);
+    stop_server(&server);
+}
+
+void test_read_ahead() {
+    // Through a mapping and with pread, then with read-ahead left to the kernel
+    static const long mmap_thresholds[] = {TFTP_SESSION_DEFAULT_MMAP_THRESHOLD, 0, 0};
+    static const long max_prefetches[] = {TFTP_SESSION_DEFAULT_MAX_PREFETCH, TFTP_SESSION_DEFAULT_MAX_PREFETCH, 0};
+    long prefetches[3] = {0, 0, 0};
+    int transferred = 1;
+    for (int i = 0; i < 3; i++) {
+        test_server server;
+        tftp_server_config config = create_test_config();
+        config.mmap_threshold = mmap_thresholds[i];
+        config.max_prefetch = max_prefetches[i];
+        if (start_server(&server, &config) != TFTP_SUCCESS) {
+            check("Start server", 0);
+            return;
+        }
+        test_options options = {1024, 8, 0};
+        transferred = transferred && run_clients(ntohs(server.server.address.sin_port), 4, "boot.img", &options) == 4;
+        prefetches[i] = server.server.prefetches;
+        stop_server(&server);
+    }
+    check("Transfers with read-ahead", transferred);
+    check("Read ahead of the client", prefetches[0] >= 4 && prefetches[1] >= 4 && prefetches[2] == 0);
+
+    // A mapped file that is truncated after the first block ends with a short block at its new size
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.mmap_threshold = 1;
+    create_test_file("shrink.img", test_file_content, TEST_FILE_SIZE);
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        remove_test_file("shrink.img");
+        return;
+    }
+    test_client client;
+    memset(&client, 0, sizeof(client));
+    client.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client.server.sin_family = AF_INET;
+    client.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client.server.sin_port = server.server.address.sin_port;
+    uint8_t packet[600];
+    test_options plain = {0, 0, 0};
+    client_send(&client, packet, build_request(packet, "shrink.img", &plain));
+    struct pollfd fd = {client.socket, POLLIN, 0};
+    socklen_t from_size = sizeof(client.server);
+    int received = poll(&fd, 1, 2000) == 1 ? recvfrom(client.socket, packet, sizeof(packet), 0,
+                                                      (struct sockaddr *) &client.server, &from_size) : -1;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/shrink.img", test_root);
+    int truncated = received == 516 && truncate(path, 600) == 0;
+    client_send_ack(&client, 1);
+    received = poll(&fd, 1, 2000) == 1 ? recv(client.socket, packet, sizeof(packet), 0) : -1;
+    int short_block = received == 4 + 88 && packet[1] == TFTP_OPCODE_DATA && packet[3] == 2 &&
+                      memcmp(packet + 4, test_file_content + 512, 88) == 0;
+    client_send_ack(&client, 2);
+    close(client.socket);
+    check("Mapped file that shrinks ends at its new size", truncated && short_block && wait_for_idle(&server));
+    stop_server(&server);
+    remove_test_file("shrink.img");
+}
+
+void test_warm_set() {
+    // Pinned files are served even by a cache without a budget
+    tftp_cache cache;
+    tftp_cache_init(&cache, 0);
+    tftp_warm_set warm;
+    if (tftp_warm_start(&warm, &cache, test_root, "*.img,missing/*", 1) != TFTP_SUCCESS) {
+        check("Start warm set", 0);
+        tftp_cache_destroy(&cache);
+        return;
+    }
+    check("Pinned matching files at startup", warm.files == 1 && cache.pinned == TEST_FILE_SIZE);
+
+    test_server server;
+    tftp_server_config config = create_test_config();
+    config.cache = &cache;
+    if (start_server(&server, &config) != TFTP_SUCCESS) {
+        check("Start server", 0);
+        tftp_warm_stop(&warm);
+        tftp_cache_destroy(&cache);
+        return;
+    }
+    test_options options = {1024, 4, 0};
+    uint16_t port = ntohs(server.server.address.sin_port);
+    check("Transfers of pinned file", run_clients(port, 3, "boot.img", &options) == 3 && cache.hits == 3);
+    check("Pinned file found under an absolute name",
+          run_clients(port, 1, "/boot.img", &options) == 1 && cache.hits == 4 && cache.bypasses == 0);
+
+    // A transfer that started on the old version keeps it after the new one is swapped in
+    test_client client;
+    memset(&client, 0, sizeof(client));
+    client.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    client.server.sin_family = AF_INET;
+    client.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    client.server.sin_port = server.server.address.sin_port;
+    uint8_t packet[600];
+    test_options plain = {0, 0, 0};
+    client_send(&client, packet, build_request(packet, "boot.img", &plain));
+    struct pollfd fd = {client.socket, POLLIN, 0};
+    int received = poll(&fd, 1, 2000) == 1 ? recv(client.socket, packet, sizeof(packet), MSG_PEEK) : -1;
+
+    uint8_t *old_content = malloc(TEST_FILE_SIZE);
+    memcpy(old_content, test_file_content, TEST_FILE_SIZE);
+    for (long i = 0; i < TEST_FILE_SIZE; i += 4096) {
+        test_file_content[i]++;
+    }
+    create_test_file("boot.img", test_file_content, TEST_FILE_SIZE);
+    int swapped = wait_for_count(&warm.swaps, 1);
+
+    // Blocks the server retransmitted while the file was replaced are skipped
+    long offset = 0;
+    int expected_block = 1;
+    int intact = received > 0;
+    while (intact) {
+        socklen_t from_size = sizeof(client.server);
+        received = poll(&fd, 1, 2000) == 1 ? recvfrom(client.socket, packet, sizeof(packet), 0,
+                                                      (struct sockaddr *) &client.server, &from_size) : -1;
+        if (received < 4 || packet[1] != TFTP_OPCODE_DATA) {
+            intact = 0;
+            break;
+        }
+        if ((packet[2] << 8u) + packet[3] != expected_block) {
+            continue;
+        }
+        intact = offset + received - 4 <= TEST_FILE_SIZE &&
+                 memcmp(packet + 4, old_content + offset, received - 4) == 0;
+        offset += received - 4;
+        client_send_ack(&client, expected_block++);
+        if (received - 4 < 512) {
+            break;
+        }
+    }
+    close(client.socket);
+    free(old_content);
+    check("Changed pinned file swapped in", swapped && cache.pinned == TEST_FILE_SIZE && cache.invalidations == 1);
+    check("Transfer in flight finished with the old version", intact && offset == TEST_FILE_SIZE);
+    check("Transfers after the swap get the new version",
+          run_clients(port, 2, "boot.img", &options) == 2 && cache.hits == 7 && cache.bypasses == 0);
+
+    // New matching files are pinned, and removed files unpinned
+    create_test_file("extra.img", test_file_content, TEST_FILE_SIZE);
+    int added = wait_for_count(&warm.swaps, 2) && cache.pinned == 2 * TEST_FILE_SIZE;
+    remove_test_file("extra.img");
+    int removed = wait_for_count(&warm.removals, 1) && cache.pinned == TEST_FILE_SIZE;
+    check("Watcher follows created and removed files", added && removed);
+
+    wait_for_idle(&server);
+    stop_server(&server);
+    tftp_warm_stop(&warm);
+    tftp_cache_destroy(&cache);
+}
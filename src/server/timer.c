@@ -0,0 +1,178 @@
+/*
+
+    Provide an implementation for timer.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#include <stddef.h>
+#include "timer.h"
+
+#define SLOT_MASK (TFTP_TIMER_SLOTS - 1)
+
+static void list_init(tftp_timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(tftp_timer *head, tftp_timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_remove(tftp_timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// Move every timer in the source list to the end of the destination list
+static void list_splice(tftp_timer *destination, tftp_timer *source) {
+    if (source->next == source) {
+        return;
+    }
+    source->next->prev = destination->prev;
+    destination->prev->next = source->next;
+    source->prev->next = destination;
+    destination->prev = source->prev;
+    list_init(source);
+}
+
+// A timer goes to the finest level that reaches its expiry, in the slot of its expiry time at that level
+static void place(tftp_timer_wheel *wheel, tftp_timer *timer) {
+    long delta = timer->expires_ms - wheel->now_ms;
+    if (delta <= 0) {
+        list_append(&wheel->expired, timer);
+        return;
+    }
+    if (delta > TFTP_TIMER_MAX_MS) {
+        timer->expires_ms = wheel->now_ms + TFTP_TIMER_MAX_MS;
+        delta = TFTP_TIMER_MAX_MS;
+    }
+    int level = 0;
+    while (delta >= 1L << (TFTP_TIMER_LEVEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (int) (timer->expires_ms >> (TFTP_TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+    list_append(&wheel->slots[level][slot], timer);
+}
+
+// The wheel entered a new slot of a coarser level, its timers are spread over the finer levels
+static void cascade(tftp_timer_wheel *wheel, int level, int slot) {
+    tftp_timer pending;
+    list_init(&pending);
+    list_splice(&pending, &wheel->slots[level][slot]);
+    while (pending.next != &pending) {
+        tftp_timer *timer = pending.next;
+        list_remove(timer);
+        place(wheel, timer);
+        wheel->cascaded++;
+    }
+}
+
+void tftp_timer_wheel_init(tftp_timer_wheel *wheel, long now_ms) {
+    wheel->now_ms = now_ms;
+    wheel->count = 0;
+    wheel->cascaded = 0;
+    for (int level = 0; level < TFTP_TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TFTP_TIMER_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    list_init(&wheel->expired);
+}
+
+void tftp_timer_init(tftp_timer *timer, void *context) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires_ms = 0;
+    timer->context = context;
+}
+
+int tftp_timer_armed(const tftp_timer *timer) {
+    return timer->next != NULL;
+}
+
+void tftp_timer_arm(tftp_timer_wheel *wheel, tftp_timer *timer, long expires_ms) {
+    if (tftp_timer_armed(timer)) {
+        list_remove(timer);
+    } else {
+        wheel->count++;
+    }
+    timer->expires_ms = expires_ms;
+    place(wheel, timer);
+}
+
+void tftp_timer_cancel(tftp_timer_wheel *wheel, tftp_timer *timer) {
+    if (tftp_timer_armed(timer)) {
+        list_remove(timer);
+        wheel->count--;
+    }
+}
+
+void tftp_timer_advance(tftp_timer_wheel *wheel, long now_ms) {
+    while (wheel->now_ms < now_ms) {
+        if (wheel->count == 0) {
+            // Nothing to cascade or expire on the way
+            wheel->now_ms = now_ms;
+            return;
+        }
+        wheel->now_ms++;
+        long now = wheel->now_ms;
+        for (int level = 1; level < TFTP_TIMER_LEVELS; level++) {
+            if ((now & ((1L << (TFTP_TIMER_LEVEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            cascade(wheel, level, (int) (now >> (TFTP_TIMER_LEVEL_BITS * level)) & SLOT_MASK);
+        }
+        list_splice(&wheel->expired, &wheel->slots[0][now & SLOT_MASK]);
+    }
+}
+
+tftp_timer *tftp_timer_take_expired(tftp_timer_wheel *wheel) {
+    tftp_timer *timer = wheel->expired.next;
+    if (timer == &wheel->expired) {
+        return NULL;
+    }
+    list_remove(timer);
+    wheel->count--;
+    return timer;
+}
+
+long tftp_timer_next_ms(const tftp_timer_wheel *wheel, long max_ms) {
+    if (wheel->count == 0) {
+        return max_ms;
+    }
+    if (wheel->expired.next != &wheel->expired) {
+        return 0;
+    }
+    // Coarser levels only hand over timers at the start of the next round of level 0
+    long limit = TFTP_TIMER_SLOTS - (wheel->now_ms & SLOT_MASK);
+    if (limit > max_ms) {
+        limit = max_ms;
+    }
+    for (long delta = 1; delta < limit; delta++) {
+        const tftp_timer *slot = &wheel->slots[0][(wheel->now_ms + delta) & SLOT_MASK];
+        if (slot->next != slot) {
+            return delta;
+        }
+    }
+    return limit;
+}
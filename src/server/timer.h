@@ -0,0 +1,72 @@
+/*
+
+    Hierarchical timing wheel, with constant time arming and cancelling of timers
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_TIMER_H
+#define TFTPSERVER_TIMER_H
+
+// Every level has 64 slots, level 0 has a resolution of one millisecond and every next level is 64 times coarser
+#define TFTP_TIMER_LEVEL_BITS 6
+#define TFTP_TIMER_SLOTS (1 << TFTP_TIMER_LEVEL_BITS)
+#define TFTP_TIMER_LEVELS 4
+// About 4.6 hours, timers further away are clamped to this
+#define TFTP_TIMER_MAX_MS ((1L << (TFTP_TIMER_LEVEL_BITS * TFTP_TIMER_LEVELS)) - 1)
+
+typedef struct tftp_timer {
+    struct tftp_timer *next;
+    struct tftp_timer *prev;
+    long expires_ms;
+    void *context;
+} tftp_timer;
+
+typedef struct {
+    // The last millisecond that was processed
+    long now_ms;
+    long count;
+
+    // Circular lists, the slots themselves are the list heads
+    tftp_timer slots[TFTP_TIMER_LEVELS][TFTP_TIMER_SLOTS];
+    // Timers that expired but were not taken yet
+    tftp_timer expired;
+
+    long cascaded;
+} tftp_timer_wheel;
+
+void tftp_timer_wheel_init(tftp_timer_wheel *wheel, long now_ms);
+
+void tftp_timer_init(tftp_timer *timer, void *context);
+
+int tftp_timer_armed(const tftp_timer *timer);
+
+// Arms the timer, or moves it if it was armed already
+void tftp_timer_arm(tftp_timer_wheel *wheel, tftp_timer *timer, long expires_ms);
+
+void tftp_timer_cancel(tftp_timer_wheel *wheel, tftp_timer *timer);
+
+// Moves every timer that expired at or before now_ms to the expired list
+void tftp_timer_advance(tftp_timer_wheel *wheel, long now_ms);
+
+// Takes the next expired timer off the list and disarms it, or returns NULL
+tftp_timer *tftp_timer_take_expired(tftp_timer_wheel *wheel);
+
+// Milliseconds until the next timer could expire, at most max_ms
+long tftp_timer_next_ms(const tftp_timer_wheel *wheel, long max_ms);
+
+#endif //TFTPSERVER_TIMER_H
@@ -0,0 +1,102 @@
+/*
+
+    Microbenchmark of the timing wheel, the cost per operation should not depend on the number of timers
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "timer.h"
+
+// Timeouts are spread over this many milliseconds, enough to use the first three levels
+#define BENCH_SPREAD_MS 10000
+
+static uint32_t random_state = 1;
+
+static long random_delay() {
+    random_state ^= random_state << 13u;
+    random_state ^= random_state >> 17u;
+    random_state ^= random_state << 5u;
+    return 1 + random_state % BENCH_SPREAD_MS;
+}
+
+static long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void run(long count) {
+    tftp_timer_wheel *wheel = malloc(sizeof(tftp_timer_wheel));
+    tftp_timer *timers = malloc(count * sizeof(tftp_timer));
+    tftp_timer_wheel_init(wheel, 0);
+    for (long i = 0; i < count; i++) {
+        tftp_timer_init(&timers[i], NULL);
+    }
+
+    long start = now_ns();
+    for (long i = 0; i < count; i++) {
+        tftp_timer_arm(wheel, &timers[i], wheel->now_ms + random_delay());
+    }
+    double arm = (double) (now_ns() - start) / count;
+
+    // As every acknowledgement does
+    start = now_ns();
+    for (long i = 0; i < count; i++) {
+        tftp_timer_arm(wheel, &timers[i], wheel->now_ms + random_delay());
+    }
+    double rearm = (double) (now_ns() - start) / count;
+
+    start = now_ns();
+    for (long i = 0; i < count; i += 2) {
+        tftp_timer_cancel(wheel, &timers[i]);
+    }
+    double cancel = (double) (now_ns() - start) / ((count + 1) / 2);
+    for (long i = 0; i < count; i += 2) {
+        tftp_timer_arm(wheel, &timers[i], wheel->now_ms + random_delay());
+    }
+
+    // One loop iteration per millisecond, every expired timer is taken in a batch
+    long expired = 0;
+    start = now_ns();
+    for (long ms = 1; ms <= BENCH_SPREAD_MS; ms++) {
+        tftp_timer_advance(wheel, ms);
+        while (tftp_timer_take_expired(wheel) != NULL) {
+            expired++;
+        }
+    }
+    double expiry = (double) (now_ns() - start) / count;
+
+    printf("%10li %10.1f %10.1f %10.1f %10.1f %12li%s\n", count, arm, rearm, cancel, expiry, wheel->cascaded,
+           expired == count ? "" : " (timers lost)");
+    free(timers);
+    free(wheel);
+}
+
+int main(int argc, char **argv) {
+    long max_count = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+    printf("%10s %10s %10s %10s %10s %12s\n", "timers", "arm ns", "re-arm ns", "cancel ns", "expire ns", "cascaded");
+    for (long count = 1000; count <= max_count; count *= 10) {
+        run(count);
+    }
+    return 0;
+}
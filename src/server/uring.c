@@ -0,0 +1,506 @@
+/*
+
+    Provide an implementation for uring.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "uring.h"
+
+#ifdef TFTP_HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#define USER_DATA_SEND 1u
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int ring_fd, unsigned opcode, const void *argument, unsigned count) {
+    return (int) syscall(__NR_io_uring_register, ring_fd, opcode, argument, count);
+}
+
+static struct io_uring_sqe *next_sqe(tftp_uring *ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void set_file(struct io_uring_sqe *sqe, int fixed_index, int file_descriptor) {
+    if (fixed_index >= 0) {
+        sqe->fd = fixed_index;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = file_descriptor;
+    }
+}
+
+static tftp_uring_message *message_at(tftp_uring *ring, long sequence) {
+    return &ring->messages[sequence % TFTP_URING_MESSAGES];
+}
+
+// A slice of the arena that stays reserved until its message and every older one completed, or NULL if it is full
+static uint8_t *reserve(tftp_uring *ring, long size) {
+    long offset = ring->arena_head % TFTP_URING_ARENA_SIZE;
+    long taken = size;
+    if (offset + size > TFTP_URING_ARENA_SIZE) {
+        // Slices do not wrap around, the end of the arena is skipped instead
+        taken += TFTP_URING_ARENA_SIZE - offset;
+        offset = 0;
+    }
+    if (ring->arena_head + taken - ring->arena_tail > TFTP_URING_ARENA_SIZE) {
+        return NULL;
+    }
+    ring->arena_head += taken;
+    return ring->arena + offset;
+}
+
+// Idle transmissions are only recorded while reaping, the server looks at them right after
+static void complete(tftp_uring *ring, unsigned long user_data, int result, int record) {
+    tftp_uring_message *message = message_at(ring, (long) (user_data >> 1u));
+    tftp_transmission *transmission = message->transmission;
+    tftp_batch *batch = ring->batch;
+    if (user_data & USER_DATA_SEND) {
+        if (result >= 0) {
+            ring->sends++;
+            batch->sent_packets++;
+#ifdef MSG_ZEROCOPY
+            if (transmission->send_flags & MSG_ZEROCOPY) {
+                transmission->zerocopy_sent++;
+            }
+#endif
+        } else {
+            // Also the sends behind a failed or short read, which io_uring cancels
+            batch->dropped_packets++;
+        }
+    } else {
+        ring->reads++;
+        if (result != (int) message->iovecs[1].iov_len) {
+            ring->failed_reads++;
+        }
+    }
+    message->pending--;
+    transmission->uring_pending--;
+    if (transmission->uring_pending == 0 && record && ring->idle_count < TFTP_URING_MESSAGES) {
+        ring->idle[ring->idle_count++] = transmission;
+    }
+}
+
+// Frees the oldest messages that completed, with their part of the arena
+static void retire(tftp_uring *ring) {
+    while (ring->first_message < ring->next_message) {
+        tftp_uring_message *message = message_at(ring, ring->first_message);
+        if (!message->submitted || message->pending > 0) {
+            break;
+        }
+        ring->arena_tail = message->arena_end;
+        ring->first_message++;
+    }
+}
+
+static void prepare_read(tftp_uring *ring, tftp_uring_message *message, long sequence) {
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    sqe->opcode = ring->fixed_buffer ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    set_file(sqe, message->transmission->fixed_file, message->read_fd);
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe->addr = (unsigned long) message->iovecs[1].iov_base;
+    sqe->len = message->iovecs[1].iov_len;
+    sqe->off = message->read_offset;
+    sqe->buf_index = 0;
+    sqe->user_data = (unsigned long) sequence << 1u;
+    message->pending++;
+}
+
+static struct io_uring_sqe *prepare_send(tftp_uring *ring, tftp_uring_message *message, long sequence) {
+    tftp_transmission *transmission = message->transmission;
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    set_file(sqe, transmission->fixed_socket, transmission->socket);
+    sqe->addr = (unsigned long) &message->message;
+    sqe->len = 1;
+    sqe->msg_flags = transmission->send_flags;
+    sqe->user_data = ((unsigned long) sequence << 1u) | USER_DATA_SEND;
+    message->pending++;
+    return sqe;
+}
+
+// Every waiting message of a transmission goes into one linked chain, so its blocks are read and sent in order. A
+// transmission with a chain in flight waits for it to complete, a chain can't be extended once it was submitted.
+static void submit_ready(tftp_uring *ring) {
+    for (long i = ring->first_message; i < ring->next_message; i++) {
+        tftp_transmission *transmission = message_at(ring, i)->transmission;
+        if (message_at(ring, i)->submitted || transmission->uring_pending > 0) {
+            continue;
+        }
+        struct io_uring_sqe *last_send = NULL;
+        for (long j = i; j < ring->next_message; j++) {
+            tftp_uring_message *message = message_at(ring, j);
+            if (message->submitted || message->transmission != transmission) {
+                continue;
+            }
+            if (last_send != NULL) {
+                last_send->flags |= IOSQE_IO_LINK;
+            }
+            if (message->read_fd >= 0) {
+                prepare_read(ring, message, j);
+            }
+            last_send = prepare_send(ring, message, j);
+            message->submitted = 1;
+            transmission->uring_pending += message->pending;
+        }
+    }
+}
+
+// Hands the submission queue to the kernel without waiting for anything. What it can't take now stays queued for
+// the next flush or reap.
+static int submit(tftp_uring *ring) {
+    unsigned waiting = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (waiting == 0) {
+        return TFTP_SUCCESS;
+    }
+    int entered;
+    do {
+        entered = uring_enter(ring->ring_fd, waiting, 0, 0);
+        ring->submit_calls++;
+        ring->batch->send_syscalls++;
+    } while (entered < 0 && errno == EINTR);
+    return entered >= 0 || errno == EAGAIN || errno == EBUSY ? TFTP_SUCCESS : TFTP_ERROR;
+}
+
+// Takes back what the kernel did not accept and leaves the rest of the server's life to sendmmsg. What is in flight
+// still completes through the event fd.
+static void fall_back(tftp_uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    for (unsigned index = head; index != *ring->sq_tail; index++) {
+        complete(ring, ring->sqes[ring->sq_array[index & *ring->sq_mask]].user_data, -ECANCELED, 0);
+    }
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+    for (long i = ring->first_message; i < ring->next_message; i++) {
+        tftp_uring_message *message = message_at(ring, i);
+        if (!message->submitted) {
+            message->submitted = 1;
+            ring->batch->dropped_packets++;
+        }
+    }
+    retire(ring);
+    if (ring->batch->engine_context == ring) {
+        ring->batch->engine_flush = NULL;
+        ring->batch->engine_context = NULL;
+    }
+}
+
+// Takes every completion that is there, without waiting for more
+static void collect(tftp_uring *ring, int record) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        complete(ring, cqe->user_data, cqe->res, record);
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    retire(ring);
+}
+
+// Room for another message, and for size bytes of its payload if it has to be read
+static int make_room(tftp_uring *ring, int read, long size, uint8_t **buffer) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (ring->next_message - ring->first_message < TFTP_URING_MESSAGES &&
+            (!read || (*buffer = reserve(ring, size)) != NULL)) {
+            return 1;
+        }
+        // The event loop did not get to the completions yet
+        collect(ring, 0);
+    }
+    return 0;
+}
+
+// Copies the queued messages, so the batch is free again as soon as this returns, and submits them without waiting
+static int uring_flush(tftp_batch *batch, void *context) {
+    tftp_uring *ring = context;
+    int result = TFTP_SUCCESS;
+    for (int i = 0; i < batch->count; i++) {
+        struct iovec *payload = &batch->tx_iovecs[i][1];
+        uint8_t *buffer = payload->iov_base;
+        if (!make_room(ring, batch->read_fds[i] >= 0, (long) payload->iov_len, &buffer)) {
+            // Too much is in flight, the message is lost as if the network dropped it
+            batch->dropped_packets++;
+            result = TFTP_SEND_FAILED;
+            continue;
+        }
+        tftp_uring_message *message = message_at(ring, ring->next_message++);
+        message->transmission = batch->transmissions[i];
+        message->message = batch->tx_messages[i].msg_hdr;
+        message->message.msg_iov = message->iovecs;
+        memcpy(message->header, batch->headers[i], sizeof(message->header));
+        message->iovecs[0].iov_base = message->header;
+        message->iovecs[0].iov_len = sizeof(message->header);
+        message->iovecs[1].iov_base = buffer;
+        message->iovecs[1].iov_len = payload->iov_len;
+        message->read_fd = batch->read_fds[i];
+        message->read_offset = batch->read_offsets[i];
+        message->arena_end = ring->arena_head;
+        message->submitted = 0;
+        message->pending = 0;
+    }
+
+    submit_ready(ring);
+    if (submit(ring) != TFTP_SUCCESS) {
+        fall_back(ring);
+        result = TFTP_SEND_FAILED;
+    }
+    return result;
+}
+
+void tftp_uring_reap(tftp_uring *ring) {
+    if (ring->ring_fd < 0) {
+        return;
+    }
+    uint64_t signalled;
+    read(ring->event_fd, &signalled, sizeof(signalled));
+    ring->idle_count = 0;
+    collect(ring, 1);
+
+    if (ring->batch->engine_context == ring) {
+        submit_ready(ring);
+        if (submit(ring) != TFTP_SUCCESS) {
+            fall_back(ring);
+        }
+    }
+}
+
+static int in_flight(tftp_uring *ring) {
+    for (long i = ring->first_message; i < ring->next_message; i++) {
+        if (message_at(ring, i)->pending > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void tftp_uring_wait(tftp_uring *ring) {
+    if (ring->sqes == NULL) {
+        return;
+    }
+    while (in_flight(ring)) {
+        unsigned waiting = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (uring_enter(ring->ring_fd, waiting, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            break;
+        }
+        tftp_uring_reap(ring);
+    }
+    // Nothing completes anymore, messages that never got submitted are dropped
+    fall_back(ring);
+}
+
+int tftp_uring_init(tftp_uring *ring, tftp_batch *batch) {
+    memset(ring, 0, sizeof(tftp_uring));
+    ring->ring_fd = -1;
+    ring->event_fd = -1;
+    ring->batch = batch;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = uring_setup(TFTP_URING_ENTRIES, &params);
+    if (ring_fd < 0) {
+        return TFTP_ERROR;
+    }
+    ring->ring_fd = ring_fd;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        tftp_uring_destroy(ring, batch);
+        return TFTP_ERROR;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            tftp_uring_destroy(ring, batch);
+            return TFTP_ERROR;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        tftp_uring_destroy(ring, batch);
+        return TFTP_ERROR;
+    }
+
+    uint8_t *sq_ring = ring->sq_ring;
+    uint8_t *cq_ring = ring->cq_ring;
+    ring->sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+    ring->arena = malloc(TFTP_URING_ARENA_SIZE);
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->arena == NULL || ring->event_fd < 0 ||
+        uring_register(ring_fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) != 0) {
+        tftp_uring_destroy(ring, batch);
+        return TFTP_ERROR;
+    }
+
+    // Both registrations are optimisations, the engine works without them
+    struct iovec arena = {ring->arena, TFTP_URING_ARENA_SIZE};
+    ring->fixed_buffer = uring_register(ring_fd, IORING_REGISTER_BUFFERS, &arena, 1) == 0;
+
+    int files[2 * TFTP_URING_FIXED_SESSIONS];
+    memset(files, -1, sizeof(files));
+    ring->fixed_files = uring_register(ring_fd, IORING_REGISTER_FILES, files, 2 * TFTP_URING_FIXED_SESSIONS) == 0;
+    if (ring->fixed_files) {
+        for (int i = 0; i < TFTP_URING_FIXED_SESSIONS; i++) {
+            ring->free_slots[i] = TFTP_URING_FIXED_SESSIONS - 1 - i;
+        }
+        ring->free_slot_count = TFTP_URING_FIXED_SESSIONS;
+    }
+
+    batch->engine_flush = uring_flush;
+    batch->engine_context = ring;
+    return TFTP_SUCCESS;
+}
+
+void tftp_uring_destroy(tftp_uring *ring, tftp_batch *batch) {
+    tftp_uring_wait(ring);
+    if (batch->engine_context == ring) {
+        batch->engine_flush = NULL;
+        batch->engine_context = NULL;
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    ring->sqes = NULL;
+    ring->cq_ring = NULL;
+    ring->sq_ring = NULL;
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+    }
+    if (ring->event_fd >= 0) {
+        close(ring->event_fd);
+        ring->event_fd = -1;
+    }
+    free(ring->arena);
+    ring->arena = NULL;
+}
+
+// The socket and file of a session take two neighbouring slots of the fixed file table
+void tftp_uring_register(tftp_uring *ring, tftp_transmission *transmission) {
+    if (ring->ring_fd < 0 || ring->free_slot_count == 0) {
+        return;
+    }
+    int slot = ring->free_slots[ring->free_slot_count - 1];
+    int files[2] = {transmission->socket, transmission->file_descriptor};
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = 2 * slot;
+    update.fds = (unsigned long) files;
+    if (uring_register(ring->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 2) != 2) {
+        return;
+    }
+    ring->free_slot_count--;
+    transmission->fixed_socket = 2 * slot;
+    transmission->fixed_file = 2 * slot + 1;
+}
+
+void tftp_uring_unregister(tftp_uring *ring, tftp_transmission *transmission) {
+    if (ring->ring_fd < 0 || transmission->fixed_socket < 0) {
+        return;
+    }
+    // The table holds its own reference, the descriptors are only really closed once they are replaced here
+    int files[2] = {-1, -1};
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = transmission->fixed_socket;
+    update.fds = (unsigned long) files;
+    uring_register(ring->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 2);
+    ring->free_slots[ring->free_slot_count++] = transmission->fixed_socket / 2;
+    transmission->fixed_socket = -1;
+    transmission->fixed_file = -1;
+}
+
+#else
+
+// Built without io_uring support, the server keeps using sendmmsg and pread
+
+int tftp_uring_init(tftp_uring *ring, tftp_batch *batch) {
+    memset(ring, 0, sizeof(tftp_uring));
+    ring->ring_fd = -1;
+    ring->event_fd = -1;
+    return TFTP_ERROR;
+}
+
+void tftp_uring_destroy(tftp_uring *ring, tftp_batch *batch) {
+}
+
+void tftp_uring_reap(tftp_uring *ring) {
+}
+
+void tftp_uring_wait(tftp_uring *ring) {
+}
+
+void tftp_uring_register(tftp_uring *ring, tftp_transmission *transmission) {
+}
+
+void tftp_uring_unregister(tftp_uring *ring, tftp_transmission *transmission) {
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+
+    Optional io_uring engine for the file reads and sends of a batch
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_URING_H
+#define TFTPSERVER_URING_H
+
+#include <stddef.h>
+#include "../common/tftp.h"
+
+// Messages the kernel may be working on at once, a batch can be queued while the one before is still in flight
+#define TFTP_URING_MESSAGES (2 * TFTP_BATCH_SIZE)
+// Two entries per message: the file read and the send linked behind it
+#define TFTP_URING_ENTRIES (2 * TFTP_URING_MESSAGES)
+// Payloads are read into this, and stay there until their send completed
+#define TFTP_URING_ARENA_SIZE (1024 * 1024)
+// The sockets and files of this many sessions are registered as fixed files, later sessions use plain descriptors
+#define TFTP_URING_FIXED_SESSIONS 1024
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// A copy of a queued message, everything the kernel reads for it must stay put until it completed
+typedef struct {
+    tftp_transmission *transmission;
+    struct msghdr message;
+    struct iovec iovecs[2];
+    uint8_t header[4];
+
+    // The file the payload is read from, or -1 if it is ready
+    int read_fd;
+    off_t read_offset;
+    // Where the arena is free again once this and every older message completed
+    long arena_end;
+
+    int submitted;
+    // Completions still to come, one for the read and one for the send
+    int pending;
+} tftp_uring_message;
+
+typedef struct {
+    // -1 if the engine is not in use
+    int ring_fd;
+    // Signalled by the kernel for every completion, so they are reaped from the event loop
+    int event_fd;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Handed out and freed again in queueing order, by counters that only grow
+    tftp_uring_message messages[TFTP_URING_MESSAGES];
+    long first_message;
+    long next_message;
+    uint8_t *arena;
+    long arena_head;
+    long arena_tail;
+
+    // Statistics go to the batch the engine sends for
+    tftp_batch *batch;
+
+    // Transmissions whose last operation completed during the last tftp_uring_reap, each one once, as a transmission
+    // has one chain in flight at most. Completions taken while flushing are not recorded.
+    tftp_transmission *idle[TFTP_URING_MESSAGES];
+    int idle_count;
+
+    // The arena is registered as fixed buffer 0, so reads into it skip pinning pages every time
+    int fixed_buffer;
+    int fixed_files;
+    int free_slots[TFTP_URING_FIXED_SESSIONS];
+    int free_slot_count;
+
+    long submit_calls;
+    long reads;
+    long failed_reads;
+    long sends;
+} tftp_uring;
+
+int tftp_uring_init(tftp_uring *ring, tftp_batch *batch);
+
+// Waits for everything in flight, then closes the ring
+void tftp_uring_destroy(tftp_uring *ring, tftp_batch *batch);
+
+// Takes the completions the event fd signalled, and submits messages that waited for older ones of their transmission
+void tftp_uring_reap(tftp_uring *ring);
+
+// Blocks until nothing is in flight anymore, so every transmission can be freed
+void tftp_uring_wait(tftp_uring *ring);
+
+void tftp_uring_register(tftp_uring *ring, tftp_transmission *transmission);
+
+void tftp_uring_unregister(tftp_uring *ring, tftp_transmission *transmission);
+
+#endif //TFTPSERVER_URING_H
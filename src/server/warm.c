@@ -0,0 +1,305 @@
+/*
+
+    Provide an implementation for warm.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "../common/tftp.h"
+#include "warm.h"
+#include "metrics.h"
+#include "log.h"
+
+// A finished write, a file renamed into place or away, a deletion, and touch, which changes the modification time
+#define TFTP_WARM_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB | IN_ONLYDIR)
+
+static int matches(const tftp_warm_set *warm, const char *path) {
+    for (int i = 0; i < warm->pattern_count; i++) {
+        if (fnmatch(warm->patterns[i], path, FNM_PATHNAME) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Pins the file at path, relative to the root directory, returns its size or -1
+static long load(tftp_warm_set *warm, const char *path) {
+    int file_descriptor = openat(warm->root_fd, path, O_RDONLY | O_CLOEXEC);
+    if (file_descriptor < 0) {
+        return -1;
+    }
+    struct stat stats;
+    long size = -1;
+    if (fstat(file_descriptor, &stats) == 0 && S_ISREG(stats.st_mode) &&
+        tftp_cache_pin(warm->cache, path, file_descriptor, &stats, warm->lock_memory) == TFTP_SUCCESS) {
+        size = stats.st_size;
+    }
+    close(file_descriptor);
+    if (size < 0) {
+        log_message(LOG_VERBOSE, "Could not pin %s in memory.\n", path);
+        tftp_metrics_add(&warm->failures, 1);
+    }
+    return size;
+}
+
+// Expands pattern, loads every regular file it matches, and adds their sizes to bytes. Returns the number of files.
+static long load_pattern(tftp_warm_set *warm, const char *pattern, long *bytes) {
+    char *absolute;
+    if (asprintf(&absolute, "%s/%s", warm->root_path, pattern) < 0) {
+        return 0;
+    }
+    long files = 0;
+    glob_t found;
+    // GLOB_MARK ends directories with a /, so they can be told apart without a stat
+    if (glob(absolute, GLOB_MARK, NULL, &found) == 0) {
+        for (size_t i = 0; i < found.gl_pathc; i++) {
+            const char *path = found.gl_pathv[i] + strlen(warm->root_path) + 1;
+            if (path[strlen(path) - 1] == '/') {
+                continue;
+            }
+            long size = load(warm, path);
+            if (size >= 0) {
+                files++;
+                *bytes += size;
+            }
+        }
+        globfree(&found);
+    }
+    free(absolute);
+    return files;
+}
+
+static void watch_directory(tftp_warm_set *warm, const char *path) {
+    char *absolute;
+    if (asprintf(&absolute, "%s/%s", warm->root_path, path) < 0) {
+        return;
+    }
+    int watch = inotify_add_watch(warm->inotify_fd, absolute, TFTP_WARM_WATCH_MASK);
+    free(absolute);
+    if (watch < 0) {
+        return;
+    }
+    // Patterns in the same directory get the same watch
+    for (int i = 0; i < warm->directory_count; i++) {
+        if (warm->directories[i].watch == watch) {
+            return;
+        }
+    }
+    tftp_warm_directory *directories = realloc(warm->directories,
+                                               (warm->directory_count + 1) * sizeof(tftp_warm_directory));
+    if (directories == NULL) {
+        return;
+    }
+    warm->directories = directories;
+    directories[warm->directory_count].watch = watch;
+    directories[warm->directory_count].path = strdup(path);
+    if (directories[warm->directory_count].path != NULL) {
+        warm->directory_count++;
+    }
+}
+
+// Watches every directory the last component of pattern can match in. Directories created later are not watched.
+static void watch_pattern(tftp_warm_set *warm, const char *pattern) {
+    const char *separator = strrchr(pattern, '/');
+    if (separator == NULL) {
+        watch_directory(warm, "");
+        return;
+    }
+    char *absolute;
+    if (asprintf(&absolute, "%s/%.*s", warm->root_path, (int) (separator - pattern), pattern) < 0) {
+        return;
+    }
+    glob_t found;
+    if (glob(absolute, GLOB_ONLYDIR, NULL, &found) == 0) {
+        for (size_t i = 0; i < found.gl_pathc; i++) {
+            watch_directory(warm, found.gl_pathv[i] + strlen(warm->root_path) + 1);
+        }
+        globfree(&found);
+    }
+    free(absolute);
+}
+
+static void handle_event(tftp_warm_set *warm, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Changes were lost, so everything is loaded again
+        log_message(LOG_VERBOSE, "Missed changes to pinned files, loading all of them again.\n");
+        long bytes = 0;
+        for (int i = 0; i < warm->pattern_count; i++) {
+            tftp_metrics_add(&warm->swaps, load_pattern(warm, warm->patterns[i], &bytes));
+        }
+        return;
+    }
+    if (event->len == 0) {
+        return;
+    }
+    const tftp_warm_directory *directory = NULL;
+    for (int i = 0; i < warm->directory_count && directory == NULL; i++) {
+        if (warm->directories[i].watch == event->wd) {
+            directory = &warm->directories[i];
+        }
+    }
+    char *path;
+    if (directory == NULL ||
+        asprintf(&path, "%s%s%s", directory->path, directory->path[0] != 0 ? "/" : "", event->name) < 0) {
+        return;
+    }
+    if (!matches(warm, path)) {
+        free(path);
+        return;
+    }
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        tftp_cache_unpin(warm->cache, path);
+        tftp_metrics_add(&warm->removals, 1);
+        log_message(LOG_VERBOSE, "Unpinned %s, it was removed.\n", path);
+    } else if (load(warm, path) >= 0) {
+        // Transfers that started on the old version finish with it, new ones get this one
+        tftp_metrics_add(&warm->swaps, 1);
+        log_message(LOG_VERBOSE, "Swapped in the new version of %s.\n", path);
+    }
+    free(path);
+}
+
+static void *run_watcher(void *argument) {
+    tftp_warm_set *warm = argument;
+    uint8_t events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd watcher = {warm->inotify_fd, POLLIN, 0};
+    while (warm->running) {
+        if (poll(&watcher, 1, TFTP_WARM_POLL_MS) != 1) {
+            continue;
+        }
+        ssize_t length;
+        while ((length = read(warm->inotify_fd, events, sizeof(events))) > 0) {
+            ssize_t offset = 0;
+            while (offset < length) {
+                const struct inotify_event *event = (const struct inotify_event *) (events + offset);
+                handle_event(warm, event);
+                offset += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int parse_patterns(tftp_warm_set *warm, const char *patterns) {
+    char *copy = strdup(patterns);
+    if (copy == NULL) {
+        return TFTP_ERROR;
+    }
+    char *saved;
+    for (char *pattern = strtok_r(copy, ",", &saved); pattern != NULL; pattern = strtok_r(NULL, ",", &saved)) {
+        // Requested file names are relative to the root directory, so the patterns are too
+        while (*pattern == '/') {
+            pattern++;
+        }
+        if (*pattern == 0) {
+            continue;
+        }
+        if (warm->pattern_count >= TFTP_WARM_MAX_PATTERNS) {
+            free(copy);
+            return TFTP_ERROR;
+        }
+        warm->patterns[warm->pattern_count] = strdup(pattern);
+        if (warm->patterns[warm->pattern_count] == NULL) {
+            free(copy);
+            return TFTP_ERROR;
+        }
+        warm->pattern_count++;
+    }
+    free(copy);
+    return TFTP_SUCCESS;
+}
+
+int tftp_warm_start(tftp_warm_set *warm, tftp_cache *cache, const char *root_path, const char *patterns,
+                    int lock_memory) {
+    memset(warm, 0, sizeof(tftp_warm_set));
+    warm->cache = cache;
+    warm->lock_memory = lock_memory;
+    warm->inotify_fd = -1;
+    warm->root_fd = open(root_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    warm->root_path = strdup(root_path);
+    if (warm->root_fd < 0 || warm->root_path == NULL || parse_patterns(warm, patterns) != TFTP_SUCCESS) {
+        tftp_warm_stop(warm);
+        return TFTP_ERROR;
+    }
+    // Glob results start with the root path as it is written here, which is cut off again to get the file name
+    size_t root_length = strlen(warm->root_path);
+    while (root_length > 0 && warm->root_path[root_length - 1] == '/') {
+        warm->root_path[--root_length] = 0;
+    }
+
+    warm->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (warm->inotify_fd < 0) {
+        tftp_warm_stop(warm);
+        return TFTP_ERROR;
+    }
+    // Watched before anything is loaded, so a file that changes while loading is loaded again
+    for (int i = 0; i < warm->pattern_count; i++) {
+        watch_pattern(warm, warm->patterns[i]);
+    }
+    for (int i = 0; i < warm->pattern_count; i++) {
+        warm->files += load_pattern(warm, warm->patterns[i], &warm->bytes);
+    }
+
+    warm->running = 1;
+    if (pthread_create(&warm->thread, NULL, run_watcher, warm) != 0) {
+        tftp_warm_stop(warm);
+        return TFTP_ERROR;
+    }
+    warm->started = 1;
+    return TFTP_SUCCESS;
+}
+
+void tftp_warm_stop(tftp_warm_set *warm) {
+    warm->running = 0;
+    if (warm->started) {
+        pthread_join(warm->thread, NULL);
+        warm->started = 0;
+    }
+    if (warm->inotify_fd >= 0) {
+        close(warm->inotify_fd);
+        warm->inotify_fd = -1;
+    }
+    if (warm->root_fd >= 0) {
+        close(warm->root_fd);
+        warm->root_fd = -1;
+    }
+    for (int i = 0; i < warm->directory_count; i++) {
+        free(warm->directories[i].path);
+    }
+    free(warm->directories);
+    warm->directories = NULL;
+    warm->directory_count = 0;
+    for (int i = 0; i < warm->pattern_count; i++) {
+        free(warm->patterns[i]);
+    }
+    warm->pattern_count = 0;
+    free(warm->root_path);
+    warm->root_path = NULL;
+}
@@ -0,0 +1,72 @@
+/*
+
+    Files loaded into the contents cache at startup, and swapped for their new version when they change on disk
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_WARM_H
+#define TFTPSERVER_WARM_H
+
+#include <pthread.h>
+#include "cache.h"
+
+#define TFTP_WARM_MAX_PATTERNS 64
+// How long the watcher waits for changes before it checks whether it should stop
+#define TFTP_WARM_POLL_MS 100
+
+typedef struct {
+    int watch;
+    // Relative to the root directory, empty for the root directory itself
+    char *path;
+} tftp_warm_directory;
+
+typedef struct {
+    tftp_cache *cache;
+    int root_fd;
+    char *root_path;
+    // Globs relative to the root directory
+    char *patterns[TFTP_WARM_MAX_PATTERNS];
+    int pattern_count;
+    int lock_memory;
+
+    // Watches the directories the patterns match in
+    int inotify_fd;
+    tftp_warm_directory *directories;
+    int directory_count;
+
+    pthread_t thread;
+    volatile int running;
+    int started;
+
+    // Written by the watcher only, once it runs
+    long files;
+    long bytes;
+    long swaps;
+    long removals;
+    long failures;
+} tftp_warm_set;
+
+// Loads every regular file under root_path matching one of the comma separated globs in patterns as a pinned
+// cache entry, and starts a thread that swaps in new versions of them. lock_memory locks their contents with mlock.
+int tftp_warm_start(tftp_warm_set *warm, tftp_cache *cache, const char *root_path, const char *patterns,
+                    int lock_memory);
+
+// Stops the watcher, the entries stay in the cache until it is destroyed
+void tftp_warm_stop(tftp_warm_set *warm);
+
+#endif //TFTPSERVER_WARM_H
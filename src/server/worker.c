@@ -0,0 +1,94 @@
+/*
+
+    Provide an implementation for worker.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include "worker.h"
+#include "log.h"
+
+static void *run_worker(void *argument) {
+    tftp_worker *worker = argument;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            log_message(LOG_VERBOSE, "Could not pin worker %d to CPU %d.\n", worker->id, worker->cpu);
+        }
+    }
+
+    log_message(LOG_DEBUG, "Worker %d started.\n", worker->id);
+    tftp_server_run(&worker->server, worker->running);
+    log_message(LOG_VERBOSE, "Worker %d stopped after %li transfers.\n", worker->id, worker->server.completed_count);
+    return NULL;
+}
+
+int tftp_workers_start(tftp_worker *workers, int count, const struct sockaddr_in *address,
+                       const tftp_server_config *config, int pin_cpus, volatile int *running) {
+    tftp_server_config worker_config = *config;
+    worker_config.reuse_port = 1;
+
+    struct sockaddr_in worker_address = *address;
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(workers, 0, sizeof(tftp_worker) * count);
+    for (int i = 0; i < count; i++) {
+        tftp_worker *worker = &workers[i];
+        worker->id = i;
+        worker->cpu = pin_cpus && cpu_count > 0 ? (int) (i % cpu_count) : -1;
+        worker->running = running;
+        // Multicast groups belong to one worker, so each needs ports no other worker hands out
+        if (config->multicast_port != 0) {
+            worker_config.multicast_port = config->multicast_port + i * TFTP_MULTICAST_PORTS;
+        }
+
+        if (tftp_server_init(&worker->server, &worker_address, &worker_config) != TFTP_SUCCESS) {
+            *running = 0;
+            tftp_workers_join(workers, i);
+            return TFTP_ERROR;
+        }
+        // If an ephemeral port was requested, every following worker has to join the port the first one got
+        worker_address.sin_port = worker->server.address.sin_port;
+
+        if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+            tftp_server_destroy(&worker->server);
+            *running = 0;
+            tftp_workers_join(workers, i);
+            return TFTP_ERROR;
+        }
+        worker->started = 1;
+    }
+    return TFTP_SUCCESS;
+}
+
+void tftp_workers_join(tftp_worker *workers, int count) {
+    for (int i = 0; i < count; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+            tftp_server_destroy(&workers[i].server);
+            workers[i].started = 0;
+        }
+    }
+}
@@ -0,0 +1,49 @@
+/*
+
+    Worker threads that each run an independent server on a shared port
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_WORKER_H
+#define TFTPSERVER_WORKER_H
+
+#include <pthread.h>
+#include "server.h"
+
+#define TFTP_MAX_WORKERS 256
+
+typedef struct {
+    int id;
+
+    // The CPU this worker is pinned to, or -1 if it may run anywhere
+    int cpu;
+
+    // Each worker owns its listening socket, session list and buffers, nothing is shared on the hot path
+    tftp_server server;
+
+    volatile int *running;
+    pthread_t thread;
+    int started;
+} tftp_worker;
+
+int tftp_workers_start(tftp_worker *workers, int count, const struct sockaddr_in *address,
+                       const tftp_server_config *config, int pin_cpus, volatile int *running);
+
+void tftp_workers_join(tftp_worker *workers, int count);
+
+#endif //TFTPSERVER_WORKER_H
@@ -0,0 +1,223 @@
+/*
+
+    Provide an implementation for writer.h
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "../common/tftp.h"
+#include "writer.h"
+
+static int write_fully(tftp_write_job *job) {
+    int written = 0;
+    while (written < job->length) {
+        ssize_t result = pwrite(job->file_descriptor, job->data + written, job->length - written,
+                                job->offset + written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return result < 0 ? errno : ENOSPC;
+        }
+        written += result;
+    }
+    return 0;
+}
+
+static void fail_job(tftp_write_job *job, int error) {
+    job->result = error == 0 ? TFTP_SUCCESS : TFTP_ERROR;
+    job->error = error;
+}
+
+// Write a run of DATA jobs for the same file with consecutive offsets, using one pwritev when it goes through whole
+static void write_run(tftp_writer *writer, tftp_write_job *first, int count) {
+    struct iovec iovecs[TFTP_WRITER_MAX_IOVECS];
+    long total = 0;
+    tftp_write_job *job = first;
+    for (int i = 0; i < count; i++, job = job->next) {
+        iovecs[i].iov_base = job->data;
+        iovecs[i].iov_len = job->length;
+        total += job->length;
+    }
+
+    ssize_t written = pwritev(first->file_descriptor, iovecs, count, first->offset);
+    writer->write_calls++;
+    writer->writes += count;
+    job = first;
+    for (int i = 0; i < count; i++, job = job->next) {
+        if (written == total) {
+            fail_job(job, 0);
+        } else {
+            // Short or failed write, fall back to the jobs one by one to find out which of them failed
+            fail_job(job, write_fully(job));
+        }
+    }
+}
+
+static void finish_file(tftp_writer *writer, tftp_write_job *job) {
+    int error = 0;
+    // Preallocated space beyond the received data is given back
+    if (ftruncate(job->file_descriptor, job->offset) != 0) {
+        error = errno;
+    }
+    if (error == 0 && job->sync) {
+        writer->syncs++;
+        if (fsync(job->file_descriptor) != 0) {
+            error = errno;
+        }
+    }
+    if (close(job->file_descriptor) != 0 && error == 0) {
+        error = errno;
+    }
+    fail_job(job, error);
+}
+
+static void process_jobs(tftp_writer *writer, tftp_write_job *jobs) {
+    tftp_write_job *job = jobs;
+    while (job != NULL) {
+        if (job->kind == TFTP_WRITE_FINISH) {
+            finish_file(writer, job);
+            job = job->next;
+            continue;
+        }
+        int count = 1;
+        tftp_write_job *last = job;
+        while (count < TFTP_WRITER_MAX_IOVECS && last->next != NULL && last->next->kind == TFTP_WRITE_DATA &&
+               last->next->file_descriptor == job->file_descriptor &&
+               last->next->offset == last->offset + last->length) {
+            last = last->next;
+            count++;
+        }
+        write_run(writer, job, count);
+        job = last->next;
+    }
+}
+
+static void *run_writer(void *argument) {
+    tftp_writer *writer = argument;
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (writer->pending == NULL && !writer->stopping) {
+            pthread_cond_wait(&writer->wake, &writer->lock);
+        }
+        if (writer->pending == NULL) {
+            break;
+        }
+        tftp_write_job *jobs = writer->pending;
+        tftp_write_job *jobs_tail = writer->pending_tail;
+        writer->pending = NULL;
+        writer->pending_tail = NULL;
+        pthread_mutex_unlock(&writer->lock);
+
+        process_jobs(writer, jobs);
+
+        pthread_mutex_lock(&writer->lock);
+        // Completions are kept in submission order, so a file is never reported finished before its data
+        if (writer->completed_tail != NULL) {
+            writer->completed_tail->next = jobs;
+        } else {
+            writer->completed = jobs;
+        }
+        writer->completed_tail = jobs_tail;
+        uint64_t one = 1;
+        write(writer->event_fd, &one, sizeof(one));
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+int tftp_writer_start(tftp_writer *writer) {
+    memset(writer, 0, sizeof(tftp_writer));
+    writer->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (writer->event_fd < 0) {
+        return TFTP_ERROR;
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+    if (pthread_create(&writer->thread, NULL, run_writer, writer) != 0) {
+        close(writer->event_fd);
+        writer->event_fd = -1;
+        return TFTP_ERROR;
+    }
+    writer->started = 1;
+    return TFTP_SUCCESS;
+}
+
+// Every job that was queued is still written before the thread exits
+void tftp_writer_stop(tftp_writer *writer) {
+    if (!writer->started) {
+        return;
+    }
+    tftp_writer_submit(writer);
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = 1;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    writer->started = 0;
+
+    close(writer->event_fd);
+    writer->event_fd = -1;
+    pthread_cond_destroy(&writer->wake);
+    pthread_mutex_destroy(&writer->lock);
+}
+
+void tftp_writer_queue(tftp_writer *writer, tftp_write_job *job) {
+    job->next = NULL;
+    if (writer->queued_tail != NULL) {
+        writer->queued_tail->next = job;
+    } else {
+        writer->queued = job;
+    }
+    writer->queued_tail = job;
+}
+
+void tftp_writer_submit(tftp_writer *writer) {
+    if (writer->queued == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&writer->lock);
+    if (writer->pending_tail != NULL) {
+        writer->pending_tail->next = writer->queued;
+    } else {
+        writer->pending = writer->queued;
+    }
+    writer->pending_tail = writer->queued_tail;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    writer->queued = NULL;
+    writer->queued_tail = NULL;
+}
+
+tftp_write_job *tftp_writer_take_completed(tftp_writer *writer) {
+    uint64_t count;
+    pthread_mutex_lock(&writer->lock);
+    read(writer->event_fd, &count, sizeof(count));
+    tftp_write_job *jobs = writer->completed;
+    writer->completed = NULL;
+    writer->completed_tail = NULL;
+    pthread_mutex_unlock(&writer->lock);
+    return jobs;
+}
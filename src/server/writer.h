@@ -0,0 +1,96 @@
+/*
+
+    Write-behind thread that takes disk writes for uploads off the event loop
+    Copyright (C) 2020 Johannes Draaijer
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef TFTPSERVER_WRITER_H
+#define TFTPSERVER_WRITER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Kinds of write jobs
+#define TFTP_WRITE_DATA 0
+// Truncate the file to offset, optionally fsync it, and close it
+#define TFTP_WRITE_FINISH 1
+
+// The most jobs written with a single pwritev call
+#define TFTP_WRITER_MAX_IOVECS 64
+
+typedef struct tftp_write_job {
+    struct tftp_write_job *next;
+
+    int kind;
+    int file_descriptor;
+    off_t offset;
+    int sync;
+
+    // DATA jobs write length bytes from data, which usually points into packet
+    uint8_t *data;
+    int length;
+
+    // The size the job was taken from the pool with
+    int size;
+    // Owner of the job, handed back untouched on completion
+    void *context;
+
+    // TFTP_SUCCESS, or TFTP_ERROR with the errno of the failed call
+    int result;
+    int error;
+
+    // Uploads receive DATA packets straight into this, so the payload is written without copying it
+    uint8_t packet[];
+} tftp_write_job;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int started;
+    int stopping;
+
+    // Queued by the server thread without locking, handed over in one go by tftp_writer_submit
+    tftp_write_job *queued;
+    tftp_write_job *queued_tail;
+
+    tftp_write_job *pending;
+    tftp_write_job *pending_tail;
+    tftp_write_job *completed;
+    tftp_write_job *completed_tail;
+
+    // Readable whenever completed jobs are waiting to be taken
+    int event_fd;
+
+    long writes;
+    long write_calls;
+    long syncs;
+} tftp_writer;
+
+int tftp_writer_start(tftp_writer *writer);
+
+void tftp_writer_stop(tftp_writer *writer);
+
+void tftp_writer_queue(tftp_writer *writer, tftp_write_job *job);
+
+void tftp_writer_submit(tftp_writer *writer);
+
+tftp_write_job *tftp_writer_take_completed(tftp_writer *writer);
+
+#endif //TFTPSERVER_WRITER_H